@@ -0,0 +1,38 @@
+#ifndef __ENDPOINT_HASH_H__
+#define __ENDPOINT_HASH_H__
+
+#include <boost/asio.hpp>
+#include <boost/functional/hash.hpp>
+
+namespace std {
+
+template<> struct hash<boost::asio::ip::udp::endpoint> {
+    typedef boost::asio::ip::udp::endpoint argument_type;
+    typedef size_t result_type;
+
+    result_type operator()(const argument_type &arg) const noexcept {
+        return \
+            boost::hash_range(
+                (const uint8_t *)arg.data(),
+                (const uint8_t *)arg.data() + arg.size()
+            );
+    }
+};
+
+template<> struct hash<boost::asio::ip::address> {
+    typedef boost::asio::ip::address argument_type;
+    typedef size_t result_type;
+
+    result_type operator()(const argument_type &arg) const noexcept {
+        if (arg.is_v4()) {
+            auto bytes = arg.to_v4().to_bytes();
+            return boost::hash_range(bytes.begin(), bytes.end());
+        }
+        auto bytes = arg.to_v6().to_bytes();
+        return boost::hash_range(bytes.begin(), bytes.end());
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#ifndef WINDOWS
+
+#include <memory>
+#include <string>
+#include <functional>
+#include <sys/types.h>
+#include <boost/asio.hpp>
+
+#include "common_utils/common.h"
+
+// Passes listening sockets from a running process to its replacement over
+// a unix socket, so a restart never refuses connections. The replacement
+// asks at the path before binding, adopts the descriptors it receives and
+// confirms once it accepts on them; the running process then stops
+// accepting and drains. Every process serves the path in turn, the next
+// replacement takes over from it the same way. Both ends must run as the
+// same user.
+class ListenerHandoff {
+    using local = boost::asio::local::stream_protocol;
+
+public:
+    struct Sockets {
+        int tcp = -1;
+        int udp = -1;
+    };
+
+    ListenerHandoff(boost::asio::io_context &ctx, std::string path);
+
+    // asks the process serving the path for its sockets, blocks until they
+    // arrive; false when no process serves it
+    bool Receive(Sockets &sockets);
+    // tells the previous process its sockets are in use
+    void Confirm();
+
+    // serves the sockets to the next process, taken runs once it confirmed
+    void Serve(Sockets sockets, std::function<void()> taken);
+    void Stop();
+
+private:
+    void DoAccept();
+    void DoWaitConfirm(std::shared_ptr<local::socket> conn);
+
+    std::string path_;
+    local::acceptor acceptor_;
+    local::socket previous_;
+    // the replacement the sockets were sent to, waiting for its confirm
+    std::shared_ptr<local::socket> next_;
+    Sockets sockets_;
+    std::function<void()> taken_;
+    bool serving_;
+    // the socket file we bound, a replacement binds its own over it
+    dev_t dev_;
+    ino_t ino_;
+};
+
+#endif // WINDOWS
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef __NAT_TABLE_H__
+#define __NAT_TABLE_H__
+
+#include <list>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+
+// Fixed capacity association table. Entries sharing an idle timeout are
+// kept in one list ordered by last activity, so the front of every list
+// is the next to expire and the oldest front overall is the least
+// recently used entry, which makes room when the table is full.
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class NatTable {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t expirations = 0;
+    };
+
+    explicit NatTable(size_t capacity)
+        : capacity_(std::max((size_t)1, capacity)) {
+    }
+
+    Value *Find(const Key &key) {
+        auto itr = index_.find(key);
+        if (itr == index_.end()) {
+            ++stats_.misses;
+            return nullptr;
+        }
+        ++stats_.hits;
+        TouchEntry(itr->second);
+        return &itr->second->value;
+    }
+
+    void Touch(const Key &key) {
+        auto itr = index_.find(key);
+        if (itr != index_.end()) {
+            TouchEntry(itr->second);
+        }
+    }
+
+    // the key must not be present; returns true and hands out the least
+    // recently used entry when the table was full
+    bool Insert(const Key &key, Value value, Clock::duration timeout, Value *evicted) {
+        bool full = index_.size() >= capacity_;
+        if (full) {
+            EvictOldest(evicted);
+        }
+        size_t group = GroupOf(timeout);
+        auto &entries = groups_[group].entries;
+        entries.push_back(Entry{ key, std::move(value), Clock::now(), group });
+        index_.emplace(key, std::prev(entries.end()));
+        return full;
+    }
+
+    // moves the entry to a longer timeout, never shortens it
+    void Extend(const Key &key, Clock::duration timeout) {
+        auto itr = index_.find(key);
+        if (itr == index_.end() || groups_[itr->second->group].timeout >= timeout) {
+            return;
+        }
+        auto entry = itr->second;
+        size_t group = GroupOf(timeout);
+        auto &entries = groups_[group].entries;
+        entries.splice(entries.end(), groups_[entry->group].entries, entry);
+        entry->group = group;
+        entry->last_active = Clock::now();
+    }
+
+    bool Erase(const Key &key, Value *erased) {
+        auto itr = index_.find(key);
+        if (itr == index_.end()) {
+            return false;
+        }
+        auto entry = itr->second;
+        *erased = std::move(entry->value);
+        groups_[entry->group].entries.erase(entry);
+        index_.erase(itr);
+        return true;
+    }
+
+    template<typename Callback>
+    void Expire(Callback callback) {
+        auto now = Clock::now();
+        for (auto &group : groups_) {
+            auto &entries = group.entries;
+            while (!entries.empty() && now - entries.front().last_active >= group.timeout) {
+                Value value = std::move(entries.front().value);
+                index_.erase(entries.front().key);
+                entries.pop_front();
+                ++stats_.expirations;
+                callback(value);
+            }
+        }
+    }
+
+    template<typename Callback>
+    void Clear(Callback callback) {
+        for (auto &group : groups_) {
+            for (auto &entry : group.entries) {
+                callback(entry.value);
+            }
+            group.entries.clear();
+        }
+        index_.clear();
+    }
+
+    size_t Size() const { return index_.size(); }
+    size_t Capacity() const { return capacity_; }
+    const Stats &GetStats() const { return stats_; }
+
+private:
+    struct Entry {
+        Key key;
+        Value value;
+        Clock::time_point last_active;
+        size_t group;
+    };
+
+    using EntryList = std::list<Entry>;
+
+    struct Group {
+        Clock::duration timeout;
+        EntryList entries;
+    };
+
+    void TouchEntry(typename EntryList::iterator entry) {
+        auto &entries = groups_[entry->group].entries;
+        entry->last_active = Clock::now();
+        entries.splice(entries.end(), entries, entry);
+    }
+
+    size_t GroupOf(Clock::duration timeout) {
+        for (size_t i = 0; i < groups_.size(); ++i) {
+            if (groups_[i].timeout == timeout) {
+                return i;
+            }
+        }
+        groups_.push_back(Group{ timeout, EntryList() });
+        return groups_.size() - 1;
+    }
+
+    void EvictOldest(Value *evicted) {
+        Group *oldest = nullptr;
+        for (auto &group : groups_) {
+            if (!group.entries.empty()
+                && (!oldest
+                    || group.entries.front().last_active < oldest->entries.front().last_active)) {
+                oldest = &group;
+            }
+        }
+        auto &entry = oldest->entries.front();
+        *evicted = std::move(entry.value);
+        index_.erase(entry.key);
+        oldest->entries.pop_front();
+        ++stats_.evictions;
+    }
+
+    size_t capacity_;
+    std::vector<Group> groups_;
+    std::unordered_map<Key, typename EntryList::iterator, Hash> index_;
+    Stats stats_;
+};
+
+#endif
@@ -22,8 +22,28 @@ inline std::shared_ptr<boost::program_options::options_description>
                     ("config-file,c", bpo::value<std::string>(), "Configuration file")
                     ("dns-servers,d", bpo::value<std::string>(), "Override system dns servers")
                     ("resolve-mode", bpo::value<std::string>(), "Resolve mode")
+                    ("resolver-cache-size", bpo::value<size_t>()->default_value(4096),
+                        "Hostnames kept by the resolver cache, 0 to disable")
+                    ("resolver-cache-ttl", bpo::value<size_t>()->default_value(60),
+                        "Lifetime of resolved addresses in seconds")
+                    ("resolver-negative-ttl", bpo::value<size_t>()->default_value(5),
+                        "Lifetime of failed lookups in seconds, 0 to disable")
+                    ("resolver-prefetch-rate", bpo::value<size_t>()->default_value(10),
+                        "Refreshes per second of popular names about to expire, 0 to disable")
+                    ("dns-cache-file", bpo::value<std::string>(),
+                        "Snapshot file keeping the resolver cache across restarts")
                     ("verbose", bpo::value<int>()->default_value(1),"Verbose log")
                     ("timeout", bpo::value<size_t>()->default_value(60), "Timeout in seconds")
+                    ("offload-threads", bpo::value<size_t>()->default_value(0),
+                        "Crypto worker threads for bulk sessions, 0 to disable")
+                    ("offload-threshold", bpo::value<size_t>()->default_value(1024),
+                        "Throughput in KiB/s above which a session direction is offloaded")
+                    ("max-sessions", bpo::value<size_t>()->default_value(0),
+                        "Sessions served at once, accepting pauses beyond, 0 for no limit")
+                    ("max-handshakes", bpo::value<size_t>()->default_value(0),
+                        "Sessions still in their handshake at once, 0 for no limit")
+                    ("max-sessions-per-client", bpo::value<size_t>()->default_value(0),
+                        "Sessions of one client address, 0 for no limit")
                     ("help,h", "Print this help message");
                 return desc;
             }();
@@ -33,11 +53,24 @@ inline std::shared_ptr<boost::program_options::options_description>
 struct ResolverArgs {
     std::string servers;
     std::string mode;
+    size_t cache_size = 0;
+    size_t cache_ttl = 0;
+    size_t negative_ttl = 0;
+    size_t prefetch_rate = 0;
+    std::string cache_file;
 };
 
 inline void GetResolverArgs(const boost::program_options::variables_map &vm, ResolverArgs *args) {
     args->servers.clear();
     args->mode.clear();
+    args->cache_file.clear();
+    args->cache_size = vm["resolver-cache-size"].as<size_t>();
+    args->cache_ttl = vm["resolver-cache-ttl"].as<size_t>();
+    args->negative_ttl = vm["resolver-negative-ttl"].as<size_t>();
+    args->prefetch_rate = vm["resolver-prefetch-rate"].as<size_t>();
+    if (vm.count("dns-cache-file")) {
+        args->cache_file = vm["dns-cache-file"].as<std::string>();
+    }
     if (vm.count("dns-servers")) {
         args->servers = vm["dns-servers"].as<std::string>();
     }
@@ -0,0 +1,67 @@
+#ifndef __PACKET_BUFFER_H__
+#define __PACKET_BUFFER_H__
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+// Storage for one datagram, with room in front and behind the payload so
+// ciphers can add their framing without moving it.
+struct PacketBuffer {
+    static const size_t kCapacity = 8192 + 128;
+    // a coalesced GRO/GSO burst of up to 64 KiB plus per segment framing
+    static const size_t kLargeCapacity = 65536 + 8192;
+
+    explicit PacketBuffer(size_t capacity) : data(capacity) {}
+
+    uint8_t *Begin() { return data.data(); }
+    uint8_t *End() { return data.data() + data.size(); }
+    size_t Capacity() const { return data.size(); }
+
+    std::vector<uint8_t> data;
+};
+
+// Per-thread free lists of packet buffers, a datagram in flight owns its
+// buffer until the send completes.
+class PacketBufferPool {
+public:
+    struct Recycler {
+        void operator()(PacketBuffer *buf) const {
+            bool large = buf->Capacity() == PacketBuffer::kLargeCapacity;
+            auto &free_list = FreeList(large);
+            if (free_list.size() >= (large ? kMaxFreeLargeBuffers : kMaxFreeBuffers)) {
+                delete buf;
+                return;
+            }
+            free_list.emplace_back(buf);
+        }
+    };
+
+    using Pointer = std::unique_ptr<PacketBuffer, Recycler>;
+
+    static Pointer Acquire(bool large = false) {
+        auto &free_list = FreeList(large);
+        if (free_list.empty()) {
+            return Pointer(new PacketBuffer(
+                large ? PacketBuffer::kLargeCapacity : PacketBuffer::kCapacity
+            ));
+        }
+        Pointer buf(free_list.back().release());
+        free_list.pop_back();
+        return buf;
+    }
+
+private:
+    using FreeListType = std::vector<std::unique_ptr<PacketBuffer>>;
+
+    static FreeListType &FreeList(bool large) {
+        thread_local FreeListType free_list;
+        thread_local FreeListType large_free_list;
+        return large ? large_free_list : free_list;
+    }
+
+    static const size_t kMaxFreeBuffers = 256;
+    static const size_t kMaxFreeLargeBuffers = 16;
+};
+
+#endif
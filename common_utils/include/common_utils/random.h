@@ -0,0 +1,21 @@
+#ifndef __COMMON_UTILS_RANDOM_H__
+#define __COMMON_UTILS_RANDOM_H__
+
+#include <cstddef>
+#include <cstdint>
+
+// Cryptographically secure random bytes from a per-thread ChaCha20 buffer,
+// seeded from the OS and refilled in large blocks.
+void RandomBytes(void *buf, size_t len);
+
+#ifdef TEST_HOOKS
+// Serves the given bytes instead of the pool on this thread, for tests
+// reproducing recorded sessions; nullptr returns to the pool. Running out
+// of scripted bytes aborts. Only compiled into the test builds.
+void ScriptRandomBytes(const uint8_t *bytes, size_t len);
+#endif
+
+// uniform in [0, upper_bound), without modulo bias
+uint32_t RandomUniform(uint32_t upper_bound);
+
+#endif // __COMMON_UTILS_RANDOM_H__
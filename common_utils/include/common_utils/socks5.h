@@ -38,7 +38,9 @@ enum ReplyCode {
 enum AddressType {
     IPV4_ATYPE    = 0x01,
     DOMAIN_ATYPE  = 0x03,
-    IPV6_ATYPE    = 0x04
+    IPV6_ATYPE    = 0x04,
+    // reserved, announces a StreamMux carrier to ss-server
+    MUX_ATYPE     = 0x7f
 };
 
 __START_PACKED
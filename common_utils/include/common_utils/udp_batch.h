@@ -0,0 +1,58 @@
+#ifndef __UDP_BATCH_H__
+#define __UDP_BATCH_H__
+
+#include <chrono>
+#include <string>
+#include <boost/asio.hpp>
+
+#include "common_utils/common.h"
+
+// Non-blocking bursts of datagrams, one system call per burst where the
+// platform has recvmmsg/sendmmsg.
+//
+// With segmentation offload a single entry may carry several datagrams
+// of segment size bytes each (only the last one may be shorter): GRO
+// coalesces them on receive, GSO splits them again on send.
+class UdpBatchIO {
+    using udp = boost::asio::ip::udp;
+public:
+    static const size_t kMaxBatch = 32;
+    static const size_t kMaxSegments = 64;
+    static const size_t kMaxSegmentedSize = 65507;
+
+    // fills lengths and, if given, senders and segment sizes (0 when the
+    // entry is a plain datagram); returns the number of entries read,
+    // 0 with ec == would_block when nothing is queued
+    static size_t ReceiveBatch(udp::socket &socket,
+                               const boost::asio::mutable_buffer *bufs,
+                               size_t *lengths, udp::endpoint *senders,
+                               size_t count, boost::system::error_code &ec,
+                               size_t *segment_sizes = nullptr);
+
+    // destinations may be null for a connected socket, segment sizes may
+    // be null or 0 for plain datagrams; returns the number of entries
+    // sent, ec tells why the next one was not
+    static size_t SendBatch(udp::socket &socket,
+                            const boost::asio::const_buffer *packets,
+                            const udp::endpoint *destinations,
+                            size_t count, boost::system::error_code &ec,
+                            const size_t *segment_sizes = nullptr);
+
+    // false when the kernel has no support; receive buffers of a GRO
+    // socket must hold PacketBuffer::kLargeCapacity bytes
+    static bool EnableGro(udp::socket &socket);
+    static bool GsoSupported(udp::socket &socket);
+};
+
+struct UdpBatchStats {
+    void Record(size_t packets, std::chrono::steady_clock::duration elapsed);
+    std::string DumpToStr() const;
+
+    uint64_t batches = 0;
+    uint64_t packets = 0;
+    size_t max_batch = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef WINDOWS
+
+#include <cstring>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "common_utils/handoff.h"
+
+namespace bsys = boost::system;
+
+namespace {
+
+// the data byte tells which sockets follow, in this order
+const uint8_t kTcpBit = 0x01;
+const uint8_t kUdpBit = 0x02;
+const uint8_t kConfirm = 0x01;
+
+// a process that accepted but never answers must not keep the replacement
+// from binding
+const time_t kReceiveTimeout = 5;
+
+union ControlBuffer {
+    struct cmsghdr align;
+    uint8_t data[CMSG_SPACE(sizeof(int) * 2)];
+};
+
+// listening sockets only go to, and only come from, processes of our own
+// user
+bool SameUser(int fd) {
+#ifdef LINUX
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return false;
+    }
+    uid_t uid = cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        return false;
+    }
+#endif
+    return uid == geteuid();
+}
+
+bool SendSockets(int fd, uint8_t mask, const int *fds, size_t count) {
+    ControlBuffer control;
+    struct iovec iov{ &mask, 1 };
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    std::memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count) {
+        msg.msg_control = control.data;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) {
+        LOG(WARNING) << "cannot hand the listening sockets over: " << std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}
+
+ListenerHandoff::ListenerHandoff(boost::asio::io_context &ctx, std::string path)
+    : path_(std::move(path)), acceptor_(ctx), previous_(ctx), serving_(false),
+      dev_(0), ino_(0) {
+}
+
+bool ListenerHandoff::Receive(Sockets &sockets) {
+    bsys::error_code ec;
+    previous_.connect(local::endpoint(path_), ec);
+    if (ec) {
+        VLOG(1) << "no process to take the listening sockets from: " << ec.message();
+        previous_.close(ec);
+        return false;
+    }
+    if (!SameUser(previous_.native_handle())) {
+        LOG(WARNING) << "the process serving " << path_ << " runs as another user, not taking its sockets";
+        previous_.close(ec);
+        return false;
+    }
+    struct timeval tv{ kReceiveTimeout, 0 };
+    setsockopt(previous_.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint8_t mask = 0;
+    ControlBuffer control;
+    struct iovec iov{ &mask, 1 };
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+    ssize_t n;
+    do {
+        n = recvmsg(previous_.native_handle(), &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) {
+        LOG(WARNING) << "socket handoff failed: "
+                     << (n < 0 ? std::strerror(errno) : "connection closed");
+        previous_.close(ec);
+        return false;
+    }
+
+    int fds[2];
+    size_t count = 0;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = std::min((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), (size_t)2);
+            std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+    size_t expected = !!(mask & kTcpBit) + !!(mask & kUdpBit);
+    if (count != expected || (msg.msg_flags & MSG_CTRUNC)) {
+        LOG(WARNING) << "socket handoff failed: unexpected descriptors";
+        for (size_t i = 0; i < count; ++i) {
+            ::close(fds[i]);
+        }
+        previous_.close(ec);
+        return false;
+    }
+
+    size_t i = 0;
+    if (mask & kTcpBit) {
+        sockets.tcp = fds[i++];
+    }
+    if (mask & kUdpBit) {
+        sockets.udp = fds[i++];
+    }
+    LOG(INFO) << "took over the listening sockets of the previous process";
+    return true;
+}
+
+void ListenerHandoff::Confirm() {
+    if (!previous_.is_open()) {
+        return;
+    }
+    uint8_t ack = kConfirm;
+    bsys::error_code ec;
+    boost::asio::write(previous_, boost::asio::buffer(&ack, 1), ec);
+    if (ec) {
+        LOG(WARNING) << "cannot confirm the socket handoff: " << ec.message();
+    }
+    previous_.close(ec);
+}
+
+void ListenerHandoff::Serve(Sockets sockets, std::function<void()> taken) {
+    sockets_ = sockets;
+    taken_ = std::move(taken);
+
+    // the path is stale or belongs to the previous process, which is done
+    // serving it once we confirmed
+    ::unlink(path_.c_str());
+    bsys::error_code ec;
+    acceptor_.open(local(), ec);
+    if (!ec) {
+        // whoever connects gets the listening sockets, the path is ours alone
+        mode_t mask = ::umask(0177);
+        acceptor_.bind(local::endpoint(path_), ec);
+        ::umask(mask);
+    }
+    struct stat st;
+    if (!ec && ::stat(path_.c_str(), &st) < 0) {
+        ec = bsys::error_code(errno, bsys::system_category());
+    }
+    if (!ec) {
+        dev_ = st.st_dev;
+        ino_ = st.st_ino;
+        acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec) {
+        LOG(ERROR) << "cannot serve the socket handoff at " << path_ << ": " << ec.message();
+        acceptor_.close(ec);
+        return;
+    }
+    serving_ = true;
+    LOG(INFO) << "socket handoff served at " << path_;
+    DoAccept();
+}
+
+// the path is left alone once a replacement bound its own socket there
+void ListenerHandoff::Stop() {
+    bsys::error_code ec;
+    struct stat st;
+    if (serving_ && ::stat(path_.c_str(), &st) == 0
+        && st.st_dev == dev_ && st.st_ino == ino_) {
+        ::unlink(path_.c_str());
+    }
+    serving_ = false;
+    acceptor_.close(ec);
+    if (next_) {
+        next_->close(ec);
+        next_.reset();
+    }
+}
+
+void ListenerHandoff::DoAccept() {
+    acceptor_.async_accept([this](bsys::error_code ec, local::socket conn) {
+        if (!serving_) {
+            return;
+        }
+        if (!ec && !SameUser(conn.native_handle())) {
+            LOG(WARNING) << "refused a socket handoff to a process of another user";
+        } else if (!ec) {
+            int fds[2];
+            size_t count = 0;
+            uint8_t mask = 0;
+            if (sockets_.tcp >= 0) {
+                mask |= kTcpBit;
+                fds[count++] = sockets_.tcp;
+            }
+            if (sockets_.udp >= 0) {
+                mask |= kUdpBit;
+                fds[count++] = sockets_.udp;
+            }
+            auto peer = std::make_shared<local::socket>(std::move(conn));
+            if (SendSockets(peer->native_handle(), mask, fds, count)) {
+                DoWaitConfirm(std::move(peer));
+            }
+        }
+        DoAccept();
+    });
+}
+
+// one replacement at a time, a newer one supersedes a pending one
+void ListenerHandoff::DoWaitConfirm(std::shared_ptr<local::socket> conn) {
+    bsys::error_code ignored;
+    if (next_) {
+        next_->close(ignored);
+    }
+    next_ = conn;
+    auto ack = std::make_shared<uint8_t>(0);
+    boost::asio::async_read(
+        *conn, boost::asio::buffer(ack.get(), 1),
+        [this, conn, ack](bsys::error_code ec, size_t) {
+            if (!serving_ || next_ != conn) {
+                return;
+            }
+            next_.reset();
+            if (ec || *ack != kConfirm) {
+                LOG(WARNING) << "the new process did not take over the listening sockets";
+                return;
+            }
+            LOG(INFO) << "listening sockets taken over by the new process";
+            serving_ = false;
+            bsys::error_code ignored;
+            acceptor_.close(ignored);
+            auto taken = std::move(taken_);
+            taken();
+        }
+    );
+}
+
+#endif // WINDOWS
@@ -0,0 +1,106 @@
+
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <sodium.h>
+
+#include "common_utils/random.h"
+
+namespace {
+
+// Every refill draws a new key from the head of the keystream and wipes
+// the old one (fast key erasure), and served bytes are wiped as they go,
+// so a later state leak cannot reveal earlier output.
+class RandomPool {
+public:
+    RandomPool() : pos_(kBlockSize) {
+        if (sodium_init() < 0) {
+            abort();
+        }
+        randombytes_buf(key_.data(), key_.size());
+    }
+
+    ~RandomPool() {
+        sodium_memzero(key_.data(), key_.size());
+        sodium_memzero(block_.data(), block_.size());
+    }
+
+    void Fill(uint8_t *out, size_t len) {
+        if (len > kBlockSize / 2) {
+            randombytes_buf(out, len);
+            return;
+        }
+        while (len) {
+            if (pos_ == kBlockSize) {
+                Refill();
+            }
+            size_t n = std::min(len, kBlockSize - pos_);
+            memcpy(out, block_.data() + pos_, n);
+            sodium_memzero(block_.data() + pos_, n);
+            pos_ += n;
+            out += n;
+            len -= n;
+        }
+    }
+
+private:
+    static const size_t kBlockSize = 4096;
+
+    void Refill() {
+        static const std::array<uint8_t, crypto_stream_chacha20_NONCEBYTES> kNonce{};
+        crypto_stream_chacha20(block_.data(), block_.size(), kNonce.data(), key_.data());
+        std::copy_n(block_.begin(), key_.size(), key_.begin());
+        sodium_memzero(block_.data(), key_.size());
+        pos_ = key_.size();
+    }
+
+    size_t pos_;
+    std::array<uint8_t, crypto_stream_chacha20_KEYBYTES> key_;
+    std::array<uint8_t, kBlockSize> block_;
+};
+
+RandomPool &GetPool() {
+    thread_local RandomPool pool;
+    return pool;
+}
+
+#ifdef TEST_HOOKS
+thread_local const uint8_t *script = nullptr;
+thread_local size_t script_len = 0;
+#endif
+
+}
+
+void RandomBytes(void *buf, size_t len) {
+#ifdef TEST_HOOKS
+    if (script) {
+        if (len > script_len) {
+            abort();
+        }
+        memcpy(buf, script, len);
+        script += len;
+        script_len -= len;
+        return;
+    }
+#endif
+    GetPool().Fill((uint8_t *)buf, len);
+}
+
+#ifdef TEST_HOOKS
+void ScriptRandomBytes(const uint8_t *bytes, size_t len) {
+    script = bytes;
+    script_len = bytes ? len : 0;
+}
+#endif
+
+uint32_t RandomUniform(uint32_t upper_bound) {
+    if (upper_bound < 2) {
+        return 0;
+    }
+    uint32_t min = (1U + ~upper_bound) % upper_bound;
+    uint32_t r;
+    do {
+        RandomBytes(&r, sizeof r);
+    } while (r < min);
+    return r % upper_bound;
+}
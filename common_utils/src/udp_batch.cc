@@ -0,0 +1,229 @@
+
+#include <array>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#ifdef LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+#include "common_utils/udp_batch.h"
+
+using boost::asio::ip::udp;
+namespace bsys = boost::system;
+
+#ifdef LINUX
+
+static bsys::error_code LastError() {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return boost::asio::error::would_block;
+    }
+    return bsys::error_code(errno, bsys::system_category());
+}
+
+using ControlBuffer = std::array<uint8_t, CMSG_SPACE(sizeof(int))>;
+
+size_t UdpBatchIO::ReceiveBatch(udp::socket &socket,
+                                const boost::asio::mutable_buffer *bufs,
+                                size_t *lengths, udp::endpoint *senders,
+                                size_t count, bsys::error_code &ec,
+                                size_t *segment_sizes) {
+    std::array<mmsghdr, kMaxBatch> msgs;
+    std::array<iovec, kMaxBatch> iovs;
+    std::array<ControlBuffer, kMaxBatch> controls;
+
+    count = std::min(count, static_cast<size_t>(kMaxBatch));
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = bufs[i].data();
+        iovs[i].iov_len = bufs[i].size();
+        msgs[i].msg_hdr = msghdr{};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (senders) {
+            msgs[i].msg_hdr.msg_name = senders[i].data();
+            msgs[i].msg_hdr.msg_namelen = senders[i].capacity();
+        }
+        if (segment_sizes) {
+            msgs[i].msg_hdr.msg_control = controls[i].data();
+            msgs[i].msg_hdr.msg_controllen = controls[i].size();
+        }
+    }
+
+    int n = recvmmsg(socket.native_handle(), msgs.data(), count, MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+        ec = LastError();
+        return 0;
+    }
+    ec.clear();
+    for (int i = 0; i < n; ++i) {
+        lengths[i] = msgs[i].msg_len;
+        if (senders) {
+            senders[i].resize(msgs[i].msg_hdr.msg_namelen);
+        }
+        if (segment_sizes) {
+            segment_sizes[i] = 0;
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+                 cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int segment_size;
+                    memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                    if ((size_t)segment_size < lengths[i]) {
+                        segment_sizes[i] = segment_size;
+                    }
+                }
+            }
+        }
+    }
+    return n;
+}
+
+size_t UdpBatchIO::SendBatch(udp::socket &socket,
+                             const boost::asio::const_buffer *packets,
+                             const udp::endpoint *destinations,
+                             size_t count, bsys::error_code &ec,
+                             const size_t *segment_sizes) {
+    std::array<mmsghdr, kMaxBatch> msgs;
+    std::array<iovec, kMaxBatch> iovs;
+    std::array<ControlBuffer, kMaxBatch> controls;
+
+    count = std::min(count, static_cast<size_t>(kMaxBatch));
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = const_cast<void *>(packets[i].data());
+        iovs[i].iov_len = packets[i].size();
+        msgs[i].msg_hdr = msghdr{};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (destinations) {
+            msgs[i].msg_hdr.msg_name = const_cast<sockaddr *>(destinations[i].data());
+            msgs[i].msg_hdr.msg_namelen = destinations[i].size();
+        }
+        if (segment_sizes && segment_sizes[i]) {
+            uint16_t segment_size = segment_sizes[i];
+            msgs[i].msg_hdr.msg_control = controls[i].data();
+            msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(segment_size));
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+    }
+
+    int n = sendmmsg(socket.native_handle(), msgs.data(), count, MSG_DONTWAIT);
+    if (n < 0) {
+        ec = LastError();
+        return 0;
+    }
+    ec.clear();
+    return n;
+}
+
+bool UdpBatchIO::EnableGro(udp::socket &socket) {
+    int on = 1;
+    return setsockopt(socket.native_handle(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+bool UdpBatchIO::GsoSupported(udp::socket &socket) {
+    int segment_size = 0;
+    socklen_t len = sizeof(segment_size);
+    return getsockopt(socket.native_handle(), SOL_UDP, UDP_SEGMENT, &segment_size, &len) == 0;
+}
+
+#else // LINUX
+
+size_t UdpBatchIO::ReceiveBatch(udp::socket &socket,
+                                const boost::asio::mutable_buffer *bufs,
+                                size_t *lengths, udp::endpoint *senders,
+                                size_t count, bsys::error_code &ec,
+                                size_t *segment_sizes) {
+    size_t n = 0;
+    ec.clear();
+    while (n < count) {
+        if (!socket.available(ec) || ec) {
+            if (!n && !ec) {
+                ec = boost::asio::error::would_block;
+            }
+            break;
+        }
+        udp::endpoint sender;
+        lengths[n] = socket.receive_from(bufs[n], sender, 0, ec);
+        if (ec) {
+            break;
+        }
+        if (senders) {
+            senders[n] = sender;
+        }
+        if (segment_sizes) {
+            segment_sizes[n] = 0;
+        }
+        ++n;
+    }
+    if (n) {
+        ec.clear();
+    }
+    return n;
+}
+
+size_t UdpBatchIO::SendBatch(udp::socket &socket,
+                             const boost::asio::const_buffer *packets,
+                             const udp::endpoint *destinations,
+                             size_t count, bsys::error_code &ec,
+                             const size_t *segment_sizes) {
+    size_t n = 0;
+    ec.clear();
+    while (n < count) {
+        if (destinations) {
+            socket.send_to(packets[n], destinations[n], 0, ec);
+        } else {
+            socket.send(packets[n], 0, ec);
+        }
+        if (ec) {
+            break;
+        }
+        ++n;
+    }
+    return n;
+}
+
+bool UdpBatchIO::EnableGro(udp::socket &socket) {
+    return false;
+}
+
+bool UdpBatchIO::GsoSupported(udp::socket &socket) {
+    return false;
+}
+
+#endif // LINUX
+
+void UdpBatchStats::Record(size_t count, std::chrono::steady_clock::duration elapsed) {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    ++batches;
+    packets += count;
+    max_batch = std::max(max_batch, count);
+    total_us += us;
+    max_us = std::max(max_us, us);
+}
+
+std::string UdpBatchStats::DumpToStr() const {
+    std::ostringstream oss;
+    oss << "batches: " << batches
+        << ", packets: " << packets
+        << ", avg batch: " << (batches ? (double)packets / batches : 0.0)
+        << ", max batch: " << max_batch
+        << ", avg latency: " << (batches ? total_us / batches : 0) << "us"
+        << ", max latency: " << max_us << "us";
+    return oss.str();
+}
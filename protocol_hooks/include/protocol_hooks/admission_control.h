@@ -0,0 +1,62 @@
+#ifndef __ADMISSION_CONTROL_H__
+#define __ADMISSION_CONTROL_H__
+
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+
+// Bounds what a stream server takes on: sessions in total, sessions still
+// in their handshake and sessions per client address. A server stops
+// accepting while saturated and leaves new connections in the listen
+// backlog, instead of taking on more than it can serve.
+// Per client counts live in a fixed table of hashed counters, each client
+// owns one counter in each of two rows and the smaller one is its count.
+// Clients sharing both counters are limited together, never one above
+// its limit. IPv6 clients are counted by their /64.
+class AdmissionControl {
+public:
+    struct Limits {
+        size_t sessions = 0;
+        size_t handshakes = 0;
+        size_t per_client = 0;
+    };
+
+    explicit AdmissionControl(Limits limits);
+
+    bool Enabled() const {
+        return limits_.sessions || limits_.handshakes || limits_.per_client;
+    }
+
+    // accepting pauses while true
+    bool Saturated() const;
+
+    // false when the client is at its limit
+    bool Allows(const boost::asio::ip::address &client) const;
+    void Admit(const void *session, const boost::asio::ip::address &client);
+    // the session finished its handshake
+    void Established(const void *session);
+    void Release(const void *session);
+
+    size_t Handshakes() const { return handshakes_; }
+
+private:
+    static const size_t kWidth = 4096;
+
+    struct Entry {
+        std::array<size_t, 2> slots;
+        bool counted;
+        bool established;
+    };
+
+    std::array<size_t, 2> Slots(const boost::asio::ip::address &client) const;
+
+    Limits limits_;
+    size_t handshakes_;
+    std::vector<uint32_t> counters_;
+    std::unordered_map<const void *, Entry> sessions_;
+};
+
+#endif
@@ -38,6 +38,10 @@ public:
     virtual bool GetResolveArgs(std::string &hostname, uint16_t &port) const;
     virtual bool NeedResolve() const { return remote_info_->NeedResolve(); }
     virtual bool HasTarget() const { return !remote_info_->IsEmpty(); }
+    // stream multiplexing, the client side sends a carrier header in place
+    // of a target and the server side reports having received one
+    virtual bool StartMuxCarrier() { return false; }
+    virtual bool IsMuxCarrier() const { return false; }
 
 protected:
     size_t header_length_;
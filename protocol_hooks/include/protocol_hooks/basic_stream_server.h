@@ -5,15 +5,38 @@
 #include <sstream>
 #include <unordered_map>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <cares_service/cares.hxx>
 
+#include "protocol_hooks/admission_control.h"
 #include "protocol_hooks/basic_protocol.h"
+#include "protocol_hooks/caching_resolver.h"
+#include "protocol_hooks/stream_mux.h"
+#include "protocol_hooks/upstream_pin.h"
+#include "protocol_hooks/warm_pool.h"
+#include "protocol_hooks/wrap_offloader.h"
 
 struct StreamServerArgs {
     boost::asio::ip::tcp::endpoint bind_ep;
     std::function<std::unique_ptr<BasicProtocol>()> generator;
     size_t timeout = 60000;
+    size_t offload_threads = 0;
+    size_t offload_threshold = 0;
+    // server hostname of client side processes, pinned by UpstreamPin
+    std::string upstream_host;
+    uint16_t upstream_port = 0;
+    // pre-connected upstream connections, 0 to disable
+    size_t warm_pool_size = 0;
+    size_t warm_pool_idle = 30;
+    // carriers multiplexing client connections, 0 to disable
+    size_t mux_connections = 0;
+    // listening socket taken over from a previous process, -1 to bind
+    int listen_fd = -1;
+    // admission limits, 0 for none
+    size_t max_sessions = 0;
+    size_t max_handshakes = 0;
+    size_t max_sessions_per_client = 0;
 };
 
 #define DECLARE_STREAM_SERVER(__server_name, __session_name) \
@@ -21,12 +44,31 @@ class __server_name : public std::enable_shared_from_this<__server_name> { \
     typedef boost::asio::ip::tcp tcp; \
     using ProtocolPtr = std::unique_ptr<BasicProtocol>; \
     using ProtocolGenerator = std::function<ProtocolPtr(void)>; \
-    using resolver_type = cares::tcp::resolver; \
+    using resolver_type = CachingResolver<cares::tcp::resolver>; \
 public: \
     __server_name(boost::asio::io_context &ctx, StreamServerArgs args, std::shared_ptr<resolver_type> resolver) \
-        : acceptor_(ctx, std::move(args.bind_ep)), timeout_(args.timeout), \
-          protocol_generator_(std::move(args.generator)), resolver_(resolver) { \
+        : acceptor_(ctx), timeout_(args.timeout), \
+          protocol_generator_(std::move(args.generator)), resolver_(resolver), \
+          drain_timer_(ctx), \
+          admission_({ args.max_sessions, args.max_handshakes, args.max_sessions_per_client }), \
+          accept_timer_(ctx), accepting_(false) { \
+        if (args.listen_fd >= 0) { \
+            acceptor_.assign(args.bind_ep.protocol(), args.listen_fd); \
+        } else { \
+            acceptor_.open(args.bind_ep.protocol()); \
+            acceptor_.set_option(tcp::acceptor::reuse_address(true)); \
+            acceptor_.bind(args.bind_ep); \
+            acceptor_.listen(); \
+        } \
         LOG(INFO) << #__server_name " running at " << acceptor_.local_endpoint(); \
+        boost::asio::use_service<WrapOffloader>(ctx).Start(args.offload_threads, args.offload_threshold); \
+        if (!args.upstream_host.empty()) { \
+            boost::asio::use_service<UpstreamPin>(ctx).Start(args.upstream_host, args.upstream_port, resolver); \
+        } \
+        boost::asio::use_service<WarmPool>(ctx).Start(args.warm_pool_size, \
+                                                      std::chrono::seconds(args.warm_pool_idle)); \
+        boost::asio::use_service<StreamMux>(ctx).Start(args.mux_connections, protocol_generator_, timeout_); \
+        boost::asio::use_service<StreamMux>(ctx).Admission(&admission_, [this]() { ResumeAccept(); }); \
         running_ = true; \
         DoAccept(); \
     } \
@@ -39,15 +81,23 @@ public: \
     } \
  \
     void Stop(); \
+    void Drain(std::chrono::seconds deadline); \
  \
     bool Stopped() const { \
         return !running_; \
     } \
  \
     void DumpConnections() const; \
+ \
+    int NativeHandle() { \
+        return acceptor_.native_handle(); \
+    } \
  \
 private: \
     void DoAccept(); \
+    void ResumeAccept(); \
+    void DoDrain(std::chrono::steady_clock::time_point deadline); \
+    void CloseSessions(); \
     static void ReleaseSession(std::weak_ptr<__server_name> server, __session_name *ptr); \
  \
     tcp::acceptor acceptor_; \
@@ -56,13 +106,23 @@ private: \
     ProtocolGenerator protocol_generator_; \
     std::shared_ptr<resolver_type> resolver_; \
     std::unordered_map<__session_name *, std::weak_ptr<__session_name>> sessions_; \
+    boost::asio::steady_timer drain_timer_; \
+    AdmissionControl admission_; \
+    boost::asio::steady_timer accept_timer_; \
+    bool accepting_; \
 }
 
 #define DEFINE_STREAM_SERVER(__server_name, __session_name) \
 void __server_name::DoAccept() { \
+    accepting_ = true; \
     acceptor_.async_accept([this](bsys::error_code ec, tcp::socket socket) { \
-        if (!ec) { \
-            VLOG(1) << "A new client accepted: " << socket.remote_endpoint(); \
+        accepting_ = false; \
+        bsys::error_code ep_ec; \
+        auto remote = socket.remote_endpoint(ep_ec); \
+        if (!ec && !ep_ec && !admission_.Allows(remote.address())) { \
+            VLOG(1) << "Client over its session limit: " << remote; \
+        } else if (!ec && !ep_ec) { \
+            VLOG(1) << "A new client accepted: " << remote; \
             std::shared_ptr<__session_name> session{ \
                 new __session_name(std::move(socket), protocol_generator_(), resolver_, timeout_), \
                 std::bind(&__server_name::ReleaseSession, \
@@ -70,7 +130,34 @@ void __server_name::DoAccept() { \
                           std::placeholders::_1) \
             }; \
             sessions_.emplace(session.get(), session); \
+            if (admission_.Enabled()) { \
+                admission_.Admit(session.get(), remote.address()); \
+                std::weak_ptr<__server_name> server = shared_from_this(); \
+                session->OnEstablished([server, ptr = session.get()]() { \
+                    auto self = server.lock(); \
+                    if (self) { \
+                        self->admission_.Established(ptr); \
+                        self->ResumeAccept(); \
+                    } \
+                }); \
+            } \
             session->Start(); \
+        } else if (ec == boost::asio::error::no_descriptors \
+                   || ec == bsys::errc::too_many_files_open_in_system \
+                   || ec == boost::asio::error::no_buffer_space \
+                   || ec == boost::asio::error::no_memory) { \
+            LOG(WARNING) << "accept failed: " << ec.message() << ", pausing"; \
+            accept_timer_.expires_after(std::chrono::milliseconds(100)); \
+            accept_timer_.async_wait([this](bsys::error_code timer_ec) { \
+                if (!timer_ec) { \
+                    ResumeAccept(); \
+                } \
+            }); \
+            return; \
+        } \
+        if (running_ && admission_.Saturated()) { \
+            VLOG(1) << "admission limits reached, accepting paused"; \
+            return; \
         } \
         if (running_) { \
             DoAccept(); \
@@ -78,10 +165,58 @@ void __server_name::DoAccept() { \
     }); \
 } \
  \
+void __server_name::ResumeAccept() { \
+    if (!running_ || accepting_ || admission_.Saturated()) { \
+        return; \
+    } \
+    accept_timer_.cancel(); \
+    DoAccept(); \
+} \
+ \
 void __server_name::Stop() { \
     if (Stopped()) { return; } \
     acceptor_.cancel(); \
     running_ = false; \
+    CloseSessions(); \
+} \
+ \
+void __server_name::Drain(std::chrono::seconds deadline) { \
+    if (Stopped()) { return; } \
+    boost::system::error_code ignored; \
+    acceptor_.close(ignored); \
+    running_ = false; \
+    LOG(INFO) << "draining " << sessions_.size() << " sessions within " << deadline.count() << "s"; \
+    DoDrain(std::chrono::steady_clock::now() + deadline); \
+} \
+ \
+void __server_name::DoDrain(std::chrono::steady_clock::time_point deadline) { \
+    auto &mux = boost::asio::use_service<StreamMux>(acceptor_.get_executor().context()); \
+    if (sessions_.empty() && !mux.Carriers()) { \
+        LOG(INFO) << "all sessions drained"; \
+        CloseSessions(); \
+        return; \
+    } \
+    if (std::chrono::steady_clock::now() >= deadline) { \
+        LOG(INFO) << "drain deadline passed, closing " << sessions_.size() << " sessions"; \
+        CloseSessions(); \
+        return; \
+    } \
+    drain_timer_.expires_after(std::chrono::seconds(1)); \
+    drain_timer_.async_wait( \
+        [this, self = shared_from_this(), deadline](bsys::error_code ec) { \
+            if (!ec) { \
+                DoDrain(deadline); \
+            } \
+        } \
+    ); \
+} \
+ \
+void __server_name::CloseSessions() { \
+    drain_timer_.cancel(); \
+    accept_timer_.cancel(); \
+    boost::asio::use_service<UpstreamPin>(acceptor_.get_executor().context()).Stop(); \
+    boost::asio::use_service<WarmPool>(acceptor_.get_executor().context()).Stop(); \
+    boost::asio::use_service<StreamMux>(acceptor_.get_executor().context()).Stop(); \
     for (auto &kv : sessions_) { \
         auto p = kv.second.lock(); \
         if (p) { \
@@ -93,6 +228,9 @@ void __server_name::Stop() { \
 void __server_name::DumpConnections() const { \
     std::ostringstream oss; \
     oss << "Current connections: " << sessions_.size() << std::endl; \
+    if (admission_.Enabled()) { \
+        oss << "In handshake: " << admission_.Handshakes() << std::endl; \
+    } \
     for (auto &kv : sessions_) { \
         auto conn = kv.second.lock(); \
         if (conn) { \
@@ -106,8 +244,12 @@ void __server_name::ReleaseSession(std::weak_ptr<__server_name> server, __sessio
     auto self = server.lock(); \
     if (self) { \
         self->sessions_.erase(ptr); \
+        self->admission_.Release(ptr); \
     } \
     delete ptr; \
+    if (self) { \
+        self->ResumeAccept(); \
+    } \
 }
 
 #endif
@@ -9,11 +9,15 @@
 #include <cares_service/cares.hxx>
 
 #include "protocol_hooks/basic_protocol.h"
+#include "protocol_hooks/caching_resolver.h"
+#include "protocol_hooks/happy_eyeballs.h"
+#include "protocol_hooks/upstream_pin.h"
+#include "protocol_hooks/wrap_offloader.h"
 
 class BasicStreamSession {
 protected:
     typedef boost::asio::ip::tcp tcp;
-    using resolver_type = cares::tcp::resolver;
+    using resolver_type = CachingResolver<cares::tcp::resolver>;
 
 public:
     BasicStreamSession(tcp::socket socket,
@@ -22,16 +26,29 @@ public:
                        size_t ttl = 5000)
         : context_(socket.get_executor().context()),
           client_(std::move(socket), ttl), target_(context_, ttl),
-          resolver_(resolver), protocol_(std::move(protocol)) {
+          resolver_(resolver), resolve_ticket_(0), protocol_(std::move(protocol)),
+          offload_inflight_(0), close_pending_(false) {
     }
 
     ~BasicStreamSession() = default;
 
+    // runs once, when the session is past its handshake and relays
+    void OnEstablished(std::function<void(void)> handler) {
+        on_established_ = std::move(handler);
+    }
+
     void Close() {
+        // a wrap running on a crypto worker finishes first, its completion
+        // closes the session
+        if (offload_inflight_) {
+            close_pending_ = true;
+            return;
+        }
         VLOG(1) << "Closing: " << client_.socket.remote_endpoint();
         client_.CancelAll();
         target_.CancelAll();
-        resolver_->cancel();
+        CancelConnect();
+        resolver_->cancel(resolve_ticket_);
     }
 
     std::string DumpToStr() const {
@@ -55,7 +72,7 @@ protected:
     template<typename Self, typename Port>
     void DoResolveTarget(Self self, std::string host, Port port, AfterConnected cb) {
         VLOG(2) << "Resolving to " << host << ":" << port;
-        resolver_->async_resolve(
+        resolve_ticket_ = resolver_->async_resolve(
             std::move(host), std::move(port),
             [this, self, cb = std::move(cb)]
             (boost::system::error_code ec, resolver_type::results_type results) {
@@ -71,30 +88,91 @@ protected:
         TimerAgain(self, client_);
     }
 
-    template<class Self, class EndpointSequence>
-    void DoConnectTarget(Self self, const EndpointSequence &results, AfterConnected cb) {
-        boost::asio::async_connect(
-            target_.socket, results,
-            [this, self, cb = std::move(cb)](boost::system::error_code ec, tcp::endpoint ep) {
-                if (ec) {
-                    if (ec == boost::asio::error::operation_aborted) {
-                        VLOG(1) << "Connect canceled";
+    // a single known endpoint is connected directly, resolved hosts race
+    // their addresses
+    template<class EndpointSequence, class Handler>
+    void AsyncConnectTarget(const EndpointSequence &endpoints, Handler handler) {
+        boost::asio::async_connect(target_.socket, endpoints, std::move(handler));
+    }
+
+    template<class Handler>
+    void AsyncConnectTarget(const resolver_type::results_type &results, Handler handler) {
+        connector_ = HappyEyeballs::Start(target_.socket, results, std::move(handler));
+    }
+
+    // connects to the pinned address of the upstream, a refused address
+    // hands the attempt to the next one
+    template<class Handler>
+    void AsyncConnectUpstream(Handler handler, size_t attempt = 0) {
+        auto &upstream = boost::asio::use_service<UpstreamPin>(context_);
+        auto ep = upstream.Endpoint();
+        target_.socket.async_connect(
+            ep,
+            [this, &upstream, ep, attempt, handler = std::move(handler)]
+            (boost::system::error_code ec) mutable {
+                if (ec && ec != boost::asio::error::operation_aborted) {
+                    upstream.ReportFailure(ep);
+                    if (attempt + 1 < upstream.Size()) {
+                        boost::system::error_code ignored;
+                        target_.socket.close(ignored);
+                        AsyncConnectUpstream(std::move(handler), attempt + 1);
                         return;
                     }
-                    LOG(INFO) << "Cannot connect to remote: " << ec.message();
-                    client_.CancelAll();
-                    return;
                 }
-                client_.timer.cancel();
-                VLOG(1) << "Connected to remote " << ep;
-                cb();
+                handler(ec, ep);
             }
         );
+    }
+
+    void CancelConnect() {
+        auto connector = connector_.lock();
+        if (connector) {
+            connector->Cancel();
+        }
+    }
+
+    template<class Self>
+    auto TargetConnected(Self self, AfterConnected cb) {
+        return [this, self, cb = std::move(cb)](boost::system::error_code ec, tcp::endpoint ep) {
+            if (ec) {
+                if (ec == boost::asio::error::operation_aborted) {
+                    VLOG(1) << "Connect canceled";
+                    return;
+                }
+                LOG(INFO) << "Cannot connect to remote: " << ec.message();
+                client_.CancelAll();
+                return;
+            }
+            client_.timer.cancel();
+            VLOG(1) << "Connected to remote " << ep;
+            cb();
+        };
+    }
+
+    template<class Self, class EndpointSequence>
+    void DoConnectTarget(Self self, const EndpointSequence &results, AfterConnected cb) {
+        AsyncConnectTarget(results, TargetConnected(self, std::move(cb)));
+        TimerAgain(self, client_);
+    }
+
+    // client side sessions reach their upstream without a lookup once its
+    // address is pinned, until then it is resolved per connection
+    template<class Self>
+    void DoConnectUpstream(Self self, AfterConnected cb) {
+        if (!boost::asio::use_service<UpstreamPin>(context_).Pinned()) {
+            std::string hostname;
+            uint16_t port;
+            protocol_->GetResolveArgs(hostname, port);
+            DoResolveTarget(self, std::move(hostname), port, std::move(cb));
+            return;
+        }
+        AsyncConnectUpstream(TargetConnected(self, std::move(cb)));
         TimerAgain(self, client_);
     }
 
     template<typename Self>
     void DoRelayStream(Self self, Peer &src, Peer &dest, BasicProtocol::Wrapper wrapper) {
+        MarkEstablished();
         src.socket.async_read_some(
             src.buf.GetBuffer(),
             [this, self, &src, &dest,
@@ -116,43 +194,82 @@ protected:
                 }
                 src.timer.cancel();
                 src.buf.Append(len);
-                ssize_t valid_length = wrapper(src.buf);
-                if (valid_length == 0) { // need more
-                    DoRelayStream(self, src, dest, std::move(wrapper));
+                auto &offloader = boost::asio::use_service<WrapOffloader>(context_);
+                auto &meter = (&src == &client_) ? client_meter_ : target_meter_;
+                if (offloader.ShouldOffload(meter, len) || offload_inflight_) {
+                    if (!offload_serializer_) {
+                        offload_serializer_ = offloader.NewSerializer();
+                    }
+                    ++offload_inflight_;
+                    auto wrapper_ptr = std::make_shared<BasicProtocol::Wrapper>(std::move(wrapper));
+                    offloader.Submit(
+                        *offload_serializer_,
+                        [wrapper_ptr, &src]() { return (*wrapper_ptr)(src.buf); },
+                        [this, self, &src, &dest, wrapper_ptr](ssize_t valid_length) {
+                            --offload_inflight_;
+                            if (close_pending_) {
+                                if (!offload_inflight_) {
+                                    close_pending_ = false;
+                                    Close();
+                                }
+                                return;
+                            }
+                            DoRelayWrapped(self, src, dest, std::move(*wrapper_ptr), valid_length);
+                        }
+                    );
                     return;
-                } else if (valid_length < 0) { // error occurs
-                    boost::system::error_code ep_ec;
-                    LOG(WARNING) << "Protocol hook error, remote ep: " << src.socket.remote_endpoint(ep_ec);
-                    if (ep_ec) {
-                        LOG(INFO) << "cannot get error endpoint, " << ep_ec.message();
+                }
+                ssize_t valid_length = wrapper(src.buf);
+                DoRelayWrapped(self, src, dest, std::move(wrapper), valid_length);
+            }
+        );
+        TimerAgain(self, src);
+    }
+
+    template<typename Self>
+    void DoRelayWrapped(Self self, Peer &src, Peer &dest,
+                        BasicProtocol::Wrapper wrapper, ssize_t valid_length) {
+        if (valid_length == 0) { // need more
+            DoRelayStream(self, src, dest, std::move(wrapper));
+            return;
+        } else if (valid_length < 0) { // error occurs
+            boost::system::error_code ep_ec;
+            LOG(WARNING) << "Protocol hook error, remote ep: " << src.socket.remote_endpoint(ep_ec);
+            if (ep_ec) {
+                LOG(INFO) << "cannot get error endpoint, " << ep_ec.message();
+            }
+            src.CancelAll();
+            dest.CancelAll();
+            return;
+        }
+        boost::asio::async_write(dest.socket,
+            src.buf.GetConstBuffer(),
+            [this, self, &src, &dest, wrapper = std::move(wrapper)]
+            (boost::system::error_code ec, size_t len) {
+                if (ec) {
+                    if (ec == boost::asio::error::operation_aborted) {
+                        VLOG(1) << "Write operation canceled";
+                        return;
                     }
+                    LOG(WARNING) << "Relay write unexcepted error: " << ec.message();
                     src.CancelAll();
                     dest.CancelAll();
                     return;
                 }
-                boost::asio::async_write(dest.socket,
-                    src.buf.GetConstBuffer(),
-                    [this, self, &src, &dest, wrapper = std::move(wrapper)]
-                    (boost::system::error_code ec, size_t len) {
-                        if (ec) {
-                            if (ec == boost::asio::error::operation_aborted) {
-                                VLOG(1) << "Write operation canceled";
-                                return;
-                            }
-                            LOG(WARNING) << "Relay write unexcepted error: " << ec.message();
-                            src.CancelAll();
-                            dest.CancelAll();
-                            return;
-                        }
-                        dest.timer.cancel();
-                        src.buf.Reset();
-                        DoRelayStream(self, src, dest, std::move(wrapper));
-                    }
-                );
-                TimerAgain(self, dest);
+                dest.timer.cancel();
+                src.buf.Reset();
+                DoRelayStream(self, src, dest, std::move(wrapper));
             }
         );
-        TimerAgain(self, src);
+        TimerAgain(self, dest);
+    }
+
+    void MarkEstablished() {
+        if (on_established_) {
+            auto handler = std::move(on_established_);
+            on_established_ = nullptr;
+            handler();
+        }
     }
 
     void TimerExpiredCallBack(Peer &peer, boost::system::error_code ec) {
@@ -164,7 +281,8 @@ protected:
             }
             client_.CancelAll();
             target_.CancelAll();
-            resolver_->cancel();
+            CancelConnect();
+            resolver_->cancel(resolve_ticket_);
         }
     }
 
@@ -182,8 +300,18 @@ protected:
     boost::asio::io_context &context_;
     Peer client_;
     Peer target_;
+    ThroughputMeter client_meter_;
+    ThroughputMeter target_meter_;
     std::shared_ptr<resolver_type> resolver_;
+    resolver_type::Ticket resolve_ticket_;
+    std::weak_ptr<HappyEyeballs> connector_;
     std::unique_ptr<BasicProtocol> protocol_;
+    // jobs of both directions on the crypto workers, and a Close waiting
+    // for them
+    std::unique_ptr<WrapOffloader::Serializer> offload_serializer_;
+    size_t offload_inflight_;
+    bool close_pending_;
+    std::function<void(void)> on_established_;
 };
 
 #endif
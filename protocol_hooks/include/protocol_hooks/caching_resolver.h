@@ -0,0 +1,335 @@
+#ifndef __CACHING_RESOLVER_H__
+#define __CACHING_RESOLVER_H__
+
+#include <list>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <common_utils/options.h>
+
+// Approximate per key counters in a fixed amount of memory, a count-min
+// sketch whose counters are halved periodically so old popularity fades.
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t width);
+
+    // returns the estimated count including this increment
+    uint32_t Increment(const std::string &key);
+
+private:
+    static const size_t kDepth = 4;
+    static const uint8_t kMaxCount = 255;
+
+    void Age();
+
+    size_t width_;
+    size_t increments_;
+    std::vector<uint8_t> counters_;
+};
+
+// Hostname to address cache shared by the tcp and udp resolvers of an
+// io_context. Successful lookups live for a fixed TTL, failures for a
+// shorter one; the least recently used entry makes room when full.
+// Names looked up often are refreshed shortly before they expire, at a
+// bounded rate, so popular names never miss. With a snapshot file the
+// answers survive restarts, it is written periodically from a helper
+// thread and on shutdown.
+class DnsCache : public boost::asio::io_context::service {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Address = boost::asio::ip::address;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t negative_hits = 0;
+        uint64_t misses = 0;
+        uint64_t expirations = 0;
+        uint64_t evictions = 0;
+        uint64_t coalesced = 0;
+        uint64_t prefetches = 0;
+        uint64_t prefetches_throttled = 0;
+    };
+
+    static boost::asio::io_context::id id;
+
+    explicit DnsCache(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx), capacity_(0), sketch_(kSketchWidth),
+          prefetch_rate_(0), prefetch_tokens_(0), snapshot_writing_(false) {
+    }
+
+    void Start(const ResolverArgs &args);
+    bool Enabled() const { return capacity_ != 0; }
+
+    // true on a hit, a cached failure is returned through ec; refresh is
+    // set when a popular entry is about to expire
+    bool Lookup(const std::string &host, std::vector<Address> &addresses,
+                boost::system::error_code &ec, bool *refresh = nullptr);
+    // false when the prefetch rate is used up
+    bool TakePrefetchToken();
+    void Store(const std::string &host, std::vector<Address> addresses);
+    void StoreFailure(const std::string &host, boost::system::error_code ec);
+    void RecordCoalesced() { ++stats_.coalesced; }
+
+    // address family (4 or 6) the last connection to the host went
+    // through, 0 when unknown; kept apart from the cached addresses, so
+    // it outlives their expiry and works with the cache disabled
+    uint8_t PreferredFamily(const std::string &host) const;
+    void RememberFamily(const std::string &host, uint8_t family);
+
+    // hostnames differing in case or a trailing dot share one entry
+    static std::string Key(const std::string &host);
+
+    size_t Size() const { return index_.size(); }
+    size_t Capacity() const { return capacity_; }
+    const Stats &GetStats() const { return stats_; }
+    void DumpStats() const;
+
+private:
+    struct Entry {
+        std::string host;
+        std::vector<Address> addresses;
+        boost::system::error_code ec;
+        Clock::time_point refresh_at;
+        Clock::time_point expires;
+    };
+
+    struct Family {
+        std::string host;
+        uint8_t family;
+    };
+
+    using EntryList = std::list<Entry>;
+    using FamilyList = std::list<Family>;
+
+    static const size_t kMaxAddresses = 16;
+    static const size_t kSketchWidth = 4096;
+    static const size_t kMaxFamilies = 4096;
+    // lookups within the sketch's aging period that make a name popular
+    static const uint32_t kHotLookups = 4;
+    static const uint32_t kSnapshotVersion = 1;
+
+    void shutdown();
+    void LoadSnapshot();
+    // in the background unless wait, skipped while a write is under way
+    void SaveSnapshot(bool wait);
+    void Insert(std::string host, std::vector<Address> addresses,
+                boost::system::error_code ec, Clock::duration ttl);
+
+    size_t capacity_;
+    Clock::duration ttl_;
+    Clock::duration negative_ttl_;
+    FrequencySketch sketch_;
+    double prefetch_rate_;
+    double prefetch_tokens_;
+    Clock::time_point prefetch_refilled_;
+    std::string snapshot_file_;
+    Clock::time_point snapshot_saved_;
+    std::thread snapshot_writer_;
+    std::atomic<bool> snapshot_writing_;
+    EntryList entries_;
+    std::unordered_map<std::string, EntryList::iterator> index_;
+    FamilyList families_;
+    std::unordered_map<std::string, FamilyList::iterator> family_index_;
+    Stats stats_;
+};
+
+// Puts the DnsCache of its io_context in front of a cares resolver, the
+// interface is the one of the wrapped resolver. Concurrent lookups of a
+// host share one query; every caller gets a ticket, so cancelling one
+// waiter leaves the others and the query running.
+template<typename Resolver>
+class CachingResolver {
+public:
+    using results_type = typename Resolver::results_type;
+    using endpoint_type = typename results_type::endpoint_type;
+    using Ticket = uint64_t;
+
+    explicit CachingResolver(boost::asio::io_context &ctx)
+        : ctx_(ctx), resolver_(ctx), cache_(boost::asio::use_service<DnsCache>(ctx)),
+          state_(std::make_shared<State>()) {
+    }
+
+    void set_servers(const std::string &servers, boost::system::error_code &ec) {
+        resolver_.set_servers(servers, ec);
+    }
+
+    void resolve_mode(const std::string &mode, boost::system::error_code &ec) {
+        resolver_.resolve_mode(mode, ec);
+    }
+
+    // the handler of the ticket completes with operation_aborted
+    void cancel(Ticket ticket) {
+        auto itr = state_->waiters.find(ticket);
+        if (itr == state_->waiters.end()) {
+            return;
+        }
+        auto handler = std::move(itr->second.handler);
+        state_->waiters.erase(itr);
+        boost::asio::post(ctx_, [handler]() {
+            handler(boost::asio::error::operation_aborted, results_type());
+        });
+    }
+
+    void cancel() {
+        auto waiters = std::move(state_->waiters);
+        state_->waiters.clear();
+        for (auto &waiter : waiters) {
+            auto handler = std::move(waiter.second.handler);
+            boost::asio::post(ctx_, [handler]() {
+                handler(boost::asio::error::operation_aborted, results_type());
+            });
+        }
+        resolver_.cancel();
+    }
+
+    // answers from the cache only, returns false on a miss
+    bool lookup(const std::string &host, uint16_t port,
+                results_type &results, boost::system::error_code &ec) {
+        std::vector<DnsCache::Address> addresses;
+        bool refresh = false;
+        if (!cache_.Enabled() || !cache_.Lookup(host, addresses, ec, &refresh)) {
+            return false;
+        }
+        if (refresh && !state_->flights.count(DnsCache::Key(host)) && cache_.TakePrefetchToken()) {
+            VLOG(2) << "prefetching " << host;
+            async_refresh(host, port, [](boost::system::error_code, results_type) {});
+        }
+        results = MakeResults(host, port, addresses);
+        return true;
+    }
+
+    template<typename Handler>
+    Ticket async_resolve(std::string host, uint16_t port, Handler &&handler) {
+        results_type results;
+        boost::system::error_code ec;
+        if (lookup(host, port, results, ec)) {
+            Ticket ticket = AddWaiter(port, std::forward<Handler>(handler));
+            std::weak_ptr<State> weak_state = state_;
+            boost::asio::post(ctx_, [weak_state, ticket, ec, results]() {
+                auto state = weak_state.lock();
+                if (state) {
+                    Complete(*state, ticket, ec, results);
+                }
+            });
+            return ticket;
+        }
+        return async_refresh(std::move(host), port, std::forward<Handler>(handler));
+    }
+
+    // skips the cache but stores the answer, for callers that already
+    // missed through lookup
+    template<typename Handler>
+    Ticket async_refresh(std::string host, uint16_t port, Handler &&handler) {
+        Ticket ticket = AddWaiter(port, std::forward<Handler>(handler));
+        auto key = DnsCache::Key(host);
+        auto &flight = state_->flights[key];
+        flight.push_back(ticket);
+        if (flight.size() > 1) {
+            cache_.RecordCoalesced();
+            return ticket;
+        }
+
+        auto &cache = cache_;
+        std::weak_ptr<State> weak_state = state_;
+        resolver_.async_resolve(
+            std::move(host), port,
+            [&cache, weak_state, key](boost::system::error_code ec, results_type results) {
+                std::vector<DnsCache::Address> addresses;
+                for (auto &entry : results) {
+                    addresses.push_back(entry.endpoint().address());
+                }
+                if (!ec) {
+                    cache.Store(key, addresses);
+                } else if (ec != boost::asio::error::operation_aborted) {
+                    cache.StoreFailure(key, ec);
+                }
+
+                auto state = weak_state.lock();
+                if (!state) {
+                    return;
+                }
+                auto itr = state->flights.find(key);
+                if (itr == state->flights.end()) {
+                    return;
+                }
+                auto tickets = std::move(itr->second);
+                state->flights.erase(itr);
+                for (auto ticket : tickets) {
+                    auto waiter = state->waiters.find(ticket);
+                    if (waiter == state->waiters.end()) {
+                        continue;
+                    }
+                    Complete(*state, ticket, ec,
+                             ec ? results_type() : MakeResults(key, waiter->second.port, addresses));
+                }
+            }
+        );
+        return ticket;
+    }
+
+private:
+    using Callback = std::function<void(boost::system::error_code, results_type)>;
+
+    struct Waiter {
+        uint16_t port;
+        Callback handler;
+    };
+
+    struct State {
+        Ticket next_ticket = 0;
+        std::unordered_map<Ticket, Waiter> waiters;
+        // tickets waiting on the query of a host
+        std::unordered_map<std::string, std::vector<Ticket>> flights;
+    };
+
+    // handlers may be move only, the type erased one owns them through a
+    // shared pointer
+    template<typename Handler>
+    Ticket AddWaiter(uint16_t port, Handler &&handler) {
+        auto owned = std::make_shared<typename std::decay<Handler>::type>(std::forward<Handler>(handler));
+        Ticket ticket = ++state_->next_ticket;
+        state_->waiters.emplace(ticket, Waiter{
+            port,
+            [owned](boost::system::error_code ec, results_type results) {
+                (*owned)(ec, std::move(results));
+            }
+        });
+        return ticket;
+    }
+
+    static void Complete(State &state, Ticket ticket,
+                         boost::system::error_code ec, results_type results) {
+        auto itr = state.waiters.find(ticket);
+        if (itr == state.waiters.end()) {
+            return;
+        }
+        auto handler = std::move(itr->second.handler);
+        state.waiters.erase(itr);
+        handler(ec, std::move(results));
+    }
+
+    static results_type MakeResults(const std::string &host, uint16_t port,
+                                    const std::vector<DnsCache::Address> &addresses) {
+        std::vector<endpoint_type> endpoints;
+        endpoints.reserve(addresses.size());
+        for (auto &address : addresses) {
+            endpoints.emplace_back(address, port);
+        }
+        return results_type::create(endpoints.begin(), endpoints.end(), host, std::to_string(port));
+    }
+
+    boost::asio::io_context &ctx_;
+    Resolver resolver_;
+    DnsCache &cache_;
+    std::shared_ptr<State> state_;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __HAPPY_EYEBALLS_H__
+#define __HAPPY_EYEBALLS_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "protocol_hooks/caching_resolver.h"
+
+// Connects to the first reachable address of a resolved host the RFC 8305
+// way: address families are interleaved and a new attempt starts every
+// 250ms or as soon as the previous one fails, so an unreachable family
+// costs a stagger delay instead of a connect timeout. The winning socket
+// is moved into the destination and its family is remembered for the
+// host by the DnsCache, cached addresses or not.
+class HappyEyeballs : public std::enable_shared_from_this<HappyEyeballs> {
+    typedef boost::asio::ip::tcp tcp;
+
+public:
+    using Handler = std::function<void(boost::system::error_code, tcp::endpoint)>;
+
+    static std::shared_ptr<HappyEyeballs> Start(tcp::socket &socket,
+                                                const tcp::resolver::results_type &results,
+                                                Handler handler);
+
+    // the handler completes with operation_aborted
+    void Cancel();
+
+    HappyEyeballs(tcp::socket &socket, std::string host,
+                  std::vector<tcp::endpoint> endpoints, Handler handler);
+
+private:
+    void Interleave();
+    bool StartAttempt();
+    void OnAttempt(size_t index, boost::system::error_code ec);
+    void ArmStagger();
+    void Finish(boost::system::error_code ec, tcp::endpoint ep);
+
+    tcp::socket &socket_;
+    std::string host_;
+    std::vector<tcp::endpoint> endpoints_;
+    std::vector<std::unique_ptr<tcp::socket>> attempts_;
+    size_t pending_;
+    bool done_;
+    boost::system::error_code last_error_;
+    boost::asio::steady_timer stagger_timer_;
+    Handler handler_;
+    DnsCache &cache_;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef __STREAM_MUX_H__
+#define __STREAM_MUX_H__
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/endian/arithmetic.hpp>
+
+#include <common_utils/util.h>
+#include <cares_service/cares.hxx>
+
+#include "protocol_hooks/admission_control.h"
+#include "protocol_hooks/basic_protocol.h"
+#include "protocol_hooks/caching_resolver.h"
+#include "protocol_hooks/happy_eyeballs.h"
+
+namespace mux {
+
+enum { VERSION = 0x01 };
+
+enum Command {
+    SYN_CMD = 0x00, // opens a stream, the payload is the socks5 target address
+    FIN_CMD = 0x01, // the sender writes no more to the stream
+    PSH_CMD = 0x02,
+    NOP_CMD = 0x03,
+    UPD_CMD = 0x04, // returns window credit, a 32 bit byte count
+    RST_CMD = 0x05  // aborts the stream
+};
+
+__START_PACKED
+struct FrameHeader {
+    uint8_t ver;
+    uint8_t cmd;
+    uint16_t length;
+    uint32_t sid;
+} __PACKED;
+__END_PACKED;
+
+// bytes a stream may send before its peer returns credit
+const uint32_t kWindow = 256 * 1024;
+const size_t kMaxPayload = 16384;
+// streams a carrier takes at once, further SYNs are answered with RST
+const size_t kMaxStreams = 128;
+
+// sent in place of a target address, the reserved address type and the
+// mux version
+const std::array<uint8_t, 3> kCarrierHeader{ { socks5::MUX_ATYPE, 0x00, VERSION } };
+
+} // mux
+
+class MuxCarrier;
+
+// A connection carried as one stream of a MuxCarrier. Its socket is
+// relayed to and from the stream; reading pauses while the peer's window
+// is used up and credit is returned as data reaches the socket.
+class MuxStream : public std::enable_shared_from_this<MuxStream> {
+    typedef boost::asio::ip::tcp tcp;
+
+public:
+    MuxStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid, tcp::socket socket, size_t ttl);
+    // the socket is connected later, by the server side
+    MuxStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid, size_t ttl);
+
+    void Start();
+    // closes the stream, notify tells the peer with a RST
+    void Reset(bool notify);
+    bool Closed() const { return closed_; }
+
+    tcp::socket &Socket() { return peer_.socket; }
+    void SetConnector(std::weak_ptr<HappyEyeballs> connector) { connector_ = std::move(connector); }
+    void TimerAgain();
+
+    void OnData(const uint8_t *data, size_t len);
+    void OnFin();
+    void OnCredit(uint32_t credit);
+
+private:
+    void DoRead();
+    void DoWrite();
+    void MaybeFinish();
+    void Close();
+
+    std::shared_ptr<MuxCarrier> carrier_;
+    uint32_t sid_;
+    Peer peer_;
+    // received data waiting for the socket, and the part being written
+    Buffer pending_;
+    Buffer inflight_;
+    uint32_t send_window_;
+    bool started_;
+    bool reading_;
+    bool writing_;
+    bool fin_sent_;
+    bool fin_received_;
+    bool shutdown_;
+    bool closed_;
+    std::weak_ptr<HappyEyeballs> connector_;
+};
+
+// One protocol connection carrying many streams. Frames are wrapped in
+// the order they are queued and written in batches, everything queued
+// while a write is in flight goes out with the next one.
+class MuxCarrier : public std::enable_shared_from_this<MuxCarrier> {
+    typedef boost::asio::ip::tcp tcp;
+
+public:
+    using OpenHandler = std::function<void(std::shared_ptr<MuxCarrier>, uint32_t,
+                                           const uint8_t *, size_t)>;
+
+    MuxCarrier(tcp::socket socket, std::unique_ptr<BasicProtocol> protocol,
+               size_t ttl, bool client);
+
+    // client side, sends the carrier header once connected
+    void Connect(const tcp::endpoint &ep);
+    void Initialize();
+    // server side, the header is read and leftover holds the first frames
+    void Start(Buffer &leftover, OpenHandler on_open);
+
+    std::shared_ptr<MuxStream> Open(tcp::socket socket, const uint8_t *address, size_t len);
+    void AddStream(uint32_t sid, std::shared_ptr<MuxStream> stream);
+    void Remove(uint32_t sid);
+
+    void Send(uint8_t cmd, uint32_t sid, const uint8_t *data = nullptr, size_t len = 0);
+    void SendCredit(uint32_t sid, uint32_t credit);
+    void Close();
+
+    boost::asio::io_context &GetContext() { return context_; }
+    bool IsClient() const { return client_; }
+    bool Closed() const { return closed_; }
+    size_t Streams() const { return streams_.size(); }
+    bool Full() const { return streams_.size() >= mux::kMaxStreams; }
+
+private:
+    void DoRead();
+    bool Rejected(const boost::system::error_code &ec) const;
+    void NoDelay();
+    bool Dispatch();
+    bool OnFrame(uint8_t cmd, uint32_t sid, const uint8_t *payload, size_t len);
+    void Flush();
+    void TimerAgain(size_t ttl);
+
+    boost::asio::io_context &context_;
+    Peer peer_;
+    std::unique_ptr<BasicProtocol> protocol_;
+    size_t ttl_;
+    bool client_;
+    bool ready_;
+    bool writing_;
+    bool closed_;
+    // the peer sent at least one frame
+    bool acknowledged_;
+    // the server closed the carrier without sending any
+    bool rejected_;
+    uint32_t next_sid_;
+    // plaintext not dispatched yet
+    Buffer frames_;
+    // frames queued, and the wrapped ones being written
+    Buffer out_;
+    Buffer wire_;
+    std::unordered_map<uint32_t, std::weak_ptr<MuxStream>> streams_;
+    OpenHandler on_open_;
+};
+
+// Multiplexes connections over few protocol connections, smux style. The
+// client side opens up to a configured number of carriers to the pinned
+// upstream and spreads streams over them; a carrier announces itself with
+// a reserved address type, which older servers reject, so a carrier the
+// server closed without a single frame turns multiplexing off for a while.
+// The server side takes over connections announcing a carrier and
+// connects every stream to its target; streams count against the
+// server's admission like the sessions it accepts.
+class StreamMux : public boost::asio::io_context::service {
+    typedef boost::asio::ip::tcp tcp;
+    using Clock = std::chrono::steady_clock;
+
+public:
+    using ProtocolGenerator = std::function<std::unique_ptr<BasicProtocol>(void)>;
+    using resolver_type = CachingResolver<cares::tcp::resolver>;
+
+    static boost::asio::io_context::id id;
+
+    explicit StreamMux(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx), limit_(0), ttl_(0), admission_(nullptr) {
+    }
+
+    void Start(size_t carriers, ProtocolGenerator generator, size_t ttl);
+    void Stop();
+    bool Enabled();
+
+    // client side, carries the socket to the socks5 address
+    void Open(tcp::socket socket, const uint8_t *address, size_t len);
+    // server side, takes over a connection that announced a carrier
+    void Accept(tcp::socket socket, std::unique_ptr<BasicProtocol> protocol,
+                Buffer &leftover, std::shared_ptr<resolver_type> resolver, size_t ttl);
+    // server side, resume runs whenever a stream leaves its handshake or
+    // ends, until stopped
+    void Admission(AdmissionControl *admission, std::function<void()> resume);
+    void ReleaseStream(const MuxStream *stream);
+
+    void Release(MuxCarrier *carrier, bool rejected);
+    size_t Carriers() const { return carriers_.size(); }
+
+private:
+    void shutdown();
+    std::shared_ptr<MuxCarrier> NewCarrier();
+    bool AdmitStream(const MuxStream *stream, const boost::asio::ip::address &client);
+    void StreamEstablished(const MuxStream *stream);
+    static void DoConnectStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid,
+                                const uint8_t *address, size_t len,
+                                const boost::asio::ip::address &client,
+                                std::shared_ptr<resolver_type> resolver, size_t ttl);
+
+    size_t limit_;
+    size_t ttl_;
+    ProtocolGenerator generator_;
+    Clock::time_point disabled_until_;
+    std::vector<std::shared_ptr<MuxCarrier>> carriers_;
+    // the admission of the stream server in this io_context
+    AdmissionControl *admission_;
+    std::function<void()> resume_;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __UPSTREAM_PIN_H__
+#define __UPSTREAM_PIN_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <cares_service/cares.hxx>
+
+#include "protocol_hooks/caching_resolver.h"
+
+// Keeps the addresses of the upstream server of a client side process.
+// The hostname is resolved once at start and refreshed in the background;
+// sessions connect to the pinned address, which moves on to the next one
+// whenever a connection to it fails.
+class UpstreamPin : public boost::asio::io_context::service {
+    typedef boost::asio::ip::tcp tcp;
+
+public:
+    using resolver_type = CachingResolver<cares::tcp::resolver>;
+
+    static boost::asio::io_context::id id;
+
+    explicit UpstreamPin(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx),
+          running_(false), port_(0), current_(0), refresh_timer_(ctx) {
+    }
+
+    // ip literals are pinned as they are and never refreshed
+    void Start(std::string host, uint16_t port, std::shared_ptr<resolver_type> resolver);
+    void Stop();
+
+    bool Pinned() const { return !endpoints_.empty(); }
+    size_t Size() const { return endpoints_.size(); }
+    tcp::endpoint Endpoint() const { return endpoints_[current_]; }
+
+    void ReportFailure(const tcp::endpoint &ep);
+
+private:
+    void shutdown();
+    void DoResolve();
+    void DoRefresh(std::chrono::steady_clock::duration delay);
+
+    bool running_;
+    std::string host_;
+    uint16_t port_;
+    std::shared_ptr<resolver_type> resolver_;
+    std::vector<tcp::endpoint> endpoints_;
+    size_t current_;
+    boost::asio::steady_timer refresh_timer_;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __WARM_POOL_H__
+#define __WARM_POOL_H__
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <common_utils/common.h>
+
+// Keeps connections to the pinned upstream established ahead of time, so
+// a session only has to write its header. The pool follows the rate
+// sessions ask for connections, enough to cover the connect time until
+// the next refill, and is never larger than its limit. Idle connections
+// expire before the upstream would drop them and are checked for liveness
+// when taken.
+class WarmPool : public boost::asio::io_context::service {
+    typedef boost::asio::ip::tcp tcp;
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static boost::asio::io_context::id id;
+
+    explicit WarmPool(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx),
+          running_(false), max_size_(0), demand_(0), rate_(0),
+          connect_time_(Clock::duration::zero()), tick_timer_(ctx) {
+    }
+
+    void Start(size_t max_size, std::chrono::seconds idle_timeout);
+    void Stop();
+    bool Enabled() const { return running_; }
+
+    // moves a live pooled connection into the socket, false when the pool
+    // is empty
+    bool Take(tcp::socket &socket, tcp::endpoint &ep);
+
+private:
+    struct Idle {
+        std::unique_ptr<tcp::socket> socket;
+        tcp::endpoint ep;
+        Clock::time_point since;
+    };
+
+    void shutdown();
+    void DoTick();
+    void Refill();
+    void DoConnect(const tcp::endpoint &ep);
+    void Expire();
+    static bool Alive(tcp::socket &socket);
+
+    bool running_;
+    size_t max_size_;
+    Clock::duration idle_timeout_;
+    // takes since the last tick and their moving average per second
+    size_t demand_;
+    double rate_;
+    // moving average of the time a connect takes
+    Clock::duration connect_time_;
+    std::list<std::unique_ptr<tcp::socket>> attempts_;
+    std::deque<Idle> idle_;
+    boost::asio::steady_timer tick_timer_;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __WRAP_OFFLOADER_H__
+#define __WRAP_OFFLOADER_H__
+
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <common_utils/common.h>
+
+class ThroughputMeter {
+public:
+    // returns the rate in bytes per second over about the last second,
+    // including `bytes'
+    size_t Update(size_t bytes);
+
+private:
+    std::chrono::steady_clock::time_point window_start_ = std::chrono::steady_clock::now();
+    size_t window_bytes_ = 0;
+    size_t rate_ = 0;
+};
+
+// Moves Wrap/UnWrap of bulk flows to a crypto worker pool so they cannot
+// starve interactive sessions sharing the loop. Results are posted back to
+// the owning io_context. Protocols may share state between their two
+// directions, so a session submits all of its jobs through one serializer
+// and wraps inline only while none is in flight.
+class WrapOffloader : public boost::asio::io_context::service {
+public:
+    using Job = std::function<ssize_t(void)>;
+    using Completion = std::function<void(ssize_t)>;
+    using Serializer = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+
+    static boost::asio::io_context::id id;
+
+    explicit WrapOffloader(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx), threshold_(0) {
+    }
+
+    void Start(size_t threads, size_t threshold);
+    bool Enabled() const { return !!pool_; }
+    bool ShouldOffload(ThroughputMeter &meter, size_t bytes) const {
+        return pool_ && meter.Update(bytes) >= threshold_;
+    }
+
+    // jobs submitted through one serializer run one at a time, in order
+    std::unique_ptr<Serializer> NewSerializer() {
+        return std::make_unique<Serializer>(pool_->get_executor());
+    }
+
+    void Submit(Serializer &serializer, Job job, Completion done);
+
+private:
+    void shutdown();
+
+    size_t threshold_;
+    std::unique_ptr<boost::asio::thread_pool> pool_;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+
+#include "protocol_hooks/admission_control.h"
+
+AdmissionControl::AdmissionControl(Limits limits)
+    : limits_(limits), handshakes_(0) {
+    if (limits_.per_client) {
+        counters_.resize(kWidth * 2);
+    }
+}
+
+bool AdmissionControl::Saturated() const {
+    return (limits_.sessions && sessions_.size() >= limits_.sessions)
+           || (limits_.handshakes && handshakes_ >= limits_.handshakes);
+}
+
+bool AdmissionControl::Allows(const boost::asio::ip::address &client) const {
+    if (!limits_.per_client) {
+        return true;
+    }
+    auto slots = Slots(client);
+    return std::min(counters_[slots[0]], counters_[slots[1]]) < limits_.per_client;
+}
+
+void AdmissionControl::Admit(const void *session, const boost::asio::ip::address &client) {
+    if (!Enabled()) {
+        return;
+    }
+    Entry entry{ {{ 0, 0 }}, false, false };
+    if (limits_.per_client) {
+        entry.slots = Slots(client);
+        ++counters_[entry.slots[0]];
+        ++counters_[entry.slots[1]];
+        entry.counted = true;
+    }
+    ++handshakes_;
+    sessions_.emplace(session, entry);
+}
+
+void AdmissionControl::Established(const void *session) {
+    auto itr = sessions_.find(session);
+    if (itr == sessions_.end() || itr->second.established) {
+        return;
+    }
+    itr->second.established = true;
+    --handshakes_;
+}
+
+void AdmissionControl::Release(const void *session) {
+    auto itr = sessions_.find(session);
+    if (itr == sessions_.end()) {
+        return;
+    }
+    auto &entry = itr->second;
+    if (!entry.established) {
+        --handshakes_;
+    }
+    if (entry.counted) {
+        --counters_[entry.slots[0]];
+        --counters_[entry.slots[1]];
+    }
+    sessions_.erase(itr);
+}
+
+std::array<size_t, 2> AdmissionControl::Slots(const boost::asio::ip::address &client) const {
+    uint64_t hash;
+    if (client.is_v4()) {
+        auto bytes = client.to_v4().to_bytes();
+        hash = boost::hash_range(bytes.begin(), bytes.end());
+    } else if (client.to_v6().is_v4_mapped()) {
+        auto bytes = boost::asio::ip::make_address_v4(
+            boost::asio::ip::v4_mapped, client.to_v6()).to_bytes();
+        hash = boost::hash_range(bytes.begin(), bytes.end());
+    } else {
+        auto bytes = client.to_v6().to_bytes();
+        hash = boost::hash_range(bytes.begin(), bytes.begin() + 8);
+    }
+    // the second row takes other bits of the mixed hash
+    uint64_t mixed = hash * 0x9e3779b97f4a7c15ull;
+    return {{ (size_t)(hash % kWidth), kWidth + (size_t)((mixed >> 32) % kWidth) }};
+}
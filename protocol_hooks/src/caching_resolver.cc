@@ -0,0 +1,407 @@
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#ifdef WINDOWS
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <iterator>
+#include <algorithm>
+
+#include "protocol_hooks/caching_resolver.h"
+
+boost::asio::io_context::id DnsCache::id;
+
+namespace {
+
+uint64_t Mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// snapshot integers are big endian, the file is one flat run of records:
+//   header: "SSDC" version:u32 saved_at:u64 count:u32
+//   record: remaining_ms:u32 host_length:u16 address_count:u8 0:u8
+//           host (family:u8 address)...
+const char kSnapshotMagic[4] = { 'S', 'S', 'D', 'C' };
+const size_t kSnapshotHeader = 4 + 4 + 8 + 4;
+const size_t kRecordHeader = 4 + 2 + 1 + 1;
+const auto kSnapshotInterval = std::chrono::minutes(5);
+
+void Put(std::string &out, uint64_t v, size_t bytes) {
+    while (bytes--) {
+        out.push_back((char)(v >> (bytes * 8)));
+    }
+}
+
+uint64_t Get(const uint8_t *p, size_t bytes) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// written aside, synced and renamed over the old snapshot, so neither a
+// crash nor a power loss leaves a torn or empty file behind
+bool WriteSnapshot(const std::string &file, const std::string &data) {
+    auto temp_file = file + ".tmp";
+    FILE *fp = fopen(temp_file.c_str(), "wb");
+    if (!fp) {
+        LOG(WARNING) << "unable to create dns cache snapshot " << temp_file;
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), fp) == data.size() && fflush(fp) == 0;
+#ifdef WINDOWS
+    written = written && _commit(_fileno(fp)) == 0;
+#else
+    written = written && fsync(fileno(fp)) == 0;
+#endif
+    written = fclose(fp) == 0 && written;
+    if (!written) {
+        LOG(WARNING) << "unable to write dns cache snapshot " << temp_file;
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    if (std::rename(temp_file.c_str(), file.c_str()) != 0) {
+        LOG(WARNING) << "unable to replace dns cache snapshot " << file;
+        return false;
+    }
+    return true;
+}
+
+int64_t WallSeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count();
+}
+
+}
+
+FrequencySketch::FrequencySketch(size_t width)
+    : width_(std::max((size_t)1, width)), increments_(0), counters_(kDepth * width_) {
+}
+
+uint32_t FrequencySketch::Increment(const std::string &key) {
+    uint64_t h1 = std::hash<std::string>()(key);
+    uint64_t h2 = Mix(h1) | 1;
+    uint32_t estimate = kMaxCount;
+    for (size_t i = 0; i < kDepth; ++i) {
+        auto &counter = counters_[i * width_ + (h1 + i * h2) % width_];
+        if (counter < kMaxCount) {
+            ++counter;
+        }
+        estimate = std::min(estimate, (uint32_t)counter);
+    }
+    if (++increments_ >= width_ * 8) {
+        Age();
+    }
+    return estimate;
+}
+
+void FrequencySketch::Age() {
+    for (auto &counter : counters_) {
+        counter >>= 1;
+    }
+    increments_ = 0;
+}
+
+std::string DnsCache::Key(const std::string &host) {
+    std::string key(host);
+    std::transform(key.begin(), key.end(), key.begin(),
+                   [](unsigned char c) { return (char)std::tolower(c); });
+    if (!key.empty() && key.back() == '.') {
+        key.pop_back();
+    }
+    return key;
+}
+
+void DnsCache::Start(const ResolverArgs &args) {
+    if (capacity_ || !args.cache_size || !args.cache_ttl) {
+        return;
+    }
+    capacity_ = args.cache_size;
+    ttl_ = std::chrono::seconds(args.cache_ttl);
+    negative_ttl_ = std::chrono::seconds(args.negative_ttl);
+    prefetch_rate_ = args.prefetch_rate;
+    prefetch_tokens_ = args.prefetch_rate;
+    prefetch_refilled_ = Clock::now();
+    LOG(INFO) << "dns cache enabled, entries: " << capacity_
+              << ", ttl: " << args.cache_ttl << "s, negative ttl: " << args.negative_ttl << "s"
+              << ", prefetch rate: " << args.prefetch_rate << "/s";
+
+    snapshot_file_ = args.cache_file;
+    snapshot_saved_ = Clock::now();
+    if (!snapshot_file_.empty()) {
+        LoadSnapshot();
+    }
+}
+
+// the last snapshot is written on the loop, stalling shutdown until it
+// is on disk
+void DnsCache::shutdown() {
+    if (snapshot_writer_.joinable()) {
+        snapshot_writer_.join();
+    }
+    if (Enabled() && !snapshot_file_.empty()) {
+        SaveSnapshot(true);
+    }
+}
+
+// entries come back in their recency order with the time spent on disk
+// taken off their lifetime
+void DnsCache::LoadSnapshot() {
+    std::ifstream ifs(snapshot_file_, std::ios::binary);
+    if (!ifs) {
+        return;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (data.size() < kSnapshotHeader || !std::equal(kSnapshotMagic, kSnapshotMagic + 4, data.begin())
+        || Get(&data[4], 4) != kSnapshotVersion) {
+        LOG(WARNING) << "ignore invalid dns cache snapshot " << snapshot_file_;
+        return;
+    }
+    int64_t offline_ms = std::max<int64_t>(0, WallSeconds() - (int64_t)Get(&data[8], 8)) * 1000;
+    size_t count = Get(&data[16], 4);
+    size_t pos = kSnapshotHeader;
+    size_t loaded = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (pos + kRecordHeader > data.size()) {
+            break;
+        }
+        int64_t remaining_ms = (int64_t)Get(&data[pos], 4) - offline_ms;
+        size_t host_length = Get(&data[pos + 4], 2);
+        size_t address_count = data[pos + 6];
+        pos += kRecordHeader;
+        if (pos + host_length > data.size()) {
+            break;
+        }
+        std::string host((const char *)&data[pos], host_length);
+        pos += host_length;
+
+        std::vector<Address> addresses;
+        for (size_t j = 0; j < address_count && pos < data.size(); ++j) {
+            uint8_t family = data[pos++];
+            if (family == 4 && pos + 4 <= data.size()) {
+                boost::asio::ip::address_v4::bytes_type bytes;
+                std::copy_n(&data[pos], bytes.size(), bytes.begin());
+                addresses.push_back(boost::asio::ip::address_v4(bytes));
+                pos += bytes.size();
+            } else if (family == 6 && pos + 16 <= data.size()) {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::copy_n(&data[pos], bytes.size(), bytes.begin());
+                addresses.push_back(boost::asio::ip::address_v6(bytes));
+                pos += bytes.size();
+            } else {
+                pos = data.size();
+            }
+        }
+        if (addresses.size() != address_count) {
+            break;
+        }
+        if (remaining_ms <= 0 || addresses.empty()) {
+            continue;
+        }
+        Insert(std::move(host), std::move(addresses), boost::system::error_code(),
+               std::chrono::milliseconds(remaining_ms));
+        ++loaded;
+    }
+    LOG(INFO) << "dns cache loaded " << loaded << " entries from " << snapshot_file_;
+}
+
+// serialized on the loop, which is quick even for a full cache; the
+// write and fsync that may block for long go to a helper thread
+void DnsCache::SaveSnapshot(bool wait) {
+    auto now = Clock::now();
+    snapshot_saved_ = now;
+    if (snapshot_writing_) {
+        VLOG(1) << "dns cache snapshot still being written, skipped";
+        return;
+    }
+    std::string out(kSnapshotMagic, sizeof(kSnapshotMagic));
+    Put(out, kSnapshotVersion, 4);
+    Put(out, (uint64_t)WallSeconds(), 8);
+    size_t count_pos = out.size();
+    Put(out, 0, 4);
+
+    uint32_t count = 0;
+    for (auto &entry : entries_) {
+        if (entry.ec || entry.expires <= now) {
+            continue;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(entry.expires - now);
+        Put(out, std::min<uint64_t>(remaining.count(), UINT32_MAX), 4);
+        Put(out, entry.host.size(), 2);
+        Put(out, entry.addresses.size(), 1);
+        Put(out, 0, 1);
+        out.append(entry.host);
+        for (auto &address : entry.addresses) {
+            if (address.is_v4()) {
+                auto bytes = address.to_v4().to_bytes();
+                out.push_back(4);
+                out.append(bytes.begin(), bytes.end());
+            } else {
+                auto bytes = address.to_v6().to_bytes();
+                out.push_back(6);
+                out.append(bytes.begin(), bytes.end());
+            }
+        }
+        ++count;
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        out[count_pos + i] = (char)(count >> ((3 - i) * 8));
+    }
+
+    if (wait) {
+        if (WriteSnapshot(snapshot_file_, out)) {
+            VLOG(1) << "dns cache saved " << count << " entries to " << snapshot_file_;
+        }
+        return;
+    }
+    if (snapshot_writer_.joinable()) {
+        snapshot_writer_.join();
+    }
+    snapshot_writing_ = true;
+    snapshot_writer_ = std::thread(
+        [this, file = snapshot_file_, out = std::move(out), count]() {
+            if (WriteSnapshot(file, out)) {
+                VLOG(1) << "dns cache saved " << count << " entries to " << file;
+            }
+            snapshot_writing_ = false;
+        }
+    );
+}
+
+bool DnsCache::Lookup(const std::string &host, std::vector<Address> &addresses,
+                      boost::system::error_code &ec, bool *refresh) {
+    auto key = Key(host);
+    uint32_t lookups = sketch_.Increment(key);
+    auto itr = index_.find(key);
+    if (itr == index_.end()) {
+        ++stats_.misses;
+        return false;
+    }
+    auto entry = itr->second;
+    auto now = Clock::now();
+    if (now >= entry->expires) {
+        index_.erase(itr);
+        entries_.erase(entry);
+        ++stats_.expirations;
+        ++stats_.misses;
+        return false;
+    }
+    entries_.splice(entries_.end(), entries_, entry);
+    if (entry->ec) {
+        ++stats_.negative_hits;
+        ec = entry->ec;
+        return true;
+    }
+    ++stats_.hits;
+    addresses = entry->addresses;
+    ec.clear();
+    if (refresh) {
+        *refresh = now >= entry->refresh_at && lookups >= kHotLookups;
+    }
+    return true;
+}
+
+bool DnsCache::TakePrefetchToken() {
+    if (prefetch_rate_ <= 0) {
+        return false;
+    }
+    auto now = Clock::now();
+    std::chrono::duration<double> elapsed = now - prefetch_refilled_;
+    prefetch_refilled_ = now;
+    prefetch_tokens_ = std::min(prefetch_rate_, prefetch_tokens_ + elapsed.count() * prefetch_rate_);
+    if (prefetch_tokens_ < 1) {
+        ++stats_.prefetches_throttled;
+        return false;
+    }
+    prefetch_tokens_ -= 1;
+    ++stats_.prefetches;
+    return true;
+}
+
+void DnsCache::Store(const std::string &host, std::vector<Address> addresses) {
+    if (!Enabled() || addresses.empty()) {
+        return;
+    }
+    if (addresses.size() > kMaxAddresses) {
+        addresses.resize(kMaxAddresses);
+    }
+    Insert(Key(host), std::move(addresses), boost::system::error_code(), ttl_);
+    // fresh answers arrive steadily on a busy server, they carry the
+    // periodic snapshot so no timer keeps the loop alive
+    if (!snapshot_file_.empty() && Clock::now() - snapshot_saved_ >= kSnapshotInterval) {
+        SaveSnapshot(false);
+    }
+}
+
+void DnsCache::StoreFailure(const std::string &host, boost::system::error_code ec) {
+    if (!Enabled() || negative_ttl_ == Clock::duration::zero()) {
+        return;
+    }
+    Insert(Key(host), std::vector<Address>(), ec, negative_ttl_);
+}
+
+void DnsCache::Insert(std::string host, std::vector<Address> addresses,
+                      boost::system::error_code ec, Clock::duration ttl) {
+    auto itr = index_.find(host);
+    if (itr != index_.end()) {
+        entries_.erase(itr->second);
+        index_.erase(itr);
+    } else if (index_.size() >= capacity_) {
+        index_.erase(entries_.front().host);
+        entries_.pop_front();
+        ++stats_.evictions;
+    }
+    // the last tenth of the lifetime is the window for refreshing ahead
+    auto now = Clock::now();
+    entries_.push_back(Entry{ host, std::move(addresses), ec, now + ttl - ttl / 10, now + ttl });
+    index_.emplace(std::move(host), std::prev(entries_.end()));
+}
+
+uint8_t DnsCache::PreferredFamily(const std::string &host) const {
+    auto itr = family_index_.find(Key(host));
+    return itr == family_index_.end() ? 0 : itr->second->family;
+}
+
+void DnsCache::RememberFamily(const std::string &host, uint8_t family) {
+    auto key = Key(host);
+    auto itr = family_index_.find(key);
+    if (itr != family_index_.end()) {
+        itr->second->family = family;
+        families_.splice(families_.end(), families_, itr->second);
+        return;
+    }
+    if (family_index_.size() >= kMaxFamilies) {
+        family_index_.erase(families_.front().host);
+        families_.pop_front();
+    }
+    families_.push_back(Family{ key, family });
+    family_index_.emplace(std::move(key), std::prev(families_.end()));
+}
+
+void DnsCache::DumpStats() const {
+    if (!Enabled()) {
+        return;
+    }
+    auto hits = stats_.hits + stats_.negative_hits;
+    auto lookups = hits + stats_.misses;
+    LOG(INFO) << "dns cache: " << Size() << "/" << Capacity()
+              << ", hits: " << stats_.hits
+              << ", negative hits: " << stats_.negative_hits
+              << ", misses: " << stats_.misses
+              << ", hit rate: " << (lookups ? 100.0 * hits / lookups : 0.0) << "%"
+              << ", expirations: " << stats_.expirations
+              << ", evictions: " << stats_.evictions
+              << ", coalesced: " << stats_.coalesced
+              << ", prefetches: " << stats_.prefetches
+              << ", throttled prefetches: " << stats_.prefetches_throttled;
+}
@@ -0,0 +1,139 @@
+
+#include "protocol_hooks/happy_eyeballs.h"
+
+using boost::asio::ip::tcp;
+namespace bsys = boost::system;
+
+namespace {
+
+const auto kAttemptDelay = std::chrono::milliseconds(250);
+
+uint8_t FamilyOf(const tcp::endpoint &ep) {
+    return ep.address().is_v6() ? 6 : 4;
+}
+
+}
+
+std::shared_ptr<HappyEyeballs> HappyEyeballs::Start(tcp::socket &socket,
+                                                    const tcp::resolver::results_type &results,
+                                                    Handler handler) {
+    std::vector<tcp::endpoint> endpoints;
+    std::string host;
+    for (auto &entry : results) {
+        endpoints.push_back(entry.endpoint());
+        host = entry.host_name();
+    }
+    auto connector = std::make_shared<HappyEyeballs>(
+        socket, std::move(host), std::move(endpoints), std::move(handler)
+    );
+    connector->Interleave();
+    if (!connector->StartAttempt()) {
+        connector->Finish(boost::asio::error::host_not_found, tcp::endpoint());
+    }
+    return connector;
+}
+
+HappyEyeballs::HappyEyeballs(tcp::socket &socket, std::string host,
+                             std::vector<tcp::endpoint> endpoints, Handler handler)
+    : socket_(socket), host_(std::move(host)), endpoints_(std::move(endpoints)),
+      pending_(0), done_(false),
+      stagger_timer_(socket.get_executor().context()),
+      handler_(std::move(handler)),
+      cache_(boost::asio::use_service<DnsCache>(socket.get_executor().context())) {
+}
+
+// the family that won last time for this host goes first, otherwise the
+// resolver's order decides
+void HappyEyeballs::Interleave() {
+    if (endpoints_.size() < 2) {
+        return;
+    }
+    uint8_t first = cache_.PreferredFamily(host_);
+    if (!first) {
+        first = FamilyOf(endpoints_.front());
+    }
+    std::vector<tcp::endpoint> preferred, others;
+    for (auto &ep : endpoints_) {
+        (FamilyOf(ep) == first ? preferred : others).push_back(ep);
+    }
+    endpoints_.clear();
+    for (size_t i = 0; i < std::max(preferred.size(), others.size()); ++i) {
+        if (i < preferred.size()) {
+            endpoints_.push_back(preferred[i]);
+        }
+        if (i < others.size()) {
+            endpoints_.push_back(others[i]);
+        }
+    }
+}
+
+bool HappyEyeballs::StartAttempt() {
+    size_t index = attempts_.size();
+    if (index >= endpoints_.size()) {
+        return false;
+    }
+    attempts_.emplace_back(new tcp::socket(socket_.get_executor().context()));
+    ++pending_;
+    VLOG(2) << "connect attempt " << index << " to " << endpoints_[index];
+    attempts_[index]->async_connect(
+        endpoints_[index],
+        [self = shared_from_this(), index](bsys::error_code ec) {
+            self->OnAttempt(index, ec);
+        }
+    );
+    ArmStagger();
+    return true;
+}
+
+void HappyEyeballs::ArmStagger() {
+    if (attempts_.size() >= endpoints_.size()) {
+        stagger_timer_.cancel();
+        return;
+    }
+    stagger_timer_.expires_after(kAttemptDelay);
+    stagger_timer_.async_wait(
+        [self = shared_from_this()](bsys::error_code ec) {
+            if (!ec && !self->done_) {
+                self->StartAttempt();
+            }
+        }
+    );
+}
+
+void HappyEyeballs::OnAttempt(size_t index, bsys::error_code ec) {
+    --pending_;
+    if (done_) {
+        return;
+    }
+    if (!ec) {
+        cache_.RememberFamily(host_, FamilyOf(endpoints_[index]));
+        socket_ = std::move(*attempts_[index]);
+        Finish(ec, endpoints_[index]);
+        return;
+    }
+    VLOG(2) << "connect attempt " << index << " to " << endpoints_[index]
+            << " failed, " << ec.message();
+    last_error_ = ec;
+    if (!StartAttempt() && !pending_) {
+        Finish(last_error_, tcp::endpoint());
+    }
+}
+
+void HappyEyeballs::Cancel() {
+    if (done_) {
+        return;
+    }
+    Finish(boost::asio::error::operation_aborted, tcp::endpoint());
+}
+
+void HappyEyeballs::Finish(bsys::error_code ec, tcp::endpoint ep) {
+    done_ = true;
+    stagger_timer_.cancel();
+    for (auto &attempt : attempts_) {
+        bsys::error_code ignored;
+        attempt->close(ignored);
+    }
+    auto handler = std::move(handler_);
+    handler_ = nullptr;
+    boost::asio::post(socket_.get_executor(), std::bind(handler, ec, ep));
+}
@@ -0,0 +1,710 @@
+
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+
+#include <common_utils/socks5.h>
+
+#include "protocol_hooks/stream_mux.h"
+#include "protocol_hooks/upstream_pin.h"
+#include "protocol_hooks/warm_pool.h"
+
+using boost::asio::ip::tcp;
+namespace bsys = boost::system;
+
+boost::asio::io_context::id StreamMux::id;
+
+namespace {
+
+// how long plain connections are used after a server ignored a carrier
+const auto kFallbackPeriod = std::chrono::minutes(5);
+
+}
+
+MuxStream::MuxStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid,
+                     tcp::socket socket, size_t ttl)
+    : carrier_(std::move(carrier)), sid_(sid), peer_(std::move(socket), ttl),
+      send_window_(mux::kWindow), started_(false), reading_(false), writing_(false),
+      fin_sent_(false), fin_received_(false), shutdown_(false), closed_(false) {
+}
+
+MuxStream::MuxStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid, size_t ttl)
+    : carrier_(std::move(carrier)), sid_(sid),
+      peer_(carrier_->GetContext(), ttl),
+      send_window_(mux::kWindow), started_(false), reading_(false), writing_(false),
+      fin_sent_(false), fin_received_(false), shutdown_(false), closed_(false) {
+}
+
+void MuxStream::Start() {
+    if (closed_) {
+        return;
+    }
+    started_ = true;
+    TimerAgain();
+    DoRead();
+    DoWrite();
+    MaybeFinish();
+}
+
+void MuxStream::DoRead() {
+    if (closed_ || fin_sent_ || reading_ || !send_window_) {
+        return;
+    }
+    size_t len = std::min(static_cast<size_t>(send_window_), mux::kMaxPayload);
+    peer_.buf.Reset();
+    peer_.buf.ReserveCapacity(len);
+    reading_ = true;
+    auto self(shared_from_this());
+    peer_.socket.async_read_some(
+        boost::asio::buffer(peer_.buf.Begin(), len),
+        [this, self](bsys::error_code ec, size_t length) {
+            reading_ = false;
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                if (ec == boost::asio::error::misc_errors::eof) {
+                    carrier_->Send(mux::FIN_CMD, sid_);
+                    fin_sent_ = true;
+                    MaybeFinish();
+                    return;
+                }
+                VLOG(1) << "mux stream " << sid_ << " read error: " << ec.message();
+                Reset(true);
+                return;
+            }
+            TimerAgain();
+            send_window_ -= length;
+            carrier_->Send(mux::PSH_CMD, sid_, peer_.buf.Begin(), length);
+            DoRead();
+        }
+    );
+}
+
+void MuxStream::DoWrite() {
+    if (closed_ || !started_ || writing_ || !pending_.Size()) {
+        return;
+    }
+    std::swap(pending_, inflight_);
+    writing_ = true;
+    auto self(shared_from_this());
+    boost::asio::async_write(
+        peer_.socket,
+        inflight_.GetConstBuffer(),
+        [this, self](bsys::error_code ec, size_t length) {
+            writing_ = false;
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                VLOG(1) << "mux stream " << sid_ << " write error: " << ec.message();
+                Reset(true);
+                return;
+            }
+            TimerAgain();
+            inflight_.Reset();
+            carrier_->SendCredit(sid_, length);
+            DoWrite();
+            MaybeFinish();
+        }
+    );
+}
+
+void MuxStream::OnData(const uint8_t *data, size_t len) {
+    if (closed_ || fin_received_) {
+        return;
+    }
+    if (pending_.Size() + inflight_.Size() + len > mux::kWindow) {
+        LOG(WARNING) << "mux stream " << sid_ << " overran its window";
+        Reset(true);
+        return;
+    }
+    pending_.AppendData(data, len);
+    DoWrite();
+}
+
+void MuxStream::OnFin() {
+    fin_received_ = true;
+    MaybeFinish();
+}
+
+void MuxStream::OnCredit(uint32_t credit) {
+    send_window_ = std::min(send_window_ + credit, mux::kWindow);
+    DoRead();
+}
+
+// the stream is done once both sides sent FIN and everything received
+// reached the socket
+void MuxStream::MaybeFinish() {
+    if (closed_ || !started_) {
+        return;
+    }
+    if (fin_received_ && !shutdown_ && !writing_ && !pending_.Size()) {
+        bsys::error_code ignored;
+        peer_.socket.shutdown(tcp::socket::shutdown_send, ignored);
+        shutdown_ = true;
+    }
+    if (fin_sent_ && shutdown_) {
+        VLOG(2) << "mux stream " << sid_ << " terminates normally";
+        Close();
+    }
+}
+
+void MuxStream::Reset(bool notify) {
+    if (closed_) {
+        return;
+    }
+    if (notify) {
+        carrier_->Send(mux::RST_CMD, sid_);
+    }
+    Close();
+}
+
+void MuxStream::Close() {
+    closed_ = true;
+    auto connector = connector_.lock();
+    if (connector) {
+        connector->Cancel();
+    }
+    bsys::error_code ignored;
+    peer_.socket.close(ignored);
+    peer_.timer.cancel();
+    carrier_->Remove(sid_);
+    if (!carrier_->IsClient()) {
+        boost::asio::use_service<StreamMux>(carrier_->GetContext()).ReleaseStream(this);
+    }
+}
+
+void MuxStream::TimerAgain() {
+    auto self(shared_from_this());
+    peer_.timer.expires_from_now(peer_.ttl);
+    peer_.timer.async_wait(
+        [this, self](bsys::error_code ec) {
+            if (!ec && !closed_) {
+                VLOG(1) << "mux stream " << sid_ << " TTL expired";
+                Reset(true);
+            }
+        }
+    );
+}
+
+MuxCarrier::MuxCarrier(tcp::socket socket, std::unique_ptr<BasicProtocol> protocol,
+                       size_t ttl, bool client)
+    : context_(socket.get_executor().context()),
+      peer_(std::move(socket), ttl), protocol_(std::move(protocol)), ttl_(ttl),
+      client_(client), ready_(false), writing_(false), closed_(false),
+      acknowledged_(false), rejected_(false), next_sid_(1) {
+}
+
+void MuxCarrier::Connect(const tcp::endpoint &ep) {
+    auto self(shared_from_this());
+    peer_.socket.async_connect(
+        ep,
+        [this, self, ep](bsys::error_code ec) {
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                LOG(INFO) << "mux carrier cannot connect to " << ep << ": " << ec.message();
+                boost::asio::use_service<UpstreamPin>(context_).ReportFailure(ep);
+                Close();
+                return;
+            }
+            Initialize();
+        }
+    );
+    TimerAgain(ttl_);
+}
+
+// connected by us or taken from the warm pool
+void MuxCarrier::Initialize() {
+    NoDelay();
+    auto self(shared_from_this());
+    protocol_->DoInitializeProtocol(
+        peer_,
+        [this, self]() {
+            if (closed_) {
+                return;
+            }
+            VLOG(1) << "mux carrier ready";
+            ready_ = true;
+            peer_.buf.Reset();
+            TimerAgain(ttl_);
+            DoRead();
+            Flush();
+        }
+    );
+    TimerAgain(ttl_);
+}
+
+// the first frame answers the carrier header
+void MuxCarrier::Start(Buffer &leftover, OpenHandler on_open) {
+    on_open_ = std::move(on_open);
+    NoDelay();
+    ready_ = true;
+    Send(mux::NOP_CMD, 0);
+    frames_.AppendData(leftover);
+    leftover.Reset();
+    if (!Dispatch()) {
+        Close();
+        return;
+    }
+    TimerAgain(ttl_ * 2);
+    DoRead();
+}
+
+// small frames of many streams follow each other, a SYN and the first
+// data right behind it would otherwise wait for a delayed ack
+void MuxCarrier::NoDelay() {
+    bsys::error_code ec;
+    peer_.socket.set_option(tcp::no_delay(true), ec);
+}
+
+std::shared_ptr<MuxStream> MuxCarrier::Open(tcp::socket socket, const uint8_t *address, size_t len) {
+    uint32_t sid = next_sid_;
+    next_sid_ += 2;
+    auto stream = std::make_shared<MuxStream>(shared_from_this(), sid, std::move(socket), ttl_);
+    AddStream(sid, stream);
+    Send(mux::SYN_CMD, sid, address, len);
+    stream->Start();
+    return stream;
+}
+
+void MuxCarrier::AddStream(uint32_t sid, std::shared_ptr<MuxStream> stream) {
+    streams_.emplace(sid, stream);
+    if (ready_) {
+        peer_.timer.cancel();
+    }
+}
+
+// a carrier without streams is kept for a TTL, twice as long on the
+// server so the client is the one closing it
+void MuxCarrier::Remove(uint32_t sid) {
+    streams_.erase(sid);
+    if (streams_.empty() && ready_ && !closed_) {
+        TimerAgain(client_ ? ttl_ : ttl_ * 2);
+    }
+}
+
+void MuxCarrier::Send(uint8_t cmd, uint32_t sid, const uint8_t *data, size_t len) {
+    if (closed_) {
+        return;
+    }
+    mux::FrameHeader hdr;
+    hdr.ver = mux::VERSION;
+    hdr.cmd = cmd;
+    hdr.length = boost::endian::native_to_big(static_cast<uint16_t>(len));
+    hdr.sid = boost::endian::native_to_big(sid);
+    out_.AppendData(reinterpret_cast<const uint8_t *>(&hdr), sizeof hdr);
+    if (len) {
+        out_.AppendData(data, len);
+    }
+    Flush();
+}
+
+void MuxCarrier::SendCredit(uint32_t sid, uint32_t credit) {
+    uint32_t payload = boost::endian::native_to_big(credit);
+    Send(mux::UPD_CMD, sid, reinterpret_cast<const uint8_t *>(&payload), sizeof payload);
+}
+
+void MuxCarrier::Flush() {
+    if (closed_ || !ready_ || writing_ || !out_.Size()) {
+        return;
+    }
+    std::swap(out_, wire_);
+    if (protocol_->Wrap(wire_) < 0) {
+        LOG(WARNING) << "mux carrier protocol hook error";
+        Close();
+        return;
+    }
+    writing_ = true;
+    auto self(shared_from_this());
+    boost::asio::async_write(
+        peer_.socket,
+        wire_.GetConstBuffer(),
+        [this, self](bsys::error_code ec, size_t length) {
+            writing_ = false;
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                LOG(INFO) << "mux carrier write error: " << ec.message();
+                rejected_ = Rejected(ec);
+                Close();
+                return;
+            }
+            wire_.Reset();
+            Flush();
+        }
+    );
+}
+
+// a server without mux drops the connection on the header, before any
+// frame came back
+bool MuxCarrier::Rejected(const bsys::error_code &ec) const {
+    return client_ && !acknowledged_
+           && (ec == boost::asio::error::misc_errors::eof
+               || ec == boost::asio::error::connection_reset
+               || ec == boost::asio::error::broken_pipe);
+}
+
+void MuxCarrier::DoRead() {
+    auto self(shared_from_this());
+    peer_.socket.async_read_some(
+        peer_.buf.GetBuffer(),
+        [this, self](bsys::error_code ec, size_t length) {
+            if (closed_) {
+                return;
+            }
+            if (ec) {
+                if (ec != boost::asio::error::misc_errors::eof) {
+                    LOG(INFO) << "mux carrier read error: " << ec.message();
+                }
+                rejected_ = Rejected(ec);
+                Close();
+                return;
+            }
+            peer_.buf.Append(length);
+            ssize_t valid_length = protocol_->UnWrap(peer_.buf);
+            if (valid_length < 0) {
+                LOG(WARNING) << "mux carrier protocol hook error";
+                Close();
+                return;
+            }
+            if (valid_length > 0) {
+                frames_.AppendData(peer_.buf);
+                peer_.buf.Reset();
+                if (!Dispatch()) {
+                    Close();
+                    return;
+                }
+            }
+            DoRead();
+        }
+    );
+}
+
+// frames are consumed in one go after the loop, a partial one waits for
+// the next read
+bool MuxCarrier::Dispatch() {
+    size_t offset = 0;
+    bool ok = true;
+    while (frames_.Size() - offset >= sizeof(mux::FrameHeader)) {
+        auto *hdr = reinterpret_cast<const mux::FrameHeader *>(frames_.Begin() + offset);
+        if (hdr->ver != mux::VERSION) {
+            LOG(WARNING) << "mux frame of unknown version " << (uint32_t)hdr->ver;
+            ok = false;
+            break;
+        }
+        size_t len = boost::endian::big_to_native(hdr->length);
+        if (frames_.Size() - offset < sizeof(mux::FrameHeader) + len) {
+            break;
+        }
+        const uint8_t *payload = frames_.Begin() + offset + sizeof(mux::FrameHeader);
+        offset += sizeof(mux::FrameHeader) + len;
+        if (!OnFrame(hdr->cmd, boost::endian::big_to_native(hdr->sid), payload, len)) {
+            ok = false;
+            break;
+        }
+    }
+    if (ok) {
+        frames_.DeQueue(offset);
+    }
+    return ok;
+}
+
+bool MuxCarrier::OnFrame(uint8_t cmd, uint32_t sid, const uint8_t *payload, size_t len) {
+    acknowledged_ = true;
+    std::shared_ptr<MuxStream> stream;
+    auto itr = streams_.find(sid);
+    if (itr != streams_.end()) {
+        stream = itr->second.lock();
+    }
+    switch (cmd) {
+    case mux::SYN_CMD:
+        if (client_ || stream || !on_open_) {
+            LOG(WARNING) << "unexpected mux SYN of stream " << sid;
+            return false;
+        }
+        if (Full()) {
+            VLOG(1) << "mux carrier full, reset stream " << sid;
+            Send(mux::RST_CMD, sid);
+            break;
+        }
+        on_open_(shared_from_this(), sid, payload, len);
+        break;
+    case mux::FIN_CMD:
+        if (stream) {
+            stream->OnFin();
+        }
+        break;
+    case mux::PSH_CMD:
+        if (stream) {
+            stream->OnData(payload, len);
+        }
+        break;
+    case mux::NOP_CMD:
+        break;
+    case mux::UPD_CMD: {
+        uint32_t credit;
+        if (len != sizeof credit) {
+            return false;
+        }
+        if (stream) {
+            memcpy(&credit, payload, sizeof credit);
+            stream->OnCredit(boost::endian::big_to_native(credit));
+        }
+        break;
+    }
+    case mux::RST_CMD:
+        if (stream) {
+            stream->Reset(false);
+        }
+        break;
+    default:
+        LOG(WARNING) << "unknown mux command " << (uint32_t)cmd;
+        return false;
+    }
+    return true;
+}
+
+void MuxCarrier::Close() {
+    if (closed_) {
+        return;
+    }
+    auto self(shared_from_this());
+    closed_ = true;
+    auto streams = std::move(streams_);
+    streams_.clear();
+    for (auto &kv : streams) {
+        auto stream = kv.second.lock();
+        if (stream) {
+            stream->Reset(false);
+        }
+    }
+    bsys::error_code ignored;
+    peer_.socket.close(ignored);
+    peer_.timer.cancel();
+    boost::asio::use_service<StreamMux>(context_).Release(this, rejected_);
+}
+
+// bounds the connect and the handshake, then the time without streams
+void MuxCarrier::TimerAgain(size_t ttl) {
+    auto self(shared_from_this());
+    peer_.timer.expires_from_now(boost::posix_time::millisec(ttl));
+    peer_.timer.async_wait(
+        [this, self](bsys::error_code ec) {
+            if (ec || closed_ || (ready_ && !streams_.empty())) {
+                return;
+            }
+            VLOG(1) << "mux carrier " << (ready_ ? "idle" : "handshake timed out") << ", closing";
+            Close();
+        }
+    );
+}
+
+void StreamMux::Start(size_t carriers, ProtocolGenerator generator, size_t ttl) {
+    if (limit_ || carriers == 0) {
+        return;
+    }
+    if (!generator()->StartMuxCarrier()) {
+        LOG(WARNING) << "protocol cannot carry multiplexed streams, mux disabled";
+        return;
+    }
+    limit_ = carriers;
+    generator_ = std::move(generator);
+    ttl_ = ttl;
+    LOG(INFO) << "stream mux enabled, carriers: " << carriers;
+}
+
+void StreamMux::Stop() {
+    limit_ = 0;
+    auto carriers = carriers_;
+    for (auto &carrier : carriers) {
+        carrier->Close();
+    }
+    admission_ = nullptr;
+    resume_ = nullptr;
+}
+
+void StreamMux::shutdown() {
+    limit_ = 0;
+    carriers_.clear();
+}
+
+// false as well once every carrier is full, connections go plain then
+bool StreamMux::Enabled() {
+    if (!limit_ || Clock::now() < disabled_until_
+        || !boost::asio::use_service<UpstreamPin>(get_io_context()).Pinned()) {
+        return false;
+    }
+    size_t count = 0;
+    for (auto &c : carriers_) {
+        if (c->IsClient() && !c->Full()) {
+            return true;
+        }
+        count += c->IsClient();
+    }
+    return count < limit_;
+}
+
+// a stream goes to the least loaded carrier, a new one is opened as long
+// as every carrier is busy and the limit allows; carriers filled up since
+// Enabled() was asked get one more carrier beyond the limit
+void StreamMux::Open(tcp::socket socket, const uint8_t *address, size_t len) {
+    std::shared_ptr<MuxCarrier> carrier;
+    size_t count = 0;
+    for (auto &c : carriers_) {
+        if (!c->IsClient()) {
+            continue;
+        }
+        ++count;
+        if (!carrier || c->Streams() < carrier->Streams()) {
+            carrier = c;
+        }
+    }
+    if (!carrier || (carrier->Streams() && count < limit_) || carrier->Full()) {
+        carrier = NewCarrier();
+    }
+    carrier->Open(std::move(socket), address, len);
+}
+
+std::shared_ptr<MuxCarrier> StreamMux::NewCarrier() {
+    auto &ctx = get_io_context();
+    auto protocol = generator_();
+    protocol->StartMuxCarrier();
+    tcp::socket socket(ctx);
+    tcp::endpoint ep;
+    bool pooled = boost::asio::use_service<WarmPool>(ctx).Take(socket, ep);
+    auto carrier = std::make_shared<MuxCarrier>(std::move(socket), std::move(protocol), ttl_, true);
+    carriers_.push_back(carrier);
+    if (pooled) {
+        carrier->Initialize();
+    } else {
+        carrier->Connect(boost::asio::use_service<UpstreamPin>(ctx).Endpoint());
+    }
+    return carrier;
+}
+
+void StreamMux::Accept(tcp::socket socket, std::unique_ptr<BasicProtocol> protocol,
+                       Buffer &leftover, std::shared_ptr<resolver_type> resolver, size_t ttl) {
+    bsys::error_code ec;
+    auto client = socket.remote_endpoint(ec).address();
+    auto carrier = std::make_shared<MuxCarrier>(std::move(socket), std::move(protocol), ttl, false);
+    carriers_.push_back(carrier);
+    carrier->Start(
+        leftover,
+        [client, resolver, ttl](std::shared_ptr<MuxCarrier> carrier, uint32_t sid,
+                                const uint8_t *address, size_t len) {
+            DoConnectStream(std::move(carrier), sid, address, len, client, resolver, ttl);
+        }
+    );
+}
+
+void StreamMux::Admission(AdmissionControl *admission, std::function<void()> resume) {
+    admission_ = admission;
+    resume_ = std::move(resume);
+}
+
+// a stream is one more session of its client, refused while the server
+// or the client is at its limit
+bool StreamMux::AdmitStream(const MuxStream *stream, const boost::asio::ip::address &client) {
+    if (!admission_ || !admission_->Enabled()) {
+        return true;
+    }
+    if (admission_->Saturated() || !admission_->Allows(client)) {
+        return false;
+    }
+    admission_->Admit(stream, client);
+    return true;
+}
+
+void StreamMux::StreamEstablished(const MuxStream *stream) {
+    if (admission_) {
+        admission_->Established(stream);
+        resume_();
+    }
+}
+
+void StreamMux::ReleaseStream(const MuxStream *stream) {
+    if (admission_) {
+        admission_->Release(stream);
+        resume_();
+    }
+}
+
+void StreamMux::Release(MuxCarrier *carrier, bool rejected) {
+    auto itr = std::find_if(carriers_.begin(), carriers_.end(),
+        [carrier](const std::shared_ptr<MuxCarrier> &c) { return c.get() == carrier; });
+    if (itr == carriers_.end()) {
+        return;
+    }
+    carriers_.erase(itr);
+    if (carrier->IsClient() && rejected && limit_) {
+        LOG(WARNING) << "server rejected the mux carrier, plain connections are used for "
+                     << std::chrono::duration_cast<std::chrono::seconds>(kFallbackPeriod).count() << "s";
+        disabled_until_ = Clock::now() + kFallbackPeriod;
+    }
+}
+
+void StreamMux::DoConnectStream(std::shared_ptr<MuxCarrier> carrier, uint32_t sid,
+                                const uint8_t *address, size_t len,
+                                const boost::asio::ip::address &client,
+                                std::shared_ptr<resolver_type> resolver, size_t ttl) {
+    auto stream = std::make_shared<MuxStream>(carrier, sid, ttl);
+    carrier->AddStream(sid, stream);
+    auto &mux = boost::asio::use_service<StreamMux>(carrier->GetContext());
+    if (!mux.AdmitStream(stream.get(), client)) {
+        VLOG(1) << "mux stream of " << client << " over the session limits";
+        stream->Reset(true);
+        return;
+    }
+
+    uint8_t reply = socks5::GENERAL_SOCKS_FAIL_REP;
+    TargetInfo target;
+    if (!len || socks5::Request::NeedMore(address - 3, len + 3)
+        || !GetTargetFromSocks5Address(address, &reply, target)
+        || reply != socks5::SUCCEEDED_REP) {
+        LOG(INFO) << "invalid mux stream address";
+        stream->Reset(true);
+        return;
+    }
+
+    stream->TimerAgain();
+    auto connected = [stream, &mux](bsys::error_code ec, tcp::endpoint ep) {
+        if (stream->Closed()) {
+            return;
+        }
+        if (ec) {
+            LOG(INFO) << "Cannot connect to remote: " << ec.message();
+            stream->Reset(true);
+            return;
+        }
+        VLOG(1) << "Connected to remote " << ep;
+        mux.StreamEstablished(stream.get());
+        stream->Start();
+    };
+    if (target.NeedResolve()) {
+        resolver->async_resolve(
+            target.GetHostname(), target.GetPort(),
+            [stream, connected](bsys::error_code ec, resolver_type::results_type results) {
+                if (stream->Closed()) {
+                    return;
+                }
+                if (ec) {
+                    VLOG(1) << "Unable to resolve: " << ec.message();
+                    stream->Reset(true);
+                    return;
+                }
+                stream->SetConnector(HappyEyeballs::Start(stream->Socket(), results, connected));
+            }
+        );
+    } else {
+        tcp::endpoint ep(target.GetIp(), target.GetPort());
+        stream->Socket().async_connect(
+            ep,
+            [connected, ep](bsys::error_code ec) {
+                connected(ec, ep);
+            }
+        );
+    }
+}
@@ -0,0 +1,99 @@
+
+#include <algorithm>
+
+#include "protocol_hooks/upstream_pin.h"
+
+using boost::asio::ip::tcp;
+namespace bsys = boost::system;
+
+boost::asio::io_context::id UpstreamPin::id;
+
+namespace {
+
+// cares_service hands out no record TTLs, answers are renewed on a fixed
+// period and failures retried sooner
+const auto kRefreshInterval = std::chrono::seconds(60);
+const auto kRetryInterval = std::chrono::seconds(5);
+
+}
+
+void UpstreamPin::Start(std::string host, uint16_t port, std::shared_ptr<resolver_type> resolver) {
+    if (running_ || Pinned()) {
+        return;
+    }
+    bsys::error_code ec;
+    auto address = boost::asio::ip::make_address(host, ec);
+    if (!ec) {
+        endpoints_.emplace_back(address, port);
+        return;
+    }
+    running_ = true;
+    host_ = std::move(host);
+    port_ = port;
+    resolver_ = std::move(resolver);
+    DoResolve();
+}
+
+void UpstreamPin::Stop() {
+    running_ = false;
+    refresh_timer_.cancel();
+}
+
+void UpstreamPin::shutdown() {
+    Stop();
+    resolver_.reset();
+}
+
+// a refreshed answer keeps the pin where it was if that address is still
+// part of it
+void UpstreamPin::DoResolve() {
+    resolver_->async_refresh(
+        host_, port_,
+        [this](bsys::error_code ec, resolver_type::results_type results) {
+            if (!running_) {
+                return;
+            }
+            if (ec) {
+                LOG(WARNING) << "unable to resolve upstream " << host_ << ", " << ec.message();
+                DoRefresh(kRetryInterval);
+                return;
+            }
+            std::vector<tcp::endpoint> endpoints;
+            for (auto &entry : results) {
+                endpoints.push_back(entry.endpoint());
+            }
+            size_t current = 0;
+            if (Pinned()) {
+                auto itr = std::find(endpoints.begin(), endpoints.end(), Endpoint());
+                if (itr != endpoints.end()) {
+                    current = itr - endpoints.begin();
+                }
+            }
+            endpoints_ = std::move(endpoints);
+            current_ = current;
+            if (Pinned()) {
+                VLOG(1) << "upstream " << host_ << " pinned to " << Endpoint()
+                        << " of " << endpoints_.size() << " addresses";
+            }
+            DoRefresh(kRefreshInterval);
+        }
+    );
+}
+
+void UpstreamPin::DoRefresh(std::chrono::steady_clock::duration delay) {
+    refresh_timer_.expires_after(delay);
+    refresh_timer_.async_wait(
+        [this](bsys::error_code ec) {
+            if (!ec && running_) {
+                DoResolve();
+            }
+        }
+    );
+}
+
+void UpstreamPin::ReportFailure(const tcp::endpoint &ep) {
+    if (Pinned() && Endpoint() == ep) {
+        current_ = (current_ + 1) % endpoints_.size();
+        LOG(INFO) << "upstream " << ep << " failed, fail over to " << Endpoint();
+    }
+}
@@ -0,0 +1,155 @@
+
+#include <cmath>
+#include <algorithm>
+
+#include "protocol_hooks/upstream_pin.h"
+#include "protocol_hooks/warm_pool.h"
+
+using boost::asio::ip::tcp;
+namespace bsys = boost::system;
+
+boost::asio::io_context::id WarmPool::id;
+
+namespace {
+
+const auto kTickInterval = std::chrono::seconds(1);
+// weight of the last tick in the demand rate
+const double kRateWeight = 0.3;
+// below this many takes per second the pool drains
+const double kMinRate = 0.01;
+
+}
+
+void WarmPool::Start(size_t max_size, std::chrono::seconds idle_timeout) {
+    if (running_ || max_size == 0) {
+        return;
+    }
+    running_ = true;
+    max_size_ = max_size;
+    idle_timeout_ = idle_timeout;
+    LOG(INFO) << "warm pool enabled, up to " << max_size << " connections, idle "
+              << idle_timeout.count() << "s";
+    DoTick();
+}
+
+void WarmPool::Stop() {
+    running_ = false;
+    tick_timer_.cancel();
+    for (auto &attempt : attempts_) {
+        bsys::error_code ignored;
+        attempt->close(ignored);
+    }
+    idle_.clear();
+}
+
+void WarmPool::shutdown() {
+    Stop();
+    attempts_.clear();
+}
+
+// the newest connection is the one least likely dropped by the upstream
+bool WarmPool::Take(tcp::socket &socket, tcp::endpoint &ep) {
+    if (!running_) {
+        return false;
+    }
+    ++demand_;
+    bool taken = false;
+    while (!idle_.empty() && !taken) {
+        auto idle = std::move(idle_.back());
+        idle_.pop_back();
+        if (!Alive(*idle.socket)) {
+            VLOG(2) << "pooled connection to " << idle.ep << " is gone";
+            continue;
+        }
+        socket = std::move(*idle.socket);
+        ep = idle.ep;
+        taken = true;
+    }
+    Refill();
+    return taken;
+}
+
+void WarmPool::DoTick() {
+    tick_timer_.expires_after(kTickInterval);
+    tick_timer_.async_wait(
+        [this](bsys::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            rate_ = rate_ * (1 - kRateWeight) + demand_ * kRateWeight;
+            if (rate_ < kMinRate) {
+                rate_ = 0;
+            }
+            demand_ = 0;
+            Expire();
+            Refill();
+            DoTick();
+        }
+    );
+}
+
+// enough connections for the takes expected until the next tick plus the
+// ones made while they connect
+void WarmPool::Refill() {
+    auto &upstream = boost::asio::use_service<UpstreamPin>(get_io_context());
+    if (!upstream.Pinned()) {
+        return;
+    }
+    double rate = std::max(rate_, static_cast<double>(demand_));
+    double window = std::chrono::duration<double>(connect_time_ + kTickInterval).count();
+    size_t target = std::min(max_size_, static_cast<size_t>(std::ceil(rate * window)));
+    while (idle_.size() + attempts_.size() < target) {
+        DoConnect(upstream.Endpoint());
+    }
+}
+
+void WarmPool::DoConnect(const tcp::endpoint &ep) {
+    attempts_.emplace_front(new tcp::socket(get_io_context()));
+    auto itr = attempts_.begin();
+    auto started = Clock::now();
+    (*itr)->async_connect(
+        ep,
+        [this, itr, ep, started](bsys::error_code ec) {
+            auto socket = std::move(*itr);
+            attempts_.erase(itr);
+            if (ec == boost::asio::error::operation_aborted || !running_) {
+                return;
+            }
+            if (ec) {
+                VLOG(1) << "warm connect to " << ep << " failed, " << ec.message();
+                boost::asio::use_service<UpstreamPin>(get_io_context()).ReportFailure(ep);
+                return;
+            }
+            auto now = Clock::now();
+            auto elapsed = now - started;
+            connect_time_ = connect_time_ == Clock::duration::zero()
+                            ? elapsed : (connect_time_ * 7 + elapsed) / 8;
+            idle_.push_back(Idle{ std::move(socket), ep, now });
+        }
+    );
+}
+
+// idle connections go before the upstream times them out, and as soon as
+// it closes them
+void WarmPool::Expire() {
+    auto now = Clock::now();
+    idle_.erase(
+        std::remove_if(idle_.begin(), idle_.end(),
+            [this, now](Idle &idle) {
+                return now - idle.since >= idle_timeout_ || !Alive(*idle.socket);
+            }
+        ),
+        idle_.end()
+    );
+}
+
+// the upstream never speaks first, anything readable on an idle
+// connection, data or eof, means it cannot carry a session
+bool WarmPool::Alive(tcp::socket &socket) {
+    bsys::error_code ec, ignored;
+    char c;
+    socket.non_blocking(true, ignored);
+    socket.receive(boost::asio::buffer(&c, 1), tcp::socket::message_peek, ec);
+    socket.non_blocking(false, ignored);
+    return ec == boost::asio::error::would_block;
+}
@@ -0,0 +1,53 @@
+
+#include "protocol_hooks/wrap_offloader.h"
+
+boost::asio::io_context::id WrapOffloader::id;
+
+size_t ThroughputMeter::Update(size_t bytes) {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    auto elapsed = duration_cast<milliseconds>(now - window_start_).count();
+    if (elapsed >= 2000) {
+        rate_ = 0;
+        window_bytes_ = 0;
+        window_start_ = now;
+        elapsed = 0;
+    } else if (elapsed >= 1000) {
+        rate_ = window_bytes_ * 1000 / elapsed;
+        window_bytes_ = 0;
+        window_start_ = now;
+        elapsed = 0;
+    }
+    window_bytes_ += bytes;
+    // the previous window stands in for the part of the last second
+    // before the current one started
+    return window_bytes_ + rate_ * (1000 - elapsed) / 1000;
+}
+
+void WrapOffloader::Start(size_t threads, size_t threshold) {
+    if (pool_ || threads == 0) {
+        return;
+    }
+    threshold_ = threshold;
+    pool_ = std::make_unique<boost::asio::thread_pool>(threads);
+    LOG(INFO) << "crypto offload enabled, threads: " << threads
+              << ", threshold: " << threshold << " B/s";
+}
+
+void WrapOffloader::Submit(Serializer &serializer, Job job, Completion done) {
+    auto &ctx = get_io_context();
+    auto work = boost::asio::make_work_guard(ctx);
+    boost::asio::post(serializer,
+        [&ctx, work, job = std::move(job), done = std::move(done)]() {
+            ssize_t result = job();
+            boost::asio::post(ctx, std::bind(done, result));
+        }
+    );
+}
+
+void WrapOffloader::shutdown() {
+    if (pool_) {
+        pool_->stop();
+        pool_->join();
+    }
+}
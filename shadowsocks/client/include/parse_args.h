@@ -8,8 +8,11 @@
 #include <plugin_utils/plugin.h>
 #include <common_utils/options.h>
 
+#include "udprelay.h"
+
 void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
-               ResolverArgs *rargs, int *log_level, Plugin *plugin);
+               ResolverArgs *rargs, int *log_level, Plugin *plugin,
+               UdpAssociateParam *udp);
 
 #endif
 
@@ -0,0 +1,152 @@
+#ifndef __UDPRELAY_H__
+#define __UDPRELAY_H__
+
+#include <deque>
+#include <unordered_map>
+#include <boost/asio.hpp>
+
+#include <cares_service/cares.hxx>
+#include <common_utils/endpoint_hash.h>
+#include <common_utils/nat_table.h>
+#include <common_utils/packet_buffer.h>
+#include <common_utils/udp_batch.h>
+#include <crypto_utils/cipher.h>
+#include <protocol_hooks/caching_resolver.h>
+#include <protocol_hooks/upstream_pin.h>
+
+struct UdpAssociateParam {
+    using CryptoContextGenerator = std::function<std::unique_ptr<CryptoContext>(void)>;
+    boost::asio::ip::udp::endpoint bind_ep;
+    std::string server_host;
+    uint16_t server_port = 0;
+    // the server is the tcp upstream, false when a plugin carries tcp
+    bool pinned = false;
+    CryptoContextGenerator crypto_generator;
+    bool udp_enable = false;
+    size_t max_associations = 4096;
+    size_t idle_timeout = 60;
+};
+
+// Relays the datagrams of socks5 UDP ASSOCIATE clients to ss-server. Each
+// client endpoint owns an association with its own crypto context and a
+// socket connected to the server; only addresses holding an admitted
+// control connection are served.
+class UdpAssociateServer : public std::enable_shared_from_this<UdpAssociateServer> {
+    typedef boost::asio::ip::udp udp;
+    using resolver_type = CachingResolver<cares::tcp::resolver>;
+    using CryptoContextGenerator = UdpAssociateParam::CryptoContextGenerator;
+
+    struct Datagram {
+        PacketBufferPool::Pointer buf;
+        const uint8_t *data;
+        size_t size;
+        udp::endpoint ep;
+    };
+
+    struct Association {
+        Association(boost::asio::io_context &ctx)
+            : socket(ctx) {
+        }
+
+        void Close() {
+            boost::system::error_code ec;
+            closed = true;
+            socket.close(ec);
+        }
+
+        udp::socket socket;
+        bool closed = false;
+        udp::endpoint client_ep;
+        udp::endpoint server_ep;
+        std::unique_ptr<CryptoContext> crypto;
+    };
+
+    using NatTableType = NatTable<udp::endpoint, std::shared_ptr<Association>>;
+public:
+
+    UdpAssociateServer(boost::asio::io_context &ctx, UdpAssociateParam param,
+                       std::shared_ptr<resolver_type> resolver);
+
+    udp::endpoint LocalEndpoint() const {
+        return local_ep_;
+    }
+
+    // the address may use the relay until the returned token is released
+    std::shared_ptr<void> Admit(const boost::asio::ip::address &address);
+
+    void Stop();
+
+    bool Stopped() const {
+        return !running_;
+    }
+
+    void DumpStats() const;
+
+private:
+
+    void DoResolveServer();
+    bool ServerEndpoint(udp::endpoint &ep);
+    void ServerRefused(const std::shared_ptr<Association> &assoc);
+    void DoReceive();
+    void DrainReceive();
+    void ProcessRequest(const udp::endpoint &ep, PacketBufferPool::Pointer &buf, size_t length);
+    void DoSendToServer(std::shared_ptr<Association> assoc, Datagram dgram);
+    void DoReceiveFromServer(std::shared_ptr<Association> assoc);
+    void DrainServer(std::shared_ptr<Association> assoc);
+    void QueueReply(Datagram dgram);
+    void FlushReplies();
+    void DoSweep();
+
+    static const size_t kMaxDrainRounds = 8;
+    static const size_t kMaxPendingReplies = 4096;
+    // sweeps between refreshes of a server not shared with tcp
+    static const size_t kServerRefresh = 60;
+    // rsv, rsv and frag in front of every socks5 udp datagram
+    static const size_t kSocks5UdpHeader = 3;
+
+    bool running_;
+    udp::socket socket_;
+    udp::endpoint local_ep_;
+    size_t headroom_;
+    size_t tailroom_;
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs_;
+    std::deque<Datagram> replies_;
+    bool flush_pending_;
+    uint64_t dropped_replies_;
+    UdpBatchStats recv_stats_;
+    UdpBatchStats send_stats_;
+    std::string server_host_;
+    uint16_t server_port_;
+    bool pinned_;
+    udp::endpoint server_ep_;
+    bool resolving_;
+    // a hostname not shared with tcp, resolved by the relay itself
+    bool refresh_server_;
+    size_t server_age_;
+    std::shared_ptr<resolver_type> resolver_;
+    CryptoContextGenerator crypto_generator_;
+    std::unordered_map<boost::asio::ip::address, size_t> admitted_;
+    boost::asio::deadline_timer sweep_timer_;
+    NatTableType::Clock::duration idle_timeout_;
+    NatTableType associations_;
+};
+
+// Lets the socks5 sessions of an io_context find its udp relay.
+class UdpAssociateService : public boost::asio::io_context::service {
+public:
+    static boost::asio::io_context::id id;
+
+    explicit UdpAssociateService(boost::asio::io_context &ctx)
+        : boost::asio::io_context::service(ctx) {
+    }
+
+    void Attach(std::shared_ptr<UdpAssociateServer> relay) { relay_ = relay; }
+    std::shared_ptr<UdpAssociateServer> Relay() const { return relay_.lock(); }
+
+private:
+    void shutdown() {}
+
+    std::weak_ptr<UdpAssociateServer> relay_;
+};
+
+#endif
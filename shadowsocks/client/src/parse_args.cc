@@ -12,7 +12,8 @@ namespace bpo = boost::program_options;
 using boost::asio::ip::tcp;
 
 void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
-               ResolverArgs *rargs, int *log_level, Plugin *p) {
+               ResolverArgs *rargs, int *log_level, Plugin *p,
+               UdpAssociateParam *udp) {
     auto factory = CryptoContextGeneratorFactory::Instance();
     bpo::options_description desc("Socks5 Proxy Server");
     desc.add(*GetCommonOptions()).add_options()
@@ -21,7 +22,18 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
         ("method,m", bpo::value<std::string>(), "Cipher method")
         ("password,k", bpo::value<std::string>(), "Password")
         ("plugin", bpo::value<std::string>(), "Plugin executable name")
-        ("plugin-opts", bpo::value<std::string>(), "Plugin options");
+        ("plugin-opts", bpo::value<std::string>(), "Plugin options")
+        ("udp-relay,u", "Enable socks5 udp associate")
+        ("udp-max-associations", bpo::value<size_t>()->default_value(4096),
+            "Upper bound of udp associations")
+        ("udp-timeout", bpo::value<size_t>()->default_value(60),
+            "Idle timeout of udp associations in seconds")
+        ("warm-pool-size", bpo::value<size_t>()->default_value(4),
+            "Upper bound of pre-connected server connections, 0 to disable")
+        ("warm-pool-idle", bpo::value<size_t>()->default_value(30),
+            "Idle timeout of pre-connected server connections in seconds")
+        ("mux-connections", bpo::value<size_t>()->default_value(0),
+            "Server connections carrying multiplexed socks connections, 0 to disable");
 
     bpo::variables_map vm;
     bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
@@ -58,6 +70,14 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
     }
     args->bind_ep = tcp::endpoint(bind_address, bind_port);
     args->timeout = vm["timeout"].as<size_t>() * 1000;
+    args->offload_threads = vm["offload-threads"].as<size_t>();
+    args->offload_threshold = vm["offload-threshold"].as<size_t>() * 1024;
+    args->max_sessions = vm["max-sessions"].as<size_t>();
+    args->max_handshakes = vm["max-handshakes"].as<size_t>();
+    args->max_sessions_per_client = vm["max-sessions-per-client"].as<size_t>();
+    args->warm_pool_size = vm["warm-pool-size"].as<size_t>();
+    args->warm_pool_idle = vm["warm-pool-idle"].as<size_t>();
+    args->mux_connections = vm["mux-connections"].as<size_t>();
 
     if (!vm.count("server-address")) {
         std::cerr << "Please specify the server address" << std::endl;
@@ -74,6 +94,15 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
 
     *log_level = vm["verbose"].as<int>();
 
+    // plugins only carry tcp, datagrams go to the server itself
+    udp->udp_enable = vm.count("udp-relay");
+    udp->bind_ep.address(bind_address);
+    udp->bind_ep.port(bind_port);
+    udp->server_host = server_host;
+    udp->server_port = server_port;
+    udp->max_associations = vm["udp-max-associations"].as<size_t>();
+    udp->idle_timeout = vm["udp-timeout"].as<size_t>();
+
     if (vm.count("plugin")) {
         std::string plugin = vm["plugin"].as<std::string>();
         if (!plugin.empty()) {
@@ -96,6 +125,9 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
         }
     }
     auto remote_target = std::make_shared<TargetInfo>(MakeTarget(server_host, server_port));
+    args->upstream_host = server_host;
+    args->upstream_port = server_port;
+    udp->pinned = !p->Enabled();
     if (remote_target->IsEmpty()) {
         std::cerr << "Invalid server host / port" << std::endl;
         exit(-1);
@@ -113,6 +145,8 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
 
     GetResolverArgs(vm, rargs);
 
+    udp->crypto_generator = *crypto_generator;
+
     args->generator = \
         [target = std::move(remote_target), g = *crypto_generator]() {
             return GetProtocol<ShadowsocksClient>(target, g());
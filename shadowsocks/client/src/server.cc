@@ -6,8 +6,10 @@
 #include <common_utils/common.h>
 #include <common_utils/util.h>
 #include <protocol_hooks/basic_stream_session.h>
+#include <protocol_hooks/stream_mux.h>
 
 #include "server.h"
+#include "udprelay.h"
 
 using boost::asio::ip::tcp;
 namespace bsys = boost::system;
@@ -130,6 +132,11 @@ private:
                     return;
                 }
 
+                if (hdr->cmd == socks5::UDP_ASSOCIATE_CMD) {
+                    DoUdpAssociate();
+                    return;
+                }
+
                 if (hdr->cmd != socks5::CONNECT_CMD) {
                     LOG(WARNING) << "Unsupport socks command: " << (uint32_t)hdr->cmd;
                     DoWriteSocks5Reply(socks5::CMD_NOT_SUPPORTED_REP);
@@ -144,16 +151,30 @@ private:
                     return;
                 }
 
-                boost::asio::ip::address address;
-                if (protocol_->NeedResolve()) {
+                // multiplexed connections are answered at once, the address
+                // opens their stream after the reply
+                if (boost::asio::use_service<StreamMux>(context_).Enabled()) {
+                    mux_address_.assign(client_.buf.GetData() + 3, client_.buf.End());
+                    DoWriteSocks5Reply(socks5::SUCCEEDED_REP);
+                    return;
+                }
+
+                tcp::endpoint pooled;
+                if (boost::asio::use_service<WarmPool>(context_).Take(target_.socket, pooled)) {
+                    VLOG(2) << "Using pooled connection to " << pooled;
+                    RemoteConnected()(bsys::error_code(), pooled);
+                } else if (!protocol_->NeedResolve()) {
+                    tcp::endpoint ep = protocol_->GetEndpoint();
+                    VLOG(2) << "Connecting to " << ep;
+                    DoConnectRemote(std::array<tcp::endpoint, 1>{ ep });
+                } else if (boost::asio::use_service<UpstreamPin>(context_).Pinned()) {
+                    AsyncConnectUpstream(RemoteConnected());
+                    TimerAgain(self, client_);
+                } else {
                     std::string hostname;
                     uint16_t port;
                     protocol_->GetResolveArgs(hostname, port);
                     DoResolveRemote(std::move(hostname), std::move(port));
-                } else {
-                    tcp::endpoint ep = protocol_->GetEndpoint();
-                    VLOG(2) << "Connecting to " << ep;
-                    DoConnectRemote(std::array<tcp::endpoint, 1>{ ep });
                 }
             }
         );
@@ -164,7 +185,7 @@ private:
     void DoResolveRemote(std::string host, Port port) {
         auto self(shared_from_this());
         VLOG(2) << "Resolving to " << host << ":" << port;
-        resolver_->async_resolve(
+        resolve_ticket_ = resolver_->async_resolve(
             std::move(host), std::move(port),
             [this, self](bsys::error_code ec, resolver_type::results_type results) {
                 if (ec) {
@@ -180,26 +201,28 @@ private:
     template<class EndpointSequence>
     void DoConnectRemote(const EndpointSequence &results) {
         auto self(shared_from_this());
-        boost::asio::async_connect(
-            target_.socket, results,
-            [this, self](bsys::error_code ec, tcp::endpoint ep) {
-                if (ec) {
-                    if (ec == boost::asio::error::operation_aborted) {
-                        VLOG(1) << "Connect canceled";
-                        return;
-                    }
-                    LOG(INFO) << "Cannot connect to remote: " << ec.message();
-                    DoWriteSocks5Reply((ec == boost::asio::error::connection_refused
-                                        ? socks5::CONN_REFUSED_REP
-                                        : socks5::NETWORK_UNREACHABLE_REP));
+        AsyncConnectTarget(results, RemoteConnected());
+        TimerAgain(self, client_);
+    }
+
+    std::function<void(bsys::error_code, tcp::endpoint)> RemoteConnected() {
+        auto self(shared_from_this());
+        return [this, self](bsys::error_code ec, tcp::endpoint ep) {
+            if (ec) {
+                if (ec == boost::asio::error::operation_aborted) {
+                    VLOG(1) << "Connect canceled";
                     return;
                 }
-                client_.timer.cancel();
-                VLOG(1) << "Connected to remote " << ep;
-                DoWriteSocks5Reply(socks5::SUCCEEDED_REP);
+                LOG(INFO) << "Cannot connect to remote: " << ec.message();
+                DoWriteSocks5Reply((ec == boost::asio::error::connection_refused
+                                    ? socks5::CONN_REFUSED_REP
+                                    : socks5::NETWORK_UNREACHABLE_REP));
+                return;
             }
-        );
-        TimerAgain(self, client_);
+            client_.timer.cancel();
+            VLOG(1) << "Connected to remote " << ep;
+            DoWriteSocks5Reply(socks5::SUCCEEDED_REP);
+        };
     }
 
     void DoWriteSocks5Reply(uint8_t reply) {
@@ -207,9 +230,10 @@ private:
         auto *hdr = (socks5::Reply *)(client_.buf.GetData());
         hdr->rsv = 0;
         hdr->rep = reply;
+        bsys::error_code ignored;
         client_.buf.Reset(
                 socks5::Reply::FillBoundAddress(client_.buf.GetData(),
-                                                target_.socket.local_endpoint()));
+                                                target_.socket.local_endpoint(ignored)));
         boost::asio::async_write(
             client_.socket,
             client_.buf.GetConstBuffer(),
@@ -218,7 +242,12 @@ private:
                     LOG(WARNING) << "Unexcepted write error " << ec.message();
                     return;
                 }
-                if (reply == socks5::SUCCEEDED_REP) {
+                if (reply == socks5::SUCCEEDED_REP && !mux_address_.empty()) {
+                    client_.timer.cancel();
+                    boost::asio::use_service<StreamMux>(context_).Open(
+                        std::move(client_.socket), mux_address_.data(), mux_address_.size()
+                    );
+                } else if (reply == socks5::SUCCEEDED_REP) {
                     client_.timer.cancel();
                     client_.buf.Reset();
                     protocol_->DoInitializeProtocol(
@@ -233,6 +262,82 @@ private:
         TimerAgain(self, client_);
     }
 
+    void DoUdpAssociate() {
+        auto relay = boost::asio::use_service<UdpAssociateService>(context_).Relay();
+        bsys::error_code ec;
+        auto local_ep = client_.socket.local_endpoint(ec);
+        auto remote_ep = client_.socket.remote_endpoint(ec);
+        if (!relay || ec) {
+            LOG(WARNING) << "Udp associate unavailable";
+            DoWriteSocks5UdpReply(socks5::CMD_NOT_SUPPORTED_REP, tcp::endpoint());
+            return;
+        }
+        udp_admission_ = relay->Admit(remote_ep.address());
+
+        // tell the client where the relay listens, as seen on this connection
+        auto relay_ep = relay->LocalEndpoint();
+        auto address = relay_ep.address();
+        if (address.is_unspecified()) {
+            address = local_ep.address();
+        }
+        if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+            address = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+        }
+        VLOG(1) << "Udp associate for " << remote_ep;
+        DoWriteSocks5UdpReply(socks5::SUCCEEDED_REP, tcp::endpoint(address, relay_ep.port()));
+    }
+
+    void DoWriteSocks5UdpReply(uint8_t reply, tcp::endpoint bound_ep) {
+        auto self(shared_from_this());
+        auto *hdr = (socks5::Reply *)(client_.buf.GetData());
+        hdr->rsv = 0;
+        hdr->rep = reply;
+        client_.buf.Reset(socks5::Reply::FillBoundAddress(client_.buf.GetData(), bound_ep));
+        boost::asio::async_write(
+            client_.socket,
+            client_.buf.GetConstBuffer(),
+            [this, self, reply](bsys::error_code ec, size_t len) {
+                if (ec) {
+                    LOG(WARNING) << "Unexcepted write error " << ec.message();
+                    client_.CancelAll();
+                    return;
+                }
+                client_.timer.cancel();
+                if (reply != socks5::SUCCEEDED_REP) {
+                    client_.CancelAll();
+                    return;
+                }
+                client_.buf.Reset();
+                DoHoldUdpAssociation();
+            }
+        );
+        TimerAgain(self, client_);
+    }
+
+    // the association lives as long as its control connection, anything
+    // the client sends on it is discarded; it no longer counts as a
+    // handshake in progress
+    void DoHoldUdpAssociation() {
+        MarkEstablished();
+        auto self(shared_from_this());
+        client_.socket.async_read_some(
+            client_.buf.GetBuffer(),
+            [this, self](bsys::error_code ec, size_t len) {
+                if (ec) {
+                    if (ec != boost::asio::error::misc_errors::eof
+                        && ec != boost::asio::error::operation_aborted) {
+                        LOG(WARNING) << "Udp association read error: " << ec.message();
+                    }
+                    VLOG(2) << "Udp association closed";
+                    udp_admission_.reset();
+                    client_.CancelAll();
+                    return;
+                }
+                DoHoldUdpAssociation();
+            }
+        );
+    }
+
     void StartStream() {
         VLOG(2) << "Start streaming";
         auto self(shared_from_this());
@@ -246,6 +351,8 @@ private:
                                 std::placeholders::_1));
     }
 
+    std::shared_ptr<void> udp_admission_;
+    std::vector<uint8_t> mux_address_;
 };
 
 DEFINE_STREAM_SERVER(Socks5ProxyServer, Session);
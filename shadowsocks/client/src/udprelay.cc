@@ -0,0 +1,423 @@
+
+#include "udprelay.h"
+
+#include <common_utils/util.h>
+
+using boost::asio::ip::udp;
+namespace bsys = boost::system;
+
+boost::asio::io_context::id UdpAssociateService::id;
+
+// control connections and datagrams of one client may reach dual stack
+// sockets in different forms
+static boost::asio::ip::address Normalize(const boost::asio::ip::address &address) {
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+    }
+    return address;
+}
+
+UdpAssociateServer::UdpAssociateServer(boost::asio::io_context &ctx, UdpAssociateParam param,
+                                       std::shared_ptr<resolver_type> resolver)
+    : socket_(ctx, param.bind_ep),
+      flush_pending_(false),
+      dropped_replies_(0),
+      server_host_(std::move(param.server_host)),
+      server_port_(param.server_port),
+      pinned_(param.pinned),
+      resolving_(false),
+      refresh_server_(false),
+      server_age_(0),
+      resolver_(resolver),
+      crypto_generator_(std::move(param.crypto_generator)),
+      sweep_timer_(ctx),
+      idle_timeout_(std::chrono::seconds(param.idle_timeout)),
+      associations_(param.max_associations) {
+    running_ = true;
+    local_ep_ = socket_.local_endpoint();
+    auto probe = crypto_generator_();
+    headroom_ = probe->PacketHeadroom();
+    tailroom_ = probe->PacketTailroom();
+    LOG(INFO) << "udp associate running at " << local_ep_;
+
+    bsys::error_code ec;
+    auto address = boost::asio::ip::make_address(server_host_, ec);
+    if (pinned_) {
+        boost::asio::use_service<UpstreamPin>(ctx).Start(server_host_, server_port_, resolver_);
+    } else if (!ec) {
+        server_ep_ = udp::endpoint(address, server_port_);
+    } else {
+        refresh_server_ = true;
+        DoResolveServer();
+    }
+    DoReceive();
+    DoSweep();
+}
+
+std::shared_ptr<void> UdpAssociateServer::Admit(const boost::asio::ip::address &address) {
+    auto normalized = Normalize(address);
+    ++admitted_[normalized];
+    std::weak_ptr<UdpAssociateServer> weak = shared_from_this();
+    return std::shared_ptr<void>(
+        nullptr,
+        [weak, normalized](void *) {
+            auto self = weak.lock();
+            if (!self) {
+                return;
+            }
+            auto itr = self->admitted_.find(normalized);
+            if (itr != self->admitted_.end() && --itr->second == 0) {
+                self->admitted_.erase(itr);
+            }
+        }
+    );
+}
+
+// the server port stays 0 until its hostname resolved, failures are
+// retried by the sweep and answers refreshed by it
+void UdpAssociateServer::DoResolveServer() {
+    resolving_ = true;
+    server_age_ = 0;
+    resolver_->async_resolve(
+        server_host_, server_port_,
+        [this](bsys::error_code ec, resolver_type::results_type results) {
+            resolving_ = false;
+            if (ec) {
+                LOG(WARNING) << "unable to resolve " << server_host_ << ", " << ec.message();
+                return;
+            }
+            auto ep = results.begin()->endpoint();
+            server_ep_ = udp::endpoint(ep.address(), ep.port());
+            VLOG(1) << "udp relay server " << server_ep_;
+        }
+    );
+}
+
+void UdpAssociateServer::DoReceive() {
+    socket_.async_wait(
+        udp::socket::wait_read,
+        [this](bsys::error_code ec) {
+            if (!ec) {
+                DrainReceive();
+            }
+
+            if (running_) {
+                DoReceive();
+            }
+        }
+    );
+}
+
+// datagrams land after the cipher headroom, so the socks5 address and
+// payload are sealed where they are once the 3 byte header is skipped
+void UdpAssociateServer::DrainReceive() {
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> senders;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < bufs_.size(); ++i) {
+            if (!bufs_[i]) {
+                bufs_[i] = PacketBufferPool::Acquire();
+            }
+            buffers[i] = boost::asio::buffer(bufs_[i]->Begin() + headroom_,
+                                             bufs_[i]->Capacity() - headroom_ - tailroom_);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(socket_, buffers.data(), lengths.data(),
+                                            senders.data(), buffers.size(), ec);
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "udp receive error: " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ProcessRequest(senders[i], bufs_[i], lengths[i]);
+        }
+        recv_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        if (n < buffers.size()) {
+            return;
+        }
+    }
+}
+
+void UdpAssociateServer::ProcessRequest(const udp::endpoint &ep,
+                                        PacketBufferPool::Pointer &buf, size_t length) {
+    if (!admitted_.count(Normalize(ep.address()))) {
+        VLOG(1) << "udp datagram from unassociated client " << ep;
+        return;
+    }
+
+    uint8_t *data = buf->Begin() + headroom_;
+    if (length <= kSocks5UdpHeader || data[2] != 0) {
+        VLOG(1) << "short or fragmented socks5 udp datagram from " << ep;
+        return;
+    }
+    uint8_t *plaintext = data + kSocks5UdpHeader;
+    size_t plain_length = length - kSocks5UdpHeader;
+
+    TargetInfo target;
+    size_t head_length = GetTargetFromSocks5Address(plaintext, nullptr, target);
+    if (!head_length || head_length > plain_length) {
+        LOG(WARNING) << "invalid udp header";
+        return;
+    }
+
+    std::shared_ptr<Association> assoc;
+    auto entry = associations_.Find(ep);
+    if (entry) {
+        assoc = *entry;
+    } else {
+        udp::endpoint server_ep;
+        if (!ServerEndpoint(server_ep)) {
+            VLOG(1) << "server unresolved, drop packet from " << ep;
+            return;
+        }
+        assoc = std::make_shared<Association>(socket_.get_executor().context());
+        bsys::error_code ec;
+        assoc->socket.connect(server_ep, ec);
+        if (ec) {
+            LOG(WARNING) << "unable to connect " << server_ep << ", " << ec.message();
+            return;
+        }
+        assoc->client_ep = ep;
+        assoc->server_ep = server_ep;
+        assoc->crypto = crypto_generator_();
+        std::shared_ptr<Association> evicted;
+        if (associations_.Insert(ep, assoc, idle_timeout_, &evicted)) {
+            VLOG(1) << "association table full, evict " << evicted->client_ep;
+            evicted->Close();
+        }
+        DoReceiveFromServer(assoc);
+    }
+
+    uint8_t *packet;
+    ssize_t packet_length = assoc->crypto->EncryptPacket(plaintext, plain_length, &packet);
+    if (packet_length <= 0) {
+        LOG(WARNING) << "udp encrypt error";
+        return;
+    }
+    DoSendToServer(assoc, Datagram{ std::move(buf), packet, (size_t)packet_length, assoc->server_ep });
+}
+
+// new associations follow the upstream pin, so they pick up its refreshes
+// and fail overs
+bool UdpAssociateServer::ServerEndpoint(udp::endpoint &ep) {
+    if (!pinned_) {
+        ep = server_ep_;
+        return ep.port() != 0;
+    }
+    auto &upstream = boost::asio::use_service<UpstreamPin>(socket_.get_executor().context());
+    if (!upstream.Pinned()) {
+        return false;
+    }
+    auto pinned = upstream.Endpoint();
+    ep = udp::endpoint(pinned.address(), pinned.port());
+    return true;
+}
+
+// nothing listens at the address, the next datagram of the client opens
+// an association to the one failed over to
+void UdpAssociateServer::ServerRefused(const std::shared_ptr<Association> &assoc) {
+    LOG(WARNING) << "server " << assoc->server_ep << " refused " << assoc->client_ep;
+    if (pinned_) {
+        auto &upstream = boost::asio::use_service<UpstreamPin>(socket_.get_executor().context());
+        upstream.ReportFailure(boost::asio::ip::tcp::endpoint(assoc->server_ep.address(),
+                                                              assoc->server_ep.port()));
+    }
+    auto entry = associations_.Find(assoc->client_ep);
+    if (entry && *entry == assoc) {
+        std::shared_ptr<Association> erased;
+        associations_.Erase(assoc->client_ep, &erased);
+    }
+    assoc->Close();
+}
+
+void UdpAssociateServer::DoSendToServer(std::shared_ptr<Association> assoc, Datagram dgram) {
+    auto buffer = boost::asio::buffer(dgram.data, dgram.size);
+    assoc->socket.async_send(
+        std::move(buffer),
+        [assoc, buf{ std::move(dgram.buf) }]
+        (bsys::error_code ec, size_t length) {
+            if (ec && ec != boost::asio::error::operation_aborted) {
+                LOG(WARNING) << "unable to send to server for " << assoc->client_ep
+                             << ", " << ec.message();
+            }
+        }
+    );
+}
+
+void UdpAssociateServer::DoReceiveFromServer(std::shared_ptr<Association> assoc) {
+    assoc->socket.async_wait(
+        udp::socket::wait_read,
+        [this, assoc](bsys::error_code ec) {
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted) {
+                    LOG(WARNING) << "unable to receive for " << assoc->client_ep
+                                 << ", " << ec.message();
+                }
+                return;
+            }
+            DrainServer(assoc);
+            if (assoc->closed) {
+                return;
+            }
+            associations_.Touch(assoc->client_ep);
+            DoReceiveFromServer(assoc);
+        }
+    );
+}
+
+// replies are opened in place, the socks5 header goes into the room the
+// cipher framing leaves in front of the plaintext
+void UdpAssociateServer::DrainServer(std::shared_ptr<Association> assoc) {
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs;
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < bufs.size(); ++i) {
+            if (!bufs[i]) {
+                bufs[i] = PacketBufferPool::Acquire();
+            }
+            buffers[i] = boost::asio::buffer(bufs[i]->Begin() + kSocks5UdpHeader,
+                                             bufs[i]->Capacity() - kSocks5UdpHeader);
+        }
+
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(assoc->socket, buffers.data(), lengths.data(),
+                                            nullptr, buffers.size(), ec);
+        if (ec == boost::asio::error::connection_refused) {
+            ServerRefused(assoc);
+            return;
+        }
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "unable to receive for " << assoc->client_ep
+                             << ", " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t *plaintext;
+            ssize_t plain_length = assoc->crypto->DecryptPacket(
+                bufs[i]->Begin() + kSocks5UdpHeader, lengths[i], &plaintext
+            );
+            if (plain_length <= 0) {
+                LOG(WARNING) << "udp decrypt error";
+                continue;
+            }
+            uint8_t *data = plaintext - kSocks5UdpHeader;
+            std::fill_n(data, kSocks5UdpHeader, 0);
+            QueueReply(Datagram{ std::move(bufs[i]), data,
+                                 kSocks5UdpHeader + plain_length, assoc->client_ep });
+        }
+        if (n < buffers.size()) {
+            return;
+        }
+    }
+}
+
+void UdpAssociateServer::QueueReply(Datagram dgram) {
+    if (replies_.size() >= kMaxPendingReplies) {
+        ++dropped_replies_;
+        VLOG(1) << "reply queue full, drop packet to " << dgram.ep;
+        return;
+    }
+    replies_.emplace_back(std::move(dgram));
+    if (!flush_pending_) {
+        flush_pending_ = true;
+        boost::asio::post(socket_.get_executor(), [this]() { FlushReplies(); });
+    }
+}
+
+// replies gathered during one loop turn leave in as few calls as possible
+void UdpAssociateServer::FlushReplies() {
+    std::array<boost::asio::const_buffer, UdpBatchIO::kMaxBatch> packets;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> destinations;
+
+    flush_pending_ = false;
+    while (!replies_.empty()) {
+        size_t count = std::min(replies_.size(), packets.size());
+        for (size_t i = 0; i < count; ++i) {
+            packets[i] = boost::asio::buffer(replies_[i].data, replies_[i].size);
+            destinations[i] = replies_[i].ep;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::SendBatch(socket_, packets.data(), destinations.data(), count, ec);
+        if (n) {
+            send_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        }
+        replies_.erase(replies_.begin(), replies_.begin() + n);
+
+        if (ec == boost::asio::error::would_block) {
+            flush_pending_ = true;
+            socket_.async_wait(
+                udp::socket::wait_write,
+                [this](bsys::error_code ec) {
+                    flush_pending_ = false;
+                    if (!ec) {
+                        FlushReplies();
+                    }
+                }
+            );
+            return;
+        } else if (ec) {
+            LOG(WARNING) << "unable to send to " << replies_.front().ep
+                         << ", " << ec.message();
+            replies_.pop_front();
+        }
+    }
+}
+
+void UdpAssociateServer::DoSweep() {
+    sweep_timer_.expires_from_now(boost::posix_time::seconds(1));
+    sweep_timer_.async_wait(
+        [this](bsys::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            associations_.Expire(
+                [](std::shared_ptr<Association> &assoc) {
+                    VLOG(1) << "association expired " << assoc->client_ep;
+                    assoc->Close();
+                }
+            );
+            if (refresh_server_ && !resolving_
+                && (!server_ep_.port() || ++server_age_ >= kServerRefresh)) {
+                DoResolveServer();
+            }
+            DoSweep();
+        }
+    );
+}
+
+void UdpAssociateServer::Stop() {
+    running_ = false;
+    socket_.cancel();
+    sweep_timer_.cancel();
+    associations_.Clear(
+        [](std::shared_ptr<Association> &assoc) {
+            assoc->Close();
+        }
+    );
+}
+
+void UdpAssociateServer::DumpStats() const {
+    auto &stats = associations_.GetStats();
+    LOG(INFO) << "udp associations: " << associations_.Size() << "/" << associations_.Capacity()
+              << ", admitted clients: " << admitted_.size()
+              << ", hits: " << stats.hits
+              << ", misses: " << stats.misses
+              << ", evictions: " << stats.evictions
+              << ", expirations: " << stats.expirations
+              << ", pending replies: " << replies_.size()
+              << ", dropped replies: " << dropped_replies_ << std::endl
+              << "receive " << recv_stats_.DumpToStr() << std::endl
+              << "send " << send_stats_.DumpToStr();
+}
@@ -6,15 +6,17 @@
 #include <boost/endian/buffers.hpp>
 
 #include <sodium.h>
+#include <common_utils/random.h>
 
 #include "crypto_utils/cipher.h"
 #include "crypto_utils/crypto.h"
+#include "crypto_utils/salt_filter.h"
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
 class AeadCipher : public Cipher {
 public:
     AeadCipher(std::vector<uint8_t> master_key)
-        : Cipher(std::move(master_key)), initialized_(false) {
+        : Cipher(std::move(master_key)), initialized_(false), salt_pending_(false) {
         std::fill(nonce_.begin(), nonce_.end(), 0);
     }
 
@@ -23,8 +25,11 @@ public:
     ssize_t Encrypt(Buffer &buf);
     ssize_t Decrypt(Buffer &buf);
 
-    ssize_t EncryptOnce(Buffer &buf);
-    ssize_t DecryptOnce(Buffer &buf);
+    ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet);
+    ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext);
+
+    size_t PacketHeadroom() const { return key_len; }
+    size_t PacketTailroom() const { return tag_len; }
 
     static void DeriveKeyFromPassword(std::string password, std::vector<uint8_t> &key) {
         key.resize(key_len);
@@ -33,7 +38,29 @@ public:
 
     virtual bool DeriveSessionKey();
 
+    void Reset();
+
 protected:
+    // one AEAD chunk of a batch, sealed or opened under its own nonce
+    struct ChunkJob {
+        std::array<uint8_t, nonce_len> nonce;
+        uint8_t *out;
+        const uint8_t *in;
+        size_t in_len;
+    };
+
+    bool CheckSalt();
+    bool AcceptSalt();
+    void RecordSalt();
+
+    int EncryptChunks(const uint8_t *data, size_t len, size_t max_payload, Buffer &buf);
+    int DecryptChunks(size_t *offset, Buffer &buf);
+
+    // chunks of one buffer use consecutive, predictable nonces, so a cipher
+    // may override these to process the whole batch in one pass
+    virtual int CipherEncryptBatch(const ChunkJob *jobs, size_t count);
+    virtual int CipherDecryptBatch(const ChunkJob *jobs, size_t count);
+
     virtual int CipherEncrypt(
                     void *c, size_t *clen,
                     const uint8_t *m, size_t mlen,
@@ -47,8 +74,14 @@ protected:
                 ) = 0;
 
     const size_t kTagLength = tag_len;
+    const size_t kLengthSize = 2;
+    const size_t kMaxPayloadLength = 0x3fff;
     bool initialized_;
+    // the received salt is remembered once its first chunk authenticates
+    bool salt_pending_;
     std::vector<uint8_t> chunk_;
+    std::vector<ChunkJob> jobs_;
+    std::vector<boost::endian::big_uint16_buf_t> lengths_;
     std::array<uint8_t, key_len> key_;
     std::array<uint8_t, key_len> salt_;
     std::array<uint8_t, nonce_len> nonce_;
@@ -56,73 +89,32 @@ protected:
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
 ssize_t AeadCipher<key_len, nonce_len, tag_len>::Encrypt(Buffer &buf) {
-    size_t ciphertext_length = 0;
-
     chunk_.reserve(buf.Size());
     std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk_));
     buf.Reset();
 
     if (!initialized_) {
-        randombytes_buf(salt_.data(), salt_.size());
+        RandomBytes(salt_.data(), salt_.size());
+        RecordSalt();
         if (!DeriveSessionKey()) {
             LOG(WARNING) << "Key derivation error";
             return -1;
         }
         buf.AppendData(salt_);
-        ciphertext_length += salt_.size();
         initialized_ = true;
     }
 
-    size_t processed_length = 0;
-    while (processed_length < chunk_.size()) {
-        size_t plaintext_length = std::min(chunk_.size() - processed_length, (size_t)0x3fff);
-        boost::endian::big_uint16_buf_t length_buf{ (uint16_t)plaintext_length };
-        size_t clen = plaintext_length + sizeof length_buf + tag_len * 2;
-        int ret;
-
-        buf.PrepareCapacity(clen);
-
-        ret = CipherEncrypt(
-                buf.End(), &clen,
-                (uint8_t *)&length_buf, sizeof length_buf,
-                nullptr, 0
-        );
-        if (ret) {
-            LOG(WARNING) << "CipherEncrypt error while encrypting length: " << ret;
-            return ret;
-        }
-        sodium_increment(nonce_.data(), nonce_.size());
-        buf.Append(clen);
-        ciphertext_length += clen;
-
-        ret = CipherEncrypt(
-                buf.End(), &clen,
-                chunk_.data() + processed_length, plaintext_length,
-                nullptr, 0
-        );
-        if (ret) {
-            LOG(WARNING) << "CipherEncrypt error while encrypting data" << ret;
-            return ret;
-        }
-        sodium_increment(nonce_.data(), nonce_.size());
-        buf.Append(clen);
-        ciphertext_length += clen;
-        processed_length += plaintext_length;
-    }
-    chunk_.erase(chunk_.begin(), chunk_.begin() + processed_length);
-
-    if (ciphertext_length != buf.Size()) {
-        LOG(FATAL) << "unexcepted ciphertext length: " << ciphertext_length
-                   << ", should be " << buf.Size();
+    int ret = EncryptChunks(chunk_.data(), chunk_.size(), kMaxPayloadLength, buf);
+    chunk_.clear();
+    if (ret) {
+        return -1;
     }
 
-    return ciphertext_length;
+    return buf.Size();
 }
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
 ssize_t AeadCipher<key_len, nonce_len, tag_len>::Decrypt(Buffer &buf) {
-    size_t plaintext_length = 0;
-
     chunk_.reserve(buf.Size());
     std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk_));
     buf.Reset();
@@ -133,141 +125,271 @@ ssize_t AeadCipher<key_len, nonce_len, tag_len>::Decrypt(Buffer &buf) {
         }
         std::copy_n(chunk_.begin(), salt_.size(), salt_.begin());
         chunk_.erase(chunk_.begin(), chunk_.begin() + salt_.size());
+        if (!CheckSalt()) {
+            return -1;
+        }
         if (!DeriveSessionKey()) {
             LOG(WARNING) << "Key derivation error";
             return -1;
         }
         initialized_ = true;
+        salt_pending_ = true;
     }
 
     size_t processed_length = 0;
-    while (processed_length < chunk_.size()) {
+    int ret = DecryptChunks(&processed_length, buf);
+    if (ret) {
+        return -1;
+    }
+    if (salt_pending_ && processed_length && !AcceptSalt()) {
+        return -1;
+    }
+    chunk_.erase(chunk_.begin(), chunk_.begin() + processed_length);
+
+    return buf.Size();
+}
+
+// rejects a known salt before any key derivation, records nothing, so
+// junk salts cannot push genuine ones out of the filter
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+bool AeadCipher<key_len, nonce_len, tag_len>::CheckSalt() {
+    auto &filter = SaltFilter::Instance();
+    if (filter.Enabled() && filter.Contains(salt_.data(), salt_.size())) {
+        LOG(WARNING) << "Replayed salt detected";
+        return false;
+    }
+    return true;
+}
+
+// records the salt once data under it authenticated, a concurrent session
+// that got there first with the same salt wins
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+bool AeadCipher<key_len, nonce_len, tag_len>::AcceptSalt() {
+    auto &filter = SaltFilter::Instance();
+    salt_pending_ = false;
+    if (filter.Enabled() && !filter.CheckAndAdd(salt_.data(), salt_.size())) {
+        LOG(WARNING) << "Replayed salt detected";
+        return false;
+    }
+    return true;
+}
+
+// our own salts are remembered too, so a reply cannot be reflected back
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+void AeadCipher<key_len, nonce_len, tag_len>::RecordSalt() {
+    auto &filter = SaltFilter::Instance();
+    if (filter.Enabled()) {
+        filter.Add(salt_.data(), salt_.size());
+    }
+}
+
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+int AeadCipher<key_len, nonce_len, tag_len>::EncryptChunks(
+        const uint8_t *data, size_t len,
+        size_t max_payload, Buffer &buf
+    ) {
+    size_t chunk_count = (len + max_payload - 1) / max_payload;
+    size_t ciphertext_length = len + chunk_count * (kLengthSize + tag_len * 2);
+
+    lengths_.resize(chunk_count);
+    jobs_.resize(chunk_count * 2);
+    buf.PrepareCapacity(ciphertext_length);
+
+    uint8_t *out = buf.End();
+    std::array<uint8_t, nonce_len> nonce = nonce_;
+    for (size_t i = 0; i < chunk_count; ++i) {
+        size_t plaintext_length = std::min(len - i * max_payload, max_payload);
+        ChunkJob &length_job = jobs_[i * 2];
+        ChunkJob &payload_job = jobs_[i * 2 + 1];
+
+        lengths_[i] = (uint16_t)plaintext_length;
+        length_job.nonce = nonce;
+        length_job.out = out;
+        length_job.in = (const uint8_t *)&lengths_[i];
+        length_job.in_len = kLengthSize;
+        out += kLengthSize + tag_len;
+        sodium_increment(nonce.data(), nonce.size());
+
+        payload_job.nonce = nonce;
+        payload_job.out = out;
+        payload_job.in = data + i * max_payload;
+        payload_job.in_len = plaintext_length;
+        out += plaintext_length + tag_len;
+        sodium_increment(nonce.data(), nonce.size());
+    }
+
+    int ret = CipherEncryptBatch(jobs_.data(), jobs_.size());
+    if (ret) {
+        LOG(WARNING) << "CipherEncrypt error while encrypting chunks: " << ret;
+        return ret;
+    }
+    nonce_ = nonce;
+    buf.Append(ciphertext_length);
+
+    return 0;
+}
+
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+int AeadCipher<key_len, nonce_len, tag_len>::DecryptChunks(size_t *offset, Buffer &buf) {
+    size_t processed_length = *offset;
+    size_t plaintext_length = 0;
+    std::array<uint8_t, nonce_len> nonce = nonce_;
+
+    // plaintext never outgrows the ciphertext it comes from
+    buf.PrepareCapacity(chunk_.size() - processed_length);
+    jobs_.clear();
+
+    uint8_t *out = buf.End();
+    while (true) {
         boost::endian::big_uint16_buf_t length_buf;
-        size_t ciphertext_length = sizeof length_buf + tag_len;
-        size_t mlen = sizeof length_buf;
-        int ret;
+        size_t length_chunk = kLengthSize + tag_len;
+        size_t mlen = kLengthSize;
 
-        if (processed_length + ciphertext_length > chunk_.size()) {
+        if (processed_length + length_chunk > chunk_.size()) {
             break;
         }
 
-        ret = CipherDecrypt(
+        nonce_ = nonce;
+        int ret = CipherDecrypt(
                 &length_buf, &mlen,
-                chunk_.data() + processed_length, ciphertext_length,
+                chunk_.data() + processed_length, length_chunk,
                 nullptr, 0
         );
         if (ret) {
             LOG(WARNING) << "CipherDecrypt error while decrypting length: " << ret;
             return ret;
         }
-        processed_length += mlen + tag_len;
-        ciphertext_length = length_buf.value() + tag_len;
-        if (processed_length + ciphertext_length > chunk_.size()) {
-            processed_length -= mlen + tag_len;
+        size_t payload_chunk = length_buf.value() + tag_len;
+        if (processed_length + length_chunk + payload_chunk > chunk_.size()) {
             break;
         }
-        sodium_increment(nonce_.data(), nonce_.size());
-
-        buf.PrepareCapacity(length_buf.value());
-        ret = CipherDecrypt(
-                buf.End(), &mlen,
-                chunk_.data() + processed_length, ciphertext_length,
-                nullptr, 0
-        );
-        if (ret) {
-            LOG(WARNING) << "CipherDecrypt error while decrypting data: " << ret;
-            return ret;
-        }
-        sodium_increment(nonce_.data(), nonce_.size());
-        buf.Append(mlen);
-        plaintext_length += mlen;
-        processed_length += ciphertext_length;
+        sodium_increment(nonce.data(), nonce.size());
+
+        ChunkJob job;
+        job.nonce = nonce;
+        job.out = out;
+        job.in = chunk_.data() + processed_length + length_chunk;
+        job.in_len = payload_chunk;
+        jobs_.push_back(job);
+        sodium_increment(nonce.data(), nonce.size());
+
+        out += length_buf.value();
+        plaintext_length += length_buf.value();
+        processed_length += length_chunk + payload_chunk;
     }
+    nonce_ = nonce;
 
-    if (plaintext_length != buf.Size()) {
-        LOG(FATAL) << "unexcepted ciphertext length: " << plaintext_length
-                   << ", should be " << buf.Size();
+    if (jobs_.empty()) {
+        return 0;
     }
+    int ret = CipherDecryptBatch(jobs_.data(), jobs_.size());
+    nonce_ = nonce;
+    if (ret) {
+        LOG(WARNING) << "CipherDecrypt error while decrypting data: " << ret;
+        return ret;
+    }
+    buf.Append(plaintext_length);
+    *offset = processed_length;
 
-    chunk_.erase(chunk_.begin(), chunk_.begin() + processed_length);
-
-    return plaintext_length;
+    return 0;
 }
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
-ssize_t AeadCipher<key_len, nonce_len, tag_len>::EncryptOnce(Buffer &buf) {
-    chunk_.clear();
-    if (initialized_) {
-        LOG(FATAL) << "unexpected call for EncryptOnce";
-        return -1;
+int AeadCipher<key_len, nonce_len, tag_len>::CipherEncryptBatch(const ChunkJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        size_t clen;
+        nonce_ = jobs[i].nonce;
+        int ret = CipherEncrypt(jobs[i].out, &clen, jobs[i].in, jobs[i].in_len, nullptr, 0);
+        if (ret) {
+            return ret;
+        }
     }
+    return 0;
+}
 
-    chunk_.reserve(buf.Size());
-    std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk_));
-    buf.Reset();
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+int AeadCipher<key_len, nonce_len, tag_len>::CipherDecryptBatch(const ChunkJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        size_t mlen;
+        nonce_ = jobs[i].nonce;
+        int ret = CipherDecrypt(jobs[i].out, &mlen, jobs[i].in, jobs[i].in_len, nullptr, 0);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
 
-    randombytes_buf(salt_.data(), salt_.size());
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+ssize_t AeadCipher<key_len, nonce_len, tag_len>::EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) {
+    RandomBytes(salt_.data(), salt_.size());
+    RecordSalt();
     if (!DeriveSessionKey()) {
         LOG(WARNING) << "Key derivation error";
         return -1;
     }
-    buf.AppendData(salt_);
+    std::fill(nonce_.begin(), nonce_.end(), 0);
 
-    size_t clen = chunk_.size() + tag_len;
+    size_t clen = len + tag_len;
     int ret;
-
-    buf.PrepareCapacity(clen);
-
     ret = CipherEncrypt(
-            buf.End(), &clen,
-            chunk_.data(), chunk_.size(),
+            plaintext, &clen,
+            plaintext, len,
             nullptr, 0
     );
     if (ret) {
-        LOG(WARNING) << "CipherEncrypt error while encrypting length: " << ret;
-        return ret;
+        LOG(WARNING) << "CipherEncrypt error while encrypting packet: " << ret;
+        return -1;
     }
-    buf.Append(clen);
 
-    return buf.Size();
+    *packet = plaintext - salt_.size();
+    std::copy(salt_.begin(), salt_.end(), *packet);
+    return salt_.size() + clen;
 }
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
-ssize_t AeadCipher<key_len, nonce_len, tag_len>::DecryptOnce(Buffer &buf) {
-    chunk_.clear();
-    if (initialized_) {
-        LOG(FATAL) << "unexpected call for DecryptOnce";
+ssize_t AeadCipher<key_len, nonce_len, tag_len>::DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) {
+    if (len < salt_.size() + tag_len) {
+        LOG(ERROR) << "invalid packet length: " << len;
         return -1;
     }
-
-    if (buf.Size() < salt_.size() + tag_len) {
-        LOG(ERROR) << "invalid packet length: " << buf.Size();
+    std::copy_n(packet, salt_.size(), salt_.begin());
+    if (!CheckSalt()) {
         return -1;
     }
-    std::copy_n(buf.Begin(), salt_.size(), salt_.begin());
     if (!DeriveSessionKey()) {
         LOG(WARNING) << "Key derivation error";
         return -1;
     }
+    std::fill(nonce_.begin(), nonce_.end(), 0);
 
-    chunk_.reserve(buf.Size() - salt_.size());
-    std::copy(buf.Begin() + salt_.size(), buf.End(), std::back_inserter(chunk_));
-    buf.Reset();
-
-    size_t mlen = chunk_.size();
+    uint8_t *body = packet + salt_.size();
+    size_t mlen = len - salt_.size();
     int ret;
     ret = CipherDecrypt(
-            buf.End(), &mlen,
-            chunk_.data(), chunk_.size(),
+            body, &mlen,
+            body, len - salt_.size(),
             nullptr, 0
     );
     if (ret) {
-        LOG(WARNING) << "CipherDecrypt error while decrypting data: " << ret;
-        return ret;
+        LOG(WARNING) << "CipherDecrypt error while decrypting packet: " << ret;
+        return -1;
+    }
+    if (!AcceptSalt()) {
+        return -1;
     }
-    buf.Append(mlen);
 
-    return buf.Size();
+    *plaintext = body;
+    return mlen;
+}
+
+template<size_t key_len, size_t nonce_len, size_t tag_len>
+void AeadCipher<key_len, nonce_len, tag_len>::Reset() {
+    initialized_ = false;
+    salt_pending_ = false;
+    chunk_.clear();
+    sodium_memzero(key_.data(), key_.size());
+    std::fill(nonce_.begin(), nonce_.end(), 0);
 }
 
 template<size_t key_len, size_t nonce_len, size_t tag_len>
@@ -0,0 +1,726 @@
+#ifndef __AEAD2022_H__
+#define __AEAD2022_H__
+
+#include <ctime>
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/endian/buffers.hpp>
+
+#include <sodium.h>
+#include <openssl/evp.h>
+#include <common_utils/random.h>
+#include <common_utils/socks5.h>
+
+#include "crypto_utils/aead.h"
+#include "crypto_utils/blake3.h"
+
+// how the UDP packets of a 2022 method are protected
+enum class Aead2022Udp {
+    kSeparateHeader,    // AES block encrypted header + per-session AEAD key
+    kXChaCha,           // XChaCha20-Poly1305 under the PSK, random nonce
+};
+
+// Seconds since the epoch as written to and checked in 2022 headers. In
+// test builds a pinned time lets tests open sessions recorded at a known
+// time.
+class Aead2022Clock {
+public:
+    static std::time_t Now() {
+#ifdef TEST_HOOKS
+        std::time_t pinned = Pinned();
+        if (pinned) {
+            return pinned;
+        }
+#endif
+        return std::time(nullptr);
+    }
+
+#ifdef TEST_HOOKS
+    // 0 follows the system clock again
+    static void Pin(std::time_t now) { Pinned() = now; }
+
+private:
+    static std::atomic<std::time_t> &Pinned() {
+        static std::atomic<std::time_t> pinned(0);
+        return pinned;
+    }
+#endif
+};
+
+// Shadowsocks 2022 (SIP022) framing on top of the AEAD chunk machinery.
+// The master key is the base64 decoded PSK and session subkeys come from
+// BLAKE3. Whether a side is the client or the server is learned from its
+// bound counterpart: a response follows a received request.
+template<size_t key_len, Aead2022Udp udp_mode>
+class Aead2022Cipher : public AeadCipher<key_len, 12, 16> {
+    using Base = AeadCipher<key_len, 12, 16>;
+public:
+    Aead2022Cipher(std::vector<uint8_t> psk)
+        : Base(std::move(psk)), peer_(nullptr), ecb_ctx_(nullptr), ecb_enc_(-1) {
+        ResetState();
+    }
+
+    ~Aead2022Cipher() {
+        if (ecb_ctx_) {
+            EVP_CIPHER_CTX_free(ecb_ctx_);
+        }
+    }
+
+    ssize_t Encrypt(Buffer &buf);
+    ssize_t Decrypt(Buffer &buf);
+
+    ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet);
+    ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext);
+
+    size_t PacketHeadroom() const {
+        return (udp_mode == Aead2022Udp::kXChaCha ? kXChaChaNonceSize : 0)
+               + kSessionIdSize + 8 + 1 + 8 + kSessionIdSize + 2;
+    }
+
+    void Reset() {
+        Base::Reset();
+        ResetState();
+    }
+
+    void BindPeer(Cipher *peer) {
+        peer_ = static_cast<Aead2022Cipher *>(peer);
+    }
+
+    size_t PendingDecryptBytes() const;
+
+    bool DeriveSessionKey() {
+        return DeriveSubkey(Base::salt_.data(), Base::salt_.size());
+    }
+
+    static void DeriveKeyFromPassword(std::string password, std::vector<uint8_t> &key) {
+        size_t len = 0;
+        key.resize(key_len);
+        if (sodium_base642bin(key.data(), key.size(), password.data(), password.size(),
+                              nullptr, &len, nullptr, sodium_base64_VARIANT_ORIGINAL) != 0
+            || len != key_len) {
+            LOG(FATAL) << "2022 methods take a base64 encoded "
+                       << key_len << " bytes key as password";
+        }
+    }
+
+private:
+    enum Stage { kFixedHeader, kVariableHeader, kStream };
+
+    static const uint8_t kClientStream = 0;
+    static const uint8_t kServerStream = 1;
+    static const size_t kMaxPayload = 0xffff;
+    static const size_t kMaxPadding = 900;
+    static const int64_t kMaxTimeDiff = 30;
+    static const size_t kSessionIdSize = 8;
+    static const size_t kSeparateHeaderSize = 16;
+    static const size_t kXChaChaNonceSize = 24;
+
+    using SessionId = std::array<uint8_t, kSessionIdSize>;
+
+    // a remote UDP session with its replay window
+    struct RemoteSession {
+        bool valid;
+        SessionId id;
+        std::array<uint8_t, key_len> key;
+        uint64_t window_top;
+        uint64_t window_bits;
+    };
+
+    void ResetState();
+    bool DeriveSubkey(const uint8_t *salt, size_t salt_len);
+
+    size_t FixedHeaderSize(bool response) const {
+        return 1 + 8 + (response ? key_len : 0) + 2;
+    }
+
+    bool ExpectResponse() const { return peer_ && peer_->request_sent_; }
+    bool ExpectUdpResponse() const { return peer_ && peer_->udp_request_sent_; }
+
+    int SealNext(uint8_t *out, const uint8_t *in, size_t len);
+    int OpenNext(uint8_t *out, const uint8_t *in, size_t len);
+
+    int SealRequestHeader(Buffer &buf, size_t *consumed);
+    int SealResponseHeader(Buffer &buf, size_t *consumed);
+    int OpenFixedHeader(const uint8_t *in, bool response);
+    int OpenVariableHeader(const uint8_t *in, Buffer &buf);
+
+    bool CryptSeparateHeader(uint8_t *block, bool enc);
+    RemoteSession *FindRemoteSession(const uint8_t *id);
+    static bool CheckPacketId(RemoteSession &remote, uint64_t packet_id);
+
+    static size_t AddressLength(const uint8_t *p, size_t len);
+    static bool CheckTimestamp(const uint8_t *p);
+    static void PutTimestamp(uint8_t *p);
+
+    Aead2022Cipher *peer_;
+
+    // stream state
+    Stage stage_;
+    bool request_sent_;
+    bool request_received_;
+    size_t pending_length_;
+    std::vector<uint8_t> header_;
+
+    // packet state
+    bool udp_session_ready_;
+    bool udp_request_sent_;
+    bool udp_request_received_;
+    SessionId session_id_;
+    uint64_t packet_id_;
+    // the latest remote session and the one before it, a client switching
+    // sessions may still have packets of the old one in flight
+    std::array<RemoteSession, 2> remote_;
+    EVP_CIPHER_CTX *ecb_ctx_;
+    int ecb_enc_;
+};
+
+template<size_t key_len, Aead2022Udp udp_mode>
+void Aead2022Cipher<key_len, udp_mode>::ResetState() {
+    peer_ = nullptr;
+    stage_ = kFixedHeader;
+    request_sent_ = false;
+    request_received_ = false;
+    pending_length_ = 0;
+    udp_session_ready_ = false;
+    udp_request_sent_ = false;
+    udp_request_received_ = false;
+    packet_id_ = 0;
+    for (auto &remote : remote_) {
+        remote.valid = false;
+        remote.window_top = 0;
+        remote.window_bits = 0;
+        sodium_memzero(remote.key.data(), remote.key.size());
+    }
+    sodium_memzero(header_.data(), header_.size());
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+bool Aead2022Cipher<key_len, udp_mode>::DeriveSubkey(const uint8_t *salt, size_t salt_len) {
+    uint8_t material[key_len * 2];
+    std::copy(Base::master_key_.begin(), Base::master_key_.end(), material);
+    std::copy_n(salt, salt_len, material + key_len);
+    Blake3DeriveKey("shadowsocks 2022 session subkey",
+                    material, key_len + salt_len,
+                    Base::key_.data(), Base::key_.size());
+    sodium_memzero(material, sizeof material);
+    return true;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+size_t Aead2022Cipher<key_len, udp_mode>::PendingDecryptBytes() const {
+    size_t need;
+    switch (stage_) {
+    case kFixedHeader:
+        need = Base::salt_.size() + FixedHeaderSize(ExpectResponse()) + Base::kTagLength;
+        break;
+    case kVariableHeader:
+        need = pending_length_ + Base::kTagLength;
+        break;
+    default:
+        return 0;
+    }
+    return need > Base::chunk_.size() ? need - Base::chunk_.size() : 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::SealNext(uint8_t *out, const uint8_t *in, size_t len) {
+    size_t clen;
+    int ret = this->CipherEncrypt(out, &clen, in, len, nullptr, 0);
+    sodium_increment(Base::nonce_.data(), Base::nonce_.size());
+    return ret;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::OpenNext(uint8_t *out, const uint8_t *in, size_t len) {
+    size_t mlen;
+    int ret = this->CipherDecrypt(out, &mlen, in, len, nullptr, 0);
+    sodium_increment(Base::nonce_.data(), Base::nonce_.size());
+    return ret;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+ssize_t Aead2022Cipher<key_len, udp_mode>::Encrypt(Buffer &buf) {
+    auto &chunk = Base::chunk_;
+    chunk.reserve(buf.Size());
+    std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk));
+    buf.Reset();
+
+    size_t consumed = 0;
+    if (!Base::initialized_) {
+        RandomBytes(Base::salt_.data(), Base::salt_.size());
+        Base::RecordSalt();
+        DeriveSessionKey();
+        buf.AppendData(Base::salt_);
+
+        bool response = peer_ && peer_->request_received_;
+        int ret = response ? SealResponseHeader(buf, &consumed)
+                           : SealRequestHeader(buf, &consumed);
+        if (ret) {
+            chunk.clear();
+            return -1;
+        }
+        Base::initialized_ = true;
+    }
+
+    int ret = Base::EncryptChunks(chunk.data() + consumed, chunk.size() - consumed,
+                                  kMaxPayload, buf);
+    chunk.clear();
+    if (ret) {
+        return -1;
+    }
+
+    return buf.Size();
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::SealRequestHeader(Buffer &buf, size_t *consumed) {
+    const auto &chunk = Base::chunk_;
+    const size_t tag_len = Base::kTagLength;
+
+    size_t address_length = AddressLength(chunk.data(), chunk.size());
+    if (!address_length) {
+        LOG(WARNING) << "invalid target address in request";
+        return -1;
+    }
+    size_t payload_length = chunk.size() - address_length;
+    size_t padding_length = payload_length ? 0 : RandomUniform(kMaxPadding) + 1;
+    payload_length = std::min(payload_length, kMaxPayload - address_length - 2);
+    size_t variable_length = address_length + 2 + padding_length + payload_length;
+
+    uint8_t fixed[1 + 8 + 2];
+    boost::endian::big_uint16_buf_t length_buf(variable_length);
+    fixed[0] = kClientStream;
+    PutTimestamp(fixed + 1);
+    memcpy(fixed + 9, &length_buf, 2);
+
+    boost::endian::big_uint16_buf_t padding_buf(padding_length);
+    header_.resize(variable_length);
+    uint8_t *p = header_.data();
+    p = std::copy_n(chunk.data(), address_length, p);
+    p = std::copy_n((const uint8_t *)&padding_buf, 2, p);
+    RandomBytes(p, padding_length);
+    p += padding_length;
+    std::copy_n(chunk.data() + address_length, payload_length, p);
+
+    buf.PrepareCapacity(sizeof fixed + variable_length + tag_len * 2);
+    if (SealNext(buf.End(), fixed, sizeof fixed)) {
+        return -1;
+    }
+    buf.Append(sizeof fixed + tag_len);
+    int ret = SealNext(buf.End(), header_.data(), variable_length);
+    sodium_memzero(header_.data(), header_.size());
+    if (ret) {
+        return -1;
+    }
+    buf.Append(variable_length + tag_len);
+
+    request_sent_ = true;
+    *consumed = address_length + payload_length;
+    return 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::SealResponseHeader(Buffer &buf, size_t *consumed) {
+    const auto &chunk = Base::chunk_;
+    const size_t tag_len = Base::kTagLength;
+    size_t payload_length = std::min(chunk.size(), static_cast<size_t>(kMaxPayload));
+
+    uint8_t fixed[1 + 8 + key_len + 2];
+    boost::endian::big_uint16_buf_t length_buf(payload_length);
+    fixed[0] = kServerStream;
+    PutTimestamp(fixed + 1);
+    std::copy(peer_->salt_.begin(), peer_->salt_.end(), fixed + 9);
+    memcpy(fixed + 9 + key_len, &length_buf, 2);
+
+    buf.PrepareCapacity(sizeof fixed + payload_length + tag_len * 2);
+    if (SealNext(buf.End(), fixed, sizeof fixed)) {
+        return -1;
+    }
+    buf.Append(sizeof fixed + tag_len);
+    if (SealNext(buf.End(), chunk.data(), payload_length)) {
+        return -1;
+    }
+    buf.Append(payload_length + tag_len);
+
+    *consumed = payload_length;
+    return 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+ssize_t Aead2022Cipher<key_len, udp_mode>::Decrypt(Buffer &buf) {
+    auto &chunk = Base::chunk_;
+    const size_t tag_len = Base::kTagLength;
+    chunk.reserve(buf.Size());
+    std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk));
+    buf.Reset();
+
+    size_t processed_length = 0;
+    if (stage_ == kFixedHeader) {
+        bool response = ExpectResponse();
+        size_t salt_len = Base::salt_.size();
+        if (chunk.size() < salt_len + FixedHeaderSize(response) + tag_len) { // need more
+            return 0;
+        }
+        std::copy_n(chunk.begin(), salt_len, Base::salt_.begin());
+        if (!Base::CheckSalt()) {
+            return -1;
+        }
+        DeriveSessionKey();
+        if (OpenFixedHeader(chunk.data() + salt_len, response) || !Base::AcceptSalt()) {
+            return -1;
+        }
+        processed_length = salt_len + FixedHeaderSize(response) + tag_len;
+        Base::initialized_ = true;
+        stage_ = kVariableHeader;
+    }
+
+    if (stage_ == kVariableHeader) {
+        if (chunk.size() - processed_length < pending_length_ + tag_len) {
+            chunk.erase(chunk.begin(), chunk.begin() + processed_length);
+            return 0;
+        }
+        if (OpenVariableHeader(chunk.data() + processed_length, buf)) {
+            return -1;
+        }
+        processed_length += pending_length_ + tag_len;
+        stage_ = kStream;
+    }
+
+    if (Base::DecryptChunks(&processed_length, buf)) {
+        return -1;
+    }
+    chunk.erase(chunk.begin(), chunk.begin() + processed_length);
+
+    return buf.Size();
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::OpenFixedHeader(const uint8_t *in, bool response) {
+    uint8_t fixed[1 + 8 + key_len + 2];
+    size_t fixed_length = FixedHeaderSize(response);
+
+    if (OpenNext(fixed, in, fixed_length + Base::kTagLength)) {
+        LOG(WARNING) << "unable to open 2022 fixed header";
+        return -1;
+    }
+    if (fixed[0] != (response ? kServerStream : kClientStream)) {
+        LOG(WARNING) << "unexpected 2022 stream type: " << (int)fixed[0];
+        return -1;
+    }
+    if (!CheckTimestamp(fixed + 1)) {
+        return -1;
+    }
+    if (response && sodium_memcmp(fixed + 9, peer_->salt_.data(), key_len) != 0) {
+        LOG(WARNING) << "2022 response does not match the request salt";
+        return -1;
+    }
+    boost::endian::big_uint16_buf_t length_buf;
+    memcpy(&length_buf, fixed + fixed_length - 2, 2);
+    pending_length_ = length_buf.value();
+    if (!response && pending_length_ == 0) {
+        LOG(WARNING) << "empty 2022 request header";
+        return -1;
+    }
+    return 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+int Aead2022Cipher<key_len, udp_mode>::OpenVariableHeader(const uint8_t *in, Buffer &buf) {
+    buf.PrepareCapacity(pending_length_);
+    uint8_t *out = buf.End();
+    if (OpenNext(out, in, pending_length_ + Base::kTagLength)) {
+        LOG(WARNING) << "unable to open 2022 header chunk";
+        return -1;
+    }
+    if (ExpectResponse()) {
+        buf.Append(pending_length_);
+        return 0;
+    }
+
+    // address, padding length, padding, initial payload
+    size_t address_length = AddressLength(out, pending_length_);
+    if (!address_length || address_length + 2 > pending_length_) {
+        LOG(WARNING) << "invalid 2022 request header";
+        return -1;
+    }
+    boost::endian::big_uint16_buf_t padding_buf;
+    memcpy(&padding_buf, out + address_length, 2);
+    size_t padding_length = padding_buf.value();
+    if (address_length + 2 + padding_length > pending_length_) {
+        LOG(WARNING) << "invalid 2022 request padding: " << padding_length;
+        return -1;
+    }
+    size_t payload_offset = address_length + 2 + padding_length;
+    size_t payload_length = pending_length_ - payload_offset;
+    if (!payload_length && !padding_length) {
+        LOG(WARNING) << "2022 request without payload or padding";
+        return -1;
+    }
+    memmove(out + address_length, out + payload_offset, payload_length);
+    buf.Append(address_length + payload_length);
+    request_received_ = true;
+    return 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+ssize_t Aead2022Cipher<key_len, udp_mode>::EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) {
+    bool response = peer_ && peer_->udp_request_received_;
+
+    if (!udp_session_ready_) {
+        RandomBytes(session_id_.data(), session_id_.size());
+        packet_id_ = 0;
+        if (udp_mode == Aead2022Udp::kSeparateHeader) {
+            DeriveSubkey(session_id_.data(), session_id_.size());
+        }
+        udp_session_ready_ = true;
+    }
+
+    // session id, packet id, type, timestamp, [client session id],
+    // padding length, written backwards in front of address and payload
+    size_t body_header_length = 1 + 8 + (response ? kSessionIdSize : 0) + 2;
+    uint8_t *inner = plaintext - body_header_length - kSessionIdSize - 8;
+    uint8_t *p = inner;
+    boost::endian::big_uint64_buf_t packet_id_buf(packet_id_++);
+    p = std::copy(session_id_.begin(), session_id_.end(), p);
+    p = std::copy_n((const uint8_t *)&packet_id_buf, 8, p);
+    *p++ = response ? kServerStream : kClientStream;
+    PutTimestamp(p);
+    p += 8;
+    if (response) {
+        p = std::copy(peer_->remote_[0].id.begin(), peer_->remote_[0].id.end(), p);
+    }
+    *p++ = 0;
+    *p++ = 0;
+    size_t inner_length = plaintext + len - inner;
+
+    ssize_t packet_length;
+    if (udp_mode == Aead2022Udp::kSeparateHeader) {
+        size_t clen;
+        uint8_t *body = inner + kSeparateHeaderSize;
+        std::copy_n(inner + 4, Base::nonce_.size(), Base::nonce_.begin());
+        if (this->CipherEncrypt(body, &clen, body, inner_length - kSeparateHeaderSize,
+                                nullptr, 0)
+            || !CryptSeparateHeader(inner, true)) {
+            LOG(WARNING) << "unable to seal 2022 udp packet";
+            return -1;
+        }
+        *packet = inner;
+        packet_length = kSeparateHeaderSize + clen;
+    } else {
+        unsigned long long clenll;
+        uint8_t *nonce = inner - kXChaChaNonceSize;
+        RandomBytes(nonce, kXChaChaNonceSize);
+        if (crypto_aead_xchacha20poly1305_ietf_encrypt(
+                    inner, &clenll, inner, inner_length, nullptr, 0,
+                    nullptr, nonce, Base::master_key_.data())) {
+            LOG(WARNING) << "unable to seal 2022 udp packet";
+            return -1;
+        }
+        *packet = nonce;
+        packet_length = kXChaChaNonceSize + clenll;
+    }
+    if (!response) {
+        udp_request_sent_ = true;
+    }
+
+    return packet_length;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+ssize_t Aead2022Cipher<key_len, udp_mode>::DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) {
+    const size_t tag_len = Base::kTagLength;
+    bool response = ExpectUdpResponse();
+    size_t body_header_length = 1 + 8 + (response ? kSessionIdSize : 0) + 2;
+
+    // plaintext starts with session id and packet id in both modes
+    uint8_t *inner;
+    size_t inner_length;
+    if (udp_mode == Aead2022Udp::kSeparateHeader) {
+        if (len < kSeparateHeaderSize + body_header_length + tag_len) {
+            LOG(ERROR) << "invalid packet length: " << len;
+            return -1;
+        }
+        inner = packet;
+        if (!CryptSeparateHeader(inner, false)) {
+            return -1;
+        }
+        auto known = FindRemoteSession(inner);
+        if (!known) {
+            DeriveSubkey(inner, kSessionIdSize);
+        } else {
+            std::copy(known->key.begin(), known->key.end(), Base::key_.begin());
+        }
+        std::copy_n(inner + 4, Base::nonce_.size(), Base::nonce_.begin());
+        size_t mlen;
+        uint8_t *body = inner + kSeparateHeaderSize;
+        if (this->CipherDecrypt(body, &mlen, body, len - kSeparateHeaderSize,
+                                nullptr, 0)) {
+            LOG(WARNING) << "unable to open 2022 udp packet";
+            return -1;
+        }
+        inner_length = kSeparateHeaderSize + mlen;
+    } else {
+        if (len < kXChaChaNonceSize + kSessionIdSize + 8 + body_header_length + tag_len) {
+            LOG(ERROR) << "invalid packet length: " << len;
+            return -1;
+        }
+        unsigned long long mlenll;
+        inner = packet + kXChaChaNonceSize;
+        if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+                    inner, &mlenll, nullptr,
+                    inner, len - kXChaChaNonceSize,
+                    nullptr, 0, packet, Base::master_key_.data())) {
+            LOG(WARNING) << "unable to open 2022 udp packet";
+            return -1;
+        }
+        inner_length = mlenll;
+    }
+
+    uint8_t *p = inner;
+    uint8_t *end = inner + inner_length;
+    SessionId session_id;
+    boost::endian::big_uint64_buf_t packet_id_buf;
+    std::copy_n(p, kSessionIdSize, session_id.begin());
+    memcpy(&packet_id_buf, p + kSessionIdSize, 8);
+    p += kSessionIdSize + 8;
+
+    if (*p != (response ? kServerStream : kClientStream)) {
+        LOG(WARNING) << "unexpected 2022 packet type: " << (int)*p;
+        return -1;
+    }
+    if (!CheckTimestamp(p + 1)) {
+        return -1;
+    }
+    p += 9;
+    if (response) {
+        if (!std::equal(peer_->session_id_.begin(), peer_->session_id_.end(), p)) {
+            LOG(WARNING) << "2022 packet for another client session";
+            return -1;
+        }
+        p += kSessionIdSize;
+    }
+    boost::endian::big_uint16_buf_t padding_buf;
+    memcpy(&padding_buf, p, 2);
+    p += 2;
+    if (padding_buf.value() > (size_t)(end - p)) {
+        LOG(WARNING) << "invalid 2022 packet padding: " << padding_buf.value();
+        return -1;
+    }
+    p += padding_buf.value();
+
+    auto remote = FindRemoteSession(session_id.data());
+    if (!remote) {
+        remote_[1] = remote_[0];
+        remote = &remote_[0];
+        remote->valid = true;
+        remote->id = session_id;
+        remote->window_top = 0;
+        remote->window_bits = 0;
+        if (udp_mode == Aead2022Udp::kSeparateHeader) {
+            std::copy(Base::key_.begin(), Base::key_.end(), remote->key.begin());
+        }
+    }
+    if (!CheckPacketId(*remote, packet_id_buf.value())) {
+        LOG(WARNING) << "replayed 2022 packet: " << packet_id_buf.value();
+        return -1;
+    }
+    if (!response) {
+        udp_request_received_ = true;
+    }
+
+    *plaintext = p;
+    return end - p;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+bool Aead2022Cipher<key_len, udp_mode>::CryptSeparateHeader(uint8_t *block, bool enc) {
+    int out_len;
+    if (!ecb_ctx_) {
+        ecb_ctx_ = EVP_CIPHER_CTX_new();
+    }
+    if (ecb_enc_ != (int)enc) {
+        const EVP_CIPHER *cipher = key_len == 16 ? EVP_aes_128_ecb() : EVP_aes_256_ecb();
+        if (EVP_CipherInit_ex(ecb_ctx_, cipher, nullptr, Base::master_key_.data(), nullptr, enc) <= 0) {
+            return false;
+        }
+        EVP_CIPHER_CTX_set_padding(ecb_ctx_, 0);
+        ecb_enc_ = enc;
+    }
+    return EVP_CipherUpdate(ecb_ctx_, block, &out_len, block, kSeparateHeaderSize) > 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+auto Aead2022Cipher<key_len, udp_mode>::FindRemoteSession(const uint8_t *id) -> RemoteSession * {
+    for (auto &remote : remote_) {
+        if (remote.valid && std::equal(remote.id.begin(), remote.id.end(), id)) {
+            return &remote;
+        }
+    }
+    return nullptr;
+}
+
+// sliding window over the last 64 packet ids of a remote session
+template<size_t key_len, Aead2022Udp udp_mode>
+bool Aead2022Cipher<key_len, udp_mode>::CheckPacketId(RemoteSession &remote, uint64_t packet_id) {
+    if (packet_id > remote.window_top) {
+        uint64_t shift = packet_id - remote.window_top;
+        remote.window_bits = shift >= 64 ? 0 : remote.window_bits << shift;
+        remote.window_bits |= 1;
+        remote.window_top = packet_id;
+        return true;
+    }
+    uint64_t diff = remote.window_top - packet_id;
+    if (diff >= 64 || (remote.window_bits & (1ULL << diff))) {
+        return false;
+    }
+    remote.window_bits |= 1ULL << diff;
+    return true;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+size_t Aead2022Cipher<key_len, udp_mode>::AddressLength(const uint8_t *p, size_t len) {
+    size_t result;
+    if (len < 1) {
+        return 0;
+    }
+    switch (p[0]) {
+    case socks5::IPV4_ATYPE:
+        result = 1 + 4 + 2;
+        break;
+    case socks5::DOMAIN_ATYPE:
+        if (len < 2) {
+            return 0;
+        }
+        result = 1 + 1 + p[1] + 2;
+        break;
+    case socks5::IPV6_ATYPE:
+        result = 1 + 16 + 2;
+        break;
+    default:
+        return 0;
+    }
+    return result <= len ? result : 0;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+bool Aead2022Cipher<key_len, udp_mode>::CheckTimestamp(const uint8_t *p) {
+    boost::endian::big_uint64_buf_t ts;
+    memcpy(&ts, p, 8);
+    int64_t diff = (int64_t)ts.value() - (int64_t)Aead2022Clock::Now();
+    if (diff > kMaxTimeDiff || diff < -kMaxTimeDiff) {
+        LOG(WARNING) << "2022 timestamp out of range, diff: " << diff << "s";
+        return false;
+    }
+    return true;
+}
+
+template<size_t key_len, Aead2022Udp udp_mode>
+void Aead2022Cipher<key_len, udp_mode>::PutTimestamp(uint8_t *p) {
+    boost::endian::big_uint64_buf_t ts((uint64_t)Aead2022Clock::Now());
+    memcpy(p, &ts, 8);
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __BLAKE3_H__
+#define __BLAKE3_H__
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+// Portable BLAKE3, hash and derive_key modes, following the reference
+// implementation.
+class Blake3 {
+public:
+    Blake3();
+
+    static Blake3 DeriveKey(const char *context);
+
+    void Update(const uint8_t *in, size_t len);
+    void Finalize(uint8_t *out, size_t len) const;
+
+private:
+    using Words = std::array<uint32_t, 8>;
+
+    struct Output {
+        Words input_cv;
+        std::array<uint32_t, 16> block_words;
+        uint64_t counter;
+        uint32_t block_len;
+        uint32_t flags;
+
+        Words ChainingValue() const;
+        void RootBytes(uint8_t *out, size_t len) const;
+    };
+
+    struct ChunkState {
+        Words cv;
+        uint64_t chunk_counter;
+        std::array<uint8_t, 64> block;
+        uint32_t block_len;
+        uint32_t blocks_compressed;
+        uint32_t flags;
+
+        void Init(const Words &key, uint64_t counter, uint32_t chunk_flags);
+        size_t Length() const { return blocks_compressed * 64 + block_len; }
+        uint32_t StartFlag() const;
+        void Update(const uint8_t *in, size_t len);
+        Output GetOutput() const;
+    };
+
+    Blake3(const Words &key, uint32_t flags);
+
+    static Output ParentOutput(const Words &left, const Words &right,
+                               const Words &key, uint32_t flags);
+    void AddChunkChainingValue(Words cv, uint64_t total_chunks);
+
+    Words key_;
+    ChunkState chunk_;
+    std::array<Words, 54> cv_stack_;
+    size_t cv_stack_len_;
+    uint32_t flags_;
+};
+
+void Blake3DeriveKey(const char *context,
+                     const uint8_t *material, size_t material_len,
+                     uint8_t *out, size_t out_len);
+
+#endif
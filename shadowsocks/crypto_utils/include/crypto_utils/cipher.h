@@ -1,6 +1,8 @@
 #ifndef __CIPHER_H__
 #define __CIPHER_H__
 
+#include <vector>
+#include <thread>
 #include <utility>
 #include <memory>
 #include <type_traits>
@@ -18,8 +20,28 @@ public:
     virtual ssize_t Decrypt(Buffer &buf) = 0; 
     virtual ssize_t Encrypt(Buffer &buf) = 0;
 
-    virtual ssize_t DecryptOnce(Buffer &buf) = 0;
-    virtual ssize_t EncryptOnce(Buffer &buf) = 0;
+    virtual ssize_t DecryptOnce(Buffer &buf);
+    virtual ssize_t EncryptOnce(Buffer &buf);
+
+    // Datagrams are processed in place. DecryptPacket leaves the plaintext
+    // inside the packet and points `plaintext' at it; EncryptPacket expects
+    // PacketHeadroom() free bytes before and PacketTailroom() after the
+    // plaintext, and points `packet' at the start of the result.
+    virtual ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) = 0;
+    virtual ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) = 0;
+    virtual size_t PacketHeadroom() const = 0;
+    virtual size_t PacketTailroom() const = 0;
+
+    // drop all session state so the object can serve another session
+    virtual void Reset() = 0;
+
+    // the cipher working the other direction of the same session
+    virtual void BindPeer(Cipher *peer) { }
+
+    // bytes Decrypt still needs before it can make progress, 0 if unknown
+    virtual size_t PendingDecryptBytes() const { return 0; }
+
+    const std::vector<uint8_t> &MasterKey() const { return master_key_; }
 
     static void DeriveKeyFromPassword(std::string password, std::vector<uint8_t> &key);
 
@@ -42,27 +64,116 @@ public:
 
     virtual ssize_t DecryptOnce(Buffer &buf) = 0;
     virtual ssize_t EncryptOnce(Buffer &buf) = 0;
+
+    virtual ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) = 0;
+    virtual ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) = 0;
+    virtual size_t PacketHeadroom() = 0;
+    virtual size_t PacketTailroom() = 0;
+
+    virtual size_t PendingDecryptBytes() const { return 0; }
+};
+
+// Per-thread free list of ciphers, so sessions reuse objects and their
+// cipher contexts instead of allocating and setting them up again. A
+// cipher only goes back to the list of the thread it was taken on, one
+// released elsewhere (e.g. first used on a crypto worker) is freed.
+template<typename CipherType>
+class CipherPool {
+public:
+    struct Recycler {
+        std::thread::id owner;
+
+        void operator()(Cipher *cipher) const {
+            auto &free_list = FreeList();
+            if (owner != std::this_thread::get_id() || free_list.size() >= kMaxFreeCiphers) {
+                delete cipher;
+                return;
+            }
+            cipher->Reset();
+            free_list.emplace_back(cipher);
+        }
+    };
+
+    using Pointer = std::unique_ptr<Cipher, Recycler>;
+
+    static Pointer Acquire(const std::vector<uint8_t> &master_key) {
+        auto &free_list = FreeList();
+        while (!free_list.empty()) {
+            std::unique_ptr<Cipher> cipher = std::move(free_list.back());
+            free_list.pop_back();
+            if (cipher->MasterKey() == master_key) {
+                return Pointer(cipher.release(), Recycler{ std::this_thread::get_id() });
+            }
+        }
+        return Pointer(new CipherType(master_key), Recycler{ std::this_thread::get_id() });
+    }
+
+private:
+    static std::vector<std::unique_ptr<Cipher>> &FreeList() {
+        thread_local std::vector<std::unique_ptr<Cipher>> free_list;
+        return free_list;
+    }
+
+    static const size_t kMaxFreeCiphers = 64;
 };
 
 template<typename CipherType>
 class __HelperCryptoContext : public CryptoContext {
     static_assert(std::is_base_of<Cipher, CipherType>::value, "The cipher type must inherit from Cipher");
+    using Pool = CipherPool<CipherType>;
 public:
-    template<typename ...Args>
-        __HelperCryptoContext(Args&& ...args)
-            : decryptor_(new CipherType(std::forward<Args>(args)...)),
-              encryptor_(new CipherType(std::forward<Args>(args)...)) {
-        }
+    __HelperCryptoContext(std::shared_ptr<const std::vector<uint8_t>> master_key)
+        : master_key_(std::move(master_key)) {
+    }
+
+    ssize_t Decrypt(Buffer &buf) { return GetDecryptor()->Decrypt(buf); }
+    ssize_t Encrypt(Buffer &buf) { return GetEncryptor()->Encrypt(buf); }
+
+    ssize_t DecryptOnce(Buffer &buf) { return GetDecryptor()->DecryptOnce(buf); }
+    ssize_t EncryptOnce(Buffer &buf) { return GetEncryptor()->EncryptOnce(buf); }
+
+    ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) {
+        return GetDecryptor()->DecryptPacket(packet, len, plaintext);
+    }
 
-    ssize_t Decrypt(Buffer &buf) { return decryptor_->Decrypt(buf); }
-    ssize_t Encrypt(Buffer &buf) { return encryptor_->Encrypt(buf); }
+    ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) {
+        return GetEncryptor()->EncryptPacket(plaintext, len, packet);
+    }
 
-    ssize_t DecryptOnce(Buffer &buf) { return decryptor_->DecryptOnce(buf); }
-    ssize_t EncryptOnce(Buffer &buf) { return encryptor_->EncryptOnce(buf); }
+    size_t PacketHeadroom() { return GetEncryptor()->PacketHeadroom(); }
+    size_t PacketTailroom() { return GetEncryptor()->PacketTailroom(); }
+
+    size_t PendingDecryptBytes() const {
+        return decryptor_ ? decryptor_->PendingDecryptBytes() : 0;
+    }
 
 private:
-    std::unique_ptr<Cipher> decryptor_;
-    std::unique_ptr<Cipher> encryptor_;
+    Cipher *GetDecryptor() {
+        if (!decryptor_) {
+            decryptor_ = Pool::Acquire(*master_key_);
+            BindPeers();
+        }
+        return decryptor_.get();
+    }
+
+    Cipher *GetEncryptor() {
+        if (!encryptor_) {
+            encryptor_ = Pool::Acquire(*master_key_);
+            BindPeers();
+        }
+        return encryptor_.get();
+    }
+
+    void BindPeers() {
+        if (decryptor_ && encryptor_) {
+            decryptor_->BindPeer(encryptor_.get());
+            encryptor_->BindPeer(decryptor_.get());
+        }
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> master_key_;
+    typename Pool::Pointer decryptor_;
+    typename Pool::Pointer encryptor_;
 };
 
 template<typename CipherType, typename ...Args>
@@ -73,9 +184,11 @@ std::unique_ptr<CryptoContext> GetCryptoContext(Args&& ...args) {
 template<typename CipherType>
 decltype(auto) MakeCryptoContextGenerator(std::string password) {
     static_assert(std::is_base_of<Cipher, CipherType>::value, "The cipher type must inherit from Cipher");
-    std::vector<uint8_t> master_key;
-    CipherType::DeriveKeyFromPassword(std::move(password), master_key);
-    return [master_key]() { return GetCryptoContext<CipherType>(master_key); };
+    auto master_key = std::make_shared<std::vector<uint8_t>>();
+    CipherType::DeriveKeyFromPassword(std::move(password), *master_key);
+    return [master_key = std::shared_ptr<const std::vector<uint8_t>>(master_key)]() {
+        return GetCryptoContext<CipherType>(master_key);
+    };
 }
 
 #endif
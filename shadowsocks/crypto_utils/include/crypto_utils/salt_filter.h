@@ -0,0 +1,76 @@
+#ifndef __SALT_FILTER_H__
+#define __SALT_FILTER_H__
+
+#include <mutex>
+#include <array>
+#include <algorithm>
+#include <vector>
+
+#include <sodium.h>
+
+// Remembers recently seen salts in two rotating Bloom filters of fixed
+// size. The active filter takes new salts until it holds `capacity'
+// entries, then the older one is cleared and becomes the active one, so
+// a salt is remembered for at least `capacity' insertions.
+// Salts are spread over independent shards by their keyed hash, each
+// shard rotates on its own under its own lock, so threads checking
+// different salts rarely meet on a lock.
+class SaltFilter {
+public:
+    static SaltFilter &Instance();
+
+    // capacity 0 disables the filter, not thread safe
+    void Configure(size_t capacity, double fp_rate);
+
+    bool Enabled() const { return enabled_; }
+
+    // true if the salt may have been seen before, records nothing
+    bool Contains(const uint8_t *salt, size_t len);
+    // returns false if the salt has been seen before, records it otherwise
+    bool CheckAndAdd(const uint8_t *salt, size_t len);
+    void Add(const uint8_t *salt, size_t len);
+
+private:
+    static const size_t kShards = 16;
+    static const size_t kBlockedOverhead = 4;
+
+    class BloomFilter {
+    public:
+        void Resize(size_t bits) {
+            nblocks_ = std::max<size_t>(1, (bits + 511) / 512);
+            bits_.assign(nblocks_ * 8, 0);
+        }
+        void Clear() { std::fill(bits_.begin(), bits_.end(), 0); }
+        bool Test(uint64_t hash, size_t nhashes) const;
+        void Set(uint64_t hash, size_t nhashes);
+
+    private:
+        std::vector<uint64_t> bits_;
+        size_t nblocks_ = 0;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        size_t count = 0;
+        size_t current = 0;
+        std::array<BloomFilter, 2> filters;
+
+        bool Test(uint64_t hash, size_t nhashes) const {
+            return filters[0].Test(hash, nhashes) || filters[1].Test(hash, nhashes);
+        }
+        void Add(uint64_t hash, size_t nhashes, size_t capacity);
+    };
+
+    SaltFilter();
+
+    uint64_t Hash(const uint8_t *salt, size_t len) const;
+    Shard &ShardOf(uint64_t hash) { return shards_[hash % kShards]; }
+
+    bool enabled_;
+    size_t capacity_;
+    size_t nhashes_;
+    std::array<Shard, kShards> shards_;
+    std::array<uint8_t, crypto_shorthash_KEYBYTES> key_;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <sodium.h>
 #include <common_utils/buffer.h>
+#include <common_utils/random.h>
 
 #include "crypto_utils/cipher.h"
 
@@ -18,8 +19,16 @@ public:
     ssize_t Encrypt(Buffer &buf);
     ssize_t Decrypt(Buffer &buf);
 
-    ssize_t EncryptOnce(Buffer &buf);
-    ssize_t DecryptOnce(Buffer &buf);
+    ssize_t EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet);
+    ssize_t DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext);
+
+    size_t PacketHeadroom() const { return iv_len; }
+    size_t PacketTailroom() const { return 0; }
+
+    void Reset() {
+        initialized_ = false;
+        chunk_.clear();
+    }
 
     static void DeriveKeyFromPassword(std::string password, std::vector<uint8_t> &key) {
         key.resize(key_len);
@@ -44,7 +53,7 @@ ssize_t StreamCipher<key_len, iv_len>::Encrypt(Buffer &buf) {
     buf.Reset();
 
     if (!initialized_) {
-        randombytes_buf(iv_.data(), iv_.size());
+        RandomBytes(iv_.data(), iv_.size());
         buf.AppendData(iv_);
         if (InitializeCipher(true) < 0) {
             LOG(WARNING) << "Stream cipher initialize error";
@@ -99,65 +108,47 @@ ssize_t StreamCipher<key_len, iv_len>::Decrypt(Buffer &buf) {
 }
 
 template<size_t key_len, size_t iv_len>
-ssize_t StreamCipher<key_len, iv_len>::EncryptOnce(Buffer &buf) {
-    chunk_.clear();
-    if (initialized_) {
-        LOG(FATAL) << "unexpected call for EncryptOnce";
-        return -1;
-    }
-
-    chunk_.reserve(buf.Size());
-    std::copy(buf.Begin(), buf.End(), std::back_inserter(chunk_));
-    buf.Reset();
-
-    randombytes_buf(iv_.data(), iv_.size());
-    buf.AppendData(iv_);
+ssize_t StreamCipher<key_len, iv_len>::EncryptPacket(uint8_t *plaintext, size_t len, uint8_t **packet) {
+    RandomBytes(iv_.data(), iv_.size());
     if (InitializeCipher(true) < 0) {
         LOG(WARNING) << "Stream cipher initialize error";
         return -1;
     }
 
-    buf.PrepareCapacity(chunk_.size());
     size_t clen;
-    int ret = CipherUpdate(buf.End(), &clen, chunk_.data(), chunk_.size());
+    int ret = CipherUpdate(plaintext, &clen, plaintext, len);
     if (ret) {
         LOG(WARNING) << "Stream cipher encrypt failed: " << ret;
         return ret;
     }
-    buf.Append(clen);
-    return buf.Size();
+
+    *packet = plaintext - iv_.size();
+    std::copy(iv_.begin(), iv_.end(), *packet);
+    return iv_.size() + clen;
 }
 
 template<size_t key_len, size_t iv_len>
-ssize_t StreamCipher<key_len, iv_len>::DecryptOnce(Buffer &buf) {
-    chunk_.clear();
-    if (initialized_) {
-        LOG(FATAL) << "unexpected call for DecryptOnce";
+ssize_t StreamCipher<key_len, iv_len>::DecryptPacket(uint8_t *packet, size_t len, uint8_t **plaintext) {
+    if (len < iv_.size()) {
+        LOG(ERROR) << "invalid packet length: " << len;
         return -1;
     }
 
-    if (buf.Size() < iv_.size()) {
-        LOG(ERROR) << "invalid buf length: " << buf.Size();
-        return -1;
-    }
-
-    std::copy_n(buf.Begin(), iv_.size(), iv_.begin());
+    std::copy_n(packet, iv_.size(), iv_.begin());
     if (InitializeCipher(false) < 0) {
         LOG(WARNING) << "Stream cipher initialize error";
         return -1;
     }
-    chunk_.reserve(buf.Size() - iv_.size());
-    std::copy(buf.Begin() + iv_.size(), buf.End(), std::back_inserter(chunk_));
-    buf.Reset();
 
+    uint8_t *body = packet + iv_.size();
     size_t mlen;
-    int ret = CipherUpdate(buf.End(), &mlen, chunk_.data(), chunk_.size());
+    int ret = CipherUpdate(body, &mlen, body, len - iv_.size());
     if (ret) {
         LOG(WARNING) << "Stream cipher decrypt failed: " << ret;
         return ret;
     }
-    buf.Append(mlen);
 
+    *plaintext = body;
     return mlen;
 }
 
@@ -4,6 +4,7 @@
 
 #include "crypto_utils/crypto.h"
 #include "crypto_utils/aead.h"
+#include "crypto_utils/aead2022.h"
 
 class Aes256Gcm final : public AeadCipher<32, 12, 16> {
 public:
@@ -13,6 +14,17 @@ public:
 
     ~Aes256Gcm() { }
 
+    bool DeriveSessionKey() {
+        return AeadCipher::DeriveSessionKey()
+            && crypto_aead_aes256gcm_beforenm(&state_, key_.data()) == 0;
+    }
+
+    // the expanded key is session key material as well
+    void Reset() {
+        AeadCipher::Reset();
+        sodium_memzero(&state_, sizeof(state_));
+    }
+
 private:
     int CipherEncrypt(
                 void *c, size_t *clen,
@@ -21,10 +33,10 @@ private:
         ) {
         int ret;
         unsigned long long clenll;
-        ret = crypto_aead_aes256gcm_encrypt(
+        ret = crypto_aead_aes256gcm_encrypt_afternm(
                     (uint8_t *)c, &clenll,
                     m, mlen, ad, adlen,
-                    nullptr, nonce_.data(), key_.data()
+                    nullptr, nonce_.data(), &state_
               );
         *clen = (size_t)clenll;
         return ret;
@@ -37,15 +49,17 @@ private:
         ) {
         int ret;
         unsigned long long mlenll;
-        ret = crypto_aead_aes256gcm_decrypt(
+        ret = crypto_aead_aes256gcm_decrypt_afternm(
                         (uint8_t *)m, &mlenll,
                         nullptr,
                         c, clen, ad, adlen,
-                        nonce_.data(), key_.data()
+                        nonce_.data(), &state_
               );
         *mlen = (size_t)mlenll;
         return ret;
     }
+
+    crypto_aead_aes256gcm_state state_;
 };
 
 using CipherGenerator = const EVP_CIPHER *();
@@ -61,6 +75,13 @@ public:
         EVP_CIPHER_CTX_free(ctx_);
     }
 
+    // cleanup wipes the key schedule of the session
+    void Reset() {
+        Base::Reset();
+        EVP_CIPHER_CTX_cleanup(ctx_);
+        EVP_CIPHER_CTX_init(ctx_);
+    }
+
 private:
     int CipherEncrypt(
                 void *c, size_t *clen,
@@ -109,12 +130,55 @@ private:
            && (adlen == 0 || (EVP_DecryptUpdate(ctx_, nullptr, &plain_len, ad, adlen) > 0))
            && (EVP_DecryptUpdate(ctx_, plaintext, &plain_len, c, clen - tag_len) > 0);
         *mlen = plain_len;
-        ret = ret && (EVP_EncryptFinal_ex(ctx_, plaintext + plain_len, &plain_len) > 0);
+        ret = ret && (EVP_DecryptFinal_ex(ctx_, plaintext + plain_len, &plain_len) > 0);
         *mlen += plain_len;
 
         return !ret;
     }
 
+    int CipherEncryptBatch(const typename Base::ChunkJob *jobs, size_t count) {
+        const size_t tag_len = Base::kTagLength;
+        int out_len;
+
+        // expand the key once, only the nonce changes between chunks
+        if (EVP_EncryptInit_ex(ctx_, kCipher, nullptr, Base::key_.data(), nullptr) <= 0) {
+            return 1;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            const auto &job = jobs[i];
+            int ret = (EVP_EncryptInit_ex(ctx_, nullptr, nullptr, nullptr, job.nonce.data()) > 0)
+                   && (EVP_EncryptUpdate(ctx_, job.out, &out_len, job.in, job.in_len) > 0)
+                   && (EVP_EncryptFinal_ex(ctx_, job.out + out_len, &out_len) > 0)
+                   && (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, tag_len, job.out + job.in_len) > 0);
+            if (!ret) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    int CipherDecryptBatch(const typename Base::ChunkJob *jobs, size_t count) {
+        const size_t tag_len = Base::kTagLength;
+        int out_len;
+
+        if (EVP_DecryptInit_ex(ctx_, kCipher, nullptr, Base::key_.data(), nullptr) <= 0) {
+            return 1;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            const auto &job = jobs[i];
+            size_t plain_len = job.in_len - tag_len;
+            uint8_t *tag = const_cast<uint8_t *>(job.in + plain_len);
+            int ret = (EVP_DecryptInit_ex(ctx_, nullptr, nullptr, nullptr, job.nonce.data()) > 0)
+                   && (EVP_DecryptUpdate(ctx_, job.out, &out_len, job.in, plain_len) > 0)
+                   && (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, tag_len, tag) > 0)
+                   && (EVP_DecryptFinal_ex(ctx_, job.out + out_len, &out_len) > 0);
+            if (!ret) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
     EVP_CIPHER_CTX *ctx_;
     const EVP_CIPHER * kCipher = cg();
 };
@@ -129,3 +193,12 @@ DEFINE_AND_REGISTER(128);
 
 static const CryptoContextGeneratorRegister<Aes256Gcm> kReg256("aes-256-gcm");
 
+#define DEFINE_AND_REGISTER_2022(bitlen) \
+    using Aes ## bitlen ## GcmBlake3 = \
+        AesGcmFamily<EVP_aes_ ## bitlen ## _gcm, (bitlen >> 3), \
+                     Aead2022Cipher<(bitlen >> 3), Aead2022Udp::kSeparateHeader>>; \
+    static const CryptoContextGeneratorRegister<Aes ## bitlen ## GcmBlake3> \
+    kReg2022 ## bitlen ("2022-blake3-aes-" #bitlen "-gcm");
+
+DEFINE_AND_REGISTER_2022(256);
+DEFINE_AND_REGISTER_2022(128);
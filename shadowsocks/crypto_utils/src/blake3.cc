@@ -0,0 +1,221 @@
+
+#include <cstring>
+#include <algorithm>
+
+#include "crypto_utils/blake3.h"
+
+namespace {
+
+const uint32_t kChunkLen = 1024;
+const uint32_t kChunkStart = 1 << 0;
+const uint32_t kChunkEnd = 1 << 1;
+const uint32_t kParent = 1 << 2;
+const uint32_t kRoot = 1 << 3;
+const uint32_t kDeriveKeyContext = 1 << 5;
+const uint32_t kDeriveKeyMaterial = 1 << 6;
+
+const std::array<uint32_t, 8> kIV = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+const size_t kMsgPermutation[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+inline uint32_t Rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline uint32_t Load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+         | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void Store32(uint8_t *p, uint32_t w) {
+    p[0] = w; p[1] = w >> 8; p[2] = w >> 16; p[3] = w >> 24;
+}
+
+inline void G(uint32_t *s, size_t a, size_t b, size_t c, size_t d, uint32_t mx, uint32_t my) {
+    s[a] = s[a] + s[b] + mx;
+    s[d] = Rotr(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = Rotr(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = Rotr(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = Rotr(s[b] ^ s[c], 7);
+}
+
+void Compress(const std::array<uint32_t, 8> &cv, const std::array<uint32_t, 16> &block_words,
+              uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        kIV[0], kIV[1], kIV[2], kIV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    uint32_t m[16], t[16];
+    std::copy(block_words.begin(), block_words.end(), m);
+
+    for (int r = 0; r < 7; ++r) {
+        G(s, 0, 4, 8, 12, m[0], m[1]);
+        G(s, 1, 5, 9, 13, m[2], m[3]);
+        G(s, 2, 6, 10, 14, m[4], m[5]);
+        G(s, 3, 7, 11, 15, m[6], m[7]);
+        G(s, 0, 5, 10, 15, m[8], m[9]);
+        G(s, 1, 6, 11, 12, m[10], m[11]);
+        G(s, 2, 7, 8, 13, m[12], m[13]);
+        G(s, 3, 4, 9, 14, m[14], m[15]);
+        for (size_t i = 0; i < 16; ++i) {
+            t[i] = m[kMsgPermutation[i]];
+        }
+        std::copy(t, t + 16, m);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+std::array<uint32_t, 16> BlockWords(const uint8_t *block) {
+    std::array<uint32_t, 16> words;
+    for (size_t i = 0; i < 16; ++i) {
+        words[i] = Load32(block + i * 4);
+    }
+    return words;
+}
+
+}
+
+Blake3::Words Blake3::Output::ChainingValue() const {
+    uint32_t out[16];
+    Compress(input_cv, block_words, counter, block_len, flags, out);
+    Words cv;
+    std::copy(out, out + 8, cv.begin());
+    return cv;
+}
+
+void Blake3::Output::RootBytes(uint8_t *out, size_t len) const {
+    uint64_t output_block_counter = 0;
+    while (len) {
+        uint32_t words[16];
+        uint8_t block[64];
+        Compress(input_cv, block_words, output_block_counter, block_len, flags | kRoot, words);
+        for (size_t i = 0; i < 16; ++i) {
+            Store32(block + i * 4, words[i]);
+        }
+        size_t n = std::min(len, sizeof block);
+        memcpy(out, block, n);
+        out += n;
+        len -= n;
+        ++output_block_counter;
+    }
+}
+
+void Blake3::ChunkState::Init(const Words &key, uint64_t counter, uint32_t chunk_flags) {
+    cv = key;
+    chunk_counter = counter;
+    block.fill(0);
+    block_len = 0;
+    blocks_compressed = 0;
+    flags = chunk_flags;
+}
+
+uint32_t Blake3::ChunkState::StartFlag() const {
+    return blocks_compressed == 0 ? kChunkStart : 0;
+}
+
+void Blake3::ChunkState::Update(const uint8_t *in, size_t len) {
+    while (len) {
+        if (block_len == block.size()) {
+            uint32_t out[16];
+            Compress(cv, BlockWords(block.data()), chunk_counter,
+                     block.size(), flags | StartFlag(), out);
+            std::copy(out, out + 8, cv.begin());
+            ++blocks_compressed;
+            block.fill(0);
+            block_len = 0;
+        }
+        size_t n = std::min(len, block.size() - block_len);
+        memcpy(block.data() + block_len, in, n);
+        block_len += n;
+        in += n;
+        len -= n;
+    }
+}
+
+Blake3::Output Blake3::ChunkState::GetOutput() const {
+    return Output{ cv, BlockWords(block.data()), chunk_counter, block_len,
+                   flags | StartFlag() | kChunkEnd };
+}
+
+Blake3::Output Blake3::ParentOutput(const Words &left, const Words &right,
+                                    const Words &key, uint32_t flags) {
+    std::array<uint32_t, 16> block_words;
+    std::copy(left.begin(), left.end(), block_words.begin());
+    std::copy(right.begin(), right.end(), block_words.begin() + 8);
+    return Output{ key, block_words, 0, 64, flags | kParent };
+}
+
+Blake3::Blake3() : Blake3(kIV, 0) {
+}
+
+Blake3::Blake3(const Words &key, uint32_t flags)
+    : key_(key), cv_stack_len_(0), flags_(flags) {
+    chunk_.Init(key, 0, flags);
+}
+
+Blake3 Blake3::DeriveKey(const char *context) {
+    Blake3 context_hasher(kIV, kDeriveKeyContext);
+    context_hasher.Update((const uint8_t *)context, strlen(context));
+    uint8_t context_key[32];
+    context_hasher.Finalize(context_key, sizeof context_key);
+
+    Words key;
+    for (size_t i = 0; i < 8; ++i) {
+        key[i] = Load32(context_key + i * 4);
+    }
+    return Blake3(key, kDeriveKeyMaterial);
+}
+
+void Blake3::AddChunkChainingValue(Words cv, uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        cv = ParentOutput(cv_stack_[--cv_stack_len_], cv, key_, flags_).ChainingValue();
+        total_chunks >>= 1;
+    }
+    cv_stack_[cv_stack_len_++] = cv;
+}
+
+void Blake3::Update(const uint8_t *in, size_t len) {
+    while (len) {
+        if (chunk_.Length() == kChunkLen) {
+            Words chunk_cv = chunk_.GetOutput().ChainingValue();
+            uint64_t total_chunks = chunk_.chunk_counter + 1;
+            AddChunkChainingValue(chunk_cv, total_chunks);
+            chunk_.Init(key_, total_chunks, flags_);
+        }
+        size_t n = std::min(len, kChunkLen - chunk_.Length());
+        chunk_.Update(in, n);
+        in += n;
+        len -= n;
+    }
+}
+
+void Blake3::Finalize(uint8_t *out, size_t len) const {
+    Output output = chunk_.GetOutput();
+    size_t parent_nodes_remaining = cv_stack_len_;
+    while (parent_nodes_remaining > 0) {
+        --parent_nodes_remaining;
+        output = ParentOutput(cv_stack_[parent_nodes_remaining],
+                              output.ChainingValue(), key_, flags_);
+    }
+    output.RootBytes(out, len);
+}
+
+void Blake3DeriveKey(const char *context,
+                     const uint8_t *material, size_t material_len,
+                     uint8_t *out, size_t out_len) {
+    Blake3 hasher = Blake3::DeriveKey(context);
+    hasher.Update(material, material_len);
+    hasher.Finalize(out, out_len);
+}
@@ -3,61 +3,54 @@
 
 #include "crypto_utils/crypto.h"
 #include "crypto_utils/aead.h"
+#include "crypto_utils/aead2022.h"
 
-class Chacha20Poly1305Ietf final : public AeadCipher<32, 12, 16> {
+template<class Base = AeadCipher<32, 12, 16>>
+class Chacha20Poly1305IetfFamily final : public Base {
 public:
-    Chacha20Poly1305Ietf(std::vector<uint8_t> master_key)
-        : AeadCipher(std::move(master_key)) {
+    Chacha20Poly1305IetfFamily(std::vector<uint8_t> master_key)
+        : Base(std::move(master_key)) {
     }
 
-    ~Chacha20Poly1305Ietf() { }
+    ~Chacha20Poly1305IetfFamily() { }
 
 private:
     int CipherEncrypt(
                 void *c, size_t *clen,
                 const uint8_t *m, size_t mlen,
                 const uint8_t *ad, size_t adlen
-        );
+        ) {
+        int ret;
+        unsigned long long clenll;
+        ret = crypto_aead_chacha20poly1305_ietf_encrypt(
+                        (uint8_t *)c, &clenll,
+                        m, mlen, ad, adlen,
+                        nullptr, Base::nonce_.data(), Base::key_.data()
+              );
+        *clen = (size_t)clenll;
+        return ret;
+    }
 
     int CipherDecrypt(
                 void *m, size_t *mlen,
                 const uint8_t *c, size_t clen,
                 const uint8_t *ad, size_t adlen
-        );
+        ) {
+        int ret;
+        unsigned long long mlenll;
+        ret = crypto_aead_chacha20poly1305_ietf_decrypt(
+                        (uint8_t *)m, &mlenll,
+                        nullptr,
+                        c, clen, ad, adlen,
+                        Base::nonce_.data(), Base::key_.data()
+              );
+        *mlen = (size_t)mlenll;
+        return ret;
+    }
 };
 
-int Chacha20Poly1305Ietf::CipherEncrypt(
-                void *c, size_t *clen,
-                const uint8_t *m, size_t mlen,
-                const uint8_t *ad, size_t adlen
-    ) {
-    int ret;
-    unsigned long long clenll;
-    ret = crypto_aead_chacha20poly1305_ietf_encrypt(
-                    (uint8_t *)c, &clenll,
-                    m, mlen, ad, adlen,
-                    nullptr, nonce_.data(), key_.data()
-          );
-    *clen = (size_t)clenll;
-    return ret;
-}
-
-int Chacha20Poly1305Ietf::CipherDecrypt(
-                void *m, size_t *mlen,
-                const uint8_t *c, size_t clen,
-                const uint8_t *ad, size_t adlen
-    ) {
-    int ret;
-    unsigned long long mlenll;
-    ret = crypto_aead_chacha20poly1305_ietf_decrypt(
-                    (uint8_t *)m, &mlenll,
-                    nullptr,
-                    c, clen, ad, adlen,
-                    nonce_.data(), key_.data()
-          );
-    *mlen = (size_t)mlenll;
-    return ret;
-}
+using Chacha20Poly1305Ietf = Chacha20Poly1305IetfFamily<>;
+using Chacha20Poly1305Blake3 = Chacha20Poly1305IetfFamily<Aead2022Cipher<32, Aead2022Udp::kXChaCha>>;
 
 static const CryptoContextGeneratorRegister<Chacha20Poly1305Ietf> kReg("chacha20-ietf-poly1305");
-
+static const CryptoContextGeneratorRegister<Chacha20Poly1305Blake3> kReg2022("2022-blake3-chacha20-poly1305");
@@ -20,6 +20,33 @@ bool Cipher::HKDF_SHA1(const uint8_t *key, size_t key_len,
                 session_key, skey_len) != nullptr;
 }
 
+ssize_t Cipher::DecryptOnce(Buffer &buf) {
+    uint8_t *plaintext;
+    ssize_t len = DecryptPacket(buf.Begin(), buf.Size(), &plaintext);
+    if (len < 0) {
+        return len;
+    }
+    std::copy_n(plaintext, len, buf.Begin());
+    buf.Reset(len);
+    return len;
+}
+
+ssize_t Cipher::EncryptOnce(Buffer &buf) {
+    size_t headroom = PacketHeadroom();
+    size_t len = buf.Size();
+    buf.PrepareCapacity(headroom + PacketTailroom());
+    std::copy_backward(buf.Begin(), buf.End(), buf.End() + headroom);
+
+    uint8_t *packet;
+    ssize_t packet_len = EncryptPacket(buf.Begin() + headroom, len, &packet);
+    if (packet_len < 0) {
+        return packet_len;
+    }
+    std::copy_n(packet, packet_len, buf.Begin());
+    buf.Reset(packet_len);
+    return packet_len;
+}
+
 static size_t __BytesToKey(const std::string &password, uint8_t *key, size_t key_len);
 
 void Cipher::DeriveKeyFromPassword(std::string password, std::vector<uint8_t> &key) {
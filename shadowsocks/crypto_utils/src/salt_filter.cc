@@ -0,0 +1,118 @@
+
+#include <cmath>
+#include <algorithm>
+#include <common_utils/common.h>
+
+#include "crypto_utils/salt_filter.h"
+
+// The filters are blocked: all k probes of a salt fall into one 512 bit
+// block picked by the low hash bits, so a lookup touches one cache line
+// instead of k of them. The probes come from the top bits of a sequence
+// seeded with the hash, two salts sharing a block rarely share probes.
+static inline size_t Block(uint64_t hash, size_t nblocks) {
+    return (size_t)((uint32_t)hash >> 4) % nblocks * 8;
+}
+
+static inline uint64_t NextProbe(uint64_t &state) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 55;
+}
+
+bool SaltFilter::BloomFilter::Test(uint64_t hash, size_t nhashes) const {
+    const uint64_t *block = bits_.data() + Block(hash, nblocks_);
+    uint64_t state = hash;
+    for (size_t i = 0; i < nhashes; ++i) {
+        size_t bit = NextProbe(state);
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SaltFilter::BloomFilter::Set(uint64_t hash, size_t nhashes) {
+    uint64_t *block = bits_.data() + Block(hash, nblocks_);
+    uint64_t state = hash;
+    for (size_t i = 0; i < nhashes; ++i) {
+        size_t bit = NextProbe(state);
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+SaltFilter &SaltFilter::Instance() {
+    static SaltFilter self;
+    return self;
+}
+
+SaltFilter::SaltFilter()
+    : enabled_(false), capacity_(0), nhashes_(0) {
+}
+
+void SaltFilter::Configure(size_t capacity, double fp_rate) {
+    enabled_ = false;
+    if (capacity == 0) {
+        return;
+    }
+    fp_rate = std::min(std::max(fp_rate, 1e-12), 0.5);
+
+    // two filters are probed, so each one gets half of the target rate
+    double p = fp_rate / 2;
+    double ln2 = std::log(2.0);
+    capacity_ = (capacity + kShards - 1) / kShards;
+    size_t bits = (size_t)std::ceil(-(double)capacity_ * std::log(p) / (ln2 * ln2));
+    nhashes_ = std::max<size_t>(1, (size_t)std::round((double)bits / capacity_ * ln2));
+    // blocks fill unevenly, the extra bits keep the rate near the target
+    bits += bits / kBlockedOverhead;
+    for (auto &shard : shards_) {
+        shard.count = 0;
+        shard.current = 0;
+        for (auto &filter : shard.filters) {
+            filter.Resize(bits);
+        }
+    }
+    randombytes_buf(key_.data(), key_.size());
+    enabled_ = true;
+    LOG(INFO) << "salt replay filter: capacity " << capacity
+              << ", " << (bits * 2 * kShards + 7) / 8 << " bytes, " << nhashes_ << " hashes";
+}
+
+uint64_t SaltFilter::Hash(const uint8_t *salt, size_t len) const {
+    uint64_t hash;
+    crypto_shorthash((uint8_t *)&hash, salt, len, key_.data());
+    return hash;
+}
+
+bool SaltFilter::Contains(const uint8_t *salt, size_t len) {
+    uint64_t hash = Hash(salt, len);
+    auto &shard = ShardOf(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.Test(hash, nhashes_);
+}
+
+bool SaltFilter::CheckAndAdd(const uint8_t *salt, size_t len) {
+    uint64_t hash = Hash(salt, len);
+    auto &shard = ShardOf(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.Test(hash, nhashes_)) {
+        return false;
+    }
+    shard.Add(hash, nhashes_, capacity_);
+    return true;
+}
+
+void SaltFilter::Add(const uint8_t *salt, size_t len) {
+    uint64_t hash = Hash(salt, len);
+    auto &shard = ShardOf(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.Add(hash, nhashes_, capacity_);
+}
+
+void SaltFilter::Shard::Add(uint64_t hash, size_t nhashes, size_t capacity) {
+    if (count >= capacity) {
+        current ^= 1;
+        filters[current].Clear();
+        count = 0;
+    }
+    filters[current].Set(hash, nhashes);
+    ++count;
+}
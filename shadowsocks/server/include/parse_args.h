@@ -10,8 +10,14 @@
 
 #include "udprelay.h"
 
+struct HandoffArgs {
+    // unix socket the listening sockets are handed over at, empty to disable
+    std::string path;
+    size_t drain_timeout = 30;
+};
+
 void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rargs,
-               int *log_level, Plugin *plugin, UdpServerParam *udp);
+               int *log_level, Plugin *plugin, UdpServerParam *udp, HandoffArgs *handoff);
 
 #endif
 
@@ -1,72 +1,85 @@
 #ifndef __UDPRELAY_H__
 #define __UDPRELAY_H__
 
+#include <deque>
 #include <unordered_map>
 #include <boost/asio.hpp>
-#include <boost/functional/hash.hpp>
 
 #include <cares_service/cares.hxx>
 #include <common_utils/buffer.h>
+#include <common_utils/endpoint_hash.h>
+#include <common_utils/nat_table.h>
+#include <common_utils/packet_buffer.h>
+#include <common_utils/udp_batch.h>
 #include <crypto_utils/cipher.h>
-
-namespace std {
-
-template<> struct hash<boost::asio::ip::udp::endpoint> {
-    typedef boost::asio::ip::udp::endpoint argument_type;
-    typedef size_t result_type;
-
-    result_type operator()(const argument_type &arg) const noexcept {
-        return \
-            boost::hash_range(
-                (const uint8_t *)arg.data(),
-                (const uint8_t *)arg.data() + arg.size()
-            );
-    }
-};
-
-}
+#include <protocol_hooks/caching_resolver.h>
 
 struct UdpServerParam {
+    using CryptoContextGenerator = std::function<std::unique_ptr<CryptoContext>(void)>;
     boost::asio::ip::udp::endpoint bind_ep;
-    std::unique_ptr<CryptoContext> crypto;
+    CryptoContextGenerator crypto_generator;
     bool udp_only = false;
     bool udp_enable = false;
+    bool offload = false;
+    size_t max_associations = 65536;
+    size_t idle_timeout = 30;
+    std::unordered_map<uint16_t, size_t> port_timeouts;
+    // socket taken over from a previous process, -1 to bind
+    int socket_fd = -1;
 };
 
 class UdpRelayServer : public std::enable_shared_from_this<UdpRelayServer> {
     typedef boost::asio::ip::udp udp;
-    using resolver_type = cares::udp::resolver;
+    using resolver_type = CachingResolver<cares::udp::resolver>;
+    using CryptoContextGenerator = UdpServerParam::CryptoContextGenerator;
+
+    // a datagram still inside its buffer, the endpoint is only used
+    // for replies sent on the unconnected socket; a non zero segment size
+    // makes it a burst of equally sized packets
+    struct Datagram {
+        PacketBufferPool::Pointer buf;
+        const uint8_t *data;
+        size_t size;
+        udp::endpoint ep;
+        size_t segment_size = 0;
+    };
 
     struct UdpPeer {
         UdpPeer(boost::asio::io_context &ctx)
-            : socket(ctx), timer(ctx) {
+            : socket(ctx) {
         }
 
-        void Cancel() {
-            if (socket.is_open()) {
-                socket.cancel();
-            }
-            timer.cancel();
+        // releases the descriptor at once, pending handlers see aborted
+        void Close() {
+            boost::system::error_code ec;
+            closed = true;
+            socket.close(ec);
         }
 
+        // one unconnected socket per client, whatever destinations it
+        // talks to share its source port
         udp::socket socket;
+        bool closed = false;
+        bool gro = false;
+        bool dual_stack = false;
+        std::chrono::steady_clock::duration timeout;
         udp::endpoint assoc_ep;
-        Buffer buf;
-        std::vector<uint8_t> header;
-        boost::asio::deadline_timer timer;
+        std::unique_ptr<CryptoContext> crypto;
+        // hostnames this client sent to, an association keeps talking to
+        // the same address and skips the resolver even without a cache
+        std::unordered_map<std::string, boost::asio::ip::address> resolved;
+        // sealed replies waiting for the client socket, bounded per client
+        std::deque<Datagram> replies;
+        bool flush_queued = false;
+        uint64_t dropped_replies = 0;
     };
+
+    using NatTableType = NatTable<udp::endpoint, std::shared_ptr<UdpPeer>>;
+
 public:
 
-    UdpRelayServer(boost::asio::io_context &ctx, udp::endpoint ep,
-                   std::unique_ptr<CryptoContext> crypto,
-                   std::shared_ptr<resolver_type> resolver)
-        : socket_(ctx, std::move(ep)),
-          resolver_(resolver),
-          crypto_(std::move(crypto)) {
-        running_ = true;
-        LOG(INFO) << "running at " << ep;
-        DoReceive();
-    }
+    UdpRelayServer(boost::asio::io_context &ctx, UdpServerParam param,
+                   std::shared_ptr<resolver_type> resolver);
 
     void Stop();
 
@@ -74,29 +87,62 @@ public:
         return !running_;
     }
 
+    void DumpStats() const;
+
+    int NativeHandle() {
+        return socket_.native_handle();
+    }
+
 private:
 
     void DoReceive();
-    void ProcessRelay(udp::endpoint ep, size_t length);
+    void DrainReceive();
+    void ProcessRelay(udp::endpoint ep, PacketBufferPool::Pointer &buf, size_t length);
+    bool OpenOutbound(UdpPeer &peer);
     void DoResolveTarget(std::string host, uint16_t port,
-                         std::shared_ptr<UdpPeer> peer, std::unique_ptr<Buffer> buf);
-    void DoConnectTarget(udp::endpoint ep,
-                         std::shared_ptr<UdpPeer> peer, std::unique_ptr<Buffer> buf);
-    void DoSendToTarget(std::shared_ptr<UdpPeer> peer, std::unique_ptr<Buffer> buf);
+                         std::shared_ptr<UdpPeer> peer, Datagram dgram);
+    void Resolved(UdpPeer &peer, std::string host, const boost::asio::ip::address &address);
+    void DoSendToTarget(std::shared_ptr<UdpPeer> peer, udp::endpoint ep, Datagram dgram);
     void DoReceiveFromTarget(std::shared_ptr<UdpPeer> peer);
-
-    void TimerExpiredCallback(std::shared_ptr<UdpPeer> peer, boost::system::error_code ec);
-    void TimerAgain(std::shared_ptr<UdpPeer> peer);
-
-    static void ReleaseTarget(std::weak_ptr<UdpRelayServer>, udp::endpoint, UdpPeer *);
+    void DrainTarget(std::shared_ptr<UdpPeer> peer);
+    void SealSegments(const std::shared_ptr<UdpPeer> &peer, PacketBufferPool::Pointer buf,
+                      size_t offset, size_t length, size_t segment_size,
+                      const udp::endpoint &source);
+    void SealPacket(const std::shared_ptr<UdpPeer> &peer, PacketBufferPool::Pointer buf,
+                    size_t offset, size_t length, const udp::endpoint &source);
+    void QueueReply(const std::shared_ptr<UdpPeer> &peer, Datagram dgram);
+    void FlushReplies();
+
+    void DoSweep();
+    NatTableType::Clock::duration IdleTimeout(uint16_t port) const;
+
+    static const size_t kMaxDrainRounds = 8;
+    static const size_t kMaxPendingReplies = 4096;
+    static const size_t kMaxPeerReplies = 256;
+    static const size_t kMaxResolvedHosts = 256;
+    // entries one association may add to a send batch before the next
+    static const size_t kMaxPeerBurst = 8;
+    static const size_t kMaxGroBatch = 4;
+    // socks5 address of an IPv6 source
+    static const size_t kMaxAddressHeader = 1 + 16 + 2;
 
     bool running_;
-    std::array<uint8_t, 8192> buf_;
+    bool offload_;
+    bool gso_;
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs_;
     udp::socket socket_;
-    udp::endpoint sender_;
+    std::deque<std::shared_ptr<UdpPeer>> ready_;
+    size_t pending_replies_;
+    uint64_t dropped_replies_;
+    bool flush_pending_;
+    UdpBatchStats recv_stats_;
+    UdpBatchStats send_stats_;
     std::shared_ptr<resolver_type> resolver_;
-    std::unique_ptr<CryptoContext> crypto_;
-    std::unordered_map<udp::endpoint, std::weak_ptr<UdpPeer>> targets_;
+    CryptoContextGenerator crypto_generator_;
+    boost::asio::deadline_timer sweep_timer_;
+    size_t idle_timeout_;
+    std::unordered_map<uint16_t, size_t> port_timeouts_;
+    NatTableType targets_;
 };
 
 #endif
@@ -1,15 +1,23 @@
 #include <boost/asio.hpp>
 
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
 #include <common_utils/common.h>
+#include <common_utils/handoff.h>
 #include <crypto_utils/crypto.h>
 
 #include "server.h"
 #include "udprelay.h"
 #include "parse_args.h"
 
+class ListenerHandoff;
+
 void SignalHandler(boost::asio::signal_set &signals,
                    std::shared_ptr<ForwardServer> tcp,
                    std::shared_ptr<UdpRelayServer> udp,
+                   ListenerHandoff *handoff,
                    boost::system::error_code ec, int sig);
 
 int main(int argc, char *argv[]) {
@@ -18,19 +26,45 @@ int main(int argc, char *argv[]) {
     StreamServerArgs args;
     ResolverArgs rargs;
     UdpServerParam udp_param;
+    HandoffArgs handoff_args;
 
-    ParseArgs(argc, argv, &args, &rargs, &log_level, &plugin, &udp_param);
+    ParseArgs(argc, argv, &args, &rargs, &log_level, &plugin, &udp_param, &handoff_args);
 
     InitialLogLevel(argv[0], log_level);
 
     boost::asio::io_context ctx;
+    boost::asio::use_service<DnsCache>(ctx).Start(rargs);
+
+#ifndef WINDOWS
+    std::unique_ptr<ListenerHandoff> handoff;
+    if (!handoff_args.path.empty()) {
+        handoff.reset(new ListenerHandoff(ctx, handoff_args.path));
+        ListenerHandoff::Sockets inherited;
+        if (handoff->Receive(inherited)) {
+            if (udp_param.udp_only || udp_param.udp_enable) {
+                udp_param.socket_fd = inherited.udp;
+            } else if (inherited.udp >= 0) {
+                ::close(inherited.udp);
+            }
+            if (!udp_param.udp_only) {
+                args.listen_fd = inherited.tcp;
+            } else if (inherited.tcp >= 0) {
+                ::close(inherited.tcp);
+            }
+        }
+    }
+#else
+    if (!handoff_args.path.empty()) {
+        LOG(WARNING) << "socket handoff is not supported on this platform";
+    }
+#endif
 
     std::shared_ptr<ForwardServer> tcp_server;
     std::shared_ptr<UdpRelayServer> udp_server;
     std::unique_ptr<boost::process::child> plugin_process;
 
     if (udp_param.udp_only || udp_param.udp_enable) {
-        auto resolver = std::make_shared<cares::udp::resolver>(ctx);
+        auto resolver = std::make_shared<CachingResolver<cares::udp::resolver>>(ctx);
         boost::system::error_code ec;
         if (!rargs.servers.empty()) {
             resolver->set_servers(rargs.servers, ec);
@@ -46,8 +80,7 @@ int main(int argc, char *argv[]) {
         }
         udp_server = \
             std::make_shared<UdpRelayServer>(
-                ctx, udp_param.bind_ep,
-                std::move(udp_param.crypto),
+                ctx, std::move(udp_param),
                 std::move(resolver)
             );
     }
@@ -59,7 +92,7 @@ int main(int argc, char *argv[]) {
 #endif
 
     if (!udp_param.udp_only) {
-        auto resolver = std::make_shared<cares::tcp::resolver>(ctx);
+        auto resolver = std::make_shared<CachingResolver<cares::tcp::resolver>>(ctx);
         boost::system::error_code ec;
         if (!rargs.servers.empty()) {
             resolver->set_servers(rargs.servers, ec);
@@ -100,11 +133,39 @@ int main(int argc, char *argv[]) {
         );
     }
 
+    ListenerHandoff *handoff_ptr = nullptr;
+#ifndef WINDOWS
+    // the previous process stops accepting once we confirm, from then on
+    // the next one may take the sockets from us
+    if (handoff) {
+        handoff->Confirm();
+        ListenerHandoff::Sockets sockets;
+        if (tcp_server) {
+            sockets.tcp = tcp_server->NativeHandle();
+        }
+        if (udp_server) {
+            sockets.udp = udp_server->NativeHandle();
+        }
+        handoff->Serve(sockets,
+            [&handoff_args, &tcp_server, &udp_server, &signals]() {
+                if (udp_server && !udp_server->Stopped()) {
+                    udp_server->Stop();
+                }
+                if (tcp_server) {
+                    tcp_server->Drain(std::chrono::seconds(handoff_args.drain_timeout));
+                }
+                signals.cancel();
+            }
+        );
+        handoff_ptr = handoff.get();
+    }
+#endif
+
     signals.async_wait(
         std::bind(
             SignalHandler,
             std::ref(signals),
-            tcp_server, udp_server,
+            tcp_server, udp_server, handoff_ptr,
             std::placeholders::_1,
             std::placeholders::_2
         )
@@ -124,6 +185,7 @@ int main(int argc, char *argv[]) {
 void SignalHandler(boost::asio::signal_set &signals,
                    std::shared_ptr<ForwardServer> tcp,
                    std::shared_ptr<UdpRelayServer> udp,
+                   ListenerHandoff *handoff,
                    boost::system::error_code ec, int sig) {
     if (ec == boost::asio::error::operation_aborted) {
         return;
@@ -132,23 +194,34 @@ void SignalHandler(boost::asio::signal_set &signals,
 
 #ifndef WINDOWS
     if (sig == SIGINFO) {
+        auto &ctx = signals.get_executor().context();
         boost::asio::post(
-            signals.get_executor().context(),
-            [tcp]() {
-                tcp->DumpConnections();
+            ctx,
+            [&ctx, tcp, udp]() {
+                if (tcp) {
+                    tcp->DumpConnections();
+                }
+                if (udp) {
+                    udp->DumpStats();
+                }
+                boost::asio::use_service<DnsCache>(ctx).DumpStats();
             }
         );
         signals.async_wait(
             std::bind(
                 SignalHandler,
                 std::ref(signals),
-                tcp, udp,
+                tcp, udp, handoff,
                 std::placeholders::_1,
                 std::placeholders::_2
             )
         );
         return;
     }
+
+    if (handoff) {
+        handoff->Stop();
+    }
 #endif
 
     if (tcp && !tcp->Stopped()) {
@@ -1,9 +1,12 @@
+#include <cstdio>
 #include <cstdlib>
+#include <sstream>
 #include <fstream>
 #include <iostream>
 #include <boost/program_options.hpp>
 
 #include <crypto_utils/crypto.h>
+#include <crypto_utils/salt_filter.h>
 #include <ss_proto/server.h>
 
 #include "parse_args.h"
@@ -12,8 +15,26 @@
 namespace bpo = boost::program_options;
 using boost::asio::ip::tcp;
 
+// "53:5,443:120" -> {53: 5, 443: 120}
+static bool ParsePortTimeouts(const std::string &spec,
+                              std::unordered_map<uint16_t, size_t> &timeouts) {
+    std::istringstream iss(spec);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        unsigned long port;
+        unsigned long seconds;
+        char tail;
+        if (sscanf(item.c_str(), " %lu:%lu %c", &port, &seconds, &tail) != 2
+            || port > 65535) {
+            return false;
+        }
+        timeouts[port] = seconds;
+    }
+    return true;
+}
+
 void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rargs,
-               int *log_level, Plugin *p, UdpServerParam *udp) {
+               int *log_level, Plugin *p, UdpServerParam *udp, HandoffArgs *handoff) {
     auto factory = CryptoContextGeneratorFactory::Instance();
     bpo::options_description desc("Shadowsocks Server");
     desc.add(*GetCommonOptions()).add_options()
@@ -21,6 +42,21 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rar
         ("password,k", bpo::value<std::string>(), "Password")
         ("udp-relay,u", "Enable udp relay")
         ("udp-only,U", "Udp only")
+        ("udp-offload", "Coalesce bulk udp flows with GRO/GSO where the kernel supports it")
+        ("udp-max-associations", bpo::value<size_t>()->default_value(65536),
+            "Upper bound of udp associations, also capped by the open files limit")
+        ("udp-timeout", bpo::value<size_t>()->default_value(30),
+            "Idle timeout of udp associations in seconds")
+        ("udp-port-timeouts", bpo::value<std::string>(),
+            "Idle timeouts by destination port, e.g. 53:5,443:120")
+        ("replay-capacity", bpo::value<size_t>()->default_value(1000000),
+            "Salts remembered by the replay filter, 0 to disable")
+        ("replay-fp-rate", bpo::value<double>()->default_value(1e-6),
+            "False positive rate of the replay filter")
+        ("handoff-path", bpo::value<std::string>(),
+            "Unix socket a restarted server takes the listening sockets over at")
+        ("drain-timeout", bpo::value<size_t>()->default_value(30),
+            "Seconds sessions are given to finish after a handoff")
         ("plugin", bpo::value<std::string>(), "Plugin executable name")
         ("plugin-opts", bpo::value<std::string>(), "Plugin options");
 
@@ -74,18 +110,38 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rar
         exit(-1);
     }
 
+    SaltFilter::Instance().Configure(vm["replay-capacity"].as<size_t>(),
+                                     vm["replay-fp-rate"].as<double>());
+
     GetResolverArgs(vm, rargs);
 
     udp->udp_enable = vm.count("udp-relay");
     udp->udp_only = vm.count("udp-only");
+    udp->offload = vm.count("udp-offload");
+    udp->max_associations = vm["udp-max-associations"].as<size_t>();
+    udp->idle_timeout = vm["udp-timeout"].as<size_t>();
+    if (vm.count("udp-port-timeouts")
+        && !ParsePortTimeouts(vm["udp-port-timeouts"].as<std::string>(), udp->port_timeouts)) {
+        std::cerr << "Invalid udp port timeouts" << std::endl;
+        exit(-1);
+    }
     if (udp->udp_enable || udp->udp_only) {
         udp->bind_ep.address(bind_address);
         udp->bind_ep.port(bind_port);
-        udp->crypto = (*crypto_generator)();
+        udp->crypto_generator = *crypto_generator;
     }
 
     *log_level = vm["verbose"].as<int>();
 
+    if (vm.count("handoff-path")) {
+        handoff->path = vm["handoff-path"].as<std::string>();
+        handoff->drain_timeout = vm["drain-timeout"].as<size_t>();
+        if (!handoff->path.empty() && vm.count("plugin")) {
+            std::cerr << "Socket handoff cannot be used with a plugin" << std::endl;
+            exit(-1);
+        }
+    }
+
     if (vm.count("plugin")) {
         std::string plugin = vm["plugin"].as<std::string>();
         if (!plugin.empty()) {
@@ -109,6 +165,11 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rar
 
     args->bind_ep = tcp::endpoint(bind_address, bind_port);
     args->timeout = vm["timeout"].as<size_t>() * 1000;
+    args->offload_threads = vm["offload-threads"].as<size_t>();
+    args->offload_threshold = vm["offload-threshold"].as<size_t>() * 1024;
+    args->max_sessions = vm["max-sessions"].as<size_t>();
+    args->max_handshakes = vm["max-handshakes"].as<size_t>();
+    args->max_sessions_per_client = vm["max-sessions-per-client"].as<size_t>();
 
     args->generator = \
         [g = *crypto_generator]() {
@@ -6,6 +6,7 @@
 #include <common_utils/socks5.h>
 #include <common_utils/buffer.h>
 #include <protocol_hooks/basic_stream_session.h>
+#include <protocol_hooks/stream_mux.h>
 
 #include "server.h"
 
@@ -35,6 +36,14 @@ public:
             client_,
             [this, self]() {
                 client_.timer.cancel();
+                if (protocol_->IsMuxCarrier()) {
+                    VLOG(1) << "Mux carrier from " << client_.socket.remote_endpoint();
+                    boost::asio::use_service<StreamMux>(context_).Accept(
+                        std::move(client_.socket), std::move(protocol_), client_.buf,
+                        resolver_, client_.ttl.total_milliseconds()
+                    );
+                    return;
+                }
                 auto after_connected = std::bind(&Session::DoWriteToTarget, self);
                 if (protocol_->NeedResolve()) {
                     std::string hostname;
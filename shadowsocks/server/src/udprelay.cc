@@ -1,18 +1,91 @@
 
 #include "udprelay.h"
 
+#ifndef WINDOWS
+#include <sys/resource.h>
+#endif
+
 #include <common_utils/util.h>
 
 using boost::asio::ip::udp;
 namespace bsys = boost::system;
 
+// every association holds a socket, half of the open files limit is left
+// to tcp sessions and everything else
+static size_t LimitByFdBudget(size_t capacity) {
+#ifndef WINDOWS
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        size_t budget = std::max((size_t)rl.rlim_cur / 2, (size_t)1);
+        if (capacity > budget) {
+            LOG(WARNING) << "udp associations limited to " << budget << " by RLIMIT_NOFILE";
+            return budget;
+        }
+    }
+#endif
+    return capacity;
+}
+
+// socks5 address of a reply source, v4 peers reached through a dual stack
+// socket are reported as plain IPv4
+static size_t WriteAddressHeader(const udp::endpoint &ep, uint8_t *out) {
+    auto address = ep.address();
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+        address = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+    }
+
+    size_t length;
+    if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        out[0] = socks5::IPV4_ATYPE;
+        std::copy(bytes.begin(), bytes.end(), out + 1);
+        length = 1 + bytes.size();
+    } else {
+        auto bytes = address.to_v6().to_bytes();
+        out[0] = socks5::IPV6_ATYPE;
+        std::copy(bytes.begin(), bytes.end(), out + 1);
+        length = 1 + bytes.size();
+    }
+    out[length] = (uint8_t)(ep.port() >> 8);
+    out[length + 1] = (uint8_t)(ep.port() & 0xff);
+    return length + 2;
+}
+
+UdpRelayServer::UdpRelayServer(boost::asio::io_context &ctx, UdpServerParam param,
+                               std::shared_ptr<resolver_type> resolver)
+    : offload_(param.offload),
+      socket_(ctx),
+      pending_replies_(0),
+      dropped_replies_(0),
+      flush_pending_(false),
+      resolver_(resolver),
+      crypto_generator_(std::move(param.crypto_generator)),
+      sweep_timer_(ctx),
+      idle_timeout_(param.idle_timeout),
+      port_timeouts_(std::move(param.port_timeouts)),
+      targets_(LimitByFdBudget(param.max_associations)) {
+    if (param.socket_fd >= 0) {
+        socket_.assign(param.bind_ep.protocol(), param.socket_fd);
+    } else {
+        socket_.open(param.bind_ep.protocol());
+        socket_.bind(param.bind_ep);
+    }
+    running_ = true;
+    gso_ = offload_ && UdpBatchIO::GsoSupported(socket_);
+    LOG(INFO) << "running at " << param.bind_ep;
+    if (offload_) {
+        LOG(INFO) << "udp segmentation offload " << (gso_ ? "enabled" : "unsupported");
+    }
+    DoReceive();
+    DoSweep();
+}
+
 void UdpRelayServer::DoReceive() {
-    socket_.async_receive_from(
-        boost::asio::buffer(buf_), sender_,
-        [this](bsys::error_code ec, size_t length) {
+    socket_.async_wait(
+        udp::socket::wait_read,
+        [this](bsys::error_code ec) {
             if (!ec) {
-                VLOG(1) << "received from " << sender_;
-                ProcessRelay(sender_, length);
+                DrainReceive();
             }
 
             if (running_) {
@@ -22,105 +95,206 @@ void UdpRelayServer::DoReceive() {
     );
 }
 
-void UdpRelayServer::ProcessRelay(udp::endpoint ep, size_t length) {
-    auto write_buf = std::make_unique<Buffer>(length);
-    write_buf->AppendData(buf_.data(), length);
-    if (crypto_->DecryptOnce(*write_buf) <= 0) {
+// read whatever is queued in bursts, bounded so other sockets get a turn
+void UdpRelayServer::DrainReceive() {
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> senders;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < bufs_.size(); ++i) {
+            if (!bufs_[i]) {
+                bufs_[i] = PacketBufferPool::Acquire();
+            }
+            buffers[i] = boost::asio::buffer(bufs_[i]->data);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(socket_, buffers.data(), lengths.data(),
+                                            senders.data(), buffers.size(), ec);
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "udp receive error: " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            VLOG(1) << "received from " << senders[i];
+            ProcessRelay(senders[i], bufs_[i], lengths[i]);
+        }
+        recv_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        if (n < buffers.size()) {
+            return;
+        }
+    }
+}
+
+void UdpRelayServer::ProcessRelay(udp::endpoint ep, PacketBufferPool::Pointer &buf, size_t length) {
+    // every association keeps its own crypto context, as session based
+    // methods carry per-client state between packets
+    std::shared_ptr<UdpPeer> peer;
+    std::unique_ptr<CryptoContext> crypto;
+    auto entry = targets_.Find(ep);
+    if (entry) {
+        peer = *entry;
+    } else {
+        crypto = crypto_generator_();
+    }
+    CryptoContext *ctx = peer ? peer->crypto.get() : crypto.get();
+
+    // decrypted in place, the payload is forwarded from the receive buffer
+    uint8_t *plaintext;
+    ssize_t plain_length = ctx->DecryptPacket(buf->Begin(), length, &plaintext);
+    if (plain_length <= 0) {
         LOG(WARNING) << "udp decrypt error";
         return;
     }
 
     TargetInfo target;
-    size_t head_length = GetTargetFromSocks5Address(write_buf->GetData(), nullptr, target);
-    if (!head_length) {
+    size_t head_length = GetTargetFromSocks5Address(plaintext, nullptr, target);
+    if (!head_length || head_length > (size_t)plain_length) {
         LOG(WARNING) << "invalid udp header";
         return;
     }
 
-    std::shared_ptr<UdpPeer> peer;
-    bool cache_missed = false;
-    auto itr = targets_.find(ep);
-    if (itr == targets_.end()
-        || (peer = itr->second.lock()) == nullptr) {
-        peer.reset(
-            new UdpPeer(socket_.get_executor().context()),
-            std::bind(&UdpRelayServer::ReleaseTarget,
-                      shared_from_this(),
-                      ep, std::placeholders::_1)
-        );
-        peer->header.reserve(head_length);
-        std::copy_n(write_buf->Begin(), head_length, std::back_inserter(peer->header));
+    if (!peer) {
+        peer = std::make_shared<UdpPeer>(socket_.get_executor().context());
+        if (!OpenOutbound(*peer)) {
+            return;
+        }
         peer->assoc_ep = ep;
-        itr = targets_.emplace(ep, peer).first;
-        cache_missed = true;
+        peer->crypto = std::move(crypto);
+        peer->timeout = IdleTimeout(target.GetPort());
+        std::shared_ptr<UdpPeer> evicted;
+        if (targets_.Insert(ep, peer, peer->timeout, &evicted)) {
+            VLOG(1) << "association table full, evict " << evicted->assoc_ep;
+            evicted->Close();
+        }
+        DoReceiveFromTarget(peer);
+    } else if (!port_timeouts_.empty()) {
+        // the association lives as long as its longest lived destination
+        auto timeout = IdleTimeout(target.GetPort());
+        if (timeout > peer->timeout) {
+            peer->timeout = timeout;
+            targets_.Extend(ep, timeout);
+        }
     }
-    write_buf->DeQueue(head_length);
+    Datagram dgram{ std::move(buf), plaintext + head_length, plain_length - head_length, ep };
 
-    peer->timer.cancel();
-    if (!cache_missed) {
-        DoSendToTarget(peer, std::move(write_buf));
-    } else {
-        if (target.NeedResolve()) {
-            auto host = target.GetHostname();
-            auto port = target.GetPort();
-            DoResolveTarget(std::move(host), std::move(port), peer, std::move(write_buf));
+    if (target.NeedResolve()) {
+        // repeated packets to a hostname are sent right away once the
+        // association or the cache knows its address
+        auto host = target.GetHostname();
+        auto port = target.GetPort();
+        auto itr = peer->resolved.find(host);
+        if (itr != peer->resolved.end()) {
+            DoSendToTarget(peer, udp::endpoint(itr->second, port), std::move(dgram));
+            return;
+        }
+        resolver_type::results_type results;
+        bsys::error_code ec;
+        if (resolver_->lookup(host, port, results, ec)) {
+            if (ec) {
+                VLOG(1) << "unable to resolve " << host << ", " << ec.message();
+                return;
+            }
+            auto remote_ep = results.begin()->endpoint();
+            Resolved(*peer, std::move(host), remote_ep.address());
+            DoSendToTarget(peer, std::move(remote_ep), std::move(dgram));
         } else {
-            auto remote_ep = udp::endpoint(target.GetIp(), target.GetPort());
-            DoConnectTarget(std::move(remote_ep), peer, std::move(write_buf));
+            DoResolveTarget(std::move(host), std::move(port), peer, std::move(dgram));
         }
+    } else {
+        auto remote_ep = udp::endpoint(target.GetIp(), target.GetPort());
+        DoSendToTarget(peer, std::move(remote_ep), std::move(dgram));
     }
 }
 
+// dual stack where the host allows it, so one socket reaches every family
+bool UdpRelayServer::OpenOutbound(UdpPeer &peer) {
+    bsys::error_code ec;
+    peer.socket.open(udp::v6(), ec);
+    if (!ec) {
+        peer.socket.set_option(boost::asio::ip::v6_only(false), ec);
+    }
+    if (!ec) {
+        peer.socket.bind(udp::endpoint(udp::v6(), 0), ec);
+    }
+    peer.dual_stack = !ec;
+    if (ec) {
+        peer.socket.close(ec);
+        peer.socket.open(udp::v4(), ec);
+        if (!ec) {
+            peer.socket.bind(udp::endpoint(udp::v4(), 0), ec);
+        }
+    }
+    if (ec) {
+        LOG(ERROR) << "unable to open udp socket, " << ec.message();
+        return false;
+    }
+    if (offload_) {
+        peer.gro = UdpBatchIO::EnableGro(peer.socket);
+    }
+    return true;
+}
+
 void UdpRelayServer::DoResolveTarget(
         std::string host, uint16_t port,
         std::shared_ptr<UdpPeer> peer,
-        std::unique_ptr<Buffer> buf
+        Datagram dgram
     ) {
 
-    resolver_->async_resolve(
+    resolver_->async_refresh(
         host, port,
-        [this, peer, buf{ std::move(buf) }, host]
+        [this, peer, dgram{ std::move(dgram) }, host]
         (bsys::error_code ec, resolver_type::results_type results) mutable {
             if (ec) {
                 LOG(ERROR) << "unable to resolve " << host << ", " << ec.message();
                 return;
             }
-            DoConnectTarget(*results.begin(), peer, std::move(buf));
-        }
-    );
-}
-
-void UdpRelayServer::DoConnectTarget(
-        udp::endpoint ep,
-        std::shared_ptr<UdpPeer> peer,
-        std::unique_ptr<Buffer> buf
-    ) {
-    peer->socket.async_connect(
-        ep, [this, peer, buf{ std::move(buf) }](bsys::error_code ec) mutable {
-            if (ec) {
-                LOG(ERROR) << "udp connect error: " << ec.message();
+            if (peer->closed) {
                 return;
             }
-            DoSendToTarget(peer, std::move(buf));
-            TimerAgain(peer);
-            DoReceiveFromTarget(peer);
+            auto remote_ep = results.begin()->endpoint();
+            Resolved(*peer, std::move(host), remote_ep.address());
+            DoSendToTarget(peer, std::move(remote_ep), std::move(dgram));
         }
     );
 }
 
+void UdpRelayServer::Resolved(UdpPeer &peer, std::string host,
+                              const boost::asio::ip::address &address) {
+    if (peer.resolved.size() >= kMaxResolvedHosts) {
+        peer.resolved.clear();
+    }
+    peer.resolved.emplace(std::move(host), address);
+}
+
 void UdpRelayServer::DoSendToTarget(
         std::shared_ptr<UdpPeer> peer,
-        std::unique_ptr<Buffer> buf
+        udp::endpoint ep,
+        Datagram dgram
     ) {
 
-    auto buffer = buf->GetConstBuffer(); // make sure buf is not moved before get its buffer
-    peer->socket.async_send(
-        std::move(buffer),
-        [peer, buf{ std::move(buf) }]
+    auto address = ep.address();
+    if (peer->dual_stack && address.is_v4()) {
+        ep.address(boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()));
+    } else if (!peer->dual_stack && address.is_v6()) {
+        VLOG(1) << "no ipv6 outbound, drop packet to " << ep;
+        return;
+    }
+
+    auto buffer = boost::asio::buffer(dgram.data, dgram.size);
+    peer->socket.async_send_to(
+        std::move(buffer), ep,
+        [peer, ep, buf{ std::move(dgram.buf) }]
         (bsys::error_code ec, size_t length) {
             if (ec) {
-                LOG(WARNING) << "unable to send to target " << peer->socket.remote_endpoint()
-                             << ", " << ec.message();
+                if (ec != boost::asio::error::operation_aborted) {
+                    LOG(WARNING) << "unable to send to target " << ep
+                                 << ", " << ec.message();
+                }
                 return;
             }
         }
@@ -128,89 +302,318 @@ void UdpRelayServer::DoSendToTarget(
 }
 
 void UdpRelayServer::DoReceiveFromTarget(std::shared_ptr<UdpPeer> peer) {
-    peer->socket.async_receive(
-        peer->buf.GetBuffer(),
-        [this, peer](bsys::error_code ec, size_t length) {
+    peer->socket.async_wait(
+        udp::socket::wait_read,
+        [this, peer](bsys::error_code ec) {
             if (ec) {
                 if (ec == boost::asio::error::operation_aborted) {
-                    VLOG(1) << "operation aborted " << peer->socket.remote_endpoint();
+                    VLOG(1) << "operation aborted " << peer->assoc_ep;
                     return;
                 }
-                LOG(WARNING) << "unable to receive "
-                             << peer->socket.remote_endpoint()
+                LOG(WARNING) << "unable to receive for "
+                             << peer->assoc_ep
                              << ", " << ec.message();
                 return;
             }
-            VLOG(3) << "udp received " << length << " bytes from target " << peer->socket.remote_endpoint()
-                    << ", current buffer size: " << peer->buf.Size();
-            peer->timer.cancel();
-            peer->buf.Append(length);
-
-            peer->buf.PrependData(peer->header);
-
-            crypto_->EncryptOnce(peer->buf);
-            socket_.async_send_to(
-                peer->buf.GetConstBuffer(),
-                peer->assoc_ep,
-                [this, peer](bsys::error_code ec, size_t length) {
-                    if (ec) {
-                        LOG(WARNING) << "unable to send to " << peer->assoc_ep
-                                     << ", " << ec.message();
-                        return;
-                    }
-                    peer->buf.Reset();
-                    TimerAgain(peer);
-                    DoReceiveFromTarget(peer);
-                }
-            );
+            DrainTarget(peer);
+            targets_.Touch(peer->assoc_ep);
+            DoReceiveFromTarget(peer);
         }
     );
 }
 
-void UdpRelayServer::TimerAgain(std::shared_ptr<UdpPeer> peer) {
-    peer->timer.expires_from_now(boost::posix_time::seconds(30));
-    peer->timer.async_wait(
-        std::bind(
-            &UdpRelayServer::TimerExpiredCallback,
-            this,
-            peer,
-            std::placeholders::_1
-        )
+// seal every queued reply where it was received, leaving room for the
+// longest address header and the cipher framing in front of it
+void UdpRelayServer::DrainTarget(std::shared_ptr<UdpPeer> peer) {
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs;
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> senders;
+    std::array<size_t, UdpBatchIO::kMaxBatch> segment_sizes;
+    size_t batch = peer->gro ? kMaxGroBatch : UdpBatchIO::kMaxBatch;
+    size_t offset = peer->crypto->PacketHeadroom() + kMaxAddressHeader;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < batch; ++i) {
+            if (!bufs[i]) {
+                bufs[i] = PacketBufferPool::Acquire(peer->gro);
+            }
+            size_t room = bufs[i]->Capacity() - offset - peer->crypto->PacketTailroom();
+            buffers[i] = boost::asio::buffer(bufs[i]->Begin() + offset, room);
+        }
+
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(peer->socket, buffers.data(), lengths.data(),
+                                            senders.data(), batch, ec,
+                                            peer->gro ? segment_sizes.data() : nullptr);
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "unable to receive for "
+                             << peer->assoc_ep
+                             << ", " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            VLOG(3) << "udp received " << lengths[i] << " bytes from target " << senders[i];
+            if (peer->gro && segment_sizes[i]) {
+                SealSegments(peer, std::move(bufs[i]), offset, lengths[i],
+                             segment_sizes[i], senders[i]);
+            } else {
+                SealPacket(peer, std::move(bufs[i]), offset, lengths[i], senders[i]);
+            }
+        }
+        if (n < batch) {
+            return;
+        }
+    }
+}
+
+void UdpRelayServer::SealPacket(const std::shared_ptr<UdpPeer> &peer, PacketBufferPool::Pointer buf,
+                                size_t offset, size_t length, const udp::endpoint &source) {
+    std::array<uint8_t, kMaxAddressHeader> header;
+    size_t header_length = WriteAddressHeader(source, header.data());
+    uint8_t *plaintext = buf->Begin() + offset - header_length;
+    std::copy_n(header.data(), header_length, plaintext);
+
+    uint8_t *packet;
+    ssize_t packet_length = peer->crypto->EncryptPacket(
+        plaintext, header_length + length, &packet
     );
+    if (packet_length <= 0) {
+        LOG(WARNING) << "udp encrypt error";
+        return;
+    }
+    QueueReply(peer, Datagram{ std::move(buf), packet, (size_t)packet_length, peer->assoc_ep });
 }
 
-void UdpRelayServer::TimerExpiredCallback(
-        std::shared_ptr<UdpPeer> peer,
-        bsys::error_code ec
-    ) {
-    if (ec != boost::asio::error::operation_aborted) {
-        peer->socket.cancel();
-        VLOG(1) << "timer expired " << peer->socket.remote_endpoint();
+// A GRO burst holds back to back segments. They are spread apart, last
+// first so nothing is overwritten before it moved, and each is sealed
+// where it lands: the sealed packets are equally sized and adjacent, so
+// the burst leaves as one GSO send or is split again without copies.
+// A shorter IPv4 header shifts the first packet into the unused part of
+// the header room, the payloads stay at offset + k * stride.
+void UdpRelayServer::SealSegments(const std::shared_ptr<UdpPeer> &peer,
+                                  PacketBufferPool::Pointer buf, size_t offset, size_t length, size_t segment_size,
+                                  const udp::endpoint &source) {
+    std::array<uint8_t, kMaxAddressHeader> header;
+    size_t header_length = WriteAddressHeader(source, header.data());
+    size_t headroom = peer->crypto->PacketHeadroom();
+    size_t skew = offset - headroom - header_length;
+    size_t stride = headroom + header_length + segment_size + peer->crypto->PacketTailroom();
+    size_t count = (length + segment_size - 1) / segment_size;
+    uint8_t *base = buf->Begin() + skew;
+
+    if (skew + count * stride > buf->Capacity()) {
+        // framing does not fit, copy segments out one by one
+        for (size_t k = 0; k < count; ++k) {
+            size_t segment_length = std::min(segment_size, length - k * segment_size);
+            auto segment = PacketBufferPool::Acquire();
+            std::copy_n(buf->Begin() + offset + k * segment_size, segment_length,
+                        segment->Begin() + offset);
+            SealPacket(peer, std::move(segment), offset, segment_length, source);
+        }
+        return;
+    }
+
+    for (size_t k = count; k-- > 1;) {
+        size_t segment_length = std::min(segment_size, length - k * segment_size);
+        memmove(buf->Begin() + offset + k * stride,
+                buf->Begin() + offset + k * segment_size, segment_length);
     }
+
+    size_t total = 0;
+    for (size_t k = 0; k < count; ++k) {
+        size_t segment_length = std::min(segment_size, length - k * segment_size);
+        uint8_t *plaintext = base + k * stride + headroom;
+        std::copy_n(header.data(), header_length, plaintext);
+
+        uint8_t *packet;
+        ssize_t packet_length = peer->crypto->EncryptPacket(
+            plaintext, header_length + segment_length, &packet
+        );
+        if (packet_length <= 0) {
+            LOG(WARNING) << "udp encrypt error";
+            return;
+        }
+        if (packet != base + k * stride
+            || (size_t)packet_length != stride - segment_size + segment_length) {
+            LOG(WARNING) << "unexpected sealed packet layout, dropped " << count << " segments";
+            return;
+        }
+        total += packet_length;
+    }
+
+    Datagram dgram{ std::move(buf), base, total, peer->assoc_ep };
+    dgram.segment_size = stride;
+    QueueReply(peer, std::move(dgram));
 }
 
-void UdpRelayServer::ReleaseTarget(std::weak_ptr<UdpRelayServer> server,
-                                   udp::endpoint ep, UdpPeer *ptr) {
-    auto self = server.lock();
-    if (self) {
-        auto itr = self->targets_.find(ep);
-        if (itr != self->targets_.end()) {
-            if (itr->second.expired()) {
-                self->targets_.erase(itr);
+// replies wait in the queue of their association, a client that cannot
+// keep up loses its newest packets without holding back the others
+void UdpRelayServer::QueueReply(const std::shared_ptr<UdpPeer> &peer, Datagram dgram) {
+    if (peer->replies.size() >= kMaxPeerReplies || pending_replies_ >= kMaxPendingReplies) {
+        ++peer->dropped_replies;
+        ++dropped_replies_;
+        VLOG(1) << "reply queue full, drop packet to " << dgram.ep;
+        return;
+    }
+    peer->replies.emplace_back(std::move(dgram));
+    ++pending_replies_;
+    if (!peer->flush_queued) {
+        peer->flush_queued = true;
+        ready_.push_back(peer);
+    }
+    if (!flush_pending_) {
+        flush_pending_ = true;
+        boost::asio::post(socket_.get_executor(), [this]() { FlushReplies(); });
+    }
+}
+
+// replies gathered during one loop turn leave in as few calls as
+// possible, bursts as GSO sends when the socket supports it; every ready
+// association adds a few entries per batch, round robin
+void UdpRelayServer::FlushReplies() {
+    std::array<boost::asio::const_buffer, UdpBatchIO::kMaxBatch> packets;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> destinations;
+    std::array<size_t, UdpBatchIO::kMaxBatch> segment_sizes;
+    std::array<UdpPeer *, UdpBatchIO::kMaxBatch> owners;
+
+    flush_pending_ = false;
+    while (!ready_.empty()) {
+        size_t count = 0;
+        size_t visited = 0;
+        for (; visited < ready_.size() && count < packets.size(); ++visited) {
+            auto &replies = ready_[visited]->replies;
+            size_t taken = 0;
+            for (auto itr = replies.begin();
+                 itr != replies.end() && count < packets.size() && taken < kMaxPeerBurst;
+                 ++itr) {
+                size_t segment_size = itr->segment_size;
+                size_t chunk = itr->size;
+                if (segment_size) {
+                    size_t segments = gso_ ?
+                        std::min(static_cast<size_t>(UdpBatchIO::kMaxSegments),
+                                 UdpBatchIO::kMaxSegmentedSize / segment_size) :
+                        1;
+                    chunk = segments * segment_size;
+                }
+                for (size_t off = 0;
+                     off < itr->size && count < packets.size() && taken < kMaxPeerBurst;
+                     off += chunk, ++taken) {
+                    size_t len = std::min(chunk, itr->size - off);
+                    packets[count] = boost::asio::buffer(itr->data + off, len);
+                    destinations[count] = itr->ep;
+                    segment_sizes[count] = gso_ && len > segment_size ? segment_size : 0;
+                    owners[count] = ready_[visited].get();
+                    ++count;
+                }
             }
         }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::SendBatch(socket_, packets.data(), destinations.data(),
+                                         count, ec, segment_sizes.data());
+        if (n) {
+            send_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            auto &replies = owners[i]->replies;
+            auto &front = replies.front();
+            front.data += packets[i].size();
+            front.size -= packets[i].size();
+            if (!front.size) {
+                replies.pop_front();
+                --pending_replies_;
+            }
+        }
+
+        if (ec == bsys::errc::io_error && segment_sizes[n]) {
+            // the device cannot segment, split bursts from now on
+            LOG(WARNING) << "udp segmentation offload failed, disabled";
+            gso_ = false;
+        } else if (ec && ec != boost::asio::error::would_block) {
+            auto &replies = owners[n]->replies;
+            LOG(WARNING) << "unable to send to " << replies.front().ep
+                         << ", " << ec.message();
+            replies.pop_front();
+            --pending_replies_;
+        }
+
+        // served associations go to the back, drained ones leave
+        for (size_t i = 0; i < visited; ++i) {
+            auto peer = std::move(ready_.front());
+            ready_.pop_front();
+            if (peer->replies.empty()) {
+                peer->flush_queued = false;
+            } else {
+                ready_.push_back(std::move(peer));
+            }
+        }
+
+        if (ec == boost::asio::error::would_block) {
+            flush_pending_ = true;
+            socket_.async_wait(
+                udp::socket::wait_write,
+                [this](bsys::error_code ec) {
+                    flush_pending_ = false;
+                    if (!ec) {
+                        FlushReplies();
+                    }
+                }
+            );
+            return;
+        }
     }
-    delete ptr;
+}
+
+// idle associations are closed by a coarse sweep instead of a timer each
+void UdpRelayServer::DoSweep() {
+    sweep_timer_.expires_from_now(boost::posix_time::seconds(1));
+    sweep_timer_.async_wait(
+        [this](bsys::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            targets_.Expire(
+                [](std::shared_ptr<UdpPeer> &peer) {
+                    VLOG(1) << "association expired " << peer->assoc_ep
+                            << ", dropped replies: " << peer->dropped_replies;
+                    peer->Close();
+                }
+            );
+            DoSweep();
+        }
+    );
+}
+
+UdpRelayServer::NatTableType::Clock::duration UdpRelayServer::IdleTimeout(uint16_t port) const {
+    auto itr = port_timeouts_.find(port);
+    size_t seconds = itr != port_timeouts_.end() ? itr->second : idle_timeout_;
+    return std::chrono::seconds(seconds);
 }
 
 void UdpRelayServer::Stop() {
     running_ = false;
     socket_.cancel();
-    for (auto &kv : targets_) {
-        auto target = kv.second.lock();
-        if (target) {
-            target->Cancel();
+    sweep_timer_.cancel();
+    targets_.Clear(
+        [](std::shared_ptr<UdpPeer> &peer) {
+            peer->Close();
         }
-    }
+    );
 }
 
+void UdpRelayServer::DumpStats() const {
+    auto &stats = targets_.GetStats();
+    LOG(INFO) << "udp associations: " << targets_.Size() << "/" << targets_.Capacity()
+              << ", hits: " << stats.hits
+              << ", misses: " << stats.misses
+              << ", evictions: " << stats.evictions
+              << ", expirations: " << stats.expirations
+              << ", pending replies: " << pending_replies_
+              << ", dropped replies: " << dropped_replies_ << std::endl
+              << "receive " << recv_stats_.DumpToStr() << std::endl
+              << "send " << send_stats_.DumpToStr();
+}
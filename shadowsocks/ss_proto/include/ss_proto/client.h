@@ -34,6 +34,8 @@ public:
 
     void DoInitializeProtocol(Peer &peer, NextStage next);
 
+    bool StartMuxCarrier();
+
 private:
     Buffer header_buf_;
     CryptoContextPtr crypto_context_;
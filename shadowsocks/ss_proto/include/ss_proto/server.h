@@ -16,7 +16,7 @@ class ShadowsocksServer : public BasicProtocol {
     using NextStage = BasicProtocol::NextStage;
 public:
     ShadowsocksServer(CryptoContextPtr crypto_context)
-        : crypto_context_(std::move(crypto_context)) { }
+        : crypto_context_(std::move(crypto_context)), mux_carrier_(false) { }
 
     ~ShadowsocksServer() { }
 
@@ -32,11 +32,14 @@ public:
         return crypto_context_->Decrypt(buf);
     }
 
+    bool IsMuxCarrier() const { return mux_carrier_; }
+
 private:
     void DoReadHeader(Peer &peer, NextStage next, size_t at_least = 4);
 
     Buffer header_buf_;
     CryptoContextPtr crypto_context_;
+    bool mux_carrier_;
 };
 
 #endif
@@ -33,6 +33,11 @@ public:
     void DoInitializeProtocol(Peer &peer, NextStage next);
 
     static void InitializeTunnel(const TargetInfo &forward_target);
+
+    // socks5 address of the forward target, also used by udp forwarding
+    static const std::vector<uint8_t> &GetHeader() {
+        return kHeaderBuf;
+    }
 private:
     static std::vector<uint8_t> kHeaderBuf;
 
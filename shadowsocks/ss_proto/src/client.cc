@@ -2,6 +2,8 @@
 #include <boost/endian/arithmetic.hpp>
 #include <common_utils/socks5.h>
 
+#include <protocol_hooks/stream_mux.h>
+
 #include "ss_proto/client.h"
 
 using boost::asio::ip::tcp;
@@ -15,6 +17,12 @@ uint8_t ShadowsocksClient::ParseHeader(Buffer &buf, size_t start_offset) {
     return reply;
 }
 
+bool ShadowsocksClient::StartMuxCarrier() {
+    header_buf_.Reset();
+    header_buf_.AppendData(mux::kCarrierHeader);
+    return true;
+}
+
 void ShadowsocksClient::DoInitializeProtocol(Peer &peer, NextStage next) {
     Wrap(header_buf_);
     boost::asio::async_write(
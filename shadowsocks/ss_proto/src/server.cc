@@ -2,6 +2,8 @@
 #include <boost/endian/arithmetic.hpp>
 #include <common_utils/socks5.h>
 
+#include <protocol_hooks/stream_mux.h>
+
 #include "ss_proto/server.h"
 
 using boost::asio::ip::tcp;
@@ -26,8 +28,9 @@ void ShadowsocksServer::DoReadHeader(Peer &peer, NextStage next, size_t at_least
             peer.buf.Append(length);
             ssize_t valid_length = UnWrap(peer.buf);
             if (valid_length == 0) {
+                size_t pending = crypto_context_->PendingDecryptBytes();
                 VLOG(2) << length << " bytes read, but need more";
-                DoReadHeader(peer, std::move(next));
+                DoReadHeader(peer, std::move(next), pending ? pending : 4);
                 return;
             } else if (valid_length < 0) {
                 LOG(WARNING) <<  "protocol_hook error";
@@ -45,7 +48,15 @@ void ShadowsocksServer::DoReadHeader(Peer &peer, NextStage next, size_t at_least
                 return;
             }
 
-            if (ParseHeader(header_buf_, 0) != socks5::SUCCEEDED_REP) {
+            if (header_buf_.GetData()[0] == socks5::MUX_ATYPE) {
+                if (!std::equal(mux::kCarrierHeader.begin(), mux::kCarrierHeader.end(),
+                                header_buf_.GetData())) {
+                    LOG(INFO) << "unsupported mux version";
+                    return;
+                }
+                mux_carrier_ = true;
+                header_length_ = mux::kCarrierHeader.size();
+            } else if (ParseHeader(header_buf_, 0) != socks5::SUCCEEDED_REP) {
                 LOG(INFO) << "invalid header";
                 return;
             }
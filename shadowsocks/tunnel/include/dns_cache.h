@@ -0,0 +1,76 @@
+#ifndef __DNS_CACHE_H__
+#define __DNS_CACHE_H__
+
+#include <list>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Answers repeated DNS questions from responses seen before. Entries are
+// keyed by the question section and the EDNS flavour of the query (OPT
+// record present, DO bit) and live for the smallest TTL they carry; a hit
+// is handed out with aged TTLs and the transaction ID of the query, or
+// truncated with TC when larger than the UDP payload the query allows.
+class DnsResponseCache {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+        uint64_t truncated = 0;
+    };
+
+    explicit DnsResponseCache(size_t capacity);
+
+    // writes the cached response to the query into out, returns its
+    // length or 0 on a miss
+    size_t Answer(const uint8_t *query, size_t length, uint8_t *out, size_t capacity);
+
+    // keeps a cacheable response, anything else is ignored
+    void Store(const uint8_t *response, size_t length);
+
+    // the transaction ID and the question, equal for a query and its
+    // response; false when the message has no single question
+    static bool TransactionKey(const uint8_t *msg, size_t length, std::string &key);
+
+    size_t Size() const { return index_.size(); }
+    size_t Capacity() const { return capacity_; }
+    const Stats &GetStats() const { return stats_; }
+
+private:
+    struct Entry {
+        std::string key;
+        std::vector<uint8_t> response;
+        std::vector<uint16_t> ttl_offsets;
+        Clock::time_point stored;
+        Clock::time_point expires;
+    };
+
+    struct Edns {
+        bool present = false;
+        bool dnssec_ok = false;
+        uint16_t payload = 0;
+    };
+
+    using EntryList = std::list<Entry>;
+
+    static const size_t kHeaderSize = 12;
+    static const size_t kMaxResponseSize = 4096;
+    static const uint32_t kMaxTtl = 86400;
+    static const uint32_t kMaxNegativeTtl = 300;
+    static const size_t kMinUdpPayload = 512;
+
+    static bool ParseQuestion(const uint8_t *msg, size_t length, std::string &key, size_t *end);
+    static bool ParseEdns(const uint8_t *msg, size_t length, size_t pos, Edns &edns);
+
+    size_t capacity_;
+    EntryList entries_;
+    std::unordered_map<std::string, EntryList::iterator> index_;
+    Stats stats_;
+};
+
+#endif
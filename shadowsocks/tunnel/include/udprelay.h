@@ -0,0 +1,146 @@
+#ifndef __UDPRELAY_H__
+#define __UDPRELAY_H__
+
+#include <deque>
+#include <boost/asio.hpp>
+
+#include <cares_service/cares.hxx>
+#include <common_utils/endpoint_hash.h>
+#include <common_utils/nat_table.h>
+#include <common_utils/packet_buffer.h>
+#include <common_utils/udp_batch.h>
+#include <common_utils/util.h>
+#include <crypto_utils/cipher.h>
+#include <protocol_hooks/caching_resolver.h>
+#include <protocol_hooks/upstream_pin.h>
+
+#include "dns_cache.h"
+
+struct UdpForwardParam {
+    using CryptoContextGenerator = std::function<std::unique_ptr<CryptoContext>(void)>;
+    boost::asio::ip::udp::endpoint bind_ep;
+    std::string server_host;
+    uint16_t server_port = 0;
+    // the server is the tcp upstream, false when a plugin carries tcp
+    bool pinned = false;
+    CryptoContextGenerator crypto_generator;
+    bool udp_enable = false;
+    size_t max_associations = 4096;
+    size_t idle_timeout = 60;
+    // 0 disables the dns response cache
+    size_t dns_cache_size = 0;
+};
+
+// Forwards datagrams to the fixed tunnel target through ss-server. Each
+// client endpoint owns an association with its own crypto context and a
+// socket connected to the server; the tunnel address header is written
+// into the headroom in front of every datagram. With the dns cache on, a
+// reply is cached only when it comes from the target and answers a query
+// its association sent.
+class UdpForwardServer : public std::enable_shared_from_this<UdpForwardServer> {
+    typedef boost::asio::ip::udp udp;
+    using resolver_type = CachingResolver<cares::tcp::resolver>;
+    using CryptoContextGenerator = UdpForwardParam::CryptoContextGenerator;
+
+    struct Datagram {
+        PacketBufferPool::Pointer buf;
+        const uint8_t *data;
+        size_t size;
+        udp::endpoint ep;
+    };
+
+    struct Association {
+        Association(boost::asio::io_context &ctx)
+            : socket(ctx) {
+        }
+
+        void Close() {
+            boost::system::error_code ec;
+            closed = true;
+            socket.close(ec);
+        }
+
+        udp::socket socket;
+        bool closed = false;
+        udp::endpoint client_ep;
+        udp::endpoint server_ep;
+        std::unique_ptr<CryptoContext> crypto;
+        // transaction keys of the dns queries not answered yet
+        std::deque<std::string> queries;
+    };
+
+    using NatTableType = NatTable<udp::endpoint, std::shared_ptr<Association>>;
+public:
+
+    UdpForwardServer(boost::asio::io_context &ctx, UdpForwardParam param,
+                     std::shared_ptr<resolver_type> resolver);
+
+    void Stop();
+
+    bool Stopped() const {
+        return !running_;
+    }
+
+    void DumpStats() const;
+
+private:
+
+    void DoResolveServer();
+    bool ServerEndpoint(udp::endpoint &ep);
+    void ServerRefused(const std::shared_ptr<Association> &assoc);
+    void DoResolveTarget();
+    bool FromTarget(const TargetInfo &source) const;
+    void RememberQuery(Association &assoc, const uint8_t *query, size_t length);
+    bool AnswersQuery(Association &assoc, const uint8_t *response, size_t length);
+    void DoReceive();
+    void DrainReceive();
+    void ProcessRequest(const udp::endpoint &ep, PacketBufferPool::Pointer &buf, size_t length);
+    void DoSendToServer(std::shared_ptr<Association> assoc, Datagram dgram);
+    void DoReceiveFromServer(std::shared_ptr<Association> assoc);
+    void DrainServer(std::shared_ptr<Association> assoc);
+    void QueueReply(Datagram dgram);
+    void FlushReplies();
+    void DoSweep();
+
+    static const size_t kMaxDrainRounds = 8;
+    static const size_t kMaxPendingReplies = 4096;
+    // sweeps between refreshes of a server not shared with tcp
+    static const size_t kServerRefresh = 60;
+    static const size_t kMaxPendingQueries = 64;
+    // sweeps between refreshes of the target addresses
+    static const size_t kTargetRefresh = 60;
+
+    bool running_;
+    udp::socket socket_;
+    const std::vector<uint8_t> &header_;
+    size_t offset_;
+    size_t tailroom_;
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs_;
+    std::deque<Datagram> replies_;
+    bool flush_pending_;
+    uint64_t dropped_replies_;
+    UdpBatchStats recv_stats_;
+    UdpBatchStats send_stats_;
+    std::string server_host_;
+    uint16_t server_port_;
+    bool pinned_;
+    udp::endpoint server_ep_;
+    bool resolving_;
+    // a hostname not shared with tcp, resolved by the relay itself
+    bool refresh_server_;
+    size_t server_age_;
+    std::shared_ptr<resolver_type> resolver_;
+    CryptoContextGenerator crypto_generator_;
+    std::unique_ptr<DnsResponseCache> dns_cache_;
+    TargetInfo target_;
+    // what a hostname target resolves to, replies from elsewhere are not
+    // cached
+    std::vector<boost::asio::ip::address> target_addresses_;
+    bool resolving_target_;
+    size_t target_age_;
+    boost::asio::deadline_timer sweep_timer_;
+    NatTableType::Clock::duration idle_timeout_;
+    NatTableType associations_;
+};
+
+#endif
@@ -0,0 +1,263 @@
+
+#include <cctype>
+#include <algorithm>
+
+#include "dns_cache.h"
+
+namespace {
+
+enum {
+    QR_FLAG = 0x80,
+    OPCODE_MASK = 0x78,
+    TC_FLAG = 0x02,
+    RD_FLAG = 0x01,
+    RCODE_MASK = 0x0f
+};
+
+enum { DO_FLAG = 0x80 };
+
+enum {
+    NOERROR_RCODE = 0,
+    NXDOMAIN_RCODE = 3
+};
+
+enum {
+    SOA_TYPE = 6,
+    OPT_TYPE = 41
+};
+
+uint16_t Read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t Read32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void Write32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// skips a possibly compressed owner name, returns false when truncated
+bool SkipName(const uint8_t *msg, size_t length, size_t &pos) {
+    while (pos < length) {
+        uint8_t label = msg[pos];
+        if (label == 0) {
+            ++pos;
+            return true;
+        }
+        if ((label & 0xc0) == 0xc0) {
+            pos += 2;
+            return pos <= length;
+        }
+        if (label & 0xc0) {
+            return false;
+        }
+        pos += label + 1;
+    }
+    return false;
+}
+
+}
+
+DnsResponseCache::DnsResponseCache(size_t capacity)
+    : capacity_(std::max((size_t)1, capacity)) {
+}
+
+// the key is the question in wire format with the name lowercased
+bool DnsResponseCache::ParseQuestion(const uint8_t *msg, size_t length,
+                                     std::string &key, size_t *end) {
+    if (length < kHeaderSize || Read16(msg + 4) != 1 || (msg[2] & OPCODE_MASK)) {
+        return false;
+    }
+    size_t pos = kHeaderSize;
+    key.clear();
+    while (true) {
+        if (pos >= length) {
+            return false;
+        }
+        uint8_t label = msg[pos];
+        if (label & 0xc0 || key.size() + label + 1 > 255) {
+            return false;
+        }
+        if (pos + label + 1 > length) {
+            return false;
+        }
+        key.push_back((char)label);
+        for (size_t i = 1; i <= label; ++i) {
+            key.push_back((char)std::tolower(msg[pos + i]));
+        }
+        pos += label + 1;
+        if (!label) {
+            break;
+        }
+    }
+    if (pos + 4 > length) {
+        return false;
+    }
+    key.append((const char *)msg + pos, 4);
+    *end = pos + 4;
+    return true;
+}
+
+bool DnsResponseCache::TransactionKey(const uint8_t *msg, size_t length, std::string &key) {
+    size_t end;
+    if (!ParseQuestion(msg, length, key, &end)) {
+        return false;
+    }
+    key.insert(0, (const char *)msg, 2);
+    return true;
+}
+
+// finds the OPT record of the additional section, pos at the end of the
+// question; false when the records are truncated
+bool DnsResponseCache::ParseEdns(const uint8_t *msg, size_t length, size_t pos, Edns &edns) {
+    size_t before = Read16(msg + 6) + Read16(msg + 8);
+    size_t records = before + Read16(msg + 10);
+    edns = Edns();
+    for (size_t i = 0; i < records; ++i) {
+        if (!SkipName(msg, length, pos) || pos + 10 > length) {
+            return false;
+        }
+        if (i >= before && Read16(msg + pos) == OPT_TYPE) {
+            edns.present = true;
+            edns.payload = Read16(msg + pos + 2);
+            edns.dnssec_ok = msg[pos + 6] & DO_FLAG;
+        }
+        pos += 10 + Read16(msg + pos + 8);
+        if (pos > length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t DnsResponseCache::Answer(const uint8_t *query, size_t length,
+                                uint8_t *out, size_t capacity) {
+    std::string key;
+    size_t end;
+    Edns edns;
+    if ((length >= kHeaderSize && (query[2] & QR_FLAG))
+        || !ParseQuestion(query, length, key, &end)
+        || !ParseEdns(query, length, end, edns)) {
+        return 0;
+    }
+    key.push_back((char)(edns.present | edns.dnssec_ok << 1));
+    auto itr = index_.find(key);
+    if (itr == index_.end()) {
+        ++stats_.misses;
+        return 0;
+    }
+
+    auto entry = itr->second;
+    auto now = Clock::now();
+    if (now >= entry->expires) {
+        index_.erase(itr);
+        entries_.erase(entry);
+        ++stats_.misses;
+        return 0;
+    }
+    if (entry->response.size() > capacity || end > capacity) {
+        ++stats_.misses;
+        return 0;
+    }
+
+    // too large for the requester, it retries over tcp
+    size_t limit = kMinUdpPayload;
+    if (edns.present && edns.payload > limit) {
+        limit = edns.payload;
+    }
+    if (entry->response.size() > limit) {
+        std::copy(query, query + end, out);
+        out[2] = QR_FLAG | TC_FLAG | (query[2] & RD_FLAG);
+        out[3] = entry->response[3];
+        std::fill(out + 6, out + kHeaderSize, 0);
+        entries_.splice(entries_.end(), entries_, entry);
+        ++stats_.hits;
+        ++stats_.truncated;
+        return end;
+    }
+
+    std::copy(entry->response.begin(), entry->response.end(), out);
+    out[0] = query[0];
+    out[1] = query[1];
+    uint32_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - entry->stored).count();
+    for (auto offset : entry->ttl_offsets) {
+        uint32_t ttl = Read32(&entry->response[offset]);
+        Write32(out + offset, ttl > elapsed ? ttl - elapsed : 0);
+    }
+    entries_.splice(entries_.end(), entries_, entry);
+    ++stats_.hits;
+    return entry->response.size();
+}
+
+void DnsResponseCache::Store(const uint8_t *response, size_t length) {
+    std::string key;
+    size_t pos;
+    if (length > kMaxResponseSize || length < kHeaderSize
+        || !(response[2] & QR_FLAG) || (response[2] & TC_FLAG)
+        || !ParseQuestion(response, length, key, &pos)) {
+        return;
+    }
+    uint8_t rcode = response[3] & RCODE_MASK;
+    Edns edns;
+    if ((rcode != NOERROR_RCODE && rcode != NXDOMAIN_RCODE)
+        || !ParseEdns(response, length, pos, edns)) {
+        return;
+    }
+    // servers echo the OPT record and the DO bit of the query
+    key.push_back((char)(edns.present | edns.dnssec_ok << 1));
+
+    // answers live for their smallest TTL, negative answers for the TTL
+    // of the authority records and the SOA minimum (RFC 2308), capped
+    // shorter
+    size_t answers = Read16(response + 6);
+    size_t records = answers + Read16(response + 8) + Read16(response + 10);
+    bool negative = rcode == NXDOMAIN_RCODE || !answers;
+    uint32_t min_ttl = negative ? static_cast<uint32_t>(kMaxNegativeTtl) : static_cast<uint32_t>(kMaxTtl);
+    bool has_ttl = false;
+    std::vector<uint16_t> ttl_offsets;
+    for (size_t i = 0; i < records; ++i) {
+        if (!SkipName(response, length, pos) || pos + 10 > length) {
+            return;
+        }
+        uint16_t type = Read16(response + pos);
+        size_t rdlength = Read16(response + pos + 8);
+        size_t next = pos + 10 + rdlength;
+        if (next > length) {
+            return;
+        }
+        if (type != OPT_TYPE) {
+            min_ttl = std::min(min_ttl, Read32(response + pos + 4));
+            ttl_offsets.push_back((uint16_t)(pos + 4));
+            has_ttl = true;
+        }
+        if (negative && type == SOA_TYPE && rdlength >= 22) {
+            min_ttl = std::min(min_ttl, Read32(response + next - 4));
+        }
+        pos = next;
+    }
+    if (!has_ttl || !min_ttl) {
+        return;
+    }
+
+    auto now = Clock::now();
+    auto itr = index_.find(key);
+    if (itr != index_.end()) {
+        entries_.erase(itr->second);
+        index_.erase(itr);
+    } else if (index_.size() >= capacity_) {
+        index_.erase(entries_.front().key);
+        entries_.pop_front();
+        ++stats_.evictions;
+    }
+    entries_.push_back(Entry{
+        key, std::vector<uint8_t>(response, response + length), std::move(ttl_offsets),
+        now, now + std::chrono::seconds(min_ttl)
+    });
+    index_.emplace(std::move(key), std::prev(entries_.end()));
+    ++stats_.stores;
+}
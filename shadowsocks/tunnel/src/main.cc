@@ -4,10 +4,12 @@
 #include <plugin_utils/plugin.h>
 
 #include "server.h"
+#include "udprelay.h"
 #include "parse_args.h"
 
 void SignalHandler(boost::asio::signal_set &signals,
                    std::shared_ptr<ForwardServer> tcp,
+                   std::shared_ptr<UdpForwardServer> udp,
                    boost::system::error_code ec, int sig);
 
 int main(int argc, char *argv[]) {
@@ -15,14 +17,16 @@ int main(int argc, char *argv[]) {
     Plugin plugin;
     StreamServerArgs args;
     ResolverArgs rargs;
+    UdpForwardParam udp_param;
 
-    ParseArgs(argc, argv, &args, &rargs, &log_level, &plugin);
+    ParseArgs(argc, argv, &args, &rargs, &log_level, &plugin, &udp_param);
 
     InitialLogLevel(argv[0], log_level);
 
     boost::asio::io_context ctx;
+    boost::asio::use_service<DnsCache>(ctx).Start(rargs);
 
-    auto resolver = std::make_shared<cares::tcp::resolver>(ctx);
+    auto resolver = std::make_shared<CachingResolver<cares::tcp::resolver>>(ctx);
     boost::system::error_code ec;
     if (!rargs.servers.empty()) {
         resolver->set_servers(rargs.servers, ec);
@@ -37,6 +41,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    std::shared_ptr<UdpForwardServer> udp_server;
+    if (udp_param.udp_enable) {
+        udp_server = std::make_shared<UdpForwardServer>(ctx, std::move(udp_param), resolver);
+    }
+
     auto tcp_server = std::make_shared<ForwardServer>(ctx, args, std::move(resolver));
 
     boost::asio::signal_set signals(ctx, SIGINT, SIGTERM);
@@ -47,16 +56,20 @@ int main(int argc, char *argv[]) {
 
     std::unique_ptr<boost::process::child> plugin_process;
     plugin_process = StartPlugin(plugin,
-        [&ctx, &tcp_server, &signals]() {
+        [&ctx, &tcp_server, &udp_server, &signals]() {
             boost::asio::post(
                 ctx,
-                [&tcp_server, &signals]() {
+                [&tcp_server, &udp_server, &signals]() {
                     bool need_cancel_signal = false;
                     if (tcp_server && !tcp_server->Stopped()) {
                         LOG(ERROR) << "server will terminate due to plugin exited";
                         tcp_server->Stop();
                         need_cancel_signal = true;
                     }
+                    if (udp_server && !udp_server->Stopped()) {
+                        udp_server->Stop();
+                        need_cancel_signal = true;
+                    }
                     if (need_cancel_signal) {
                         signals.cancel();
                     }
@@ -70,6 +83,7 @@ int main(int argc, char *argv[]) {
             SignalHandler,
             std::ref(signals),
             tcp_server,
+            udp_server,
             std::placeholders::_1,
             std::placeholders::_2
         )
@@ -88,6 +102,7 @@ int main(int argc, char *argv[]) {
 
 void SignalHandler(boost::asio::signal_set &signals,
                    std::shared_ptr<ForwardServer> tcp,
+                   std::shared_ptr<UdpForwardServer> udp,
                    boost::system::error_code ec, int sig) {
     if (ec == boost::asio::error::operation_aborted) {
         return;
@@ -98,14 +113,17 @@ void SignalHandler(boost::asio::signal_set &signals,
     if (sig == SIGINFO) {
         boost::asio::post(
             signals.get_executor().context(),
-            [tcp]() {
+            [tcp, udp]() {
                 tcp->DumpConnections();
+                if (udp) {
+                    udp->DumpStats();
+                }
             }
         );
         signals.async_wait(
             std::bind(
                 SignalHandler,
-                std::ref(signals), tcp,
+                std::ref(signals), tcp, udp,
                 std::placeholders::_1,
                 std::placeholders::_2
             )
@@ -116,5 +134,8 @@ void SignalHandler(boost::asio::signal_set &signals,
     if (tcp && !tcp->Stopped()) {
         tcp->Stop();
     }
+    if (udp && !udp->Stopped()) {
+        udp->Stop();
+    }
 }
 
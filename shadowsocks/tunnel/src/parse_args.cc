@@ -12,7 +12,8 @@ namespace bpo = boost::program_options;
 using boost::asio::ip::tcp;
 
 void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
-               ResolverArgs *rargs, int *log_level, Plugin *p) {
+               ResolverArgs *rargs, int *log_level, Plugin *p,
+               UdpForwardParam *udp) {
     auto factory = CryptoContextGeneratorFactory::Instance();
     bpo::options_description desc("Shadowsocks Tunnel");
     desc.add(*GetCommonOptions()).add_options()
@@ -22,7 +23,14 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
         ("method,m", bpo::value<std::string>(), "Cipher method")
         ("password,k", bpo::value<std::string>(), "Password")
         ("plugin", bpo::value<std::string>(), "Plugin executable name")
-        ("plugin-opts", bpo::value<std::string>(), "Plugin options");
+        ("plugin-opts", bpo::value<std::string>(), "Plugin options")
+        ("udp-relay,u", "Enable udp forwarding")
+        ("udp-max-associations", bpo::value<size_t>()->default_value(4096),
+            "Upper bound of udp associations")
+        ("udp-timeout", bpo::value<size_t>()->default_value(60),
+            "Idle timeout of udp associations in seconds")
+        ("dns-cache-size", bpo::value<size_t>()->default_value(4096),
+            "Entries of the dns response cache when forwarding to port 53, 0 to disable");
 
     bpo::variables_map vm;
     bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
@@ -59,6 +67,11 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
     }
     args->bind_ep = tcp::endpoint(bind_address, bind_port);
     args->timeout = vm["timeout"].as<size_t>() * 1000;
+    args->offload_threads = vm["offload-threads"].as<size_t>();
+    args->offload_threshold = vm["offload-threshold"].as<size_t>() * 1024;
+    args->max_sessions = vm["max-sessions"].as<size_t>();
+    args->max_handshakes = vm["max-handshakes"].as<size_t>();
+    args->max_sessions_per_client = vm["max-sessions-per-client"].as<size_t>();
 
     if (!vm.count("forward-to")) {
         std::cerr << "Please specify the forward address" << std::endl;
@@ -86,6 +99,18 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
 
     *log_level = vm["verbose"].as<int>();
 
+    // plugins only carry tcp, datagrams go to the server itself
+    udp->udp_enable = vm.count("udp-relay");
+    udp->bind_ep.address(bind_address);
+    udp->bind_ep.port(bind_port);
+    udp->server_host = server_host;
+    udp->server_port = server_port;
+    udp->max_associations = vm["udp-max-associations"].as<size_t>();
+    udp->idle_timeout = vm["udp-timeout"].as<size_t>();
+    if (forward_target.GetPort() == 53) {
+        udp->dns_cache_size = vm["dns-cache-size"].as<size_t>();
+    }
+
     if (vm.count("plugin")) {
         std::string plugin = vm["plugin"].as<std::string>();
         if (!plugin.empty()) {
@@ -108,6 +133,9 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
         }
     }
     auto remote_target = std::make_shared<TargetInfo>(MakeTarget(server_host, server_port));
+    args->upstream_host = server_host;
+    args->upstream_port = server_port;
+    udp->pinned = !p->Enabled();
     if (remote_target->IsEmpty()) {
         std::cerr << "Invalid server host / port" << std::endl;
     }
@@ -124,6 +152,8 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args,
 
     GetResolverArgs(vm, rargs);
 
+    udp->crypto_generator = *crypto_generator;
+
     args->generator = \
         [target = std::move(remote_target), g = *crypto_generator]() {
             return GetProtocol<ShadowsocksTunnel>(target, g());
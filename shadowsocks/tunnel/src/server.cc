@@ -37,15 +37,7 @@ public:
                 client_.timer.cancel();
                 auto after_connected = std::bind(&Session::DoWriteToTarget, self);
                 if (protocol_->NeedResolve()) {
-                    std::string hostname;
-                    uint16_t port;
-                    protocol_->GetResolveArgs(hostname, port);
-                    DoResolveTarget(
-                        self,
-                        std::move(hostname),
-                        std::move(port),
-                        std::move(after_connected)
-                    );
+                    DoConnectUpstream(self, std::move(after_connected));
                 } else {
                     DoConnectTarget(
                         self,
@@ -0,0 +1,489 @@
+
+#include "udprelay.h"
+
+#include <algorithm>
+
+#include <common_utils/util.h>
+#include <ss_proto/tunnel.h>
+
+using boost::asio::ip::udp;
+namespace bsys = boost::system;
+
+UdpForwardServer::UdpForwardServer(boost::asio::io_context &ctx, UdpForwardParam param,
+                                   std::shared_ptr<resolver_type> resolver)
+    : socket_(ctx, param.bind_ep),
+      header_(ShadowsocksTunnel::GetHeader()),
+      flush_pending_(false),
+      dropped_replies_(0),
+      server_host_(std::move(param.server_host)),
+      server_port_(param.server_port),
+      pinned_(param.pinned),
+      resolving_(false),
+      refresh_server_(false),
+      server_age_(0),
+      resolver_(resolver),
+      crypto_generator_(std::move(param.crypto_generator)),
+      dns_cache_(param.dns_cache_size ? new DnsResponseCache(param.dns_cache_size) : nullptr),
+      resolving_target_(false),
+      target_age_(0),
+      sweep_timer_(ctx),
+      idle_timeout_(std::chrono::seconds(param.idle_timeout)),
+      associations_(param.max_associations) {
+    running_ = true;
+    auto probe = crypto_generator_();
+    offset_ = probe->PacketHeadroom() + header_.size();
+    tailroom_ = probe->PacketTailroom();
+    LOG(INFO) << "udp forwarding running at " << socket_.local_endpoint();
+    if (dns_cache_) {
+        LOG(INFO) << "dns response cache of " << dns_cache_->Capacity() << " entries";
+        GetTargetFromSocks5Address(header_.data(), nullptr, target_);
+        if (target_.NeedResolve()) {
+            DoResolveTarget();
+        }
+    }
+
+    bsys::error_code ec;
+    auto address = boost::asio::ip::make_address(server_host_, ec);
+    if (pinned_) {
+        boost::asio::use_service<UpstreamPin>(ctx).Start(server_host_, server_port_, resolver_);
+    } else if (!ec) {
+        server_ep_ = udp::endpoint(address, server_port_);
+    } else {
+        refresh_server_ = true;
+        DoResolveServer();
+    }
+    DoReceive();
+    DoSweep();
+}
+
+// the server port stays 0 until its hostname resolved, failures are
+// retried by the sweep and answers refreshed by it
+void UdpForwardServer::DoResolveServer() {
+    resolving_ = true;
+    server_age_ = 0;
+    resolver_->async_resolve(
+        server_host_, server_port_,
+        [this](bsys::error_code ec, resolver_type::results_type results) {
+            resolving_ = false;
+            if (ec) {
+                LOG(WARNING) << "unable to resolve " << server_host_ << ", " << ec.message();
+                return;
+            }
+            auto ep = results.begin()->endpoint();
+            server_ep_ = udp::endpoint(ep.address(), ep.port());
+            VLOG(1) << "udp relay server " << server_ep_;
+        }
+    );
+}
+
+void UdpForwardServer::DoResolveTarget() {
+    resolving_target_ = true;
+    target_age_ = 0;
+    resolver_->async_resolve(
+        target_.GetHostname(), target_.GetPort(),
+        [this](bsys::error_code ec, resolver_type::results_type results) {
+            resolving_target_ = false;
+            if (ec) {
+                LOG(WARNING) << "unable to resolve " << target_.GetHostname() << ", " << ec.message();
+                return;
+            }
+            target_addresses_.clear();
+            for (auto &result : results) {
+                target_addresses_.push_back(result.endpoint().address());
+            }
+        }
+    );
+}
+
+// ss-server reports the address a reply came from, v4 as plain IPv4
+bool UdpForwardServer::FromTarget(const TargetInfo &source) const {
+    if (source.NeedResolve() || source.GetPort() != target_.GetPort()) {
+        return false;
+    }
+    auto address = source.GetIp();
+    auto same = [&address](boost::asio::ip::address other) {
+        if (other.is_v6() && other.to_v6().is_v4_mapped()) {
+            other = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, other.to_v6());
+        }
+        return other == address;
+    };
+    if (!target_.NeedResolve()) {
+        return same(target_.GetIp());
+    }
+    return std::any_of(target_addresses_.begin(), target_addresses_.end(), same);
+}
+
+void UdpForwardServer::RememberQuery(Association &assoc, const uint8_t *query, size_t length) {
+    std::string key;
+    if (!DnsResponseCache::TransactionKey(query, length, key)) {
+        return;
+    }
+    if (assoc.queries.size() >= kMaxPendingQueries) {
+        assoc.queries.pop_front();
+    }
+    assoc.queries.push_back(std::move(key));
+}
+
+bool UdpForwardServer::AnswersQuery(Association &assoc, const uint8_t *response, size_t length) {
+    std::string key;
+    if (!DnsResponseCache::TransactionKey(response, length, key)) {
+        return false;
+    }
+    auto itr = std::find(assoc.queries.begin(), assoc.queries.end(), key);
+    if (itr == assoc.queries.end()) {
+        return false;
+    }
+    assoc.queries.erase(itr);
+    return true;
+}
+
+void UdpForwardServer::DoReceive() {
+    socket_.async_wait(
+        udp::socket::wait_read,
+        [this](bsys::error_code ec) {
+            if (!ec) {
+                DrainReceive();
+            }
+
+            if (running_) {
+                DoReceive();
+            }
+        }
+    );
+}
+
+// datagrams land after the room for the cipher framing and the tunnel
+// header, so they are sealed where they are
+void UdpForwardServer::DrainReceive() {
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> senders;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < bufs_.size(); ++i) {
+            if (!bufs_[i]) {
+                bufs_[i] = PacketBufferPool::Acquire();
+            }
+            buffers[i] = boost::asio::buffer(bufs_[i]->Begin() + offset_,
+                                             bufs_[i]->Capacity() - offset_ - tailroom_);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(socket_, buffers.data(), lengths.data(),
+                                            senders.data(), buffers.size(), ec);
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "udp receive error: " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ProcessRequest(senders[i], bufs_[i], lengths[i]);
+        }
+        recv_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        if (n < buffers.size()) {
+            return;
+        }
+    }
+}
+
+void UdpForwardServer::ProcessRequest(const udp::endpoint &ep,
+                                      PacketBufferPool::Pointer &buf, size_t length) {
+    uint8_t *payload = buf->Begin() + offset_;
+    if (dns_cache_) {
+        auto reply = PacketBufferPool::Acquire();
+        uint8_t *data = reply->Begin();
+        size_t reply_length = dns_cache_->Answer(payload, length, data, reply->Capacity());
+        if (reply_length) {
+            VLOG(2) << "dns cache hit for " << ep;
+            QueueReply(Datagram{ std::move(reply), data, reply_length, ep });
+            return;
+        }
+    }
+
+    std::shared_ptr<Association> assoc;
+    auto entry = associations_.Find(ep);
+    if (entry) {
+        assoc = *entry;
+    } else {
+        udp::endpoint server_ep;
+        if (!ServerEndpoint(server_ep)) {
+            VLOG(1) << "server unresolved, drop packet from " << ep;
+            return;
+        }
+        assoc = std::make_shared<Association>(socket_.get_executor().context());
+        bsys::error_code ec;
+        assoc->socket.connect(server_ep, ec);
+        if (ec) {
+            LOG(WARNING) << "unable to connect " << server_ep << ", " << ec.message();
+            return;
+        }
+        assoc->client_ep = ep;
+        assoc->server_ep = server_ep;
+        assoc->crypto = crypto_generator_();
+        std::shared_ptr<Association> evicted;
+        if (associations_.Insert(ep, assoc, idle_timeout_, &evicted)) {
+            VLOG(1) << "association table full, evict " << evicted->client_ep;
+            evicted->Close();
+        }
+        DoReceiveFromServer(assoc);
+    }
+
+    if (dns_cache_) {
+        RememberQuery(*assoc, payload, length);
+    }
+
+    uint8_t *plaintext = payload - header_.size();
+    std::copy(header_.begin(), header_.end(), plaintext);
+    uint8_t *packet;
+    ssize_t packet_length = assoc->crypto->EncryptPacket(
+        plaintext, header_.size() + length, &packet
+    );
+    if (packet_length <= 0) {
+        LOG(WARNING) << "udp encrypt error";
+        return;
+    }
+    DoSendToServer(assoc, Datagram{ std::move(buf), packet, (size_t)packet_length, assoc->server_ep });
+}
+
+// new associations follow the upstream pin, so they pick up its refreshes
+// and fail overs
+bool UdpForwardServer::ServerEndpoint(udp::endpoint &ep) {
+    if (!pinned_) {
+        ep = server_ep_;
+        return ep.port() != 0;
+    }
+    auto &upstream = boost::asio::use_service<UpstreamPin>(socket_.get_executor().context());
+    if (!upstream.Pinned()) {
+        return false;
+    }
+    auto pinned = upstream.Endpoint();
+    ep = udp::endpoint(pinned.address(), pinned.port());
+    return true;
+}
+
+// nothing listens at the address, the next datagram of the client opens
+// an association to the one failed over to
+void UdpForwardServer::ServerRefused(const std::shared_ptr<Association> &assoc) {
+    LOG(WARNING) << "server " << assoc->server_ep << " refused " << assoc->client_ep;
+    if (pinned_) {
+        auto &upstream = boost::asio::use_service<UpstreamPin>(socket_.get_executor().context());
+        upstream.ReportFailure(boost::asio::ip::tcp::endpoint(assoc->server_ep.address(),
+                                                              assoc->server_ep.port()));
+    }
+    auto entry = associations_.Find(assoc->client_ep);
+    if (entry && *entry == assoc) {
+        std::shared_ptr<Association> erased;
+        associations_.Erase(assoc->client_ep, &erased);
+    }
+    assoc->Close();
+}
+
+void UdpForwardServer::DoSendToServer(std::shared_ptr<Association> assoc, Datagram dgram) {
+    auto buffer = boost::asio::buffer(dgram.data, dgram.size);
+    assoc->socket.async_send(
+        std::move(buffer),
+        [assoc, buf{ std::move(dgram.buf) }]
+        (bsys::error_code ec, size_t length) {
+            if (ec && ec != boost::asio::error::operation_aborted) {
+                LOG(WARNING) << "unable to send to server for " << assoc->client_ep
+                             << ", " << ec.message();
+            }
+        }
+    );
+}
+
+void UdpForwardServer::DoReceiveFromServer(std::shared_ptr<Association> assoc) {
+    assoc->socket.async_wait(
+        udp::socket::wait_read,
+        [this, assoc](bsys::error_code ec) {
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted) {
+                    LOG(WARNING) << "unable to receive for " << assoc->client_ep
+                                 << ", " << ec.message();
+                }
+                return;
+            }
+            DrainServer(assoc);
+            if (assoc->closed) {
+                return;
+            }
+            associations_.Touch(assoc->client_ep);
+            DoReceiveFromServer(assoc);
+        }
+    );
+}
+
+// replies are opened in place and leave without their address header
+void UdpForwardServer::DrainServer(std::shared_ptr<Association> assoc) {
+    std::array<PacketBufferPool::Pointer, UdpBatchIO::kMaxBatch> bufs;
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+
+    for (size_t round = 0; round < kMaxDrainRounds; ++round) {
+        for (size_t i = 0; i < bufs.size(); ++i) {
+            if (!bufs[i]) {
+                bufs[i] = PacketBufferPool::Acquire();
+            }
+            buffers[i] = boost::asio::buffer(bufs[i]->Begin(), bufs[i]->Capacity());
+        }
+
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(assoc->socket, buffers.data(), lengths.data(),
+                                            nullptr, buffers.size(), ec);
+        if (ec == boost::asio::error::connection_refused) {
+            ServerRefused(assoc);
+            return;
+        }
+        if (ec) {
+            if (ec != boost::asio::error::would_block) {
+                LOG(WARNING) << "unable to receive for " << assoc->client_ep
+                             << ", " << ec.message();
+            }
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t *plaintext;
+            ssize_t plain_length = assoc->crypto->DecryptPacket(
+                bufs[i]->Begin(), lengths[i], &plaintext
+            );
+            if (plain_length <= 0) {
+                LOG(WARNING) << "udp decrypt error";
+                continue;
+            }
+            TargetInfo source;
+            size_t head_length = GetTargetFromSocks5Address(plaintext, nullptr, source);
+            if (!head_length || head_length > (size_t)plain_length) {
+                LOG(WARNING) << "invalid udp header";
+                continue;
+            }
+            uint8_t *data = plaintext + head_length;
+            size_t size = plain_length - head_length;
+            // anyone may send to the outbound port of ss-server, only
+            // answers to our own queries are shared with every client
+            if (dns_cache_ && FromTarget(source) && AnswersQuery(*assoc, data, size)) {
+                dns_cache_->Store(data, size);
+            }
+            QueueReply(Datagram{ std::move(bufs[i]), data, size, assoc->client_ep });
+        }
+        if (n < buffers.size()) {
+            return;
+        }
+    }
+}
+
+void UdpForwardServer::QueueReply(Datagram dgram) {
+    if (replies_.size() >= kMaxPendingReplies) {
+        ++dropped_replies_;
+        VLOG(1) << "reply queue full, drop packet to " << dgram.ep;
+        return;
+    }
+    replies_.emplace_back(std::move(dgram));
+    if (!flush_pending_) {
+        flush_pending_ = true;
+        boost::asio::post(socket_.get_executor(), [this]() { FlushReplies(); });
+    }
+}
+
+// replies gathered during one loop turn leave in as few calls as possible
+void UdpForwardServer::FlushReplies() {
+    std::array<boost::asio::const_buffer, UdpBatchIO::kMaxBatch> packets;
+    std::array<udp::endpoint, UdpBatchIO::kMaxBatch> destinations;
+
+    flush_pending_ = false;
+    while (!replies_.empty()) {
+        size_t count = std::min(replies_.size(), packets.size());
+        for (size_t i = 0; i < count; ++i) {
+            packets[i] = boost::asio::buffer(replies_[i].data, replies_[i].size);
+            destinations[i] = replies_[i].ep;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bsys::error_code ec;
+        size_t n = UdpBatchIO::SendBatch(socket_, packets.data(), destinations.data(), count, ec);
+        if (n) {
+            send_stats_.Record(n, std::chrono::steady_clock::now() - start);
+        }
+        replies_.erase(replies_.begin(), replies_.begin() + n);
+
+        if (ec == boost::asio::error::would_block) {
+            flush_pending_ = true;
+            socket_.async_wait(
+                udp::socket::wait_write,
+                [this](bsys::error_code ec) {
+                    flush_pending_ = false;
+                    if (!ec) {
+                        FlushReplies();
+                    }
+                }
+            );
+            return;
+        } else if (ec) {
+            LOG(WARNING) << "unable to send to " << replies_.front().ep
+                         << ", " << ec.message();
+            replies_.pop_front();
+        }
+    }
+}
+
+void UdpForwardServer::DoSweep() {
+    sweep_timer_.expires_from_now(boost::posix_time::seconds(1));
+    sweep_timer_.async_wait(
+        [this](bsys::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            associations_.Expire(
+                [](std::shared_ptr<Association> &assoc) {
+                    VLOG(1) << "association expired " << assoc->client_ep;
+                    assoc->Close();
+                }
+            );
+            if (refresh_server_ && !resolving_
+                && (!server_ep_.port() || ++server_age_ >= kServerRefresh)) {
+                DoResolveServer();
+            }
+            if (dns_cache_ && target_.NeedResolve() && !resolving_target_
+                && (target_addresses_.empty() || ++target_age_ >= kTargetRefresh)) {
+                DoResolveTarget();
+            }
+            DoSweep();
+        }
+    );
+}
+
+void UdpForwardServer::Stop() {
+    running_ = false;
+    socket_.cancel();
+    sweep_timer_.cancel();
+    associations_.Clear(
+        [](std::shared_ptr<Association> &assoc) {
+            assoc->Close();
+        }
+    );
+}
+
+void UdpForwardServer::DumpStats() const {
+    auto &stats = associations_.GetStats();
+    LOG(INFO) << "udp associations: " << associations_.Size() << "/" << associations_.Capacity()
+              << ", hits: " << stats.hits
+              << ", misses: " << stats.misses
+              << ", evictions: " << stats.evictions
+              << ", expirations: " << stats.expirations
+              << ", pending replies: " << replies_.size()
+              << ", dropped replies: " << dropped_replies_ << std::endl
+              << "receive " << recv_stats_.DumpToStr() << std::endl
+              << "send " << send_stats_.DumpToStr();
+    if (dns_cache_) {
+        auto &cache_stats = dns_cache_->GetStats();
+        auto lookups = cache_stats.hits + cache_stats.misses;
+        LOG(INFO) << "dns cache: " << dns_cache_->Size() << "/" << dns_cache_->Capacity()
+                  << ", hits: " << cache_stats.hits
+                  << ", misses: " << cache_stats.misses
+                  << ", hit rate: " << (lookups ? 100.0 * cache_stats.hits / lookups : 0.0) << "%"
+                  << ", stores: " << cache_stats.stores
+                  << ", evictions: " << cache_stats.evictions
+                  << ", truncated: " << cache_stats.truncated;
+    }
+}
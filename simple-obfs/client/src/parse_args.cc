@@ -124,10 +124,17 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rar
     Obfuscator::SetObfsArgs(obfs_args);
     args->bind_ep = tcp::endpoint(bind_address, bind_port);
     args->timeout = vm["timeout"].as<size_t>() * 1000;
+    args->offload_threads = vm["offload-threads"].as<size_t>();
+    args->offload_threshold = vm["offload-threshold"].as<size_t>() * 1024;
+    args->max_sessions = vm["max-sessions"].as<size_t>();
+    args->max_handshakes = vm["max-handshakes"].as<size_t>();
+    args->max_sessions_per_client = vm["max-sessions-per-client"].as<size_t>();
 
     GetResolverArgs(vm, rargs);
 
     auto remote_target = std::make_shared<TargetInfo>(MakeTarget(server_host, server_port));
+    args->upstream_host = server_host;
+    args->upstream_port = server_port;
     if (remote_target->IsEmpty()) {
         std::cerr << "Invalid server host / port" << std::endl;
         exit(-1);
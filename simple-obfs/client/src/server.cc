@@ -35,16 +35,7 @@ public:
         };
 
         if (protocol_->NeedResolve()) {
-            std::string hostname;
-            uint16_t port;
-            protocol_->GetResolveArgs(hostname, port);
-            VLOG(1) << "connecting to " << hostname;
-            DoResolveTarget(
-                self,
-                std::move(hostname),
-                std::move(port),
-                std::move(after_connected)
-            );
+            DoConnectUpstream(self, std::move(after_connected));
         } else {
             auto ep = protocol_->GetEndpoint();
             VLOG(1) << "connecting to " << ep;
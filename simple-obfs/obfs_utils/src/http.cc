@@ -3,12 +3,12 @@
 #include <string.h>
 #include <ctime>
 #include <algorithm>
-#include <random>
 #include <functional>
 #include <boost/endian/arithmetic.hpp>
 #include <boost/format.hpp>
 
 #include <common_utils/common.h>
+#include <common_utils/random.h>
 
 #include "obfs_utils/http.h"
 
@@ -39,8 +39,6 @@ static auto kHttpResponseTemplate = boost::format(
     "\r\n"
 );
 
-static std::default_random_engine kEngine{ std::random_device{}() };
-
 static void RandB64(char *buf, size_t len);
 static ssize_t CheckHeader(Buffer &buf);
 static ssize_t GetHeader(const char *header, const char *data, size_t len, std::string &value);
@@ -51,8 +49,8 @@ ssize_t HttpObfs::ObfsRequest(Buffer &buf) {
     }
     obfs_stage_ = 1;
 
-    static int kMajorVersion = kEngine() % 51;
-    static int kMinorVersion = kEngine() % 2;
+    static int kMajorVersion = RandomUniform(51);
+    static int kMinorVersion = RandomUniform(2);
 
     std::string host_port = hostname_.to_string();
     if (kArgs->obfs_port != 80) {
@@ -83,8 +81,8 @@ ssize_t HttpObfs::ObfsResponse(Buffer &buf) {
     }
     obfs_stage_ = 1;
 
-    static int kMajorVersion = kEngine() % 11;
-    static int kMinorVersion = kEngine() % 12;
+    static int kMajorVersion = RandomUniform(11);
+    static int kMinorVersion = RandomUniform(12);
 
     char datetime[64];
     char b64[25];
@@ -189,20 +187,21 @@ ssize_t CheckHeader(Buffer &buf) {
 void RandB64(char *buf, size_t len) {
     static const char kB64Chars[] = \
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    static std::uniform_int_distribution<> u{ 0, (sizeof kB64Chars) - 2 };
 
-    auto last = std::generate_n(buf, len - 2, [&]() { return kB64Chars[u(kEngine)]; });
-    if (kEngine() % 2) {
-        *last++ = '=';
-        *last = '=';
-        return;
-    }
-    *last++ = kB64Chars[u(kEngine)];
-    if (kEngine() % 2) {
-        *last = '=';
-        return;
+    // the low 6 bits of a byte pick a character, one more byte decides padding
+    uint8_t padding;
+    RandomBytes(&padding, 1);
+    size_t chars = len - ((padding & 0x80) ? 2 : (padding & 0x40) ? 1 : 0);
+
+    uint8_t rnd[64];
+    for (size_t i = 0; i < chars; i += sizeof rnd) {
+        size_t n = std::min(chars - i, sizeof rnd);
+        RandomBytes(rnd, n);
+        for (size_t j = 0; j < n; ++j) {
+            buf[i + j] = kB64Chars[rnd[j] & 0x3f];
+        }
     }
-    *last = kB64Chars[u(kEngine)];
+    std::fill(buf + chars, buf + len, '=');
 }
 
 ssize_t NextHeader(const char **data, size_t *len) {
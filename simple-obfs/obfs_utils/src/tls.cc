@@ -1,11 +1,11 @@
 
 #include <stdint.h>
 #include <algorithm>
-#include <random>
 #include <functional>
 #include <boost/endian/arithmetic.hpp>
 
 #include <common_utils/common.h>
+#include <common_utils/random.h>
 
 #include "obfs_utils/tls.h"
 
@@ -239,7 +239,6 @@ static const EncryptedHandshake kEncryptedHandshakeTemplate = {
 
 const uint8_t kDataHeader[3] = {0x17, 0x03, 0x03};
 
-static void RandBytes(uint8_t *buf, size_t len);
 static ssize_t ObfsAppData(Buffer &buf);
 static ssize_t DeObfsAppData(Buffer &buf, size_t idx, Frame *frame);
 
@@ -266,8 +265,8 @@ ssize_t TlsObfs::ObfsRequest(Buffer &buf) {
         hello->len = CT_HTONS(tls_len - 5);
         hello->handshake_len_2 = CT_HTONS(tls_len - 9);
         hello->random_unix_time = CT_HTONL((uint32_t)time(NULL));
-        RandBytes(hello->random_bytes, 28);
-        RandBytes(hello->session_id, 32);
+        RandomBytes(hello->random_bytes, 28);
+        RandomBytes(hello->session_id, 32);
         hello->ext_len = CT_HTONS(tls_len - hello_len);
 
         /* Session Ticket */
@@ -367,11 +366,11 @@ ssize_t TlsObfs::ObfsResponse(Buffer &buf) {
         memcpy(buf.GetData(), &kServerHelloTemplate, hello_len);
         ServerHello  *hello = (ServerHello  *)data;
         hello->random_unix_time = CT_HTONL((uint32_t)time(nullptr));
-        RandBytes(hello->random_bytes, 28);
+        RandomBytes(hello->random_bytes, 28);
         if (session_id_.back()) {
             memcpy(hello->session_id, session_id_.data(), 32);
         } else {
-            RandBytes(hello->session_id, 32);
+            RandomBytes(hello->session_id, 32);
         }
 
         /* Change Cipher Spec */
@@ -566,11 +565,5 @@ void TlsObfs::ResetTarget(std::shared_ptr<const TargetInfo> &target) {
     }
 }
 
-void RandBytes(uint8_t *buf, size_t len) {
-    static std::default_random_engine e{ std::random_device{}() };
-    static std::uniform_int_distribution<uint16_t> u{0, 255};
-    std::generate_n(buf, len, std::bind(std::ref(u), std::ref(e)));
-}
-
 static const ObfsGeneratorRegister<TlsObfs> kReg("tls");
 
@@ -17,8 +17,9 @@ int main(int argc, char *argv[]) {
     InitialLogLevel(argv[0], log_level);
 
     boost::asio::io_context ctx;
+    boost::asio::use_service<DnsCache>(ctx).Start(rargs);
 
-    auto resolver = std::make_shared<cares::tcp::resolver>(ctx);
+    auto resolver = std::make_shared<CachingResolver<cares::tcp::resolver>>(ctx);
     boost::system::error_code ec;
     if (!rargs.servers.empty()) {
         resolver->set_servers(rargs.servers, ec);
@@ -124,6 +124,11 @@ void ParseArgs(int argc, char *argv[], StreamServerArgs *args, ResolverArgs *rar
     Obfuscator::SetObfsArgs(obfs_args);
     args->bind_ep = tcp::endpoint(bind_address, bind_port);
     args->timeout = vm["timeout"].as<size_t>() * 1000;
+    args->offload_threads = vm["offload-threads"].as<size_t>();
+    args->offload_threshold = vm["offload-threshold"].as<size_t>() * 1024;
+    args->max_sessions = vm["max-sessions"].as<size_t>();
+    args->max_handshakes = vm["max-handshakes"].as<size_t>();
+    args->max_sessions_per_client = vm["max-sessions-per-client"].as<size_t>();
 
     auto target_info = std::make_shared<TargetInfo>(MakeTarget(server_host, server_port));
     if (target_info->IsEmpty()) {
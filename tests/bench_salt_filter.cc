@@ -0,0 +1,135 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <sodium.h>
+
+#include <common_utils/common.h>
+#include <common_utils/random.h>
+#include <crypto_utils/crypto.h>
+#include <crypto_utils/salt_filter.h>
+
+// Cost of the salt replay filter on its own, from several threads at
+// once, and its share of a UDP packet and of a TCP session opening.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const size_t kCapacity = 1000000;
+const size_t kPacketSize = 1200;
+const size_t kRequestSize = 64;
+
+double NsPerOp(Clock::time_point start, size_t ops) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / ops;
+}
+
+std::unique_ptr<CryptoContext> NewContext(const std::string &method) {
+    auto generator = CryptoContextGeneratorFactory::Instance()->GetGenerator(method, "bench");
+    CHECK(generator) << method;
+    return (*generator)();
+}
+
+void BenchFilter(size_t threads, size_t ops) {
+    std::vector<std::vector<uint8_t>> salts(threads, std::vector<uint8_t>(ops * 32));
+    for (auto &s : salts) {
+        RandomBytes(s.data(), s.size());
+    }
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&salts, t, ops]() {
+            auto &filter = SaltFilter::Instance();
+            const uint8_t *salt = salts[t].data();
+            for (size_t i = 0; i < ops; ++i, salt += 32) {
+                if (!filter.Contains(salt, 32)) {
+                    filter.CheckAndAdd(salt, 32);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double ns = NsPerOp(start, ops * threads);
+    printf("filter check+add, %zu threads: %.1f ns/salt, %.2f M salts/s\n",
+           threads, ns * threads, 1e3 / ns);
+}
+
+// sealed while the filter is off, a client records its own salts
+std::vector<std::vector<uint8_t>> SealPackets(const std::string &method, size_t ops) {
+    auto client = NewContext(method);
+    std::vector<std::vector<uint8_t>> packets;
+    std::vector<uint8_t> space(kPacketSize + 256);
+    for (size_t i = 0; i < ops; ++i) {
+        uint8_t *plaintext = space.data() + client->PacketHeadroom();
+        uint8_t *packet;
+        ssize_t len = client->EncryptPacket(plaintext, kPacketSize, &packet);
+        CHECK_GT(len, 0);
+        packets.emplace_back(packet, packet + len);
+    }
+    return packets;
+}
+
+// by value, packets are opened in place
+double BenchPacket(const std::string &method, std::vector<std::vector<uint8_t>> packets) {
+    auto server = NewContext(method);
+    auto start = Clock::now();
+    for (auto &packet : packets) {
+        uint8_t *out;
+        CHECK_EQ(server->DecryptPacket(packet.data(), packet.size(), &out), (ssize_t)kPacketSize);
+    }
+    return NsPerOp(start, packets.size());
+}
+
+std::vector<std::vector<uint8_t>> SealOpenings(const std::string &method, size_t ops) {
+    std::vector<std::vector<uint8_t>> openings;
+    std::vector<uint8_t> request(kRequestSize, 'x');
+    for (size_t i = 0; i < ops; ++i) {
+        auto client = NewContext(method);
+        Buffer buf;
+        buf.AppendData(request.data(), request.size());
+        CHECK_GT(client->Encrypt(buf), 0);
+        openings.emplace_back(buf.Begin(), buf.End());
+    }
+    return openings;
+}
+
+double BenchSession(const std::string &method, const std::vector<std::vector<uint8_t>> &openings) {
+    auto start = Clock::now();
+    for (auto &opening : openings) {
+        auto server = NewContext(method);
+        Buffer buf;
+        buf.AppendData(opening.data(), opening.size());
+        CHECK_EQ(server->Decrypt(buf), (ssize_t)kRequestSize);
+    }
+    return NsPerOp(start, openings.size());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(sodium_init(), 0);
+
+    SaltFilter::Instance().Configure(kCapacity, 1e-6);
+    for (size_t threads : { 1, 2, 4, 8 }) {
+        BenchFilter(threads, 500000);
+    }
+
+    for (auto method : { "aes-256-gcm", "chacha20-ietf-poly1305" }) {
+        SaltFilter::Instance().Configure(0, 0);
+        auto packets = SealPackets(method, 200000);
+        auto openings = SealOpenings(method, 100000);
+        double packet_off = BenchPacket(method, packets);
+        double session_off = BenchSession(method, openings);
+        SaltFilter::Instance().Configure(kCapacity, 1e-6);
+        double packet_on = BenchPacket(method, packets);
+        double session_on = BenchSession(method, openings);
+        printf("%s udp %zu bytes: %.0f ns/packet unfiltered, %.0f ns/packet filtered\n",
+               method, kPacketSize, packet_off, packet_on);
+        printf("%s tcp opening: %.0f ns/session unfiltered, %.0f ns/session filtered\n",
+               method, session_off, session_on);
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <array>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <sodium.h>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <common_utils/udp_batch.h>
+#include <common_utils/packet_buffer.h>
+#include <crypto_utils/crypto.h>
+
+// Loopback QUIC-like bulk download through the reply path of the UDP
+// relay: a target sends GSO bursts of 1200 byte datagrams, the relay
+// reads them, seals each one and sends it to the client. Once with plain
+// batches, once with GRO on the target socket and GSO towards the client,
+// laid out the way UdpRelayServer::SealSegments does it.
+
+namespace {
+
+using udp = boost::asio::ip::udp;
+using Clock = std::chrono::steady_clock;
+
+const size_t kSegment = 1200;
+const size_t kBurst = 16;
+const size_t kBursts = 20000;
+// an acknowledgement sized datagram every few bursts breaks the pattern
+const size_t kAckEvery = 8;
+const size_t kAckSize = 60;
+// IPv4 address header of each reply
+const size_t kHeader = 7;
+
+struct Result {
+    double relay_ns = 0;
+    double seal_ns = 0;
+    size_t relay_calls = 0;
+    size_t entries = 0;
+    size_t sent = 0;
+    size_t delivered = 0;
+};
+
+class Relay {
+public:
+    Relay(boost::asio::io_context &ctx, CryptoContext &crypto, bool offload)
+        : in_(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          out_(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          crypto_(crypto), offload_(offload) {
+        in_.set_option(udp::socket::receive_buffer_size(8 << 20));
+        if (offload_) {
+            CHECK(UdpBatchIO::EnableGro(in_)) << "no UDP GRO";
+            CHECK(UdpBatchIO::GsoSupported(out_)) << "no UDP GSO";
+        }
+        for (auto &buf : bufs_) {
+            buf.resize(PacketBuffer::kLargeCapacity);
+        }
+    }
+
+    udp::endpoint Endpoint() const { return in_.local_endpoint(); }
+
+    void Drain(const udp::endpoint &client, Result &result) {
+        auto start = Clock::now();
+        size_t offset = crypto_.PacketHeadroom() + kHeader;
+        while (true) {
+            std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+            std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+            std::array<size_t, UdpBatchIO::kMaxBatch> segments;
+            for (size_t i = 0; i < bufs_.size(); ++i) {
+                buffers[i] = boost::asio::buffer(bufs_[i].data() + offset,
+                                                 bufs_[i].size() - offset - crypto_.PacketTailroom());
+            }
+            boost::system::error_code ec;
+            size_t n = UdpBatchIO::ReceiveBatch(in_, buffers.data(), lengths.data(), nullptr,
+                                                bufs_.size(), ec, offload_ ? segments.data() : nullptr);
+            ++result.relay_calls;
+            if (ec) {
+                break;
+            }
+            result.entries += n;
+
+            std::array<boost::asio::const_buffer, UdpBatchIO::kMaxBatch> packets;
+            std::array<size_t, UdpBatchIO::kMaxBatch> strides;
+            std::array<udp::endpoint, UdpBatchIO::kMaxBatch> destinations;
+            auto seal_start = Clock::now();
+            for (size_t i = 0; i < n; ++i) {
+                destinations[i] = client;
+                strides[i] = 0;
+                if (offload_ && segments[i]) {
+                    packets[i] = SealSegments(bufs_[i].data(), offset, lengths[i], segments[i]);
+                    strides[i] = crypto_.PacketHeadroom() + kHeader + segments[i] + crypto_.PacketTailroom();
+                } else {
+                    packets[i] = SealPacket(bufs_[i].data(), offset, lengths[i]);
+                }
+            }
+            result.seal_ns += std::chrono::duration<double, std::nano>(Clock::now() - seal_start).count();
+            for (size_t sent = 0; sent < n;) {
+                sent += UdpBatchIO::SendBatch(out_, packets.data() + sent, destinations.data() + sent,
+                                              n - sent, ec, strides.data() + sent);
+                ++result.relay_calls;
+                CHECK(!ec) << ec.message();
+            }
+            if (n < bufs_.size()) {
+                break;
+            }
+        }
+        result.relay_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+private:
+    boost::asio::const_buffer SealPacket(uint8_t *buf, size_t offset, size_t length) {
+        uint8_t *plaintext = buf + offset - kHeader;
+        std::memset(plaintext, 1, kHeader);
+        uint8_t *packet;
+        ssize_t packet_length = crypto_.EncryptPacket(plaintext, kHeader + length, &packet);
+        CHECK_GT(packet_length, 0);
+        return boost::asio::buffer(packet, packet_length);
+    }
+
+    boost::asio::const_buffer SealSegments(uint8_t *buf, size_t offset, size_t length, size_t segment) {
+        size_t headroom = crypto_.PacketHeadroom();
+        size_t stride = headroom + kHeader + segment + crypto_.PacketTailroom();
+        size_t count = (length + segment - 1) / segment;
+        for (size_t k = count; k-- > 1;) {
+            memmove(buf + offset + k * stride, buf + offset + k * segment,
+                    std::min(segment, length - k * segment));
+        }
+        size_t total = 0;
+        for (size_t k = 0; k < count; ++k) {
+            uint8_t *plaintext = buf + k * stride + headroom;
+            std::memset(plaintext, 1, kHeader);
+            uint8_t *packet;
+            ssize_t packet_length = crypto_.EncryptPacket(
+                plaintext, kHeader + std::min(segment, length - k * segment), &packet);
+            CHECK_GT(packet_length, 0);
+            total += packet_length;
+        }
+        return boost::asio::buffer(buf, total);
+    }
+
+    udp::socket in_;
+    udp::socket out_;
+    CryptoContext &crypto_;
+    bool offload_;
+    std::array<std::vector<uint8_t>, UdpBatchIO::kMaxBatch> bufs_;
+};
+
+size_t DrainClient(udp::socket &client) {
+    static std::array<std::array<uint8_t, 2048>, UdpBatchIO::kMaxBatch> storage;
+    std::array<boost::asio::mutable_buffer, UdpBatchIO::kMaxBatch> buffers;
+    std::array<size_t, UdpBatchIO::kMaxBatch> lengths;
+    for (size_t i = 0; i < storage.size(); ++i) {
+        buffers[i] = boost::asio::buffer(storage[i]);
+    }
+    size_t total = 0;
+    while (true) {
+        boost::system::error_code ec;
+        size_t n = UdpBatchIO::ReceiveBatch(client, buffers.data(), lengths.data(), nullptr,
+                                            buffers.size(), ec);
+        total += n;
+        if (ec || n < buffers.size()) {
+            return total;
+        }
+    }
+}
+
+Result Run(const std::string &method, bool offload) {
+    boost::asio::io_context ctx;
+    auto generator = CryptoContextGeneratorFactory::Instance()->GetGenerator(method, "bench");
+    CHECK(generator) << method;
+    auto crypto = (*generator)();
+    Relay relay(ctx, *crypto, offload);
+    udp::socket target(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    udp::socket client(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    client.set_option(udp::socket::receive_buffer_size(8 << 20));
+    CHECK(UdpBatchIO::GsoSupported(target)) << "no UDP GSO";
+
+    std::vector<uint8_t> burst(kSegment * kBurst, 'q');
+    std::vector<uint8_t> ack(kAckSize, 'a');
+    udp::endpoint relay_ep = relay.Endpoint();
+    udp::endpoint client_ep = client.local_endpoint();
+
+    Result result;
+    for (size_t i = 0; i < kBursts; ++i) {
+        std::array<boost::asio::const_buffer, 2> packets{{
+            boost::asio::buffer(burst), boost::asio::buffer(ack)
+        }};
+        std::array<udp::endpoint, 2> destinations{{ relay_ep, relay_ep }};
+        std::array<size_t, 2> segments{{ kSegment, 0 }};
+        size_t count = i % kAckEvery ? 1 : 2;
+        boost::system::error_code ec;
+        CHECK_EQ(UdpBatchIO::SendBatch(target, packets.data(), destinations.data(), count, ec,
+                                       segments.data()), count) << ec.message();
+        result.sent += kBurst + count - 1;
+
+        relay.Drain(client_ep, result);
+        result.delivered += DrainClient(client);
+    }
+    return result;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(sodium_init(), 0);
+    std::string method = argc > 1 ? argv[1] : "aes-256-gcm";
+
+    for (bool offload : { false, true }) {
+        auto result = Run(method, offload);
+        printf("%s %s: %.0f ns/datagram in the relay, %.0f of it sealing, "
+               "%.3f system calls and %.3f entries per datagram, %zu of %zu delivered\n",
+               method.c_str(), offload ? "gro+gso" : "batched",
+               result.relay_ns / result.sent, result.seal_ns / result.sent,
+               (double)result.relay_calls / result.sent, (double)result.entries / result.sent,
+               result.delivered, result.sent);
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstdio>
+#include <sodium.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+
+#include <common_utils/buffer.h>
+#include <common_utils/common.h>
+#include <crypto_utils/crypto.h>
+
+// 1000 concurrent sessions relaying small records over socketpairs, the
+// shape of a busy ss-server loop: each round the driver writes one
+// record into every session, all of them become readable in the same
+// loop turn, each reads it, wraps it with its own cipher and writes it
+// back. Once wrapping inline in the read handler, once batched: the
+// wraps of every session ready in the loop turn run back to back in
+// one posted handler and the writes are issued afterwards. The batch
+// runs the same per-session ciphers in sequence, as no multi-buffer
+// AEAD with a key per lane exists in libsodium or OpenSSL.
+
+namespace {
+
+using stream = boost::asio::local::stream_protocol;
+using Clock = std::chrono::steady_clock;
+
+const size_t kSessions = 1000;
+const size_t kRecord = 128;
+const size_t kRounds = 500;
+
+struct Result {
+    double ns_per_record = 0;
+    double wrap_ns = 0;
+    double latency_ns = 0;
+};
+
+class Batch;
+
+class Session {
+public:
+    Session(boost::asio::io_context &ctx, int fd, std::unique_ptr<CryptoContext> crypto,
+            Batch *batch, Result &result, size_t &written)
+        : socket_(ctx, stream(), fd), crypto_(std::move(crypto)), batch_(batch),
+          result_(result), written_(written) {
+    }
+
+    void DoRead();
+
+    void Wrap() {
+        auto start = Clock::now();
+        CHECK_GT(crypto_->Encrypt(buf_), 0);
+        result_.wrap_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    void DoWrite() {
+        result_.latency_ns += std::chrono::duration<double, std::nano>(Clock::now() - ready_).count();
+        boost::asio::async_write(
+            socket_, buf_.GetConstBuffer(),
+            [this](boost::system::error_code ec, size_t) {
+                CHECK(!ec) << ec.message();
+                ++written_;
+                buf_.Reset();
+                DoRead();
+            }
+        );
+    }
+
+private:
+    stream::socket socket_;
+    Buffer buf_;
+    std::unique_ptr<CryptoContext> crypto_;
+    Batch *batch_;
+    Result &result_;
+    size_t &written_;
+    Clock::time_point ready_;
+};
+
+// what the dropped --batch-wrap stage did
+class Batch {
+public:
+    explicit Batch(boost::asio::io_context &ctx)
+        : ctx_(ctx), posted_(false) {
+    }
+
+    void Submit(Session *session) {
+        pending_.push_back(session);
+        if (!posted_) {
+            posted_ = true;
+            boost::asio::post(ctx_, [this]() { Flush(); });
+        }
+    }
+
+private:
+    void Flush() {
+        posted_ = false;
+        running_.swap(pending_);
+        for (auto session : running_) {
+            session->Wrap();
+        }
+        for (auto session : running_) {
+            session->DoWrite();
+        }
+        running_.clear();
+    }
+
+    boost::asio::io_context &ctx_;
+    bool posted_;
+    std::vector<Session *> pending_;
+    std::vector<Session *> running_;
+};
+
+void Session::DoRead() {
+    socket_.async_read_some(
+        buf_.GetBuffer(),
+        [this](boost::system::error_code ec, size_t len) {
+            CHECK(!ec) << ec.message();
+            buf_.Append(len);
+            ready_ = Clock::now();
+            if (batch_) {
+                batch_->Submit(this);
+                return;
+            }
+            Wrap();
+            DoWrite();
+        }
+    );
+}
+
+Result Run(const std::string &method, bool batched) {
+    boost::asio::io_context ctx;
+    auto generator = CryptoContextGeneratorFactory::Instance()->GetGenerator(method, "bench");
+    CHECK(generator) << method;
+    Batch batch(ctx);
+    Result result;
+    size_t written = 0;
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    std::vector<int> drivers;
+    for (size_t i = 0; i < kSessions; ++i) {
+        int fds[2];
+        CHECK_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        drivers.push_back(fds[1]);
+        sessions.emplace_back(new Session(ctx, fds[0], (*generator)(),
+                                          batched ? &batch : nullptr, result, written));
+        sessions.back()->DoRead();
+    }
+
+    std::vector<uint8_t> record(kRecord, 'r');
+    std::vector<uint8_t> reply(16384);
+    auto start = Clock::now();
+    for (size_t round = 0; round < kRounds; ++round) {
+        for (int fd : drivers) {
+            CHECK_EQ(write(fd, record.data(), record.size()), (ssize_t)record.size());
+        }
+        while (written < (round + 1) * kSessions) {
+            ctx.run_one();
+        }
+        for (int fd : drivers) {
+            CHECK_GT(read(fd, reply.data(), reply.size()), 0);
+        }
+    }
+    double records = kRounds * kSessions;
+    result.ns_per_record = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / records;
+    result.wrap_ns /= records;
+    result.latency_ns /= records;
+
+    sessions.clear();
+    for (int fd : drivers) {
+        close(fd);
+    }
+    return result;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(sodium_init(), 0);
+    std::string method = argc > 1 ? argv[1] : "chacha20-ietf-poly1305";
+
+    // both ends of every socketpair
+    rlimit limit;
+    CHECK_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+    limit.rlim_cur = limit.rlim_max;
+    CHECK_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+    CHECK_GE(limit.rlim_cur, 2 * kSessions + 64) << "too few file descriptors";
+
+    for (bool batched : { false, true }) {
+        auto result = Run(method, batched);
+        printf("%s %s: %.0f ns/record in the loop, %.0f of it wrapping, "
+               "%.0f ns from readable to write issued\n",
+               method.c_str(), batched ? "batched" : "inline",
+               result.ns_per_record, result.wrap_ns, result.latency_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+"""Records Shadowsocks 2022 (SIP022) sessions for test_aead2022.cc.
+
+Written from the specification with its own pure Python primitives, so
+the vectors do not share code with the C++ implementation. Prints the
+vector table to paste into the test.
+"""
+
+import struct
+
+# ---- AES and GCM ----
+
+SBOX = []
+
+
+def _init_sbox():
+    p = q = 1
+    box = [0] * 256
+    while True:
+        p = p ^ ((p << 1) & 0xff) ^ (0x1b if p & 0x80 else 0)
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xff
+        if q & 0x80:
+            q ^= 0x09
+        x = q ^ ((q << 1 | q >> 7) & 0xff) ^ ((q << 2 | q >> 6) & 0xff) \
+            ^ ((q << 3 | q >> 5) & 0xff) ^ ((q << 4 | q >> 4) & 0xff)
+        box[p] = x ^ 0x63
+        if p == 1:
+            break
+    box[0] = 0x63
+    SBOX.extend(box)
+
+
+_init_sbox()
+
+
+def _xtime(b):
+    return ((b << 1) ^ 0x1b) & 0xff if b & 0x80 else b << 1
+
+
+def _expand_key(key):
+    nk = len(key) // 4
+    rounds = nk + 6
+    words = [list(key[4 * i:4 * i + 4]) for i in range(nk)]
+    rcon = 1
+    for i in range(nk, 4 * (rounds + 1)):
+        t = list(words[i - 1])
+        if i % nk == 0:
+            t = [SBOX[b] for b in t[1:] + t[:1]]
+            t[0] ^= rcon
+            rcon = _xtime(rcon)
+        elif nk > 6 and i % nk == 4:
+            t = [SBOX[b] for b in t]
+        words.append([a ^ b for a, b in zip(words[i - nk], t)])
+    return [sum(words[4 * r:4 * r + 4], []) for r in range(rounds + 1)]
+
+
+def aes_encrypt_block(key, block):
+    round_keys = _expand_key(key)
+    s = [a ^ b for a, b in zip(block, round_keys[0])]
+    for r in range(1, len(round_keys)):
+        s = [SBOX[b] for b in s]
+        s = [s[(i + 4 * (i % 4)) % 16] for i in range(16)]
+        if r != len(round_keys) - 1:
+            mixed = []
+            for c in range(4):
+                a = s[4 * c:4 * c + 4]
+                t = a[0] ^ a[1] ^ a[2] ^ a[3]
+                mixed += [a[i] ^ t ^ _xtime(a[i] ^ a[(i + 1) % 4]) for i in range(4)]
+            s = mixed
+        s = [a ^ b for a, b in zip(s, round_keys[r])]
+    return bytes(s)
+
+
+def _gf_mul(x, y):
+    r = 0xe1 << 120
+    z = 0
+    for i in range(127, -1, -1):
+        if (y >> i) & 1:
+            z ^= x
+        x = (x >> 1) ^ r if x & 1 else x >> 1
+    return z
+
+
+def _ghash(h, data):
+    y = 0
+    for i in range(0, len(data), 16):
+        y = _gf_mul(y ^ int.from_bytes(data[i:i + 16].ljust(16, b'\0'), 'big'), h)
+    return y
+
+
+def aes_gcm_seal(key, nonce, plaintext):
+    h = int.from_bytes(aes_encrypt_block(key, bytes(16)), 'big')
+    counter = nonce + b'\0\0\0\1'
+    out = bytearray()
+    for i in range(0, len(plaintext), 16):
+        n = struct.unpack('>I', counter[12:])[0] + 1
+        counter = counter[:12] + struct.pack('>I', n)
+        stream = aes_encrypt_block(key, counter)
+        out += bytes(a ^ b for a, b in zip(plaintext[i:i + 16], stream))
+    lengths = struct.pack('>QQ', 0, len(plaintext) * 8)
+    s = _ghash(h, bytes(out) + bytes(-len(out) % 16) + lengths)
+    tag = s ^ int.from_bytes(aes_encrypt_block(key, nonce + b'\0\0\0\1'), 'big')
+    return bytes(out) + tag.to_bytes(16, 'big')
+
+
+# ---- ChaCha20-Poly1305 ----
+
+def _rotl(v, c):
+    return ((v << c) & 0xffffffff) | (v >> (32 - c))
+
+
+def _quarter(s, a, b, c, d):
+    s[a] = (s[a] + s[b]) & 0xffffffff
+    s[d] = _rotl(s[d] ^ s[a], 16)
+    s[c] = (s[c] + s[d]) & 0xffffffff
+    s[b] = _rotl(s[b] ^ s[c], 12)
+    s[a] = (s[a] + s[b]) & 0xffffffff
+    s[d] = _rotl(s[d] ^ s[a], 8)
+    s[c] = (s[c] + s[d]) & 0xffffffff
+    s[b] = _rotl(s[b] ^ s[c], 7)
+
+
+def _chacha_rounds(state):
+    s = list(state)
+    for _ in range(10):
+        _quarter(s, 0, 4, 8, 12)
+        _quarter(s, 1, 5, 9, 13)
+        _quarter(s, 2, 6, 10, 14)
+        _quarter(s, 3, 7, 11, 15)
+        _quarter(s, 0, 5, 10, 15)
+        _quarter(s, 1, 6, 11, 12)
+        _quarter(s, 2, 7, 8, 13)
+        _quarter(s, 3, 4, 9, 14)
+    return s
+
+
+CONSTANTS = struct.unpack('<4I', b'expand 32-byte k')
+
+
+def chacha20_block(key, counter, nonce):
+    state = list(CONSTANTS) + list(struct.unpack('<8I', key)) \
+        + [counter] + list(struct.unpack('<3I', nonce))
+    s = _chacha_rounds(state)
+    return struct.pack('<16I', *[(a + b) & 0xffffffff for a, b in zip(s, state)])
+
+
+def chacha20_xor(key, counter, nonce, data):
+    out = bytearray()
+    for i in range(0, len(data), 64):
+        stream = chacha20_block(key, counter + i // 64, nonce)
+        out += bytes(a ^ b for a, b in zip(data[i:i + 64], stream))
+    return bytes(out)
+
+
+def poly1305(key, msg):
+    r = int.from_bytes(key[:16], 'little') & 0x0ffffffc0ffffffc0ffffffc0fffffff
+    s = int.from_bytes(key[16:], 'little')
+    p = (1 << 130) - 5
+    acc = 0
+    for i in range(0, len(msg), 16):
+        block = msg[i:i + 16] + b'\1'
+        acc = (acc + int.from_bytes(block, 'little')) * r % p
+    return ((acc + s) & ((1 << 128) - 1)).to_bytes(16, 'little')
+
+
+def chacha20_poly1305_seal(key, nonce, plaintext):
+    otk = chacha20_block(key, 0, nonce)[:32]
+    ct = chacha20_xor(key, 1, nonce, plaintext)
+    mac_data = ct + bytes(-len(ct) % 16) + struct.pack('<QQ', 0, len(ct))
+    return ct + poly1305(otk, mac_data)
+
+
+def hchacha20(key, nonce16):
+    state = list(CONSTANTS) + list(struct.unpack('<8I', key)) \
+        + list(struct.unpack('<4I', nonce16))
+    s = _chacha_rounds(state)
+    return struct.pack('<8I', *(s[0:4] + s[12:16]))
+
+
+def xchacha20_poly1305_seal(key, nonce, plaintext):
+    subkey = hchacha20(key, nonce[:16])
+    return chacha20_poly1305_seal(subkey, b'\0' * 4 + nonce[16:], plaintext)
+
+
+# ---- BLAKE3, inputs of one chunk ----
+
+IV = [0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19]
+PERM = [2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8]
+CHUNK_START, CHUNK_END, ROOT = 1, 2, 8
+DERIVE_KEY_CONTEXT, DERIVE_KEY_MATERIAL = 32, 64
+
+
+def _g(s, a, b, c, d, x, y):
+    s[a] = (s[a] + s[b] + x) & 0xffffffff
+    s[d] = _rotl(s[d] ^ s[a], 16)
+    s[c] = (s[c] + s[d]) & 0xffffffff
+    s[b] = _rotl(s[b] ^ s[c], 20)
+    s[a] = (s[a] + s[b] + y) & 0xffffffff
+    s[d] = _rotl(s[d] ^ s[a], 24)
+    s[c] = (s[c] + s[d]) & 0xffffffff
+    s[b] = _rotl(s[b] ^ s[c], 25)
+
+
+def _compress(cv, block, counter, block_len, flags):
+    m = list(struct.unpack('<16I', block))
+    s = list(cv) + IV[:4] + [counter & 0xffffffff, counter >> 32, block_len, flags]
+    for r in range(7):
+        _g(s, 0, 4, 8, 12, m[0], m[1])
+        _g(s, 1, 5, 9, 13, m[2], m[3])
+        _g(s, 2, 6, 10, 14, m[4], m[5])
+        _g(s, 3, 7, 11, 15, m[6], m[7])
+        _g(s, 0, 5, 10, 15, m[8], m[9])
+        _g(s, 1, 6, 11, 12, m[10], m[11])
+        _g(s, 2, 7, 8, 13, m[12], m[13])
+        _g(s, 3, 4, 9, 14, m[14], m[15])
+        m = [m[i] for i in PERM]
+    return [s[i] ^ s[i + 8] for i in range(8)]
+
+
+def blake3(data, key_words=IV, flags=0):
+    assert len(data) <= 1024
+    blocks = [data[i:i + 64] for i in range(0, len(data), 64)] or [b'']
+    cv = key_words
+    for i, block in enumerate(blocks):
+        f = flags
+        if i == 0:
+            f |= CHUNK_START
+        if i == len(blocks) - 1:
+            f |= CHUNK_END | ROOT
+        cv = _compress(cv, block.ljust(64, b'\0'), 0, len(block), f)
+    return struct.pack('<8I', *cv)
+
+
+def blake3_derive_key(context, material):
+    context_key = blake3(context.encode(), flags=DERIVE_KEY_CONTEXT)
+    return blake3(material, list(struct.unpack('<8I', context_key)), DERIVE_KEY_MATERIAL)
+
+
+# ---- SIP022 ----
+
+def session_subkey(psk, salt):
+    return blake3_derive_key('shadowsocks 2022 session subkey', psk + salt)[:len(psk)]
+
+
+class Sealer:
+    def __init__(self, method, key):
+        self.method, self.key, self.counter = method, key, 0
+
+    def seal(self, plaintext):
+        nonce = self.counter.to_bytes(12, 'little')
+        self.counter += 1
+        if self.method.endswith('chacha20-poly1305'):
+            return chacha20_poly1305_seal(self.key, nonce, plaintext)
+        return aes_gcm_seal(self.key, nonce, plaintext)
+
+
+def tcp_request(method, psk, salt, ts, address, payload):
+    s = Sealer(method, session_subkey(psk, salt))
+    variable = address + struct.pack('>H', 0) + payload
+    fixed = b'\0' + struct.pack('>QH', ts, len(variable))
+    return salt + s.seal(fixed) + s.seal(variable)
+
+
+def tcp_response(method, psk, salt, ts, request_salt, payload):
+    s = Sealer(method, session_subkey(psk, salt))
+    fixed = b'\1' + struct.pack('>Q', ts) + request_salt + struct.pack('>H', len(payload))
+    return salt + s.seal(fixed) + s.seal(payload)
+
+
+def udp_packet(method, psk, session_id, packet_id, ts, client_session_id, body, nonce=None):
+    header = session_id + struct.pack('>Q', packet_id)
+    inner = (b'\1' if client_session_id else b'\0') + struct.pack('>Q', ts) \
+        + (client_session_id or b'') + struct.pack('>H', 0) + body
+    if method.endswith('chacha20-poly1305'):
+        return nonce + xchacha20_poly1305_seal(psk, nonce, header + inner)
+    key = session_subkey(psk, session_id)
+    sealed = aes_gcm_seal(key, header[4:], inner)
+    return aes_encrypt_block(psk, header) + sealed
+
+
+def _self_test():
+    # FIPS-197 C.1/C.3, GCM test case 2, RFC 8439 2.4.2 and 2.5.2, BLAKE3 of ""
+    k = bytes(range(16))
+    assert aes_encrypt_block(k, bytes.fromhex('00112233445566778899aabbccddeeff')).hex() \
+        == '69c4e0d86a7b0430d8cdb78070b4c55a'
+    assert aes_encrypt_block(bytes(range(32)), bytes.fromhex('00112233445566778899aabbccddeeff')).hex() \
+        == '8ea2b7ca516745bfeafc49904b496089'
+    assert aes_gcm_seal(bytes(16), bytes(12), bytes(16)).hex() \
+        == '0388dace60b6a392f328c2b971b2fe78ab6e47d42cec13bdf53a67b21257bddf'
+    sunscreen = b"Ladies and Gentlemen of the class of '99: If I could offer you " \
+        b"only one tip for the future, sunscreen would be it."
+    ct = chacha20_xor(bytes(range(32)), 1, bytes.fromhex('000000000000004a00000000'), sunscreen)
+    assert ct[:16].hex() == '6e2e359a2568f98041ba0728dd0d6981'
+    assert poly1305(bytes.fromhex('85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b'),
+                    b'Cryptographic Forum Research Group').hex() \
+        == 'a8061dc1305136c6c22b8baf0c0127a9'
+    assert blake3(b'').hex() == 'af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262'
+
+
+def _c_hex(data):
+    lines = ['"%s"' % data[i:i + 32].hex() for i in range(0, len(data), 32)]
+    return lines or ['""']
+
+
+def main():
+    _self_test()
+    ts = 1700000000
+    methods = [('2022-blake3-aes-128-gcm', 16),
+               ('2022-blake3-aes-256-gcm', 32),
+               ('2022-blake3-chacha20-poly1305', 32)]
+    address = bytes([1, 127, 0, 0, 1, 0x1f, 0x90])
+    request_payload = b'GET / HTTP/1.1\r\n\r\n'
+    response_payload = b'HTTP/1.1 200 OK\r\n\r\n'
+    datagram = b'\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00'
+    for method, key_len in methods:
+        psk = bytes((7 * i + key_len) & 0xff for i in range(key_len))
+        client_salt = bytes((3 * i + 1) & 0xff for i in range(key_len))
+        server_salt = bytes((5 * i + 2) & 0xff for i in range(key_len))
+        client_sid = bytes.fromhex('0102030405060708')
+        server_sid = bytes.fromhex('a1a2a3a4a5a6a7a8')
+        client_nonce = bytes(range(0x40, 0x40 + 24))
+        server_nonce = bytes(range(0x80, 0x80 + 24))
+        chacha = method.endswith('chacha20-poly1305')
+        fields = [
+            ('method', ['"%s"' % method]),
+            ('psk', _c_hex(psk)),
+            ('client_salt', _c_hex(client_salt)),
+            ('server_salt', _c_hex(server_salt)),
+            ('request', _c_hex(tcp_request(method, psk, client_salt, ts,
+                                             address, request_payload))),
+            ('response', _c_hex(tcp_response(method, psk, server_salt, ts,
+                                               client_salt, response_payload))),
+            ('client_session', _c_hex(client_sid)),
+            ('server_session', _c_hex(server_sid)),
+            ('client_nonce', _c_hex(client_nonce if chacha else b'')),
+            ('server_nonce', _c_hex(server_nonce if chacha else b'')),
+            ('udp_request', _c_hex(udp_packet(method, psk, client_sid, 0, ts, None,
+                                                address + datagram, client_nonce))),
+            ('udp_response', _c_hex(udp_packet(method, psk, server_sid, 0, ts, client_sid,
+                                                 address + datagram, server_nonce))),
+        ]
+        print('    {')
+        for name, lines in fields:
+            print('        // %s' % name)
+            for i, line in enumerate(lines):
+                print('        ' + line + (',' if i == len(lines) - 1 else ''))
+        print('    },')
+
+
+if __name__ == '__main__':
+    main()
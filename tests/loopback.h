@@ -0,0 +1,90 @@
+#ifndef __TESTS_LOOPBACK_H__
+#define __TESTS_LOOPBACK_H__
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <boost/asio.hpp>
+#include <boost/process.hpp>
+#include <boost/process/extend.hpp>
+
+#ifdef LINUX
+#include <sys/prctl.h>
+#endif
+
+#include <common_utils/common.h>
+
+// ss-server / ss-local binaries built alongside the tests, run on
+// loopback ports for end to end tests. A failed CHECK aborts without
+// destructors, so on Linux the children also die with the test.
+class LoopbackProcess {
+public:
+    // returns once the process accepts tcp connections on port
+    LoopbackProcess(const std::string &exe, const std::vector<std::string> &args, uint16_t port)
+        : child_(exe, boost::process::args = args,
+                 boost::process::extend::on_exec_setup = [](auto &) {
+#ifdef LINUX
+                     prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+                     // the test's own sockets stay out of the child, a
+                     // connection the test closes is closed
+                     for (long fd = 3, n = sysconf(_SC_OPEN_MAX); fd < n; ++fd) {
+                         fcntl(fd, F_SETFD, FD_CLOEXEC);
+                     }
+                 }) {
+        using boost::asio::ip::tcp;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (true) {
+            CHECK(child_.running()) << exe << " exited with " << child_.exit_code();
+            boost::asio::io_context ctx;
+            tcp::socket probe(ctx);
+            boost::system::error_code ec;
+            probe.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port), ec);
+            if (!ec) {
+                break;
+            }
+            CHECK(std::chrono::steady_clock::now() < deadline) << exe << " never listened on " << port;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+
+    ~LoopbackProcess() {
+        child_.terminate();
+    }
+
+    bool Running() { return child_.running(); }
+
+    // waits up to timeout for the process to exit on its own
+    bool Exited(std::chrono::milliseconds timeout) {
+        return child_.wait_for(timeout);
+    }
+
+    int ExitCode() { return child_.exit_code(); }
+
+private:
+    boost::process::child child_;
+};
+
+// false if nothing arrives within timeout
+inline bool Readable(int fd, std::chrono::milliseconds timeout) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return ::poll(&pfd, 1, timeout.count()) > 0;
+}
+
+// password of each test method, keys of the 2022 methods in base64
+inline std::string TestPassword(const std::string &method) {
+    if (method.compare(0, 5, "2022-") != 0) {
+        return "test-password";
+    }
+    if (method.find("128") != std::string::npos) {
+        return "AAECAwQFBgcICQoLDA0ODw==";
+    }
+    return "AAECAwQFBgcICQoLDA0ODwABAgMEBQYHCAkKCwwNDg8=";
+}
+
+#endif
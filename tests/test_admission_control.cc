@@ -0,0 +1,154 @@
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <protocol_hooks/admission_control.h>
+
+namespace {
+
+using boost::asio::ip::make_address;
+
+// sessions are only told apart by address
+struct Sessions {
+    char at[8];
+};
+
+void TestDisabled() {
+    AdmissionControl admission(AdmissionControl::Limits{});
+    Sessions s;
+    CHECK(!admission.Enabled());
+    admission.Admit(&s.at[0], make_address("10.0.0.1"));
+    CHECK_EQ(admission.Handshakes(), 0);
+    CHECK(!admission.Saturated());
+    CHECK(admission.Allows(make_address("10.0.0.1")));
+    admission.Release(&s.at[0]);
+}
+
+// sessions count as handshakes until established or released
+void TestHandshakes() {
+    AdmissionControl::Limits limits;
+    limits.handshakes = 2;
+    AdmissionControl admission(limits);
+    Sessions s;
+    auto client = make_address("10.0.0.1");
+
+    admission.Admit(&s.at[0], client);
+    CHECK(!admission.Saturated());
+    admission.Admit(&s.at[1], client);
+    CHECK_EQ(admission.Handshakes(), 2);
+    CHECK(admission.Saturated());
+
+    admission.Established(&s.at[0]);
+    admission.Established(&s.at[0]);
+    CHECK_EQ(admission.Handshakes(), 1);
+    CHECK(!admission.Saturated());
+
+    admission.Release(&s.at[0]);
+    CHECK_EQ(admission.Handshakes(), 1);
+    admission.Release(&s.at[1]);
+    CHECK_EQ(admission.Handshakes(), 0);
+}
+
+// established sessions still count towards the total
+void TestSessions() {
+    AdmissionControl::Limits limits;
+    limits.sessions = 2;
+    AdmissionControl admission(limits);
+    Sessions s;
+
+    admission.Admit(&s.at[0], make_address("10.0.0.1"));
+    admission.Admit(&s.at[1], make_address("10.0.0.2"));
+    admission.Established(&s.at[0]);
+    admission.Established(&s.at[1]);
+    CHECK_EQ(admission.Handshakes(), 0);
+    CHECK(admission.Saturated());
+
+    admission.Release(&s.at[1]);
+    CHECK(!admission.Saturated());
+    admission.Admit(&s.at[2], make_address("10.0.0.3"));
+    CHECK(admission.Saturated());
+}
+
+void TestPerClient() {
+    AdmissionControl::Limits limits;
+    limits.per_client = 2;
+    AdmissionControl admission(limits);
+    Sessions s;
+    auto client = make_address("10.0.0.1");
+
+    admission.Admit(&s.at[0], client);
+    CHECK(admission.Allows(client));
+    admission.Admit(&s.at[1], client);
+    CHECK(!admission.Allows(client));
+    CHECK(!admission.Allows(make_address("::ffff:10.0.0.1")));
+    CHECK(admission.Allows(make_address("10.0.0.2")));
+    CHECK(!admission.Saturated());
+
+    // established or not, the session holds its count until released
+    admission.Established(&s.at[0]);
+    CHECK(!admission.Allows(client));
+    admission.Release(&s.at[0]);
+    CHECK(admission.Allows(client));
+}
+
+// ipv6 clients are counted by their /64
+void TestPrefix() {
+    AdmissionControl::Limits limits;
+    limits.per_client = 1;
+    AdmissionControl admission(limits);
+    Sessions s;
+
+    admission.Admit(&s.at[0], make_address("2001:db8:0:1::1"));
+    CHECK(!admission.Allows(make_address("2001:db8:0:1::1")));
+    CHECK(!admission.Allows(make_address("2001:db8:0:1:ffff:ffff:ffff:ffff")));
+    CHECK(admission.Allows(make_address("2001:db8:0:2::1")));
+    CHECK(admission.Allows(make_address("2001:db9:0:1::1")));
+
+    admission.Admit(&s.at[1], make_address("2001:db8:0:2::1"));
+    CHECK(!admission.Allows(make_address("2001:db8:0:2::2")));
+    admission.Release(&s.at[0]);
+    CHECK(admission.Allows(make_address("2001:db8:0:1::2")));
+    CHECK(!admission.Allows(make_address("2001:db8:0:2::2")));
+}
+
+// a session refused before admission is still released by its server,
+// as is one released twice, neither may touch the counts
+void TestNeverAdmitted() {
+    AdmissionControl::Limits limits;
+    limits.sessions = 2;
+    limits.handshakes = 2;
+    limits.per_client = 1;
+    AdmissionControl admission(limits);
+    Sessions s;
+    auto client = make_address("10.0.0.1");
+
+    admission.Admit(&s.at[0], client);
+    admission.Established(&s.at[1]);
+    admission.Release(&s.at[1]);
+    CHECK_EQ(admission.Handshakes(), 1);
+    CHECK(!admission.Allows(client));
+
+    admission.Admit(&s.at[2], make_address("10.0.0.2"));
+    CHECK(admission.Saturated());
+    admission.Release(&s.at[3]);
+    CHECK(admission.Saturated());
+
+    admission.Release(&s.at[0]);
+    admission.Release(&s.at[0]);
+    CHECK_EQ(admission.Handshakes(), 1);
+    CHECK(admission.Allows(client));
+    CHECK(!admission.Allows(make_address("10.0.0.2")));
+    CHECK(!admission.Saturated());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    TestDisabled();
+    TestHandshakes();
+    TestSessions();
+    TestPerClient();
+    TestPrefix();
+    TestNeverAdmitted();
+    return 0;
+}
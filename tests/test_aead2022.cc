@@ -0,0 +1,273 @@
+#include <string>
+#include <vector>
+#include <sodium.h>
+
+#include <common_utils/common.h>
+#include <common_utils/random.h>
+#include <crypto_utils/crypto.h>
+#include <crypto_utils/aead2022.h>
+
+// Sessions recorded with gen_aead2022_vectors.py, an implementation of
+// SIP022 written apart from this one. Every method must produce them byte
+// for byte given the same salts, session ids and nonces, and must open
+// them.
+
+namespace {
+
+const std::time_t kTimestamp = 1700000000;
+const std::string kAddress("\x01\x7f\x00\x00\x01\x1f\x90", 7);
+const std::string kRequestPayload("GET / HTTP/1.1\r\n\r\n");
+const std::string kResponsePayload("HTTP/1.1 200 OK\r\n\r\n");
+const std::string kDatagram("\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 12);
+
+struct Vector {
+    const char *method;
+    const char *psk;
+    const char *client_salt;
+    const char *server_salt;
+    const char *request;
+    const char *response;
+    const char *client_session;
+    const char *server_session;
+    const char *client_nonce;
+    const char *server_nonce;
+    const char *udp_request;
+    const char *udp_response;
+};
+
+const Vector kVectors[] = {
+    {
+        // method
+        "2022-blake3-aes-128-gcm",
+        // psk
+        "10171e252c333a41484f565d646b7279",
+        // client_salt
+        "0104070a0d101316191c1f2225282b2e",
+        // server_salt
+        "02070c11161b20252a2f34393e43484d",
+        // request
+        "0104070a0d101316191c1f2225282b2e3fbff13e3df66212b563261e2978fb8f"
+        "bf8c0aad18cb9925ec478bca2b032959dffff436b162547c218e755b1352371e"
+        "bb3af30779c3afc94d2ec2d36a8e66cf1bdc18f2dade",
+        // response
+        "02070c11161b20252a2f34393e43484d58bd1f702f2bf3d25194048b09f6f769"
+        "85cc871da82836e6a4cc1f82ac033744e3d57c417793f81ae049adf9f6f2f4cd"
+        "34f126b42b4aef6222576cbc50574347c0778e3b18d8089cbfb941614148",
+        // client_session
+        "0102030405060708",
+        // server_session
+        "a1a2a3a4a5a6a7a8",
+        // client_nonce
+        "",
+        // server_nonce
+        "",
+        // udp_request
+        "23e74e0d49d2ea1a0e10d7c0a93f1469bc0aafe039234b327561e8ae35c694ca"
+        "69b4b6397d797f708b432ad54792308230f6cd0f5a7658130034aa1e74bc",
+        // udp_response
+        "207853ceaa15bc601e23a846fdf40791d473654891f1d9dadfbea80aae34d632"
+        "05f9b4f28630bc0db3f913553bc1994ea4db7c41850337f85695a6b97fa468ce"
+        "2c9816693bc1",
+    },
+    {
+        // method
+        "2022-blake3-aes-256-gcm",
+        // psk
+        "20272e353c434a51585f666d747b828990979ea5acb3bac1c8cfd6dde4ebf2f9",
+        // client_salt
+        "0104070a0d101316191c1f2225282b2e3134373a3d404346494c4f5255585b5e",
+        // server_salt
+        "02070c11161b20252a2f34393e43484d52575c61666b70757a7f84898e93989d",
+        // request
+        "0104070a0d101316191c1f2225282b2e3134373a3d404346494c4f5255585b5e"
+        "a4128320bd7dcc0c543617e8883d6fb6eda8a24011ce190b0e59d9f234a36efe"
+        "d91a29cb8cc07fb806f2b4f41791494e1cc38b9174466e0657de95ac6bfa9a43"
+        "21bdd00dbf5c",
+        // response
+        "02070c11161b20252a2f34393e43484d52575c61666b70757a7f84898e93989d"
+        "437db8d54009eb2f2f9d8142fd1736fcfdf60a1feed51892d6040bb88eb08510"
+        "643494d65afb8e36b0b7bc345b2fca44545982a1669c9f15491250df9113a759"
+        "8aec9347d462ca75459c83f30500e3959d96bd158cd88e2101ed758e8c5c",
+        // client_session
+        "0102030405060708",
+        // server_session
+        "a1a2a3a4a5a6a7a8",
+        // client_nonce
+        "",
+        // server_nonce
+        "",
+        // udp_request
+        "6229920ac75eb4346f183d3fdd7ee3097b6561e24d97c6399d572b214a912a30"
+        "2065dd3ad1b6b918623c4008d8662d4ab65ddc75e9f0cdf508494105d7be",
+        // udp_response
+        "2535b2bf012e0e6c360e9f0cc324258237d4b4a6c3b605f9f0ad9cb0a1441f63"
+        "8eef5f20cc4dd45bc373b3ca878f7ceeeed8980e6db5d5d9198b9022f1a2fa16"
+        "cb58b3521fa3",
+    },
+    {
+        // method
+        "2022-blake3-chacha20-poly1305",
+        // psk
+        "20272e353c434a51585f666d747b828990979ea5acb3bac1c8cfd6dde4ebf2f9",
+        // client_salt
+        "0104070a0d101316191c1f2225282b2e3134373a3d404346494c4f5255585b5e",
+        // server_salt
+        "02070c11161b20252a2f34393e43484d52575c61666b70757a7f84898e93989d",
+        // request
+        "0104070a0d101316191c1f2225282b2e3134373a3d404346494c4f5255585b5e"
+        "ff4e2b3511eb8dfa7e064a79fc3e177cfd0bea254775ff8df387f24bb778a093"
+        "d4d47e824de69fe7e7393ca8990151ecd70ccf88c239da3bdf886f3d853cb7a2"
+        "e4840c034847",
+        // response
+        "02070c11161b20252a2f34393e43484d52575c61666b70757a7f84898e93989d"
+        "47988660722d245af97090b39e56b30c0020666ce53a88baa6d233721860c0c2"
+        "95a89848bd4b159ff92d7964f8edf8bb7536c57eb87b6d3404b0fb8605bb5474"
+        "03b5598ca0bd6a58a210233d425fb5ec0a34b6c697ecd64601d757ca96c0",
+        // client_session
+        "0102030405060708",
+        // server_session
+        "a1a2a3a4a5a6a7a8",
+        // client_nonce
+        "404142434445464748494a4b4c4d4e4f5051525354555657",
+        // server_nonce
+        "808182838485868788898a8b8c8d8e8f9091929394959697",
+        // udp_request
+        "404142434445464748494a4b4c4d4e4f50515253545556577124fdccd2e49c58"
+        "138a15afbd114c5adb3944f4b3ddabd9da5abc727ff0277e22ac7e2a4841ad92"
+        "fa2b31e4c9316ba41e2eb730de86db02f0ab9091ea80",
+        // udp_response
+        "808182838485868788898a8b8c8d8e8f9091929394959697b71d3e3ef72c4527"
+        "390fef9959d0224668d55a1262a48b5732cc50e0a44714d20e7e6f43cfb9a5b5"
+        "273917f53c96648bd1283466cdda80a3bb8fed433db523e7828399cc17e8",
+    },
+};
+
+std::string Unhex(const char *hex) {
+    std::string out(strlen(hex) / 2, 0);
+    size_t len = 0;
+    CHECK_EQ(sodium_hex2bin((uint8_t *)&out[0], out.size(), hex, strlen(hex),
+                            nullptr, &len, nullptr), 0);
+    out.resize(len);
+    return out;
+}
+
+std::unique_ptr<CryptoContext> NewContext(const std::string &method, const std::string &psk) {
+    std::string b64(sodium_base64_ENCODED_LEN(psk.size(), sodium_base64_VARIANT_ORIGINAL), 0);
+    sodium_bin2base64(&b64[0], b64.size(), (const uint8_t *)psk.data(), psk.size(),
+                      sodium_base64_VARIANT_ORIGINAL);
+    b64.resize(strlen(b64.c_str()));
+    auto generator = CryptoContextGeneratorFactory::Instance()->GetGenerator(method, b64);
+    CHECK(generator) << method;
+    return (*generator)();
+}
+
+std::string Encrypt(CryptoContext &ctx, const std::string &plain, const std::string &script) {
+    if (!script.empty()) {
+        ScriptRandomBytes((const uint8_t *)script.data(), script.size());
+    }
+    Buffer buf;
+    buf.AppendData((const uint8_t *)plain.data(), plain.size());
+    CHECK_GT(ctx.Encrypt(buf), 0);
+    ScriptRandomBytes(nullptr, 0);
+    return std::string(buf.Begin(), buf.End());
+}
+
+std::string Decrypt(CryptoContext &ctx, const std::string &wire) {
+    Buffer buf;
+    buf.AppendData((const uint8_t *)wire.data(), wire.size());
+    CHECK_GE(ctx.Decrypt(buf), 0);
+    return std::string(buf.Begin(), buf.End());
+}
+
+std::string EncryptPacket(CryptoContext &ctx, const std::string &plain, const std::string &script) {
+    std::vector<uint8_t> space(ctx.PacketHeadroom() + plain.size() + ctx.PacketTailroom());
+    uint8_t *plaintext = space.data() + ctx.PacketHeadroom();
+    std::copy(plain.begin(), plain.end(), plaintext);
+    if (!script.empty()) {
+        ScriptRandomBytes((const uint8_t *)script.data(), script.size());
+    }
+    uint8_t *packet;
+    ssize_t len = ctx.EncryptPacket(plaintext, plain.size(), &packet);
+    ScriptRandomBytes(nullptr, 0);
+    CHECK_GT(len, 0);
+    return std::string(packet, packet + len);
+}
+
+ssize_t DecryptPacket(CryptoContext &ctx, std::string packet, std::string *plain) {
+    uint8_t *plaintext;
+    ssize_t len = ctx.DecryptPacket((uint8_t *)&packet[0], packet.size(), &plaintext);
+    if (len >= 0 && plain) {
+        plain->assign(plaintext, plaintext + len);
+    }
+    return len;
+}
+
+void TestStream(const Vector &v) {
+    auto psk = Unhex(v.psk);
+    auto client = NewContext(v.method, psk);
+    auto server = NewContext(v.method, psk);
+    auto request = Unhex(v.request);
+    auto response = Unhex(v.response);
+
+    CHECK(Encrypt(*client, kAddress + kRequestPayload, Unhex(v.client_salt)) == request) << v.method;
+    CHECK(Decrypt(*server, request) == kAddress + kRequestPayload) << v.method;
+    CHECK(Encrypt(*server, kResponsePayload, Unhex(v.server_salt)) == response) << v.method;
+    CHECK(Decrypt(*client, response) == kResponsePayload) << v.method;
+}
+
+void TestPacket(const Vector &v) {
+    auto psk = Unhex(v.psk);
+    auto client = NewContext(v.method, psk);
+    auto server = NewContext(v.method, psk);
+    auto request = Unhex(v.udp_request);
+    auto response = Unhex(v.udp_response);
+    std::string plain;
+
+    auto script = Unhex(v.client_session) + Unhex(v.client_nonce);
+    CHECK(EncryptPacket(*client, kAddress + kDatagram, script) == request) << v.method;
+    CHECK_GE(DecryptPacket(*server, request, &plain), 0) << v.method;
+    CHECK(plain == kAddress + kDatagram) << v.method;
+
+    script = Unhex(v.server_session) + Unhex(v.server_nonce);
+    CHECK(EncryptPacket(*server, kAddress + kDatagram, script) == response) << v.method;
+    CHECK_GE(DecryptPacket(*client, response, &plain), 0) << v.method;
+    CHECK(plain == kAddress + kDatagram) << v.method;
+
+    CHECK_LT(DecryptPacket(*server, request, nullptr), 0) << v.method << ": replay accepted";
+}
+
+// packets of two client sessions interleaved on one association keep
+// their own replay windows
+void TestAlternatingSessions(const Vector &v) {
+    auto psk = Unhex(v.psk);
+    auto first = NewContext(v.method, psk);
+    auto second = NewContext(v.method, psk);
+    auto server = NewContext(v.method, psk);
+    std::string plain = kAddress + kDatagram;
+
+    auto a1 = EncryptPacket(*first, plain, "");
+    auto b1 = EncryptPacket(*second, plain, "");
+    auto a2 = EncryptPacket(*first, plain, "");
+    CHECK_GE(DecryptPacket(*server, a1, nullptr), 0);
+    CHECK_GE(DecryptPacket(*server, b1, nullptr), 0);
+    CHECK_LT(DecryptPacket(*server, a1, nullptr), 0) << v.method << ": replay accepted";
+    CHECK_GE(DecryptPacket(*server, a2, nullptr), 0);
+    CHECK_LT(DecryptPacket(*server, b1, nullptr), 0) << v.method << ": replay accepted";
+    CHECK_LT(DecryptPacket(*server, a2, nullptr), 0) << v.method << ": replay accepted";
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(sodium_init(), 0);
+
+    for (auto &v : kVectors) {
+        Aead2022Clock::Pin(kTimestamp);
+        TestStream(v);
+        TestPacket(v);
+        Aead2022Clock::Pin(0);
+        TestAlternatingSessions(v);
+    }
+    return 0;
+}
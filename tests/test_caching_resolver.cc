@@ -0,0 +1,284 @@
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <protocol_hooks/caching_resolver.h>
+
+// The caching resolver against a stub dns server on loopback, set as the
+// only server of the wrapped cares resolver. Names starting with
+// "missing" do not exist, every other name gets one A record whose last
+// byte counts the queries for it, so a fresh answer is told apart from a
+// cached one.
+
+namespace {
+
+using udp = boost::asio::ip::udp;
+using Resolver = CachingResolver<cares::udp::resolver>;
+
+class StubDnsServer {
+public:
+    explicit StubDnsServer(boost::asio::io_context &ctx)
+        : socket_(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)) {
+        DoReceive();
+    }
+
+    std::string Address() const {
+        return "127.0.0.1:" + std::to_string(socket_.local_endpoint().port());
+    }
+
+    // A queries received for the name
+    size_t Queries(const std::string &name) const {
+        auto itr = queries_.find(name);
+        return itr == queries_.end() ? 0 : itr->second;
+    }
+
+private:
+    enum {
+        A_TYPE = 1,
+        NXDOMAIN = 3
+    };
+
+    void DoReceive() {
+        socket_.async_receive_from(
+            boost::asio::buffer(buf_), peer_,
+            [this](boost::system::error_code ec, size_t length) {
+                if (ec) {
+                    return;
+                }
+                Reply(length);
+                DoReceive();
+            }
+        );
+    }
+
+    void Reply(size_t length) {
+        std::string name;
+        size_t pos = 12;
+        while (pos < length && buf_[pos]) {
+            size_t label = buf_[pos];
+            for (size_t i = 1; i <= label && pos + i < length; ++i) {
+                name.push_back((char)std::tolower(buf_[pos + i]));
+            }
+            name.push_back('.');
+            pos += label + 1;
+        }
+        pos += 5;
+        if (length < 12 || pos > length || name.empty()) {
+            return;
+        }
+        name.pop_back();
+        uint16_t type = buf_[pos - 4] << 8 | buf_[pos - 3];
+
+        size_t n = type == A_TYPE ? ++queries_[name] : 0;
+
+        // the question is echoed, answers follow with a 300s ttl
+        std::vector<uint8_t> reply(buf_.begin(), buf_.begin() + pos);
+        reply[2] = 0x81;
+        reply[3] = 0x80;
+        std::fill(reply.begin() + 6, reply.begin() + 12, 0);
+        if (name.compare(0, 7, "missing") == 0) {
+            reply[3] |= NXDOMAIN;
+        } else if (n) {
+            reply[7] = 1;
+            uint8_t record[] = { 0xc0, 0x0c, 0, A_TYPE, 0, 1, 0, 0, 1, 0x2c, 0, 4,
+                                 10, 0, 0, (uint8_t)n };
+            reply.insert(reply.end(), record, record + sizeof(record));
+        }
+        socket_.send_to(boost::asio::buffer(reply), peer_);
+    }
+
+    udp::socket socket_;
+    udp::endpoint peer_;
+    std::array<uint8_t, 1500> buf_;
+    std::map<std::string, size_t> queries_;
+};
+
+struct Answer {
+    bool done = false;
+    boost::system::error_code ec;
+    std::vector<udp::endpoint> endpoints;
+};
+
+Resolver::Ticket Start(Resolver &resolver, const std::string &host, uint16_t port, Answer &answer) {
+    return resolver.async_resolve(host, port,
+        [&answer](boost::system::error_code ec, Resolver::results_type results) {
+            answer.done = true;
+            answer.ec = ec;
+            for (auto &entry : results) {
+                answer.endpoints.push_back(entry.endpoint());
+            }
+        });
+}
+
+void Wait(boost::asio::io_context &ctx, const std::vector<Answer> &answers) {
+    for (auto &answer : answers) {
+        while (!answer.done) {
+            CHECK(ctx.run_one_for(std::chrono::seconds(5))) << "resolve never completed";
+        }
+    }
+}
+
+Answer Resolve(boost::asio::io_context &ctx, Resolver &resolver, const std::string &host) {
+    std::vector<Answer> answers(1);
+    Start(resolver, host, 80, answers[0]);
+    Wait(ctx, answers);
+    return answers[0];
+}
+
+udp::endpoint Endpoint(uint8_t n, uint16_t port) {
+    return udp::endpoint(boost::asio::ip::address_v4({ 10, 0, 0, n }), port);
+}
+
+std::unique_ptr<Resolver> MakeResolver(boost::asio::io_context &ctx, const StubDnsServer &server,
+                                       size_t cache_size) {
+    ResolverArgs args;
+    args.cache_size = cache_size;
+    args.cache_ttl = 1;
+    args.negative_ttl = 1;
+    boost::asio::use_service<DnsCache>(ctx).Start(args);
+
+    std::unique_ptr<Resolver> resolver(new Resolver(ctx));
+    boost::system::error_code ec;
+    resolver->set_servers(server.Address(), ec);
+    CHECK(!ec) << ec.message();
+    return resolver;
+}
+
+void Expire() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+}
+
+// answers are served from the cache until the ttl runs out
+void TestExpiry() {
+    boost::asio::io_context ctx;
+    StubDnsServer server(ctx);
+    auto resolver = MakeResolver(ctx, server, 16);
+    auto &cache = boost::asio::use_service<DnsCache>(ctx);
+
+    auto answer = Resolve(ctx, *resolver, "ttl.test");
+    CHECK(!answer.ec) << answer.ec.message();
+    CHECK(answer.endpoints == std::vector<udp::endpoint>{ Endpoint(1, 80) });
+    answer = Resolve(ctx, *resolver, "TTL.test.");
+    CHECK(!answer.ec);
+    CHECK(answer.endpoints == std::vector<udp::endpoint>{ Endpoint(1, 80) });
+    CHECK_EQ(server.Queries("ttl.test"), 1);
+    CHECK_EQ(cache.GetStats().misses, 1);
+    CHECK_EQ(cache.GetStats().hits, 1);
+
+    Resolver::results_type results;
+    boost::system::error_code ec;
+    CHECK(resolver->lookup("ttl.test", 443, results, ec));
+    CHECK(results.begin()->endpoint() == Endpoint(1, 443));
+    CHECK_EQ(cache.GetStats().hits, 2);
+
+    Expire();
+    CHECK(!resolver->lookup("ttl.test", 443, results, ec));
+    CHECK_EQ(cache.GetStats().expirations, 1);
+    answer = Resolve(ctx, *resolver, "ttl.test");
+    CHECK(answer.endpoints == std::vector<udp::endpoint>{ Endpoint(2, 80) });
+    CHECK_EQ(server.Queries("ttl.test"), 2);
+    CHECK_EQ(cache.GetStats().misses, 3);
+}
+
+// failures are cached for the negative ttl
+void TestNegative() {
+    boost::asio::io_context ctx;
+    StubDnsServer server(ctx);
+    auto resolver = MakeResolver(ctx, server, 16);
+    auto &cache = boost::asio::use_service<DnsCache>(ctx);
+
+    auto answer = Resolve(ctx, *resolver, "missing.test");
+    CHECK(answer.ec);
+    CHECK(answer.ec != boost::asio::error::operation_aborted);
+    CHECK(answer.endpoints.empty());
+    size_t queries = server.Queries("missing.test");
+    CHECK_GE(queries, 1);
+
+    auto again = Resolve(ctx, *resolver, "missing.test");
+    CHECK(again.ec == answer.ec) << again.ec.message();
+    CHECK_EQ(server.Queries("missing.test"), queries);
+    CHECK_EQ(cache.GetStats().negative_hits, 1);
+
+    Expire();
+    again = Resolve(ctx, *resolver, "missing.test");
+    CHECK(again.ec == answer.ec);
+    CHECK_GT(server.Queries("missing.test"), queries);
+}
+
+// the least recently used name makes room
+void TestEviction() {
+    boost::asio::io_context ctx;
+    StubDnsServer server(ctx);
+    auto resolver = MakeResolver(ctx, server, 2);
+    auto &cache = boost::asio::use_service<DnsCache>(ctx);
+
+    Resolve(ctx, *resolver, "a.test");
+    Resolve(ctx, *resolver, "b.test");
+    Resolve(ctx, *resolver, "a.test");
+    Resolve(ctx, *resolver, "c.test");
+    CHECK_EQ(cache.Size(), 2);
+    CHECK_EQ(cache.GetStats().evictions, 1);
+
+    Resolver::results_type results;
+    boost::system::error_code ec;
+    CHECK(resolver->lookup("a.test", 80, results, ec));
+    CHECK(resolver->lookup("c.test", 80, results, ec));
+    CHECK(!resolver->lookup("b.test", 80, results, ec));
+    auto answer = Resolve(ctx, *resolver, "b.test");
+    CHECK(answer.endpoints == std::vector<udp::endpoint>{ Endpoint(2, 80) });
+    CHECK_EQ(server.Queries("a.test"), 1);
+    CHECK_EQ(server.Queries("b.test"), 2);
+}
+
+// concurrent resolves of a host share one query, each waiter gets its
+// own port and cancelling one leaves the others waiting
+void TestSingleFlight() {
+    boost::asio::io_context ctx;
+    StubDnsServer server(ctx);
+    auto resolver = MakeResolver(ctx, server, 16);
+    auto &cache = boost::asio::use_service<DnsCache>(ctx);
+
+    const size_t kWaiters = 8;
+    const size_t kCancelled = 3;
+    std::vector<Answer> answers(kWaiters);
+    std::vector<Resolver::Ticket> tickets;
+    for (size_t i = 0; i < kWaiters; ++i) {
+        tickets.push_back(Start(*resolver, "flight.test", 1000 + i, answers[i]));
+    }
+    resolver->cancel(tickets[kCancelled]);
+    Wait(ctx, answers);
+
+    CHECK_EQ(server.Queries("flight.test"), 1);
+    CHECK_EQ(cache.GetStats().coalesced, kWaiters - 1);
+    for (size_t i = 0; i < kWaiters; ++i) {
+        if (i == kCancelled) {
+            CHECK(answers[i].ec == boost::asio::error::operation_aborted) << answers[i].ec.message();
+            CHECK(answers[i].endpoints.empty());
+            continue;
+        }
+        CHECK(!answers[i].ec) << answers[i].ec.message();
+        CHECK(answers[i].endpoints == std::vector<udp::endpoint>{ Endpoint(1, 1000 + i) });
+    }
+
+    Resolver::results_type results;
+    boost::system::error_code ec;
+    CHECK(resolver->lookup("flight.test", 53, results, ec));
+    CHECK(results.begin()->endpoint() == Endpoint(1, 53));
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    TestSingleFlight();
+    TestEviction();
+    TestNegative();
+    TestExpiry();
+    return 0;
+}
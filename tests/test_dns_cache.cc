@@ -0,0 +1,360 @@
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <common_utils/common.h>
+
+#include "dns_cache.h"
+
+namespace {
+
+enum {
+    A_TYPE = 1,
+    CNAME_TYPE = 5,
+    SOA_TYPE = 6,
+    OPT_TYPE = 41
+};
+
+struct Edns {
+    bool present;
+    uint16_t payload;
+    bool dnssec_ok;
+};
+
+const Edns kNoEdns = { false, 0, false };
+
+class Message {
+public:
+    Message(uint16_t id, uint8_t flags, uint8_t rcode) {
+        U16(id);
+        data.push_back(flags);
+        data.push_back(rcode);
+        data.resize(12, 0);
+        Count(0, 1);
+    }
+
+    // 0 question, 1 answer, 2 authority, 3 additional
+    void Count(size_t section, uint16_t n) {
+        data[4 + section * 2] = (uint8_t)(n >> 8);
+        data[5 + section * 2] = (uint8_t)n;
+    }
+
+    // dotted name, optionally ending in a pointer to an earlier name
+    void Name(const std::string &dotted, int pointer = -1) {
+        size_t start = 0;
+        while (start < dotted.size()) {
+            size_t dot = dotted.find('.', start);
+            if (dot == std::string::npos) {
+                dot = dotted.size();
+            }
+            data.push_back((uint8_t)(dot - start));
+            data.insert(data.end(), dotted.begin() + start, dotted.begin() + dot);
+            start = dot + 1;
+        }
+        if (pointer >= 0) {
+            U16(0xc000 | pointer);
+        } else {
+            data.push_back(0);
+        }
+    }
+
+    void Question(const std::string &name, uint16_t type) {
+        Name(name);
+        U16(type);
+        U16(1);
+    }
+
+    // owner given by Name() or pointer just before
+    void Record(uint16_t type, uint32_t ttl, const std::vector<uint8_t> &rdata) {
+        U16(type);
+        U16(1);
+        U32(ttl);
+        U16(rdata.size());
+        data.insert(data.end(), rdata.begin(), rdata.end());
+    }
+
+    void Opt(const Edns &edns) {
+        data.push_back(0);
+        U16(OPT_TYPE);
+        U16(edns.payload);
+        U32(edns.dnssec_ok ? 0x8000 : 0);
+        U16(0);
+    }
+
+    void U16(uint16_t v) {
+        data.push_back((uint8_t)(v >> 8));
+        data.push_back((uint8_t)v);
+    }
+
+    void U32(uint32_t v) {
+        U16(v >> 16);
+        U16(v);
+    }
+
+    std::vector<uint8_t> data;
+};
+
+uint16_t Read16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t Read32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+std::vector<uint8_t> Query(uint16_t id, const std::string &name, uint16_t type, const Edns &edns) {
+    Message m(id, 0x01, 0);
+    m.Question(name, type);
+    if (edns.present) {
+        m.Count(3, 1);
+        m.Opt(edns);
+    }
+    return m.data;
+}
+
+// name.  A 10.0.0.<i> for each of count records, names compressed
+std::vector<uint8_t> AResponse(const std::string &name, uint32_t ttl, size_t count, const Edns &edns) {
+    Message m(0x1234, 0x81, 0x80);
+    m.Question(name, A_TYPE);
+    m.Count(1, count);
+    for (size_t i = 0; i < count; ++i) {
+        m.U16(0xc00c);
+        m.Record(A_TYPE, ttl, { 10, 0, 0, (uint8_t)i });
+    }
+    if (edns.present) {
+        m.Count(3, 1);
+        m.Opt(edns);
+    }
+    return m.data;
+}
+
+std::vector<uint8_t> SoaData(uint32_t minimum) {
+    Message rdata(0, 0, 0);
+    rdata.data.clear();
+    rdata.Name("ns.example.com");
+    rdata.Name("admin.example.com");
+    for (uint32_t v : { 1u, 7200u, 3600u, 1209600u, minimum }) {
+        rdata.U32(v);
+    }
+    return rdata.data;
+}
+
+// answer, if any, from a cache that is asked the query
+std::vector<uint8_t> Ask(DnsResponseCache &cache, const std::vector<uint8_t> &query) {
+    std::vector<uint8_t> out(4096);
+    size_t n = cache.Answer(query.data(), query.size(), out.data(), out.size());
+    out.resize(n);
+    return out;
+}
+
+void TestHit() {
+    DnsResponseCache cache(16);
+    auto response = AResponse("example.com", 300, 2, kNoEdns);
+    cache.Store(response.data(), response.size());
+    CHECK_EQ(cache.Size(), 1);
+
+    auto answer = Ask(cache, Query(0xbeef, "Example.COM", A_TYPE, kNoEdns));
+    CHECK_EQ(answer.size(), response.size());
+    CHECK_EQ(Read16(answer.data()), 0xbeef);
+    CHECK(std::equal(answer.begin() + 2, answer.end(), response.begin() + 2));
+
+    CHECK(Ask(cache, Query(1, "example.org", A_TYPE, kNoEdns)).empty());
+    CHECK(Ask(cache, Query(1, "example.com", 28, kNoEdns)).empty());
+
+    // responses are never taken as queries
+    auto reflected = response;
+    CHECK(Ask(cache, reflected).empty());
+}
+
+// pointers into the middle of earlier names, in answers and authority
+void TestCompressedNames() {
+    DnsResponseCache cache(16);
+    Message m(0x1234, 0x81, 0x80);
+    m.Question("www.example.com", A_TYPE);
+    m.Count(1, 2);
+    m.Count(2, 1);
+    m.U16(0xc00c);
+    size_t target = m.data.size() + 10;
+    m.Record(CNAME_TYPE, 600, [] {
+        Message name(0, 0, 0);
+        name.data.clear();
+        name.Name("cdn", 0x10);
+        return name.data;
+    }());
+    m.U16(0xc000 | target);
+    m.Record(A_TYPE, 120, { 192, 0, 2, 1 });
+    m.Name("ns", 0x10);
+    m.Record(2, 3600, { 0xc0, 0x10 });
+    cache.Store(m.data.data(), m.data.size());
+    CHECK_EQ(cache.Size(), 1) << "compressed response not stored";
+
+    auto answer = Ask(cache, Query(7, "www.example.com", A_TYPE, kNoEdns));
+    CHECK_EQ(answer.size(), m.data.size());
+    CHECK_EQ(Read32(answer.data() + target + 12), 120);
+
+    // a pointer running off the message is rejected
+    auto broken = AResponse("bad.example.com", 300, 1, kNoEdns);
+    broken.resize(broken.size() - 16);
+    broken.push_back(0xc0);
+    cache.Store(broken.data(), broken.size());
+    CHECK(Ask(cache, Query(7, "bad.example.com", A_TYPE, kNoEdns)).empty());
+}
+
+// an NXDOMAIN and a NODATA answer, each with the SOA of the zone
+std::vector<uint8_t> Negative(const std::string &name, uint8_t rcode, uint32_t ttl, uint32_t minimum) {
+    Message m(0x1234, 0x81, 0x80 | rcode);
+    m.Question(name, A_TYPE);
+    m.Count(2, 1);
+    m.Name("example.com");
+    m.Record(SOA_TYPE, ttl, SoaData(minimum));
+    return m.data;
+}
+
+void TestNegative(DnsResponseCache &cache) {
+    auto nxdomain = Negative("missing.example.com", 3, 3600, 3600);
+    cache.Store(nxdomain.data(), nxdomain.size());
+    auto answer = Ask(cache, Query(9, "missing.example.com", A_TYPE, kNoEdns));
+    CHECK_EQ(answer.size(), nxdomain.size());
+    CHECK_EQ(answer[3] & 0x0f, 3);
+
+    // the SOA minimum bounds the negative TTL
+    auto nodata = Negative("short.example.com", 0, 3600, 1);
+    cache.Store(nodata.data(), nodata.size());
+    CHECK(!Ask(cache, Query(9, "short.example.com", A_TYPE, kNoEdns)).empty());
+
+    // nothing to say how long a failure lasts
+    Message bare(0x1234, 0x81, 0x83);
+    bare.Question("bare.example.com", A_TYPE);
+    cache.Store(bare.data.data(), bare.data.size());
+    CHECK(Ask(cache, Query(9, "bare.example.com", A_TYPE, kNoEdns)).empty());
+
+    Message servfail(0x1234, 0x81, 0x82);
+    servfail.Question("fail.example.com", A_TYPE);
+    servfail.Count(2, 1);
+    servfail.Name("example.com");
+    servfail.Record(SOA_TYPE, 60, SoaData(60));
+    cache.Store(servfail.data.data(), servfail.data.size());
+    CHECK(Ask(cache, Query(9, "fail.example.com", A_TYPE, kNoEdns)).empty());
+}
+
+void TestAging(DnsResponseCache &cache) {
+    auto lasting = AResponse("lasting.example.com", 300, 1, kNoEdns);
+    auto brief = AResponse("brief.example.com", 1, 1, kNoEdns);
+    cache.Store(lasting.data(), lasting.size());
+    cache.Store(brief.data(), brief.size());
+    TestNegative(cache);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+    auto answer = Ask(cache, Query(3, "lasting.example.com", A_TYPE, kNoEdns));
+    CHECK_EQ(answer.size(), lasting.size());
+    uint32_t ttl = Read32(answer.data() + answer.size() - 10);
+    CHECK(ttl == 299 || ttl == 298) << "ttl " << ttl;
+    CHECK(Ask(cache, Query(3, "brief.example.com", A_TYPE, kNoEdns)).empty());
+    CHECK(Ask(cache, Query(3, "short.example.com", A_TYPE, kNoEdns)).empty());
+    CHECK(!Ask(cache, Query(3, "missing.example.com", A_TYPE, kNoEdns)).empty());
+}
+
+void TestEdns() {
+    DnsResponseCache cache(16);
+    const Edns edns = { true, 1232, false };
+    const Edns dnssec = { true, 1232, true };
+    auto plain = AResponse("plain.example.com", 300, 1, kNoEdns);
+    auto opt = AResponse("opt.example.com", 300, 1, edns);
+    cache.Store(plain.data(), plain.size());
+    cache.Store(opt.data(), opt.size());
+
+    CHECK(!Ask(cache, Query(1, "plain.example.com", A_TYPE, kNoEdns)).empty());
+    CHECK(Ask(cache, Query(1, "plain.example.com", A_TYPE, edns)).empty())
+        << "an EDNS query answered without an OPT record";
+    CHECK(Ask(cache, Query(1, "opt.example.com", A_TYPE, kNoEdns)).empty())
+        << "an OPT record sent to a client without EDNS";
+    CHECK_EQ(Ask(cache, Query(1, "opt.example.com", A_TYPE, edns)).size(), opt.size());
+    CHECK(Ask(cache, Query(1, "opt.example.com", A_TYPE, dnssec)).empty())
+        << "an answer without DNSSEC records for a DO query";
+
+    auto signed_answer = AResponse("opt.example.com", 300, 2, dnssec);
+    cache.Store(signed_answer.data(), signed_answer.size());
+    CHECK_EQ(Ask(cache, Query(1, "opt.example.com", A_TYPE, dnssec)).size(), signed_answer.size());
+    CHECK_EQ(Ask(cache, Query(1, "opt.example.com", A_TYPE, edns)).size(), opt.size());
+}
+
+void TestTruncation() {
+    DnsResponseCache cache(16);
+    const Edns large = { true, 4096, false };
+    const Edns small = { true, 512, false };
+    auto big = AResponse("big.example.com", 300, 40, large);
+    CHECK_GT(big.size(), 512);
+    cache.Store(big.data(), big.size());
+
+    CHECK_EQ(Ask(cache, Query(5, "big.example.com", A_TYPE, large)).size(), big.size());
+
+    auto query = Query(6, "big.example.com", A_TYPE, small);
+    auto answer = Ask(cache, query);
+    size_t question_end = query.size() - 11;
+    CHECK_EQ(answer.size(), question_end);
+    CHECK_EQ(Read16(answer.data()), 6);
+    CHECK_EQ(answer[2], 0x83) << "response, truncated, recursion desired";
+    CHECK_EQ(Read16(answer.data() + 4), 1);
+    CHECK_EQ(Read16(answer.data() + 6), 0);
+    CHECK_EQ(Read16(answer.data() + 10), 0);
+    CHECK(std::equal(answer.begin() + 12, answer.end(), query.begin() + 12));
+    CHECK_EQ(cache.GetStats().truncated, 1);
+
+    // truncated responses are never stored
+    auto partial = AResponse("partial.example.com", 300, 1, kNoEdns);
+    partial[2] |= 0x02;
+    cache.Store(partial.data(), partial.size());
+    CHECK(Ask(cache, Query(1, "partial.example.com", A_TYPE, kNoEdns)).empty());
+}
+
+void TestEviction() {
+    DnsResponseCache cache(2);
+    for (auto name : { "a.example.com", "b.example.com" }) {
+        auto response = AResponse(name, 300, 1, kNoEdns);
+        cache.Store(response.data(), response.size());
+    }
+    // a hit makes b.example.com the newest
+    CHECK(!Ask(cache, Query(1, "a.example.com", A_TYPE, kNoEdns)).empty());
+    auto response = AResponse("c.example.com", 300, 1, kNoEdns);
+    cache.Store(response.data(), response.size());
+    CHECK_EQ(cache.Size(), 2);
+    CHECK_EQ(cache.GetStats().evictions, 1);
+    CHECK(Ask(cache, Query(1, "b.example.com", A_TYPE, kNoEdns)).empty());
+    CHECK(!Ask(cache, Query(1, "a.example.com", A_TYPE, kNoEdns)).empty());
+}
+
+// a response matches the query it answers, by id and question
+void TestTransactionKey() {
+    std::string query_key, response_key, other_key;
+    auto query = Query(0x1234, "Example.com", A_TYPE, kNoEdns);
+    auto response = AResponse("example.COM", 300, 1, kNoEdns);
+    CHECK(DnsResponseCache::TransactionKey(query.data(), query.size(), query_key));
+    CHECK(DnsResponseCache::TransactionKey(response.data(), response.size(), response_key));
+    CHECK(query_key == response_key);
+
+    auto other = Query(0x1235, "example.com", A_TYPE, kNoEdns);
+    CHECK(DnsResponseCache::TransactionKey(other.data(), other.size(), other_key));
+    CHECK(other_key != response_key);
+    other = Query(0x1234, "example.com", 28, kNoEdns);
+    CHECK(DnsResponseCache::TransactionKey(other.data(), other.size(), other_key));
+    CHECK(other_key != response_key);
+
+    CHECK(!DnsResponseCache::TransactionKey(query.data(), 11, other_key));
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    TestHit();
+    TestCompressedNames();
+    TestEdns();
+    TestTruncation();
+    TestEviction();
+    TestTransactionKey();
+    DnsResponseCache cache(16);
+    TestAging(cache);
+    return 0;
+}
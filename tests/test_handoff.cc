@@ -0,0 +1,113 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <plugin_utils/plugin.h>
+
+#include "loopback.h"
+
+// An ss-server replaced through --handoff-path while a client keeps
+// connecting: the second instance takes the listening socket over, no
+// connection attempt is refused during the switch, and the first one
+// serves its open session to the end and exits: test_handoff <ss-server>
+
+namespace {
+
+using tcp = boost::asio::ip::tcp;
+
+tcp::endpoint Loopback(uint16_t port) {
+    return tcp::endpoint(boost::asio::ip::address_v4::loopback(), port);
+}
+
+// connects in a loop from its own thread until destroyed
+class Prober {
+public:
+    explicit Prober(uint16_t port)
+        : stop_(false), attempts_(0), refused_(0) {
+        thread_ = std::thread([this, port]() {
+            while (!stop_) {
+                boost::asio::io_context ctx;
+                tcp::socket socket(ctx);
+                boost::system::error_code ec;
+                socket.connect(Loopback(port), ec);
+                ++attempts_;
+                if (ec) {
+                    LOG(ERROR) << "connect to " << port << ": " << ec.message();
+                    ++refused_;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+    }
+
+    ~Prober() {
+        stop_ = true;
+        thread_.join();
+    }
+
+    size_t Attempts() const { return attempts_; }
+    size_t Refused() const { return refused_; }
+
+private:
+    std::atomic<bool> stop_;
+    std::atomic<size_t> attempts_;
+    std::atomic<size_t> refused_;
+    std::thread thread_;
+};
+
+void TestHandoff(const std::string &exe) {
+    uint16_t port = GetFreePort();
+    std::string path = "/tmp/test_handoff." + std::to_string(getpid()) + ".sock";
+    std::string method = "aes-128-gcm";
+    std::vector<std::string> args = {
+        "-b", "127.0.0.1", "-l", std::to_string(port),
+        "-m", method, "-k", TestPassword(method),
+        "--handoff-path", path, "--drain-timeout", "30", "--verbose", "0"
+    };
+
+    LoopbackProcess first(exe, args, port);
+
+    // a session of the first process, kept open across the switch
+    boost::asio::io_context ctx;
+    tcp::socket session(ctx);
+    session.connect(Loopback(port));
+
+    {
+        Prober prober(port);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        LoopbackProcess second(exe, args, port);
+        // the second instance confirms the handoff once its servers are up
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        CHECK(second.Running());
+        CHECK(first.Running()) << "first process quit with a session open";
+
+        session.close();
+        CHECK(first.Exited(std::chrono::seconds(5))) << "first process never drained";
+        CHECK_EQ(first.ExitCode(), 0);
+
+        // only the second instance is left to accept
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        tcp::socket probe(ctx);
+        probe.connect(Loopback(port));
+        CHECK(second.Running());
+
+        size_t attempts = prober.Attempts();
+        CHECK_GT(attempts, 100) << "too few connects across the switch";
+        CHECK_EQ(prober.Refused(), 0) << "of " << attempts << " connects";
+    }
+    unlink(path.c_str());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_EQ(argc, 2) << "usage: " << argv[0] << " <ss-server>";
+    TestHandoff(argv[1]);
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <protocol_hooks/happy_eyeballs.h>
+
+// Happy eyeballs against loopback listeners: one that accepts and one
+// whose accept queue is full, so the kernel drops further SYNs and
+// attempts to it hang like attempts to an unreachable family.
+
+namespace {
+
+using tcp = boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct Outcome {
+    boost::system::error_code ec;
+    tcp::endpoint ep;
+    long ms;
+};
+
+// a listener that never accepts, with its queue filled up
+class Blackhole {
+public:
+    Blackhole(boost::asio::io_context &ctx, const boost::asio::ip::address &address)
+        : acceptor_(ctx) {
+        tcp::endpoint ep(address, 0);
+        acceptor_.open(ep.protocol());
+        acceptor_.bind(ep);
+        acceptor_.listen(0);
+        ep = acceptor_.local_endpoint();
+        for (int i = 0; i < 4; ++i) {
+            fill_.emplace_back(new tcp::socket(ctx));
+            fill_.back()->open(ep.protocol());
+            fill_.back()->non_blocking(true);
+            ::connect(fill_.back()->native_handle(), ep.data(), ep.size());
+        }
+    }
+
+    tcp::endpoint Endpoint() const { return acceptor_.local_endpoint(); }
+
+private:
+    tcp::acceptor acceptor_;
+    std::vector<std::unique_ptr<tcp::socket>> fill_;
+};
+
+Outcome Connect(boost::asio::io_context &ctx, const std::string &host,
+                const std::vector<tcp::endpoint> &endpoints, tcp::socket &socket) {
+    auto results = tcp::resolver::results_type::create(endpoints.begin(), endpoints.end(), host, "");
+    auto start = Clock::now();
+    bool done = false;
+    Outcome outcome;
+    auto connector = HappyEyeballs::Start(socket, results,
+        [&](boost::system::error_code ec, tcp::endpoint ep) {
+            outcome.ec = ec;
+            outcome.ep = ep;
+            outcome.ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+            done = true;
+        });
+    ctx.restart();
+    while (!done) {
+        CHECK(ctx.run_one_for(std::chrono::seconds(5))) << "connect never completed";
+    }
+    return outcome;
+}
+
+// ipv6 goes first but its SYNs are dropped, ipv4 wins one stagger
+// later and goes first next time
+void TestFallback(boost::asio::io_context &ctx, const tcp::endpoint &hole6, const tcp::endpoint &good4) {
+    std::vector<tcp::endpoint> endpoints{ hole6, good4 };
+    tcp::socket socket(ctx);
+    auto outcome = Connect(ctx, "fallback.test", endpoints, socket);
+    CHECK(!outcome.ec) << outcome.ec.message();
+    CHECK(outcome.ep == good4);
+    CHECK(socket.remote_endpoint() == good4);
+    CHECK_GE(outcome.ms, 240);
+    CHECK_LT(outcome.ms, 1000);
+
+    // remembered without any cached addresses for the host
+    CHECK_EQ(boost::asio::use_service<DnsCache>(ctx).PreferredFamily("FALLBACK.test"), 4);
+    tcp::socket again(ctx);
+    outcome = Connect(ctx, "fallback.test", endpoints, again);
+    CHECK(!outcome.ec);
+    CHECK(outcome.ep == good4);
+    CHECK_LT(outcome.ms, 200) << "ipv4 was not tried first";
+}
+
+// refused attempts move on at once, the last error is reported
+void TestRefused(boost::asio::io_context &ctx, const std::vector<tcp::endpoint> &closed) {
+    tcp::socket socket(ctx);
+    auto outcome = Connect(ctx, "refused.test", closed, socket);
+    CHECK(outcome.ec == boost::asio::error::connection_refused) << outcome.ec.message();
+    CHECK_LT(outcome.ms, 200) << "refused attempts waited for the stagger";
+    CHECK(!socket.is_open());
+}
+
+void TestCancel(boost::asio::io_context &ctx, const tcp::endpoint &hole) {
+    std::vector<tcp::endpoint> endpoints{ hole };
+    auto results = tcp::resolver::results_type::create(endpoints.begin(), endpoints.end(), "cancel.test", "");
+    tcp::socket socket(ctx);
+    boost::system::error_code result;
+    auto connector = HappyEyeballs::Start(socket, results,
+        [&](boost::system::error_code ec, tcp::endpoint) { result = ec; });
+    ctx.restart();
+    ctx.run_for(std::chrono::milliseconds(50));
+    connector->Cancel();
+    connector.reset();
+    ctx.run_for(std::chrono::milliseconds(50));
+    CHECK(result == boost::asio::error::operation_aborted) << result.message();
+    CHECK_EQ(boost::asio::use_service<DnsCache>(ctx).PreferredFamily("cancel.test"), 0);
+}
+
+tcp::endpoint ClosedPort(boost::asio::io_context &ctx, const boost::asio::ip::address &address) {
+    tcp::acceptor acceptor(ctx, tcp::endpoint(address, 0));
+    return acceptor.local_endpoint();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    boost::asio::io_context ctx;
+    auto v4 = boost::asio::ip::address_v4::loopback();
+    auto v6 = boost::asio::ip::address_v6::loopback();
+
+    tcp::acceptor good(ctx, tcp::endpoint(v4, 0));
+    Blackhole hole4(ctx, v4);
+    TestRefused(ctx, { ClosedPort(ctx, v4), ClosedPort(ctx, v4), ClosedPort(ctx, v4) });
+    TestCancel(ctx, hole4.Endpoint());
+
+    boost::system::error_code ec;
+    tcp::acceptor probe(ctx);
+    probe.open(tcp::v6(), ec);
+    if (!ec) {
+        probe.bind(tcp::endpoint(v6, 0), ec);
+    }
+    if (ec) {
+        LOG(WARNING) << "no ipv6 loopback, family fallback not tested";
+        return 0;
+    }
+    probe.close();
+    Blackhole hole6(ctx, v6);
+    TestFallback(ctx, hole6.Endpoint(), good.local_endpoint());
+    return 0;
+}
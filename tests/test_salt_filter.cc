@@ -0,0 +1,132 @@
+#include <vector>
+#include <sodium.h>
+
+#include <common_utils/common.h>
+#include <common_utils/random.h>
+#include <crypto_utils/crypto.h>
+#include <crypto_utils/salt_filter.h>
+
+namespace {
+
+const size_t kCapacity = 1000;
+
+std::unique_ptr<CryptoContext> NewContext(const std::string &method) {
+    auto generator = CryptoContextGeneratorFactory::Instance()->GetGenerator(method, "test");
+    CHECK(generator) << method;
+    return (*generator)();
+}
+
+std::vector<uint8_t> Seal(const std::string &method, size_t len) {
+    auto ctx = NewContext(method);
+    Buffer buf;
+    std::vector<uint8_t> plain(len, 'x');
+    buf.AppendData(plain.data(), plain.size());
+    CHECK_GT(ctx->Encrypt(buf), 0);
+    return std::vector<uint8_t>(buf.Begin(), buf.End());
+}
+
+ssize_t Open(const std::string &method, const std::vector<uint8_t> &wire, size_t len) {
+    auto ctx = NewContext(method);
+    Buffer buf;
+    buf.AppendData(wire.data(), len);
+    return ctx->Decrypt(buf);
+}
+
+void TestFilter() {
+    auto &filter = SaltFilter::Instance();
+    uint8_t salt[32];
+    RandomBytes(salt, sizeof(salt));
+    CHECK(!filter.Contains(salt, sizeof(salt)));
+    CHECK(filter.CheckAndAdd(salt, sizeof(salt)));
+    CHECK(filter.Contains(salt, sizeof(salt)));
+    CHECK(!filter.CheckAndAdd(salt, sizeof(salt)));
+
+    // remembered for at least the configured capacity
+    for (size_t i = 0; i < kCapacity; ++i) {
+        uint8_t other[32];
+        RandomBytes(other, sizeof(other));
+        filter.Add(other, sizeof(other));
+    }
+    CHECK(filter.Contains(salt, sizeof(salt)));
+}
+
+// sealed while the filter is off, a client records its own salts
+struct Sealed {
+    std::vector<uint8_t> wire;
+    std::vector<uint8_t> fresh;
+    std::vector<uint8_t> captured;
+    std::vector<uint8_t> packet;
+};
+
+std::vector<uint8_t> SealPacket(const std::string &method) {
+    auto client = NewContext(method);
+    std::vector<uint8_t> space(2048);
+    uint8_t *plaintext = space.data() + client->PacketHeadroom();
+    std::fill(plaintext, plaintext + 1200, 'y');
+    uint8_t *packet;
+    ssize_t len = client->EncryptPacket(plaintext, 1200, &packet);
+    CHECK_GT(len, 0);
+    return std::vector<uint8_t>(packet, packet + len);
+}
+
+Sealed SealAll(const std::string &method) {
+    return Sealed{ Seal(method, 100), Seal(method, 100), Seal(method, 100), SealPacket(method) };
+}
+
+void TestStream(const std::string &method, const Sealed &sealed) {
+    auto &wire = sealed.wire;
+    CHECK_EQ(Open(method, wire, wire.size()), 100);
+    CHECK_LT(Open(method, wire, wire.size()), 0) << method << ": replay accepted";
+
+    // a salt alone is not remembered, its session can still come through
+    auto &fresh = sealed.fresh;
+    CHECK_EQ(Open(method, fresh, 32), 0);
+    CHECK_EQ(Open(method, fresh, fresh.size()), 100);
+
+    // junk salts never authenticate, so they cannot rotate a genuine salt
+    // out of the filter
+    auto &captured = sealed.captured;
+    CHECK_EQ(Open(method, captured, captured.size()), 100);
+    for (size_t i = 0; i < kCapacity * 3; ++i) {
+        std::vector<uint8_t> junk(captured.size());
+        RandomBytes(junk.data(), junk.size());
+        CHECK_LT(Open(method, junk, junk.size()), 0);
+    }
+    CHECK_LT(Open(method, captured, captured.size()), 0) << method << ": replay accepted after a flood";
+}
+
+void TestPacket(const std::string &method, const Sealed &sealed) {
+    auto server = NewContext(method);
+    auto &captured = sealed.packet;
+
+    uint8_t *out;
+    std::vector<uint8_t> copy = captured;
+    CHECK_EQ(server->DecryptPacket(copy.data(), copy.size(), &out), 1200);
+    for (size_t i = 0; i < kCapacity * 3; ++i) {
+        std::vector<uint8_t> junk(captured.size());
+        RandomBytes(junk.data(), junk.size());
+        CHECK_LT(server->DecryptPacket(junk.data(), junk.size(), &out), 0);
+    }
+    copy = captured;
+    CHECK_LT(server->DecryptPacket(copy.data(), copy.size(), &out), 0) << method << ": packet replay accepted";
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_GE(sodium_init(), 0);
+    const std::vector<std::string> methods{ "aes-128-gcm", "aes-256-gcm", "chacha20-ietf-poly1305" };
+    std::vector<Sealed> sealed;
+    for (auto &method : methods) {
+        sealed.push_back(SealAll(method));
+    }
+    SaltFilter::Instance().Configure(kCapacity, 1e-6);
+
+    TestFilter();
+    for (size_t i = 0; i < methods.size(); ++i) {
+        TestStream(methods[i], sealed[i]);
+        TestPacket(methods[i], sealed[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,332 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <plugin_utils/plugin.h>
+#include <protocol_hooks/stream_mux.h>
+
+#include "loopback.h"
+
+// ss-local multiplexing connections over one carrier to ss-server, all
+// on loopback: test_stream_mux <ss-server> <ss-local>
+// A forwarder between the two counts the carrier connections. The target
+// echoes what it reads, or sends a bulk of bytes when asked with 'B'.
+
+namespace {
+
+using tcp = boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+uint8_t Pattern(size_t i) {
+    return (uint8_t)(i * 7 + i / 251);
+}
+
+void Pump(std::shared_ptr<tcp::socket> from, std::shared_ptr<tcp::socket> to) {
+    auto buf = std::make_shared<std::array<uint8_t, 16384>>();
+    from->async_read_some(
+        boost::asio::buffer(*buf),
+        [from, to, buf](boost::system::error_code ec, size_t len) {
+            if (ec) {
+                boost::system::error_code ignored;
+                to->shutdown(tcp::socket::shutdown_send, ignored);
+                return;
+            }
+            boost::asio::async_write(
+                *to, boost::asio::buffer(buf->data(), len),
+                [from, to, buf](boost::system::error_code ec, size_t) {
+                    if (!ec) {
+                        Pump(from, to);
+                    }
+                }
+            );
+        }
+    );
+}
+
+void SendBulk(std::shared_ptr<tcp::socket> socket, size_t total, size_t sent) {
+    if (sent == total) {
+        boost::system::error_code ignored;
+        socket->shutdown(tcp::socket::shutdown_send, ignored);
+        return;
+    }
+    auto buf = std::make_shared<std::vector<uint8_t>>(std::min<size_t>(65536, total - sent));
+    for (size_t i = 0; i < buf->size(); ++i) {
+        (*buf)[i] = Pattern(sent + i);
+    }
+    boost::asio::async_write(
+        *socket, boost::asio::buffer(*buf),
+        [socket, buf, total, sent](boost::system::error_code ec, size_t len) {
+            if (!ec) {
+                SendBulk(socket, total, sent + len);
+            }
+        }
+    );
+}
+
+class Loopback {
+public:
+    explicit Loopback(uint16_t server_port)
+        : target_(ctx_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          forwarder_(ctx_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          server_(boost::asio::ip::address_v4::loopback(), server_port), forwarded_(0) {
+        DoAcceptTarget();
+        DoAcceptForwarder();
+        thread_ = std::thread([this]() { ctx_.run(); });
+    }
+
+    ~Loopback() {
+        ctx_.stop();
+        thread_.join();
+    }
+
+    tcp::endpoint Target() const { return target_.local_endpoint(); }
+    uint16_t ForwarderPort() const { return forwarder_.local_endpoint().port(); }
+    size_t Forwarded() const { return forwarded_; }
+
+private:
+    void DoAcceptTarget() {
+        target_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (ec) {
+                return;
+            }
+            auto peer = std::make_shared<tcp::socket>(std::move(socket));
+            auto mode = std::make_shared<std::array<uint8_t, 5>>();
+            boost::asio::async_read(
+                *peer, boost::asio::buffer(mode->data(), 1),
+                [peer, mode](boost::system::error_code ec, size_t) {
+                    if (ec) {
+                        return;
+                    }
+                    if ((*mode)[0] != 'B') {
+                        boost::asio::write(*peer, boost::asio::buffer(mode->data(), 1), ec);
+                        Pump(peer, peer);
+                        return;
+                    }
+                    boost::asio::async_read(
+                        *peer, boost::asio::buffer(mode->data() + 1, 4),
+                        [peer, mode](boost::system::error_code ec, size_t) {
+                            if (!ec) {
+                                auto &m = *mode;
+                                SendBulk(peer, m[1] << 24 | m[2] << 16 | m[3] << 8 | m[4], 0);
+                            }
+                        }
+                    );
+                }
+            );
+            DoAcceptTarget();
+        });
+    }
+
+    void DoAcceptForwarder() {
+        forwarder_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (ec) {
+                return;
+            }
+            ++forwarded_;
+            auto client = std::make_shared<tcp::socket>(std::move(socket));
+            auto server = std::make_shared<tcp::socket>(ctx_);
+            server->async_connect(server_, [client, server](boost::system::error_code ec) {
+                if (ec) {
+                    return;
+                }
+                // frames pass one by one, Nagle would hold every second one
+                client->set_option(tcp::no_delay(true), ec);
+                server->set_option(tcp::no_delay(true), ec);
+                Pump(client, server);
+                Pump(server, client);
+            });
+            DoAcceptForwarder();
+        });
+    }
+
+    boost::asio::io_context ctx_;
+    tcp::acceptor target_;
+    tcp::acceptor forwarder_;
+    tcp::endpoint server_;
+    std::atomic<size_t> forwarded_;
+    std::thread thread_;
+};
+
+// a socks5 connection through ss-local to the target
+std::unique_ptr<tcp::socket> Connect(boost::asio::io_context &ctx, uint16_t local_port,
+                                     const tcp::endpoint &target) {
+    std::unique_ptr<tcp::socket> socket(new tcp::socket(ctx));
+    socket->connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), local_port));
+    const uint8_t hello[] = { 5, 1, 0 };
+    boost::asio::write(*socket, boost::asio::buffer(hello));
+    uint8_t choice[2];
+    boost::asio::read(*socket, boost::asio::buffer(choice));
+    CHECK_EQ(choice[1], 0);
+    auto addr = target.address().to_v4().to_bytes();
+    const uint8_t request[] = { 5, 1, 0, 1, addr[0], addr[1], addr[2], addr[3],
+                                (uint8_t)(target.port() >> 8), (uint8_t)target.port() };
+    boost::asio::write(*socket, boost::asio::buffer(request));
+    uint8_t reply[10];
+    boost::asio::read(*socket, boost::asio::buffer(reply));
+    CHECK_EQ(reply[1], 0) << "connect refused";
+    return socket;
+}
+
+void Echo(tcp::socket &socket, const std::vector<uint8_t> &data) {
+    boost::asio::write(socket, boost::asio::buffer(data));
+    std::vector<uint8_t> back(data.size());
+    boost::asio::read(socket, boost::asio::buffer(back));
+    CHECK(back == data) << "echo of " << data.size() << " bytes differs";
+}
+
+std::unique_ptr<tcp::socket> OpenEcho(boost::asio::io_context &ctx, uint16_t local_port,
+                                      const tcp::endpoint &target) {
+    auto socket = Connect(ctx, local_port, target);
+    Echo(*socket, { 'E' });
+    return socket;
+}
+
+// frames of every size, spread over streams that are all open at once
+void TestFraming(Loopback &loopback, uint16_t local_port) {
+    boost::asio::io_context ctx;
+    std::vector<std::unique_ptr<tcp::socket>> streams;
+    for (size_t i = 0; i < 8; ++i) {
+        streams.push_back(OpenEcho(ctx, local_port, loopback.Target()));
+    }
+    for (size_t len : { 1, 100, 1400, 16383, 16384, 16385, 65000 }) {
+        std::vector<std::vector<uint8_t>> sent;
+        for (size_t i = 0; i < streams.size(); ++i) {
+            sent.emplace_back(len);
+            for (size_t j = 0; j < len; ++j) {
+                sent.back()[j] = Pattern(i * 131 + j);
+            }
+            boost::asio::write(*streams[i], boost::asio::buffer(sent.back()));
+        }
+        for (size_t i = 0; i < streams.size(); ++i) {
+            std::vector<uint8_t> back(len);
+            boost::asio::read(*streams[i], boost::asio::buffer(back));
+            CHECK(back == sent[i]) << "stream " << i << " mixed up at " << len << " bytes";
+        }
+    }
+
+    // a half close reaches the target and its close comes back
+    boost::system::error_code ec;
+    streams[0]->shutdown(tcp::socket::shutdown_send);
+    uint8_t byte;
+    CHECK_EQ(streams[0]->read_some(boost::asio::buffer(&byte, 1), ec), 0);
+    CHECK(ec == boost::asio::error::eof) << ec.message();
+    Echo(*streams[1], { 1, 2, 3 });
+
+    CHECK_EQ(loopback.Forwarded(), 1) << "streams were not multiplexed";
+}
+
+// a stream whose reader stalls holds back no more than its window, the
+// other streams of the carrier keep moving
+void TestSlowReader(Loopback &loopback, uint16_t local_port) {
+    const size_t kBulk = 8 << 20;
+    boost::asio::io_context ctx;
+    auto bulk = Connect(ctx, local_port, loopback.Target());
+    auto echo = OpenEcho(ctx, local_port, loopback.Target());
+    const uint8_t request[] = { 'B', (uint8_t)(kBulk >> 24), (uint8_t)(kBulk >> 16),
+                                (uint8_t)(kBulk >> 8), (uint8_t)kBulk };
+    boost::asio::write(*bulk, boost::asio::buffer(request));
+
+    std::atomic<bool> stalled(true);
+    std::thread reader([&]() {
+        std::vector<uint8_t> buf(4096);
+        size_t total = 0;
+        // nothing read at first, the window fills up behind the reader
+        while (stalled) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        while (total < kBulk) {
+            size_t len = bulk->read_some(boost::asio::buffer(buf));
+            for (size_t i = 0; i < len; ++i) {
+                CHECK_EQ(buf[i], Pattern(total + i)) << "bulk data differs at " << total + i;
+            }
+            total += len;
+            if (total < kBulk / 8) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        boost::system::error_code ec;
+        uint8_t byte;
+        CHECK_EQ(bulk->read_some(boost::asio::buffer(&byte, 1), ec), 0);
+        CHECK(ec == boost::asio::error::eof);
+    });
+
+    auto slowest = Clock::duration::zero();
+    for (size_t i = 0; i < 50; ++i) {
+        auto start = Clock::now();
+        Echo(*echo, std::vector<uint8_t>(100, (uint8_t)i));
+        slowest = std::max(slowest, Clock::now() - start);
+        if (i == 25) {
+            stalled = false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    reader.join();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(slowest).count();
+    CHECK_LT(ms, 1000) << "a slow reader held up the carrier";
+    CHECK_EQ(loopback.Forwarded(), 1) << "streams were not multiplexed";
+}
+
+// streams beyond what a carrier takes go to another carrier, or plain
+void TestStreamCap(Loopback &loopback, uint16_t local_port) {
+    boost::asio::io_context ctx;
+    std::vector<std::unique_ptr<tcp::socket>> streams;
+    for (size_t i = 0; i < mux::kMaxStreams + 4; ++i) {
+        streams.push_back(OpenEcho(ctx, local_port, loopback.Target()));
+    }
+    for (size_t i = 0; i < streams.size(); ++i) {
+        Echo(*streams[i], { (uint8_t)i });
+    }
+    CHECK_GT(loopback.Forwarded(), 1) << "more than " << mux::kMaxStreams << " streams on a carrier";
+}
+
+void TestMethod(const std::string &server_exe, const std::string &local_exe,
+                const std::string &method) {
+    uint16_t server_port = GetFreePort();
+    uint16_t local_port = GetFreePort();
+    std::string password = TestPassword(method);
+
+    LoopbackProcess server(server_exe, {
+        "-b", "127.0.0.1", "-l", std::to_string(server_port),
+        "-m", method, "-k", password, "--verbose", "0"
+    }, server_port);
+    {
+        Loopback loopback(server_port);
+        LoopbackProcess local(local_exe, {
+            "-b", "127.0.0.1", "-l", std::to_string(local_port),
+            "-s", "127.0.0.1", "-p", std::to_string(loopback.ForwarderPort()),
+            "-m", method, "-k", password, "--mux-connections", "1",
+            "--warm-pool-size", "0", "--verbose", "0"
+        }, local_port);
+        TestFraming(loopback, local_port);
+        TestSlowReader(loopback, local_port);
+    }
+    {
+        // a fresh ss-local, the previous one may still hold its port
+        local_port = GetFreePort();
+        Loopback loopback(server_port);
+        LoopbackProcess local(local_exe, {
+            "-b", "127.0.0.1", "-l", std::to_string(local_port),
+            "-s", "127.0.0.1", "-p", std::to_string(loopback.ForwarderPort()),
+            "-m", method, "-k", password, "--mux-connections", "1",
+            "--warm-pool-size", "0", "--verbose", "0"
+        }, local_port);
+        TestStreamCap(loopback, local_port);
+    }
+    CHECK(server.Running());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_EQ(argc, 3) << "usage: " << argv[0] << " <ss-server> <ss-local>";
+    for (auto method : { "aes-128-gcm", "2022-blake3-aes-256-gcm" }) {
+        TestMethod(argv[1], argv[2], method);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <array>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <boost/asio.hpp>
+
+#include <common_utils/common.h>
+#include <plugin_utils/plugin.h>
+
+#include "loopback.h"
+
+// ss-local udp associate through ss-server to a udp echo server, all on
+// loopback: test_udp_associate <ss-server> <ss-local>
+
+namespace {
+
+using udp = boost::asio::ip::udp;
+using tcp = boost::asio::ip::tcp;
+
+class EchoServer {
+public:
+    EchoServer()
+        : socket_(ctx_, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)) {
+        DoEcho();
+        thread_ = std::thread([this]() { ctx_.run(); });
+    }
+
+    ~EchoServer() {
+        ctx_.stop();
+        thread_.join();
+    }
+
+    udp::endpoint Endpoint() const { return socket_.local_endpoint(); }
+
+private:
+    void DoEcho() {
+        socket_.async_receive_from(
+            boost::asio::buffer(buf_), sender_,
+            [this](boost::system::error_code ec, size_t len) {
+                if (ec) {
+                    return;
+                }
+                socket_.send_to(boost::asio::buffer(buf_.data(), len), sender_, 0, ec);
+                DoEcho();
+            }
+        );
+    }
+
+    boost::asio::io_context ctx_;
+    udp::socket socket_;
+    udp::endpoint sender_;
+    std::array<uint8_t, 65536> buf_;
+    std::thread thread_;
+};
+
+// returns the relay endpoint ss-local answered with
+udp::endpoint Associate(tcp::socket &control, uint16_t local_port) {
+    control.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), local_port));
+    const uint8_t hello[] = { 5, 1, 0 };
+    boost::asio::write(control, boost::asio::buffer(hello));
+    uint8_t choice[2];
+    boost::asio::read(control, boost::asio::buffer(choice));
+    CHECK_EQ(choice[0], 5);
+    CHECK_EQ(choice[1], 0);
+
+    const uint8_t request[] = { 5, 3, 0, 1, 0, 0, 0, 0, 0, 0 };
+    boost::asio::write(control, boost::asio::buffer(request));
+    uint8_t reply[10];
+    boost::asio::read(control, boost::asio::buffer(reply));
+    CHECK_EQ(reply[1], 0) << "udp associate refused";
+    CHECK_EQ(reply[3], 1) << "ss-local bound to 127.0.0.1 answers with an IPv4 address";
+    boost::asio::ip::address_v4::bytes_type addr;
+    std::copy(reply + 4, reply + 8, addr.begin());
+    return udp::endpoint(boost::asio::ip::address_v4(addr), (reply[8] << 8) | reply[9]);
+}
+
+std::vector<uint8_t> Datagram(const udp::endpoint &target, size_t len, uint8_t seed) {
+    auto addr = target.address().to_v4().to_bytes();
+    std::vector<uint8_t> datagram{ 0, 0, 0, 1, addr[0], addr[1], addr[2], addr[3],
+                                   (uint8_t)(target.port() >> 8), (uint8_t)target.port() };
+    for (size_t i = 0; i < len; ++i) {
+        datagram.push_back(seed + i);
+    }
+    return datagram;
+}
+
+void TestMethod(const std::string &server_exe, const std::string &local_exe,
+                const std::string &method) {
+    uint16_t server_port = GetFreePort();
+    uint16_t local_port = GetFreePort();
+    std::string password = TestPassword(method);
+
+    LoopbackProcess server(server_exe, {
+        "-b", "127.0.0.1", "-l", std::to_string(server_port),
+        "-m", method, "-k", password, "-u", "--verbose", "0"
+    }, server_port);
+    LoopbackProcess local(local_exe, {
+        "-b", "127.0.0.1", "-l", std::to_string(local_port),
+        "-s", "127.0.0.1", "-p", std::to_string(server_port),
+        "-m", method, "-k", password, "-u", "--verbose", "0"
+    }, local_port);
+    EchoServer echo;
+
+    boost::asio::io_context ctx;
+    tcp::socket control(ctx);
+    udp::endpoint relay = Associate(control, local_port);
+    udp::socket app(ctx, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+    std::array<uint8_t, 65536> buf;
+    for (size_t len : { 1, 16, 100, 512, 1200, 1400, 4000, 0 }) {
+        auto datagram = Datagram(echo.Endpoint(), len, len);
+        app.send_to(boost::asio::buffer(datagram), relay);
+        CHECK(Readable(app.native_handle(), std::chrono::seconds(2)))
+            << method << ": no echo of " << len << " bytes";
+        udp::endpoint from;
+        size_t n = app.receive_from(boost::asio::buffer(buf), from);
+        CHECK(from == relay);
+        CHECK_EQ(n, datagram.size()) << method;
+        CHECK(!memcmp(buf.data(), datagram.data(), n)) << method << ": echo differs";
+    }
+
+    // fragments are not supported and dropped
+    auto fragment = Datagram(echo.Endpoint(), 32, 7);
+    fragment[2] = 1;
+    app.send_to(boost::asio::buffer(fragment), relay);
+    CHECK(!Readable(app.native_handle(), std::chrono::milliseconds(300))) << method;
+
+    // the association ends with its control connection
+    control.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto late = Datagram(echo.Endpoint(), 32, 9);
+    app.send_to(boost::asio::buffer(late), relay);
+    CHECK(!Readable(app.native_handle(), std::chrono::milliseconds(300)))
+        << method << ": relayed after the control connection closed";
+
+    CHECK(server.Running());
+    CHECK(local.Running());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    CHECK_EQ(argc, 3) << "usage: " << argv[0] << " <ss-server> <ss-local>";
+    for (auto method : { "aes-128-gcm", "chacha20-ietf-poly1305",
+                         "2022-blake3-aes-256-gcm", "2022-blake3-chacha20-poly1305" }) {
+        TestMethod(argv[1], argv[2], method);
+    }
+    return 0;
+}